@@ -46,6 +46,7 @@
 #endif
 
 #include "vdifio.h"
+#include "cornerturners.h"
 
 static void cornerturn_1thread(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize)
 {
@@ -2623,7 +2624,7 @@ static void cornerturn_16thread_128bit(unsigned char *outputBuffer, const unsign
 }
 
 
-void (*getCornerTurner(int nThread, int nBit))(unsigned char *, const unsigned char * const *, int)
+static CornerTurner getGenericCornerTurner(int nThread, int nBit)
 {
 	if(nThread == 1)
 	{
@@ -2831,6 +2832,61 @@ void (*getCornerTurner(int nThread, int nBit))(unsigned char *, const unsigned c
 	}
 }
 
+enum VDIFCornerTurnerISA getBestCornerTurnerISA(void)
+{
+	return getx86CornerTurnerISA();
+}
+
+const char *getCornerTurnerISAName(enum VDIFCornerTurnerISA isa)
+{
+	static const char * const names[] = { "generic", "SSE4.1", "AVX2", "AVX-512BW" };
+
+	if(isa < 0 || isa >= NumVDIFCornerTurnerISAs)
+	{
+		return "unknown";
+	}
+
+	return names[isa];
+}
+
+void (*getCornerTurnerISA(int nThread, int nBit, enum VDIFCornerTurnerISA isa))(unsigned char *, const unsigned char * const *, int)
+{
+	if(isa == VDIFCornerTurnerISAGeneric)
+	{
+		CornerTurner cornerTurner;
+
+		cornerTurner = getGenericCornerTurner(nThread, nBit);
+		if(!cornerTurner)
+		{
+			/* no hand-written version; use one generated from the template */
+			cornerTurner = getTemplateCornerTurner(nThread, nBit);
+		}
+
+		return cornerTurner;
+	}
+	else
+	{
+		return getx86CornerTurner(nThread, nBit, isa);
+	}
+}
+
+void (*getCornerTurner(int nThread, int nBit))(unsigned char *, const unsigned char * const *, int)
+{
+	CornerTurner cornerTurner = 0;
+
+	/* Negative nThread values select alternate portable versions, so don't substitute those */
+	if(nThread > 0)
+	{
+		cornerTurner = getx86CornerTurner(nThread, nBit, getBestCornerTurnerISA());
+	}
+	if(!cornerTurner)
+	{
+		cornerTurner = getCornerTurnerISA(nThread, nBit, VDIFCornerTurnerISAGeneric);
+	}
+
+	return cornerTurner;
+}
+
 static int testCornerTurn(const unsigned char *outputBuffer, const unsigned char * const *threadData, int outputBytes, int nt, int b)
 {
 	int nError = 0;
@@ -2891,6 +2947,11 @@ static int testCornerTurn(const unsigned char *outputBuffer, const unsigned char
 			int t;	/* thread id o f current sample */
 
 			t = (i/B) % ut;
+			if(t >= nt)
+			{
+				/* ignore padded data */
+				continue;
+			}
 			ib = i % B;
 			ob = i % B;
 			is = i/(B*ut);
@@ -2917,7 +2978,7 @@ void testvdifcornerturners(int outputBytes, int nTest)
 {
 	const char devRandom[] = "/dev/urandom";
 	const int bits[] = { 1, 2, 4, 8, 16, 32, 64, 128, 0 };
-	const int maxThreads = 16;
+	const int maxThreads = VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS;
 	int bi;
 	int t;
 	unsigned char *threadData[maxThreads];
@@ -2957,37 +3018,43 @@ void testvdifcornerturners(int outputBytes, int nTest)
 		int nt;
 		for(nt = -maxThreads; nt <= maxThreads; ++nt)
 		{
-			int i;
-			void (*cornerTurner)(unsigned char *, const unsigned char * const *, int);
-			clock_t t0, t1;
-			int nError;
-			
-			cornerTurner = getCornerTurner(nt, b);
+			enum VDIFCornerTurnerISA isa;
 
-			if(!cornerTurner)
+			/* test each instruction set variant this CPU can run */
+			for(isa = VDIFCornerTurnerISAGeneric; isa <= getBestCornerTurnerISA(); ++isa)
 			{
-				continue;
-			}
-			printf("%d bits  %d threads...  ", b, nt);
-			fflush(stdout);
+				int i;
+				void (*cornerTurner)(unsigned char *, const unsigned char * const *, int);
+				clock_t t0, t1;
+				int nError;
+				
+				cornerTurner = getCornerTurnerISA(nt, b, isa);
+
+				if(!cornerTurner)
+				{
+					continue;
+				}
+				printf("%d bits  %d threads  %s...  ", b, nt, getCornerTurnerISAName(isa));
+				fflush(stdout);
 
-			t0 = clock();
-			for(i = 0; i < nTest; ++i)
-			{
-				cornerTurner(outputBuffer, (const unsigned char * const*)threadData, outputBytes);
-			}
-			t1 = clock();
-			if(t1 > t0)
-			{
-				printf("Took %d microseconds -> %0.0f Mbps", (int)(t1-t0), (8.0*nTest*outputBytes/(t1-t0)));
-			}
-			else
-			{
-				printf("Weird; took 0 time.");
-			}
+				t0 = clock();
+				for(i = 0; i < nTest; ++i)
+				{
+					cornerTurner(outputBuffer, (const unsigned char * const*)threadData, outputBytes);
+				}
+				t1 = clock();
+				if(t1 > t0)
+				{
+					printf("Took %d microseconds -> %0.0f Mbps", (int)(t1-t0), (8.0*nTest*outputBytes/(t1-t0)));
+				}
+				else
+				{
+					printf("Weird; took 0 time.");
+				}
 
-			nError = testCornerTurn(outputBuffer, (const unsigned char * const*)threadData, outputBytes, abs(nt), b);
-			printf("   %d samples of %d were wrong.\n", nError, 8*outputBytes/b);
+				nError = testCornerTurn(outputBuffer, (const unsigned char * const*)threadData, outputBytes, abs(nt), b);
+				printf("   %d samples of %d were wrong.\n", nError, 8*outputBytes/b);
+			}
 		}
 	}
 
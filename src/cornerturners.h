@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 2013-2015 Walter Brisken                                *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/cornerturners.h $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+#ifndef __CORNERTURNERS_H__
+#define __CORNERTURNERS_H__
+
+#include "vdifio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Internal interface between the portable corner turners (cornerturners.c) and the
+ * instruction set specific (cornerturners_x86.c) and template generated (cornerturners_template.c) ones
+ */
+
+typedef void (*CornerTurner)(unsigned char *, const unsigned char * const *, int);
+
+/* *** implemented in cornerturners_x86.c *** */
+
+/* returns the best x86 instruction set usable on this CPU, or VDIFCornerTurnerISAGeneric if none */
+enum VDIFCornerTurnerISA getx86CornerTurnerISA(void);
+
+/* returns an x86 SIMD corner turner, or 0 if none is implemented for this configuration / instruction set */
+CornerTurner getx86CornerTurner(int nThread, int nBit, enum VDIFCornerTurnerISA isa);
+
+/* *** implemented in cornerturners_template.c *** */
+
+#define VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS	64
+
+/* returns a portable corner turner for 1 to VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS threads of 1, 2, 4, 8, 16 or 32 bit data, or 0 otherwise */
+CornerTurner getTemplateCornerTurner(int nThread, int nBit);
+
+/* corner turns more than VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS (up to VDIF_MUX_MAX_THREADS) threads in groups,
+ * using groupTurner = getTemplateCornerTurner(VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS, nBit) on each group */
+void cornerturn_wide(CornerTurner groupTurner, unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, int nThread, int nBit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,373 @@
+/***************************************************************************
+ *   Copyright (C) 2013-2015 Walter Brisken                                *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/cornerturners_template.c $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+// Portable corner turners for any number of threads from 1 to VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS
+// and sample sizes of 1, 2, 4, 8, 16 and 32 bits.  A single inline kernel is written for
+// each case below and is instantiated with compile time constant thread count and bit
+// width, so the compiler can fold all shifts and masks.  These are used for any
+// configuration that has no hand-written (or SIMD) corner turner.
+//
+// As with the hand-written corner turners, output sample s comes from thread s % ut where
+// ut is nThread rounded up to the next power of 2.  Unlike some of those, the samples
+// belonging to the padding threads (nThread <= t < ut) are set to zero.
+
+#include <stdint.h>
+#include <string.h>
+#include "cornerturners.h"
+
+#define ALWAYS_INLINE		inline __attribute__((always_inline))
+
+
+static void cornerturn_template_tail(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int start, int outputDataSize, int nThread, int ut, int nBit)
+{
+  // Handle output bytes beyond the last full block.  start is a multiple of both the
+  // block size and ut*bytes-per-sample.
+
+  int o;
+
+  if(nBit < 8)
+  {
+    const int samplesPerByte = 8/nBit;
+    const unsigned int mask = (1U << nBit) - 1;
+
+    for(o = start; o < outputDataSize; ++o)
+    {
+      unsigned int x = 0;
+      int k;
+
+      for(k = 0; k < samplesPerByte; ++k)
+      {
+        int s = o*samplesPerByte + k;	// output sample number
+        int t = s % ut;			// thread
+        int is = s / ut;		// sample number within thread
+
+        if(t < nThread)
+        {
+          x |= ((threadBuffers[t][is/samplesPerByte] >> ((is % samplesPerByte)*nBit)) & mask) << (k*nBit);
+        }
+      }
+      outputBuffer[o] = x;
+    }
+  }
+  else
+  {
+    const int B = nBit/8;	// bytes per sample
+
+    for(o = start; o < outputDataSize; ++o)
+    {
+      int s = o / B;
+      int t = s % ut;
+
+      outputBuffer[o] = (t < nThread) ? threadBuffers[t][(s/ut)*B + o%B] : 0;
+    }
+  }
+}
+
+static ALWAYS_INLINE uint64_t repeatmask(int nOnes, int stride)
+{
+  // nOnes set bits at the bottom of every stride bits
+  uint64_t ones = (nOnes >= 64) ? ~0ULL : ((1ULL << nOnes) - 1);
+
+  return (stride >= 64) ? ones : ones * (~0ULL / ((1ULL << stride) - 1));
+}
+
+static ALWAYS_INLINE uint64_t spread(uint64_t x, const int K, const int ut, const int nBit, const uint64_t *masks)
+{
+  // Spread the bottom K bits of x such that each nBit group lands at a stride of ut*nBit bits.
+  // Same technique as the hand-written 2 and 4 thread corner turners.
+  int chunk, m;
+
+  for(chunk = K/2, m = 0; chunk >= nBit; chunk /= 2, ++m)
+  {
+    x = (x | (x << (chunk*(ut-1)))) & masks[m];
+  }
+
+  return x;
+}
+
+static ALWAYS_INLINE uint64_t load64(const unsigned char *p)
+{
+  uint64_t x;
+
+  memcpy(&x, p, sizeof(x));
+
+  return x;
+}
+
+static ALWAYS_INLINE void cornerturn_template(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, const int nThread, const int nBit)
+{
+  const unsigned char *tb[VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS];
+  int ut;	// lowest power of 2 >= nThread
+  int n, i;
+
+  if(nThread == 1)
+  {
+    memcpy(outputBuffer, threadBuffers[0], outputDataSize);
+
+    return;
+  }
+
+  // local copies of the thread pointers, so the byte stores to outputBuffer (which may alias anything) do not force them to be reloaded
+  for(i = 0; i < nThread; ++i)
+  {
+    tb[i] = threadBuffers[i];
+  }
+
+  for(ut = 1; ut < nThread; ut *= 2);
+
+  if(nBit >= 8)
+  {
+    // whole byte samples: just copy them into place
+    const int B = nBit/8;
+
+    n = outputDataSize/(ut*B);
+    for(i = 0; i < n; ++i)
+    {
+      unsigned char *out = outputBuffer + i*ut*B;
+      int t;
+
+      for(t = 0; t < nThread; ++t)
+      {
+        memcpy(out + t*B, tb[t] + i*B, B);
+      }
+      if(nThread < ut)
+      {
+        memset(out + nThread*B, 0, (ut-nThread)*B);
+      }
+    }
+
+    cornerturn_template_tail(outputBuffer, tb, n*ut*B, outputDataSize, nThread, ut, nBit);
+  }
+  else if(ut*nBit <= 64)
+  {
+    // Each block takes 64 bits from each thread and makes ut output words.  Every output
+    // word contains K bits from each thread.
+    const int K = 64/ut;
+    const uint64_t mask = (1ULL << K) - 1;
+    uint64_t masks[6];	// masks for spread(), computed once per call
+    int chunk, m;
+
+    for(chunk = K/2, m = 0; chunk >= nBit; chunk /= 2, ++m)
+    {
+      masks[m] = repeatmask(chunk, chunk*ut);
+    }
+
+    n = outputDataSize/(ut*8);
+    for(i = 0; i < n; ++i)
+    {
+      uint64_t x[VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS];
+      int t, w;
+
+      for(t = 0; t < nThread; ++t)
+      {
+        x[t] = load64(tb[t] + i*8);
+      }
+      for(w = 0; w < ut; ++w)
+      {
+        uint64_t o = 0;
+
+        for(t = 0; t < nThread; ++t)
+        {
+          o |= spread((x[t] >> (w*K)) & mask, K, ut, nBit, masks) << (t*nBit);
+        }
+        memcpy(outputBuffer + (i*ut + w)*8, &o, sizeof(o));
+      }
+    }
+
+    cornerturn_template_tail(outputBuffer, tb, n*ut*8, outputDataSize, nThread, ut, nBit);
+  }
+  else
+  {
+    // Each output word holds one sample from each of G consecutive threads.  Each block
+    // takes 64 bits from each thread and makes 64/nBit rows of ut/G output words.
+    const int G = 64/nBit;
+    const int S = 64/nBit;
+    const uint64_t mask = (1ULL << nBit) - 1;
+
+    n = outputDataSize/(ut*8);
+    for(i = 0; i < n; ++i)
+    {
+      uint64_t x[VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS];
+      uint64_t *out = (uint64_t *)(outputBuffer + i*ut*8);
+      int t, r, q;
+
+      for(t = 0; t < nThread; ++t)
+      {
+        x[t] = load64(tb[t] + i*8);
+      }
+      for(r = 0; r < S; ++r)
+      {
+        for(q = 0; q < ut/G; ++q)
+        {
+          uint64_t o = 0;
+          int j;
+
+          for(j = 0; j < G && q*G+j < nThread; ++j)
+          {
+            o |= ((x[q*G+j] >> (r*nBit)) & mask) << (j*nBit);
+          }
+          memcpy(out + r*(ut/G) + q, &o, sizeof(o));
+        }
+      }
+    }
+
+    cornerturn_template_tail(outputBuffer, tb, n*ut*8, outputDataSize, nThread, ut, nBit);
+  }
+}
+
+
+// Instantiate one corner turner per (nThread, nBit) pair
+
+#define TEMPLATE_CORNERTURNER(nThread, nBit) \
+static void cornerturn_##nThread##thread_##nBit##bit_template(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize) \
+{ \
+  cornerturn_template(outputBuffer, threadBuffers, outputDataSize, nThread, nBit); \
+}
+
+#define TEMPLATE_CORNERTURNERS(nThread) \
+TEMPLATE_CORNERTURNER(nThread, 1) \
+TEMPLATE_CORNERTURNER(nThread, 2) \
+TEMPLATE_CORNERTURNER(nThread, 4) \
+TEMPLATE_CORNERTURNER(nThread, 8) \
+TEMPLATE_CORNERTURNER(nThread, 16) \
+TEMPLATE_CORNERTURNER(nThread, 32)
+
+#define FOR_ALL_TEMPLATE_THREADS(X) \
+X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)  X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15) X(16) \
+X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) X(32) \
+X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) \
+X(49) X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63) X(64)
+
+FOR_ALL_TEMPLATE_THREADS(TEMPLATE_CORNERTURNERS)
+
+#define TEMPLATE_CORNERTURNER_ROW(nThread) \
+  { \
+    cornerturn_##nThread##thread_1bit_template, \
+    cornerturn_##nThread##thread_2bit_template, \
+    cornerturn_##nThread##thread_4bit_template, \
+    cornerturn_##nThread##thread_8bit_template, \
+    cornerturn_##nThread##thread_16bit_template, \
+    cornerturn_##nThread##thread_32bit_template \
+  },
+
+static const CornerTurner templateCornerTurners[VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS][6] =
+{
+FOR_ALL_TEMPLATE_THREADS(TEMPLATE_CORNERTURNER_ROW)
+};
+
+CornerTurner getTemplateCornerTurner(int nThread, int nBit)
+{
+	int b;
+
+	if(nThread < 1 || nThread > VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS)
+	{
+		return 0;
+	}
+
+	switch(nBit)
+	{
+	case 1:
+		b = 0;
+		break;
+	case 2:
+		b = 1;
+		break;
+	case 4:
+		b = 2;
+		break;
+	case 8:
+		b = 3;
+		break;
+	case 16:
+		b = 4;
+		break;
+	case 32:
+		b = 5;
+		break;
+	default:
+		return 0;
+	}
+
+	return templateCornerTurners[nThread-1][b];
+}
+
+
+// Corner turning for more than VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS threads is done in two
+// levels.  Threads are taken in groups of G = VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS; each
+// group is corner turned by groupTurner into a small scratch block, and the blocks are then
+// interleaved into the output.  Since ut is a power of 2 at least twice G, one output "row"
+// (one sample from each of ut threads) is just the concatenation of the corresponding rows
+// of ut/G groups, each G*nBit bits = 8*nBit bytes long.  Groups consisting entirely of padding
+// threads are zeroed; padding threads within the last partial group read from zeros.
+
+#define WIDE_ROWS_PER_BLOCK	64		// a multiple of 8, so each thread contributes whole bytes per block
+
+void cornerturn_wide(CornerTurner groupTurner, unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, int nThread, int nBit)
+{
+  const int G = VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS;
+  const int groupRowBytes = G*nBit/8;
+  static const unsigned char zeros[WIDE_ROWS_PER_BLOCK*32/8] = { 0 };
+  unsigned char scratch[WIDE_ROWS_PER_BLOCK*VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS*32/8];
+  const unsigned char *tb[VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS];
+  int ut, rowBytes, nRow, r0, g, k, j;
+
+  for(ut = 1; ut < nThread; ut *= 2);
+  rowBytes = ut*nBit/8;
+  nRow = outputDataSize/rowBytes;
+
+  for(r0 = 0; r0 < nRow; r0 += WIDE_ROWS_PER_BLOCK)
+  {
+    const int nr = (nRow - r0 < WIDE_ROWS_PER_BLOCK) ? nRow - r0 : WIDE_ROWS_PER_BLOCK;
+    const int threadOffset = r0*nBit/8;
+    unsigned char *out = outputBuffer + r0*rowBytes;
+
+    for(g = 0; g*G < ut; ++g)
+    {
+      if(g*G >= nThread)
+      {
+        for(j = 0; j < nr; ++j)
+        {
+          memset(out + j*rowBytes + g*groupRowBytes, 0, groupRowBytes);
+        }
+
+        continue;
+      }
+
+      for(k = 0; k < G; ++k)
+      {
+        tb[k] = (g*G + k < nThread) ? threadBuffers[g*G + k] + threadOffset : zeros;
+      }
+      groupTurner(scratch, tb, nr*groupRowBytes);
+      for(j = 0; j < nr; ++j)
+      {
+        memcpy(out + j*rowBytes + g*groupRowBytes, scratch + j*groupRowBytes, groupRowBytes);
+      }
+    }
+  }
+}
@@ -0,0 +1,275 @@
+/***************************************************************************
+ *   Copyright (C) 2013-2015 Walter Brisken                                *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/cornerturners_unpack.c $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+// Fused multiplex and unpack.  A correlator that unpacks the output of vdifmux() pays for
+// the corner turn writing packed multi-channel data to memory only to read it straight
+// back.  Here each thread's payload is decoded through a per-byte lookup table and
+// scattered directly to the channel arrays it would have ended up in.
+//
+// The routing follows the corner turner convention: thread sample i of thread t lands at
+// multiplexed sample i*ut + t, ut being nThread rounded up to a power of 2.  Each thread
+// sample carries W = inputChannelsPerThread*complexFactor values.  Viewed as
+// nOutputChan channels, that fixes for each (t, w) an output channel, a starting index and
+// a constant stride.  In the common case of single channel threads without fanout each
+// thread maps to one channel contiguously and whole lookup table rows are copied.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "vdifio.h"
+
+#define ALWAYS_INLINE		inline __attribute__((always_inline))
+
+// largest lookup table row: 8 1-bit samples of 4 bytes each
+#define UNPACK_MAX_ROW_BYTES	32
+
+struct unpack_layout
+{
+  int nBit;		// bits per value (bitsPerSample)
+  int W;		// values per thread sample
+  int cf;		// complex factor
+  int ut;		// nThread rounded up to power of 2
+  int nOutputChan;
+  int fanout;		// output time samples each channel gets per row of ut thread samples
+  int nThreadSample;	// thread samples in threadDataSize bytes
+  int nValue;		// values written per channel
+};
+
+static int getunpacklayout(struct unpack_layout *L, const struct vdif_mux *vm, int threadDataSize)
+{
+  int np2;
+
+  if(!vm)
+  {
+    fprintf(stderr, "Error: vdifmuxunpack: null vdif_mux structure\n");
+
+    return -1;
+  }
+  if(vm->bitsPerSample != 1 && vm->bitsPerSample != 2 && vm->bitsPerSample != 4 && vm->bitsPerSample != 8)
+  {
+    fprintf(stderr, "Error: vdifmuxunpack: %d bits per sample is not supported\n", vm->bitsPerSample);
+
+    return -2;
+  }
+
+  L->nBit = vm->bitsPerSample;
+  L->cf = vm->complexFactor;
+  L->W = vm->inputChannelsPerThread*vm->complexFactor;
+  for(L->ut = 1; L->ut < vm->nThread; L->ut *= 2);
+  for(np2 = 1; np2 < vm->nThread/vm->fanoutFactor; np2 *= 2);
+  L->nOutputChan = vm->nOutputChan;
+  L->fanout = L->ut/np2;
+
+  if(threadDataSize <= 0 || (threadDataSize*8) % (L->nBit*L->W) != 0)
+  {
+    fprintf(stderr, "Error: vdifmuxunpack: %d bytes is not a whole number of %d bit thread samples\n", threadDataSize, L->nBit*L->W);
+
+    return -3;
+  }
+
+  L->nThreadSample = threadDataSize*8/(L->nBit*L->W);
+  L->nValue = L->nThreadSample*L->fanout*L->cf;
+
+  return 0;
+}
+
+static void buildunpacklut(unsigned char *lut, const void *levels, int nBit, int elemSize)
+{
+  // lut row b holds the values of the 8/nBit samples of byte b, first sample first
+  const int spb = 8/nBit;
+  const unsigned int mask = (1U << nBit) - 1;
+  int b, k;
+
+  for(b = 0; b < 256; ++b)
+  {
+    for(k = 0; k < spb; ++k)
+    {
+      memcpy(lut + (b*spb + k)*elemSize, (const unsigned char *)levels + ((b >> (k*nBit)) & mask)*elemSize, elemSize);
+    }
+  }
+}
+
+static ALWAYS_INLINE void unpack_contiguous(unsigned char *out, const unsigned char *in, int n, const unsigned char *lut, const int rowBytes)
+{
+  int i;
+
+  for(i = 0; i < n; ++i)
+  {
+    memcpy(out + i*rowBytes, lut + in[i]*rowBytes, rowBytes);
+  }
+}
+
+static void unpackthreadcontiguous(unsigned char *out, const unsigned char *in, int n, const unsigned char *lut, int rowBytes)
+{
+  // instantiate with constant row size so the copies become single loads and stores
+  switch(rowBytes)
+  {
+  case 1:  unpack_contiguous(out, in, n, lut, 1);  break;
+  case 2:  unpack_contiguous(out, in, n, lut, 2);  break;
+  case 4:  unpack_contiguous(out, in, n, lut, 4);  break;
+  case 8:  unpack_contiguous(out, in, n, lut, 8);  break;
+  case 16: unpack_contiguous(out, in, n, lut, 16); break;
+  case 32: unpack_contiguous(out, in, n, lut, 32); break;
+  default: unpack_contiguous(out, in, n, lut, rowBytes); break;
+  }
+}
+
+static void unpackthreadstrided(unsigned char * const *chanData, const unsigned char *in, int t, const struct unpack_layout *L, const unsigned char *lut, int elemSize)
+{
+  // general case: value w of each thread sample goes to its own channel with a stride of fanout time samples
+  const int rowValues = L->nOutputChan*L->cf;
+  const int spb = 8/L->nBit;
+  const int stride = L->fanout*L->cf*elemSize;
+  static const unsigned char zeros[8] = { 0 };
+  int i, w;
+
+  for(w = 0; w < L->W; ++w)
+  {
+    const int p0 = t*L->W + w;
+    const int rem = p0 % rowValues;
+    unsigned char *out = chanData[rem/L->cf] + ((p0/rowValues)*L->cf + rem % L->cf)*elemSize;
+    int v = w;
+
+    for(i = 0; i < L->nThreadSample; ++i, v += L->W, out += stride)
+    {
+      memcpy(out, in ? lut + (in[v/spb]*spb + v%spb)*elemSize : zeros, elemSize);
+    }
+  }
+}
+
+static int vdifmuxunpack(unsigned char * const *chanData, const unsigned char * const *threadBuffers, int threadDataSize, const struct vdif_mux *vm, const void *levels, int elemSize)
+{
+  unsigned char lut[256*UNPACK_MAX_ROW_BYTES];
+  struct unpack_layout L;
+  int t, v;
+
+  v = getunpacklayout(&L, vm, threadDataSize);
+  if(v < 0)
+  {
+    return v;
+  }
+
+  buildunpacklut(lut, levels, L.nBit, elemSize);
+
+  for(t = 0; t < L.ut; ++t)
+  {
+    const unsigned char *in = (t < vm->nThread) ? threadBuffers[t] : 0;
+
+    if(L.W == L.cf && L.fanout == 1)
+    {
+      // thread t is channel t, in order
+      if(in)
+      {
+        unpackthreadcontiguous(chanData[t], in, threadDataSize, lut, 8/L.nBit*elemSize);
+      }
+      else
+      {
+        memset(chanData[t], 0, L.nValue*elemSize);
+      }
+    }
+    else
+    {
+      unpackthreadstrided(chanData, in, t, &L, lut, elemSize);
+    }
+  }
+
+  return L.nValue;
+}
+
+int vdifmuxunpackfloat(float * const *chanData, const unsigned char * const *threadBuffers, int threadDataSize, const struct vdif_mux *vm, const float *levels)
+{
+  static const float levels1[2] = { -1.0f, 1.0f };
+  static const float levels2[4] = { -3.3359f, -1.0f, 1.0f, 3.3359f };
+  float defaultLevels[256];
+  int i;
+
+  if(!levels && vm)
+  {
+    switch(vm->bitsPerSample)
+    {
+    case 1:
+      levels = levels1;
+      break;
+    case 2:
+      levels = levels2;
+      break;
+    default:
+      // offset binary
+      for(i = 0; i < 256; ++i)
+      {
+        defaultLevels[i] = i - (1 << (vm->bitsPerSample - 1));
+      }
+      levels = defaultLevels;
+    }
+  }
+
+  return vdifmuxunpack((unsigned char * const *)chanData, threadBuffers, threadDataSize, vm, levels, sizeof(float));
+}
+
+int vdifmuxunpackint8(int8_t * const *chanData, const unsigned char * const *threadBuffers, int threadDataSize, const struct vdif_mux *vm, const int8_t *levels)
+{
+  static const int8_t levels1[2] = { -1, 1 };
+  static const int8_t levels2[4] = { -3, -1, 1, 3 };
+  int8_t defaultLevels[256];
+  int i;
+
+  if(!levels && vm)
+  {
+    switch(vm->bitsPerSample)
+    {
+    case 1:
+      levels = levels1;
+      break;
+    case 2:
+      levels = levels2;
+      break;
+    default:
+      // offset binary; 8-bit code 0 has no symmetric partner so is clipped to -127
+      for(i = 0; i < 256; ++i)
+      {
+        int x = i - (1 << (vm->bitsPerSample - 1));
+
+        defaultLevels[i] = (x < -127) ? -127 : x;
+      }
+      levels = defaultLevels;
+    }
+  }
+
+  return vdifmuxunpack((unsigned char * const *)chanData, threadBuffers, threadDataSize, vm, levels, sizeof(int8_t));
+}
+
+int vdifmuxunpackvalues(const struct vdif_mux *vm, int threadDataSize)
+{
+  struct unpack_layout L;
+  int v;
+
+  v = getunpacklayout(&L, vm, threadDataSize);
+
+  return (v < 0) ? v : L.nValue;
+}
@@ -0,0 +1,566 @@
+/***************************************************************************
+ *   Copyright (C) 2013-2015 Walter Brisken                                *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/cornerturners_x86.c $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+/* SIMD corner turners for x86-64.  Three variants are provided: SSE4.1, AVX2 and AVX-512BW.
+ * All are selected at run time so a single binary can run on any x86-64 machine.
+ *
+ * The algorithm is the same for all vector widths.  Corner turning nThread threads is done
+ * in log2(nThread) rounds.  Each round interleaves pairs of adjacent streams, with a
+ * granularity that starts at nBit bits and doubles each round:
+ *
+ *   round 1:  t0 t1 | t2 t3 | ...     granularity nBit
+ *   round 2:  t0t1 t2t3 | ...         granularity 2*nBit
+ *   ...
+ *
+ * Interleaving at a granularity of 8 bits or more is a plain unpack instruction.  Below
+ * 8 bits the bytes are first unpacked and then the bits in each 16 bit word are
+ * rearranged with up to three delta swaps (Hacker's Delight, section 7-2, "outer perfect shuffle").
+ *
+ * Each block holds one vector of data from each thread, so all of the work happens in
+ * registers.  Any partial block at the end is handled a sample at a time.
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include "cornerturners.h"
+
+#ifdef HAVE_X86_CORNERTURNERS
+
+#include <immintrin.h>
+
+#define TARGET_sse41		__attribute__((target("sse4.1")))
+#define TARGET_avx2		__attribute__((target("avx2")))
+#define TARGET_avx512bw		__attribute__((target("avx512f,avx512bw")))
+#define ALWAYS_INLINE		inline __attribute__((always_inline))
+
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+#define UNROLL			_Pragma("GCC unroll 16")
+#else
+#define UNROLL
+#endif
+
+#define MAX_X86_THREADS		16
+
+
+static void cornerturn_tail(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int start, int outputDataSize, int nThread, int nBit)
+{
+	/* Handle the output bytes not covered by full vector blocks, one sample at a time.
+	 * Only used for nBit <= 8.
+	 */
+
+	const int samplesPerByte = 8/nBit;
+	const unsigned int mask = (1U << nBit) - 1;
+	int o;
+
+	for(o = start; o < outputDataSize; ++o)
+	{
+		unsigned int x = 0;
+		int k;
+
+		for(k = 0; k < samplesPerByte; ++k)
+		{
+			int s = o*samplesPerByte + k;	/* output sample number */
+			int t = s % nThread;		/* thread */
+			int is = s / nThread;		/* sample number within thread */
+
+			x |= ((threadBuffers[t][is/samplesPerByte] >> ((is % samplesPerByte)*nBit)) & mask) << (k*nBit);
+		}
+		outputBuffer[o] = x;
+	}
+}
+
+
+/* SSE4.1 */
+
+static ALWAYS_INLINE TARGET_sse41 __m128i bitshuffle_sse41(__m128i x, const int g)
+{
+	/* x contains 16 bit words with an 8 bit value from each of two streams; interleave them at granularity g bits */
+	__m128i t;
+
+	t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi16(x, 4)), _mm_set1_epi16(0x00F0));
+	x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi16(t, 4)));
+	if(g <= 2)
+	{
+		t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi16(x, 2)), _mm_set1_epi16(0x0C0C));
+		x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi16(t, 2)));
+	}
+	if(g == 1)
+	{
+		t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi16(x, 1)), _mm_set1_epi16(0x2222));
+		x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi16(t, 1)));
+	}
+
+	return x;
+}
+
+static ALWAYS_INLINE TARGET_sse41 void zip_sse41(__m128i a, __m128i b, const int g, __m128i *lo, __m128i *hi)
+{
+	switch(g)
+	{
+	case 1:
+	case 2:
+	case 4:
+		*lo = bitshuffle_sse41(_mm_unpacklo_epi8(a, b), g);
+		*hi = bitshuffle_sse41(_mm_unpackhi_epi8(a, b), g);
+		break;
+	case 8:
+		*lo = _mm_unpacklo_epi8(a, b);
+		*hi = _mm_unpackhi_epi8(a, b);
+		break;
+	case 16:
+		*lo = _mm_unpacklo_epi16(a, b);
+		*hi = _mm_unpackhi_epi16(a, b);
+		break;
+	case 32:
+		*lo = _mm_unpacklo_epi32(a, b);
+		*hi = _mm_unpackhi_epi32(a, b);
+		break;
+	default:
+		*lo = _mm_unpacklo_epi64(a, b);
+		*hi = _mm_unpackhi_epi64(a, b);
+		break;
+	}
+}
+
+static ALWAYS_INLINE TARGET_sse41 void cornerturn_sse41(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, const int nThread, const int nBit)
+{
+	const int V = sizeof(__m128i);
+	const int n = outputDataSize/(nThread*V);
+	const unsigned char *tb[MAX_X86_THREADS];
+	int i;
+
+	/* local copies of the thread pointers: stores to outputBuffer may alias anything, so the pointers would otherwise be
+	 * reloaded from threadBuffers after every store */
+	for(i = 0; i < nThread; ++i)
+	{
+		tb[i] = threadBuffers[i];
+	}
+
+	for(i = 0; i < n; ++i)
+	{
+		__m128i v[MAX_X86_THREADS], w[MAX_X86_THREADS];
+		int t, s, g;
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			v[t] = _mm_loadu_si128((const __m128i *)(tb[t] + i*V));
+		}
+
+		/* s is the number of streams remaining, each consisting of nThread/s vectors */
+UNROLL
+		for(s = nThread, g = nBit; s > 1; s /= 2, g *= 2)
+		{
+			const int m = nThread/s;
+			int j, k;
+
+UNROLL
+			for(j = 0; j < s; j += 2)
+			{
+UNROLL
+				for(k = 0; k < m; ++k)
+				{
+					zip_sse41(v[j*m+k], v[(j+1)*m+k], g, w + j*m+2*k, w + j*m+2*k+1);
+				}
+			}
+UNROLL
+			for(t = 0; t < nThread; ++t)
+			{
+				v[t] = w[t];
+			}
+		}
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			_mm_storeu_si128((__m128i *)(outputBuffer + (i*nThread + t)*V), v[t]);
+		}
+	}
+
+	cornerturn_tail(outputBuffer, tb, n*nThread*V, outputDataSize, nThread, nBit);
+}
+
+
+/* AVX2 */
+
+static ALWAYS_INLINE TARGET_avx2 __m256i bitshuffle_avx2(__m256i x, const int g)
+{
+	__m256i t;
+
+	t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi16(x, 4)), _mm256_set1_epi16(0x00F0));
+	x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi16(t, 4)));
+	if(g <= 2)
+	{
+		t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi16(x, 2)), _mm256_set1_epi16(0x0C0C));
+		x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi16(t, 2)));
+	}
+	if(g == 1)
+	{
+		t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi16(x, 1)), _mm256_set1_epi16(0x2222));
+		x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi16(t, 1)));
+	}
+
+	return x;
+}
+
+static ALWAYS_INLINE TARGET_avx2 void zip_avx2(__m256i a, __m256i b, const int g, __m256i *lo, __m256i *hi)
+{
+	__m256i l, h;
+
+	switch(g)
+	{
+	case 1:
+	case 2:
+	case 4:
+		l = bitshuffle_avx2(_mm256_unpacklo_epi8(a, b), g);
+		h = bitshuffle_avx2(_mm256_unpackhi_epi8(a, b), g);
+		break;
+	case 8:
+		l = _mm256_unpacklo_epi8(a, b);
+		h = _mm256_unpackhi_epi8(a, b);
+		break;
+	case 16:
+		l = _mm256_unpacklo_epi16(a, b);
+		h = _mm256_unpackhi_epi16(a, b);
+		break;
+	case 32:
+		l = _mm256_unpacklo_epi32(a, b);
+		h = _mm256_unpackhi_epi32(a, b);
+		break;
+	default:
+		l = _mm256_unpacklo_epi64(a, b);
+		h = _mm256_unpackhi_epi64(a, b);
+		break;
+	}
+
+	/* unpack works within 128 bit lanes; put the lanes back in stream order */
+	*lo = _mm256_permute2x128_si256(l, h, 0x20);
+	*hi = _mm256_permute2x128_si256(l, h, 0x31);
+}
+
+static ALWAYS_INLINE TARGET_avx2 void cornerturn_avx2(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, const int nThread, const int nBit)
+{
+	const int V = sizeof(__m256i);
+	const int n = outputDataSize/(nThread*V);
+	const unsigned char *tb[MAX_X86_THREADS];
+	int i;
+
+	/* local copies of the thread pointers: stores to outputBuffer may alias anything, so the pointers would otherwise be
+	 * reloaded from threadBuffers after every store */
+	for(i = 0; i < nThread; ++i)
+	{
+		tb[i] = threadBuffers[i];
+	}
+
+	for(i = 0; i < n; ++i)
+	{
+		__m256i v[MAX_X86_THREADS], w[MAX_X86_THREADS];
+		int t, s, g;
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			v[t] = _mm256_loadu_si256((const __m256i *)(tb[t] + i*V));
+		}
+
+UNROLL
+		for(s = nThread, g = nBit; s > 1; s /= 2, g *= 2)
+		{
+			const int m = nThread/s;
+			int j, k;
+
+UNROLL
+			for(j = 0; j < s; j += 2)
+			{
+UNROLL
+				for(k = 0; k < m; ++k)
+				{
+					zip_avx2(v[j*m+k], v[(j+1)*m+k], g, w + j*m+2*k, w + j*m+2*k+1);
+				}
+			}
+UNROLL
+			for(t = 0; t < nThread; ++t)
+			{
+				v[t] = w[t];
+			}
+		}
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			_mm256_storeu_si256((__m256i *)(outputBuffer + (i*nThread + t)*V), v[t]);
+		}
+	}
+
+	cornerturn_tail(outputBuffer, tb, n*nThread*V, outputDataSize, nThread, nBit);
+}
+
+
+/* AVX-512BW */
+
+static ALWAYS_INLINE TARGET_avx512bw __m512i bitshuffle_avx512bw(__m512i x, const int g)
+{
+	__m512i t;
+
+	t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi16(x, 4)), _mm512_set1_epi16(0x00F0));
+	x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_slli_epi16(t, 4)));
+	if(g <= 2)
+	{
+		t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi16(x, 2)), _mm512_set1_epi16(0x0C0C));
+		x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_slli_epi16(t, 2)));
+	}
+	if(g == 1)
+	{
+		t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi16(x, 1)), _mm512_set1_epi16(0x2222));
+		x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_slli_epi16(t, 1)));
+	}
+
+	return x;
+}
+
+static ALWAYS_INLINE TARGET_avx512bw void zip_avx512bw(__m512i a, __m512i b, const int g, __m512i *lo, __m512i *hi)
+{
+	__m512i l, h;
+
+	switch(g)
+	{
+	case 1:
+	case 2:
+	case 4:
+		l = bitshuffle_avx512bw(_mm512_unpacklo_epi8(a, b), g);
+		h = bitshuffle_avx512bw(_mm512_unpackhi_epi8(a, b), g);
+		break;
+	case 8:
+		l = _mm512_unpacklo_epi8(a, b);
+		h = _mm512_unpackhi_epi8(a, b);
+		break;
+	case 16:
+		l = _mm512_unpacklo_epi16(a, b);
+		h = _mm512_unpackhi_epi16(a, b);
+		break;
+	case 32:
+		l = _mm512_unpacklo_epi32(a, b);
+		h = _mm512_unpackhi_epi32(a, b);
+		break;
+	default:
+		l = _mm512_unpacklo_epi64(a, b);
+		h = _mm512_unpackhi_epi64(a, b);
+		break;
+	}
+
+	/* unpack works within 128 bit lanes; put the lanes back in stream order */
+	*lo = _mm512_permutex2var_epi64(l, _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0), h);
+	*hi = _mm512_permutex2var_epi64(l, _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4), h);
+}
+
+static ALWAYS_INLINE TARGET_avx512bw void cornerturn_avx512bw(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize, const int nThread, const int nBit)
+{
+	const int V = sizeof(__m512i);
+	const int n = outputDataSize/(nThread*V);
+	const unsigned char *tb[MAX_X86_THREADS];
+	int i;
+
+	/* local copies of the thread pointers: stores to outputBuffer may alias anything, so the pointers would otherwise be
+	 * reloaded from threadBuffers after every store */
+	for(i = 0; i < nThread; ++i)
+	{
+		tb[i] = threadBuffers[i];
+	}
+
+	for(i = 0; i < n; ++i)
+	{
+		__m512i v[MAX_X86_THREADS], w[MAX_X86_THREADS];
+		int t, s, g;
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			v[t] = _mm512_loadu_si512((const void *)(tb[t] + i*V));
+		}
+
+UNROLL
+		for(s = nThread, g = nBit; s > 1; s /= 2, g *= 2)
+		{
+			const int m = nThread/s;
+			int j, k;
+
+UNROLL
+			for(j = 0; j < s; j += 2)
+			{
+UNROLL
+				for(k = 0; k < m; ++k)
+				{
+					zip_avx512bw(v[j*m+k], v[(j+1)*m+k], g, w + j*m+2*k, w + j*m+2*k+1);
+				}
+			}
+UNROLL
+			for(t = 0; t < nThread; ++t)
+			{
+				v[t] = w[t];
+			}
+		}
+
+UNROLL
+		for(t = 0; t < nThread; ++t)
+		{
+			_mm512_storeu_si512((void *)(outputBuffer + (i*nThread + t)*V), v[t]);
+		}
+	}
+
+	cornerturn_tail(outputBuffer, tb, n*nThread*V, outputDataSize, nThread, nBit);
+}
+
+
+/* Instantiate specialized versions for each supported (nThread, nBit) pair */
+
+#define X86_CORNERTURNER(isa, nThread, nBit) \
+static TARGET_##isa void cornerturn_##nThread##thread_##nBit##bit_##isa(unsigned char *outputBuffer, const unsigned char * const *threadBuffers, int outputDataSize) \
+{ \
+	cornerturn_##isa(outputBuffer, threadBuffers, outputDataSize, nThread, nBit); \
+}
+
+#define X86_CORNERTURNERS(isa) \
+X86_CORNERTURNER(isa, 2, 1) \
+X86_CORNERTURNER(isa, 4, 1) \
+X86_CORNERTURNER(isa, 8, 1) \
+X86_CORNERTURNER(isa, 16, 1) \
+X86_CORNERTURNER(isa, 2, 2) \
+X86_CORNERTURNER(isa, 4, 2) \
+X86_CORNERTURNER(isa, 8, 2) \
+X86_CORNERTURNER(isa, 16, 2) \
+X86_CORNERTURNER(isa, 2, 4) \
+X86_CORNERTURNER(isa, 4, 4) \
+X86_CORNERTURNER(isa, 8, 4) \
+X86_CORNERTURNER(isa, 16, 4)
+
+X86_CORNERTURNERS(sse41)
+X86_CORNERTURNERS(avx2)
+X86_CORNERTURNERS(avx512bw)
+
+#define X86_CORNERTURNER_CASES(isa, nBit) \
+	switch(nThread) \
+	{ \
+	case 2: \
+		return cornerturn_2thread_##nBit##bit_##isa; \
+	case 4: \
+		return cornerturn_4thread_##nBit##bit_##isa; \
+	case 8: \
+		return cornerturn_8thread_##nBit##bit_##isa; \
+	case 16: \
+		return cornerturn_16thread_##nBit##bit_##isa; \
+	default: \
+		return 0; \
+	}
+
+#define X86_CORNERTURNER_SELECT(isa) \
+	if(nBit == 1) \
+	{ \
+		X86_CORNERTURNER_CASES(isa, 1) \
+	} \
+	else if(nBit == 2) \
+	{ \
+		X86_CORNERTURNER_CASES(isa, 2) \
+	} \
+	else if(nBit == 4) \
+	{ \
+		X86_CORNERTURNER_CASES(isa, 4) \
+	} \
+	else \
+	{ \
+		return 0; \
+	}
+
+enum VDIFCornerTurnerISA getx86CornerTurnerISA(void)
+{
+	static enum VDIFCornerTurnerISA isa = NumVDIFCornerTurnerISAs;
+
+	if(isa == NumVDIFCornerTurnerISAs)
+	{
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512bw"))
+		{
+			isa = VDIFCornerTurnerISAAVX512BW;
+		}
+		else if(__builtin_cpu_supports("avx2"))
+		{
+			isa = VDIFCornerTurnerISAAVX2;
+		}
+		else if(__builtin_cpu_supports("sse4.1"))
+		{
+			isa = VDIFCornerTurnerISASSE41;
+		}
+		else
+		{
+			isa = VDIFCornerTurnerISAGeneric;
+		}
+	}
+
+	return isa;
+}
+
+CornerTurner getx86CornerTurner(int nThread, int nBit, enum VDIFCornerTurnerISA isa)
+{
+	if(isa > getx86CornerTurnerISA())
+	{
+		/* this CPU can't run it */
+		return 0;
+	}
+
+	switch(isa)
+	{
+	case VDIFCornerTurnerISASSE41:
+		X86_CORNERTURNER_SELECT(sse41)
+	case VDIFCornerTurnerISAAVX2:
+		X86_CORNERTURNER_SELECT(avx2)
+	case VDIFCornerTurnerISAAVX512BW:
+		X86_CORNERTURNER_SELECT(avx512bw)
+	default:
+		return 0;
+	}
+}
+
+#else
+
+/* No x86 SIMD support in this build: everything falls back to the portable corner turners */
+
+enum VDIFCornerTurnerISA getx86CornerTurnerISA(void)
+{
+	return VDIFCornerTurnerISAGeneric;
+}
+
+CornerTurner getx86CornerTurner(int nThread, int nBit, enum VDIFCornerTurnerISA isa)
+{
+	(void)nThread;
+	(void)nBit;
+	(void)isa;
+
+	return 0;
+}
+
+#endif
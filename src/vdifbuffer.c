@@ -28,17 +28,43 @@
 //============================================================================
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <vdifio.h>
 #include "config.h"
 
 
-/* look for at least 3 back-to-back frames with consistent structure */
+/* true if buffer holds 3 back-to-back frames of frameSize bytes with consistent structure starting at offset i */
+static inline int isvdifframetriplet(const unsigned char *buffer, int i, int frameSize)
+{
+	const struct vdif_header *vh1, *vh2, *vh3;
+
+	vh1 = (const struct vdif_header *)(buffer + i);
+	vh2 = (const struct vdif_header *)(buffer + i + frameSize);
+	vh3 = (const struct vdif_header *)(buffer + i + 2*frameSize);
+
+	return getVDIFFrameBytes(vh1) == frameSize &&
+	       getVDIFFrameBytes(vh2) == frameSize &&
+	       getVDIFFrameBytes(vh3) == frameSize &&
+	       getVDIFEpoch(vh1) == getVDIFEpoch(vh2) &&
+	       getVDIFEpoch(vh1) == getVDIFEpoch(vh3) &&
+	       getVDIFFrameEpochSecOffset(vh2) - getVDIFFrameEpochSecOffset(vh1) < 2 &&
+	       getVDIFFrameEpochSecOffset(vh3) - getVDIFFrameEpochSecOffset(vh2) < 2 &&
+	       getVDIFFrameNumber(vh2) - getVDIFFrameNumber(vh1) < 5 &&
+	       getVDIFFrameNumber(vh3) - getVDIFFrameNumber(vh1) < 5;
+}
+
+/* look for at least 3 back-to-back frames with consistent structure.
+ *
+ * A likely frame size is preferred, in the order listed; failing that the smallest legal size (a multiple of 8 below
+ * bufferSize/4) is chosen.  Only the frame size declared by the header at an offset can produce a match there, so a single
+ * pass over the offsets, testing just that size at each, finds every size that would match. */
 int determinevdifframesize(const unsigned char *buffer, int bufferSize)
 {
-	int frameSize;
-	int likelyFrameSizes[] = {5032, 10032, 20032, 40032, 80032, 160032, 8032, 16032, 32032, 1032, 2032, 4032};	/* add more here as you like ... */
+	static const int likelyFrameSizes[] = {5032, 10032, 20032, 40032, 80032, 160032, 8032, 16032, 32032, 1032, 2032, 4032};	/* add more here as you like ... */
 	const int nLikelyFrameSizes = sizeof(likelyFrameSizes)/sizeof(likelyFrameSizes[0]);
-	int f;
+	int bestLikely = nLikelyFrameSizes;	/* index into likelyFrameSizes of the best match so far */
+	int bestOther = -1;			/* smallest matching size from the rest */
+	int i, f, N;
 
 	if(bufferSize < 3*(VDIF_HEADER_BYTES + 8))
 	{
@@ -47,67 +73,44 @@ int determinevdifframesize(const unsigned char *buffer, int bufferSize)
 		return -1;
 	}
 
-	/* First check likely frame sizes */
-	for(f = 0; f < nLikelyFrameSizes; ++f)
+	/* no frame can be shorter than this, so no triplet can start later */
+	N = bufferSize - 2*(VDIF_HEADER_BYTES + 8) - VDIF_HEADER_BYTES;
+
+	for(i = 0; i < N && bestLikely > 0; ++i)
 	{
-		int i, N;
+		int frameSize;
 
-		frameSize = likelyFrameSizes[f];
+		frameSize = getVDIFFrameBytes((const struct vdif_header *)(buffer + i));
 
-		N = bufferSize - 2*frameSize - VDIF_HEADER_BYTES;
-		for(i = 0; i < N ; ++i)
+		if(frameSize < VDIF_HEADER_BYTES + 8 || i >= bufferSize - 2*frameSize - VDIF_HEADER_BYTES)
 		{
-			struct vdif_header *vh1, *vh2, *vh3;
-
-			vh1 = (struct vdif_header *)(buffer + i);
-			vh2 = (struct vdif_header *)(buffer + i + frameSize);
-			vh3 = (struct vdif_header *)(buffer + i + 2*frameSize);
-
-			if(getVDIFFrameBytes(vh1) == frameSize &&
-			   getVDIFFrameBytes(vh2) == frameSize &&
-			   getVDIFFrameBytes(vh3) == frameSize &&
-			   getVDIFEpoch(vh1) == getVDIFEpoch(vh2) &&
-			   getVDIFEpoch(vh1) == getVDIFEpoch(vh3) &&
-			   getVDIFFrameEpochSecOffset(vh2) - getVDIFFrameEpochSecOffset(vh1) < 2 &&
-			   getVDIFFrameEpochSecOffset(vh3) - getVDIFFrameEpochSecOffset(vh2) < 2 &&
-			   getVDIFFrameNumber(vh2) - getVDIFFrameNumber(vh1) < 5 &&
-			   getVDIFFrameNumber(vh3) - getVDIFFrameNumber(vh1) < 5)
-			{
-				return frameSize;
-			}
+			continue;
+		}
+		if(!isvdifframetriplet(buffer, i, frameSize))
+		{
+			continue;
 		}
-	}
-
-	/* Finally do exhaustive search */
-	for(frameSize = VDIF_HEADER_BYTES + 8; frameSize < bufferSize/4; frameSize += 8)	/* step over legal frame sizes */
-	{
-		int i, N;
 
-		N = bufferSize - 2*frameSize - VDIF_HEADER_BYTES;
-		for(i = 0; i < N ; ++i)
+		for(f = 0; f < nLikelyFrameSizes && likelyFrameSizes[f] != frameSize; ++f) { }
+		if(f < nLikelyFrameSizes)
 		{
-			struct vdif_header *vh1, *vh2, *vh3;
-
-			vh1 = (struct vdif_header *)(buffer + i);
-			vh2 = (struct vdif_header *)(buffer + i + frameSize);
-			vh3 = (struct vdif_header *)(buffer + i + 2*frameSize);
-
-			if(getVDIFFrameBytes(vh1) == frameSize &&
-			   getVDIFFrameBytes(vh2) == frameSize &&
-			   getVDIFFrameBytes(vh3) == frameSize &&
-			   getVDIFEpoch(vh1) == getVDIFEpoch(vh2) &&
-			   getVDIFEpoch(vh1) == getVDIFEpoch(vh3) &&
-			   getVDIFFrameEpochSecOffset(vh2) - getVDIFFrameEpochSecOffset(vh1) < 2 &&
-			   getVDIFFrameEpochSecOffset(vh3) - getVDIFFrameEpochSecOffset(vh2) < 2 &&
-			   getVDIFFrameNumber(vh2) - getVDIFFrameNumber(vh1) < 5 &&
-			   getVDIFFrameNumber(vh3) - getVDIFFrameNumber(vh1) < 5)
+			if(f < bestLikely)
 			{
-				return frameSize;
+				bestLikely = f;
 			}
 		}
+		else if(frameSize < bufferSize/4 && (bestOther < 0 || frameSize < bestOther))
+		{
+			bestOther = frameSize;
+		}
 	}
 
-	return -1;
+	if(bestLikely < nLikelyFrameSizes)
+	{
+		return likelyFrameSizes[bestLikely];
+	}
+
+	return bestOther;
 }
 
 /* Look for first pair of consecutive valid frames and return offset to start of the first of these */
@@ -141,3 +144,166 @@ int determinevdifframeoffset(const unsigned char *buffer, int bufferSize, int fr
 
 	return -1;
 }
+
+/* 1 if the header's EDV carries a sync word and it is intact, -1 if it is damaged, 0 if there is none */
+static int checkvdifsyncword(const struct vdif_header *vh)
+{
+	if(getVDIFLegacy(vh))
+	{
+		return 0;
+	}
+
+	switch(vh->eversion)
+	{
+	case 1:
+	case 3:
+	case 4:
+		return (vh->extended2 == VDIF_SYNC_WORD) ? 1 : -1;
+	case 2:
+		return (((const struct vdif_edv2_header *)vh)->sync == VDIF_ALMA_SYNC) ? 1 : -1;
+	default:
+		return 0;
+	}
+}
+
+/* true if vh could be a frame of the same stream as vh0 */
+static inline int issamevdifstream(const struct vdif_header *vh, const struct vdif_header *vh0)
+{
+	return vh->framelength8 == vh0->framelength8 &&
+	       vh->legacymode == vh0->legacymode &&
+	       vh->epoch == vh0->epoch &&
+	       vh->version == vh0->version &&
+	       vh->nchan == vh0->nchan &&
+	       vh->nbits == vh0->nbits &&
+	       vh->iscomplex == vh0->iscomplex &&
+	       vh->eversion == vh0->eversion &&
+	       abs(getVDIFFrameEpochSecOffset(vh) - getVDIFFrameEpochSecOffset(vh0)) <= 1;
+}
+
+/* counts consistent frames, up to nFrame, starting at offset i.  *nSync gets how many had an intact sync word */
+static int countvdifsyncrun(const unsigned char *buffer, int bufferSize, int i, int frameSize, int nFrame, int *nSync)
+{
+	const struct vdif_header *vh0 = (const struct vdif_header *)(buffer + i);
+	int threadIds[VDIF_SYNC_MAX_FRAMES];
+	int lastSecond[VDIF_SYNC_MAX_FRAMES];
+	int lastFrame[VDIF_SYNC_MAX_FRAMES];
+	int nThread = 0;
+	int k;
+
+	*nSync = 0;
+	for(k = 0; k < nFrame && i + VDIF_HEADER_BYTES <= bufferSize; ++k, i += frameSize)
+	{
+		const struct vdif_header *vh = (const struct vdif_header *)(buffer + i);
+		int s, f, t, sync;
+
+		if(!issamevdifstream(vh, vh0))
+		{
+			break;
+		}
+
+		sync = checkvdifsyncword(vh);
+		if(sync < 0)
+		{
+			break;
+		}
+		*nSync += sync;
+
+		/* within a thread, frame numbers must step forward by a little, or restart early in the next second */
+		s = getVDIFFrameEpochSecOffset(vh);
+		f = getVDIFFrameNumber(vh);
+		for(t = 0; t < nThread && threadIds[t] != getVDIFThreadID(vh); ++t) { }
+		if(t < nThread)
+		{
+			if(!((s == lastSecond[t] && f >= lastFrame[t] && f - lastFrame[t] < 5) ||
+			     (s == lastSecond[t] + 1 && f < 5)))
+			{
+				break;
+			}
+		}
+		else
+		{
+			threadIds[t] = getVDIFThreadID(vh);
+			++nThread;
+		}
+		lastSecond[t] = s;
+		lastFrame[t] = f;
+	}
+
+	return k;
+}
+
+int determinevdifframesync(const unsigned char *buffer, int bufferSize, int frameSize, int nFrame, int *confidence)
+{
+	int bestOffset = -1;
+	int bestRun = 1;	/* a lone frame is not enough */
+	int bestSync = 0;
+	int i, N;
+
+	if(nFrame <= 0)
+	{
+		nFrame = VDIF_SYNC_DEFAULT_FRAMES;
+	}
+	if(nFrame > VDIF_SYNC_MAX_FRAMES)
+	{
+		nFrame = VDIF_SYNC_MAX_FRAMES;
+	}
+	if(confidence)
+	{
+		*confidence = 0;
+	}
+	if(frameSize < VDIF_HEADER_BYTES + 8)
+	{
+		return -1;
+	}
+
+	/* at least 2 headers are needed */
+	N = bufferSize - frameSize - VDIF_HEADER_BYTES;
+
+	for(i = 0; i <= N; ++i)
+	{
+		int run, nSync;
+
+		if(getVDIFFrameBytes((const struct vdif_header *)(buffer + i)) != frameSize)
+		{
+			continue;
+		}
+
+		run = countvdifsyncrun(buffer, bufferSize, i, frameSize, nFrame, &nSync);
+		if(run > bestRun)
+		{
+			bestOffset = i;
+			bestRun = run;
+			bestSync = nSync;
+			if(run == nFrame)
+			{
+				break;
+			}
+		}
+	}
+
+	/* The best run fixes what the stream looks like.  A shorter run before it that agrees is just as good: it may be cut
+	 * short by something inserted in the stream, such as a Mark6 block header, or by one damaged frame. */
+	for(i = 0; i < bestOffset; ++i)
+	{
+		int nSync;
+
+		if(issamevdifstream((const struct vdif_header *)(buffer + i), (const struct vdif_header *)(buffer + bestOffset)) &&
+		   countvdifsyncrun(buffer, bufferSize, i, frameSize, nFrame, &nSync) >= 2)
+		{
+			bestOffset = i;
+
+			break;
+		}
+	}
+
+	if(bestOffset >= 0 && confidence)
+	{
+		*confidence = 100*bestRun/nFrame;
+		if(bestSync < bestRun)
+		{
+			*confidence = *confidence*3/4;
+		}
+	}
+
+	return bestOffset;
+}
@@ -0,0 +1,1517 @@
+/***************************************************************************
+ *   Copyright (C) 2015 Walter Brisken                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/vdifcapture.c $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#ifdef HAVE_TPACKET_V3
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#endif
+#include "vdifio.h"
+
+#define VDIF_CAPTURE_CMSG_BYTES		64	/* room for the UDP_GRO and SO_RXQ_OVFL control messages of one packet */
+#define VDIF_CAPTURE_MAX_GRO_BYTES	65536	/* largest packet UDP GRO can build */
+#define VDIF_CAPTURE_POLL_MS		100	/* how often blocked threads look to see if capture has stopped */
+#define VDIF_CAPTURE_PACKET_BLOCK_BYTES	(1<<20)	/* TPACKET_V3 block size */
+#define VDIF_CAPTURE_PACKET_FRAME_BYTES	2048	/* nominal TPACKET_V3 frame size; packets are packed in blocks regardless */
+#define VDIF_CAPTURE_PACKET_RETIRE_MS	10	/* a partly filled block is passed to the consumer after this long */
+
+/* One ring per socket.  Frame i lives at data + (i % nSlot)*frameSize.  head (frames published) is written only by the
+ * receiver and tail (frames released) only by the consumer, so frames pass without a lock; the lock and conditions in
+ * struct vdif_capture only serve to sleep on an empty or full ring.  As for the Mark6 read-ahead ring, counters and
+ * waiting flags use sequentially consistent atomics so no wakeup is lost. */
+struct vdif_capture_ring
+{
+	struct vdif_capture *vc;
+	int fd;
+	int port;
+	unsigned char *data;		/* nSlot frames, plus nSpill more that GRO may write past the end */
+	unsigned int nSlot;
+	unsigned int nSpill;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int pending;		/* frames handed out by getvdifcapture() and not yet released */
+	int useGRO;
+	pthread_t thread;
+	int started;
+	struct vdif_capture_statistics stats;	/* written by the receiver only */
+
+	/* packet (TPACKET_V3) mode: the kernel fills a mapped ring of blocks directly and there is no receiver thread.
+	 * Blocks nextBlock onwards, nBlockTaken of them, belong to the consumer; the last may be only partly handed out. */
+	unsigned char *map;
+	size_t mapBytes;
+	unsigned int nBlock;
+	unsigned int nextBlock;
+	unsigned int nBlockTaken;
+	unsigned int nPacketLeft;	/* packets of the last block taken not yet looked at */
+	struct tpacket3_hdr *nextPacket;
+};
+
+struct vdif_capture
+{
+	struct vdif_capture_config config;
+	int frameSize;
+	int packetMode;			/* frames are taken from AF_PACKET rings rather than UDP sockets */
+	int nRing;
+	struct vdif_capture_ring rings[VDIF_CAPTURE_MAX_SOCKETS];
+	int nextRing;			/* where getvdifcapture() starts looking, so no ring is favoured */
+	unsigned char *scratch;		/* where the bytes around each frame are received */
+	int stop;
+	int consumerWaiting;
+	int receiversWaiting;		/* how many receivers are waiting for ring space */
+	pthread_mutex_t waitLock;
+	pthread_cond_t dataCond;
+	pthread_cond_t spaceCond;
+};
+
+static inline unsigned int loadCaptureCounter(const unsigned int *c)
+{
+	return __atomic_load_n(c, __ATOMIC_SEQ_CST);
+}
+
+static inline void storeCaptureCounter(unsigned int *c, unsigned int v)
+{
+	__atomic_store_n(c, v, __ATOMIC_SEQ_CST);
+}
+
+static inline int loadCaptureFlag(const int *f)
+{
+	return __atomic_load_n(f, __ATOMIC_SEQ_CST);
+}
+
+static inline void storeCaptureFlag(int *f, int v)
+{
+	__atomic_store_n(f, v, __ATOMIC_SEQ_CST);
+}
+
+static void wakeCaptureWaiters(int *waiting, pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+	if(loadCaptureFlag(waiting))
+	{
+		pthread_mutex_lock(lock);
+		pthread_cond_broadcast(cond);
+		pthread_mutex_unlock(lock);
+	}
+}
+
+static void waitCaptureCond(pthread_cond_t *cond, pthread_mutex_t *lock, int ms)
+{
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday(&now, 0);
+	until.tv_sec = now.tv_sec + ms/1000;
+	until.tv_nsec = (now.tv_usec + (ms%1000)*1000)*1000L;
+	if(until.tv_nsec >= 1000000000L)
+	{
+		until.tv_nsec -= 1000000000L;
+		++until.tv_sec;
+	}
+	pthread_cond_timedwait(cond, lock, &until);
+}
+
+void initvdifcaptureconfig(struct vdif_capture_config *cfg)
+{
+	memset(cfg, 0, sizeof(struct vdif_capture_config));
+	cfg->nSocketPerPort = 1;
+	cfg->ringBytes = VDIF_CAPTURE_DEFAULT_RING_BYTES;
+	cfg->batchSize = VDIF_CAPTURE_DEFAULT_BATCH;
+	cfg->socketBufferBytes = VDIF_CAPTURE_DEFAULT_SOCKET_BUFFER;
+}
+
+static int openCaptureSocket(int port, int reusePort, int socketBufferBytes)
+{
+	struct sockaddr_in addr;
+	struct timeval timeout;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot create UDP socket: %s\n", strerror(errno));
+
+		return -1;
+	}
+	if(reusePort)
+	{
+#ifdef SO_REUSEPORT
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+#endif
+		{
+			fprintf(stderr, "Error: newvdifcapture: cannot share port %d between sockets (SO_REUSEPORT)\n", port);
+			close(fd);
+
+			return -1;
+		}
+	}
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socketBufferBytes, sizeof(socketBufferBytes)) != 0)
+	{
+		fprintf(stderr, "Warning: newvdifcapture: cannot set socket buffer to %d bytes\n", socketBufferBytes);
+	}
+#ifdef SO_RXQ_OVFL
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
+
+	/* so receivers notice when capture is stopped */
+	timeout.tv_sec = 0;
+	timeout.tv_usec = VDIF_CAPTURE_POLL_MS*1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot bind to UDP port %d: %s\n", port, strerror(errno));
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/* reads the control messages of one packet: the GRO segment size, if any, and the kernel's drop count */
+static int parseCaptureCmsg(struct msghdr *msg, struct vdif_capture_ring *R)
+{
+	struct cmsghdr *cm;
+	int segmentSize = 0;
+
+	for(cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+	{
+#ifdef UDP_GRO
+		if(cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+		{
+			memcpy(&segmentSize, CMSG_DATA(cm), sizeof(int));
+		}
+#endif
+#ifdef SO_RXQ_OVFL
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+		{
+			uint32_t drops;
+
+			memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+			R->stats.nKernelDrop = drops;
+		}
+#endif
+	}
+
+	return segmentSize;
+}
+
+/* waits until at least need frames of ring space are free; returns the number free, or 0 if capture is stopping */
+static unsigned int waitCaptureSpace(struct vdif_capture_ring *R, unsigned int need)
+{
+	struct vdif_capture *vc = R->vc;
+	unsigned int space;
+
+	space = R->nSlot - (R->head - loadCaptureCounter(&R->tail));
+	if(space >= need)
+	{
+		return space;
+	}
+
+	++R->stats.nRingFull;
+	pthread_mutex_lock(&vc->waitLock);
+	/* several receivers may wait at once; the count only changes under waitLock */
+	storeCaptureFlag(&vc->receiversWaiting, vc->receiversWaiting + 1);
+	while((space = R->nSlot - (R->head - loadCaptureCounter(&R->tail))) < need && !loadCaptureFlag(&vc->stop))
+	{
+		waitCaptureCond(&vc->spaceCond, &vc->waitLock, VDIF_CAPTURE_POLL_MS);
+	}
+	storeCaptureFlag(&vc->receiversWaiting, vc->receiversWaiting - 1);
+	pthread_mutex_unlock(&vc->waitLock);
+
+	return loadCaptureFlag(&vc->stop) ? 0 : space;
+}
+
+static void *vdifCaptureReceiver(void *arg)
+{
+	struct vdif_capture_ring *R = (struct vdif_capture_ring *)arg;
+	struct vdif_capture *vc = R->vc;
+	const int frameSize = vc->frameSize;
+	const int front = vc->config.skipBytesFront;
+	const int back = vc->config.skipBytesBack;
+	const int packetSize = frameSize + front + back;
+	int batch;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned char *cmsgs;
+
+	batch = R->useGRO ? 1 : vc->config.batchSize;	/* with GRO each packet already carries many frames */
+	msgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+	iovs = (struct iovec *)calloc(3*batch, sizeof(struct iovec));
+	cmsgs = (unsigned char *)calloc(batch, VDIF_CAPTURE_CMSG_BYTES);
+	if(!msgs || !iovs || !cmsgs)
+	{
+		fprintf(stderr, "Error: vdifcapture: cannot allocate receive batch for port %d\n", R->port);
+		free(msgs);
+		free(iovs);
+		free(cmsgs);
+
+		return 0;
+	}
+
+	while(!loadCaptureFlag(&vc->stop))
+	{
+		unsigned int space, slot, n, i, good;
+		int v;
+
+		space = waitCaptureSpace(R, R->useGRO ? R->nSpill : 1);
+		if(space == 0)
+		{
+			break;
+		}
+		slot = R->head % R->nSlot;
+
+		if(R->useGRO)
+		{
+			/* one coalesced packet of up to nSpill frames; it may run into the spill area past the end */
+			n = 1;
+			iovs[0].iov_base = R->data + (size_t)slot*frameSize;
+			iovs[0].iov_len = (size_t)R->nSpill*frameSize;
+			msgs[0].msg_hdr.msg_iov = iovs;
+			msgs[0].msg_hdr.msg_iovlen = 1;
+		}
+		else
+		{
+			/* each frame is received straight into its slot; the bytes around it go to scratch */
+			n = R->nSlot - slot;
+			if(n > space)
+			{
+				n = space;
+			}
+			if(n > (unsigned int)batch)
+			{
+				n = batch;
+			}
+			for(i = 0; i < n; ++i)
+			{
+				struct iovec *iov = iovs + 3*i;
+				int k = 0;
+
+				if(front > 0)
+				{
+					iov[k].iov_base = vc->scratch;
+					iov[k].iov_len = front;
+					++k;
+				}
+				iov[k].iov_base = R->data + (size_t)(slot + i)*frameSize;
+				iov[k].iov_len = frameSize;
+				++k;
+				if(back > 0)
+				{
+					iov[k].iov_base = vc->scratch;
+					iov[k].iov_len = back;
+					++k;
+				}
+				msgs[i].msg_hdr.msg_iov = iov;
+				msgs[i].msg_hdr.msg_iovlen = k;
+			}
+		}
+		for(i = 0; i < n; ++i)
+		{
+			msgs[i].msg_hdr.msg_control = cmsgs + i*VDIF_CAPTURE_CMSG_BYTES;
+			msgs[i].msg_hdr.msg_controllen = VDIF_CAPTURE_CMSG_BYTES;
+			msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		v = recvmmsg(R->fd, msgs, n, MSG_WAITFORONE, 0);
+		if(v < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "Error: vdifcapture: receive on port %d failed: %s\n", R->port, strerror(errno));
+
+			break;
+		}
+
+		good = 0;
+		if(R->useGRO)
+		{
+			int segmentSize, len;
+
+			segmentSize = parseCaptureCmsg(&msgs[0].msg_hdr, R);
+			len = msgs[0].msg_len;
+			if(len == 0)
+			{
+				/* an empty datagram; nothing to divide into frames */
+				++R->stats.nPacket;
+				++R->stats.nBadPacket;
+
+				continue;
+			}
+			if(segmentSize == 0)
+			{
+				segmentSize = len;	/* not coalesced */
+			}
+			R->stats.nPacket += len/segmentSize;
+			if(segmentSize == frameSize && len % frameSize == 0 && !(msgs[0].msg_hdr.msg_flags & MSG_TRUNC))
+			{
+				good = len/frameSize;
+				if(slot + good > R->nSlot)
+				{
+					/* move what went past the end to the start of the ring */
+					memcpy(R->data, R->data + (size_t)R->nSlot*frameSize, (size_t)(slot + good - R->nSlot)*frameSize);
+				}
+			}
+			else
+			{
+				R->stats.nBadPacket += len/segmentSize;
+			}
+		}
+		else
+		{
+			for(i = 0; i < (unsigned int)v; ++i)
+			{
+				parseCaptureCmsg(&msgs[i].msg_hdr, R);
+				if(msgs[i].msg_len != (unsigned int)packetSize || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+				{
+					++R->stats.nBadPacket;
+					continue;
+				}
+				if(good != i)
+				{
+					/* close the hole left by a bad packet */
+					memmove(R->data + (size_t)(slot + good)*frameSize, R->data + (size_t)(slot + i)*frameSize, frameSize);
+				}
+				++good;
+			}
+			R->stats.nPacket += v;
+		}
+
+		if(good > 0)
+		{
+			R->stats.nFrame += good;
+			R->stats.nByte += (long long)good*frameSize;
+			storeCaptureCounter(&R->head, R->head + good);
+			wakeCaptureWaiters(&vc->consumerWaiting, &vc->waitLock, &vc->dataCond);
+		}
+	}
+
+	free(msgs);
+	free(iovs);
+	free(cmsgs);
+
+	/* let a sleeping consumer see that this receiver is done */
+	wakeCaptureWaiters(&vc->consumerWaiting, &vc->waitLock, &vc->dataCond);
+
+	return 0;
+}
+
+/* learns the frame size from the first packet to arrive on any socket, without taking it */
+static int peekCaptureFrameSize(struct vdif_capture *vc)
+{
+	struct pollfd fds[VDIF_CAPTURE_MAX_SOCKETS];
+	unsigned char *buffer;
+	int n = -1;
+	int r;
+
+	buffer = (unsigned char *)malloc(VDIF_CAPTURE_MAX_GRO_BYTES);
+	if(!buffer)
+	{
+		return -1;
+	}
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		fds[r].fd = vc->rings[r].fd;
+		fds[r].events = POLLIN;
+		fds[r].revents = 0;
+	}
+	for(;;)
+	{
+		if(poll(fds, vc->nRing, -1) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			break;
+		}
+		for(r = 0; r < vc->nRing; ++r)
+		{
+			if(fds[r].revents == 0)
+			{
+				continue;
+			}
+			n = recv(fds[r].fd, buffer, VDIF_CAPTURE_MAX_GRO_BYTES, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+			if(n == 0)
+			{
+				/* an empty datagram says nothing about the frame size; drop it */
+				recv(fds[r].fd, buffer, VDIF_CAPTURE_MAX_GRO_BYTES, MSG_DONTWAIT);
+			}
+			else if(n > 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			{
+				break;
+			}
+		}
+		if(r < vc->nRing)
+		{
+			/* a packet, or an error */
+			break;
+		}
+	}
+	free(buffer);
+
+	if(n < 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot receive first packet: %s\n", strerror(errno));
+
+		return -1;
+	}
+
+	return n - vc->config.skipBytesFront - vc->config.skipBytesBack;
+}
+
+#ifdef HAVE_TPACKET_V3
+static struct tpacket_block_desc *getCaptureBlock(struct vdif_capture_ring *R, unsigned int b)
+{
+	return (struct tpacket_block_desc *)(R->map + (size_t)(b % R->nBlock)*VDIF_CAPTURE_PACKET_BLOCK_BYTES);
+}
+
+static int isCaptureBlockReady(struct tpacket_block_desc *bd)
+{
+	return (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) != 0;
+}
+
+static void returnCaptureBlock(struct tpacket_block_desc *bd)
+{
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/* Headers are stripped in place: returns a pointer to the UDP payload of packet p if it is an unfragmented IPv4 UDP packet
+ * addressed to one of the capture ports, or 0 otherwise.  Packets that are not for us are not counted at all. */
+static unsigned char *getCapturePacketPayload(const struct vdif_capture *vc, struct tpacket3_hdr *p, int *payloadBytes)
+{
+	const struct sockaddr_ll *sll = (const struct sockaddr_ll *)((unsigned char *)p + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+	unsigned char *ip, *udp;
+	int ipBytes, ihl, port, k;
+
+	if(sll->sll_pkttype == PACKET_OUTGOING || sll->sll_protocol != htons(ETH_P_IP))
+	{
+		return 0;
+	}
+
+	/* tp_net skips the Ethernet header and any VLAN tags */
+	ip = (unsigned char *)p + p->tp_net;
+	ipBytes = (int)p->tp_snaplen - (int)(p->tp_net - p->tp_mac);
+	if(ipBytes < 28 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP || ((ip[6] & 0x3F) | ip[7]) != 0)
+	{
+		return 0;
+	}
+	ihl = (ip[0] & 0x0F)*4;
+	if(ihl < 20 || ihl + 8 > ipBytes)
+	{
+		/* malformed, or IP options run past what was captured */
+		return 0;
+	}
+	udp = ip + ihl;
+	port = (udp[2] << 8) | udp[3];
+	for(k = 0; k < vc->config.nPort; ++k)
+	{
+		if(vc->config.ports[k] == port)
+		{
+			break;
+		}
+	}
+	if(k == vc->config.nPort)
+	{
+		return 0;
+	}
+
+	*payloadBytes = ((udp[4] << 8) | udp[5]) - 8;
+	if(p->tp_snaplen < p->tp_len || ihl + 8 + *payloadBytes > ipBytes)
+	{
+		*payloadBytes = -1;	/* truncated */
+	}
+
+	return udp + 8;
+}
+
+static int openCapturePacketRing(struct vdif_capture *vc, struct vdif_capture_ring *R, int fanoutGroup)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	int version = TPACKET_V3;
+	int one = 1;
+	unsigned int ifIndex;
+
+	ifIndex = if_nametoindex(vc->config.packetInterface);
+	if(ifIndex == 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: no network interface called %s\n", vc->config.packetInterface);
+
+		return -1;
+	}
+
+	R->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if(R->fd < 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot create packet socket (needs CAP_NET_RAW): %s\n", strerror(errno));
+
+		return -1;
+	}
+	if(setsockopt(R->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: TPACKET_V3 is not supported: %s\n", strerror(errno));
+
+		return -1;
+	}
+#ifdef PACKET_IGNORE_OUTGOING
+	setsockopt(R->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+	(void)one;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = VDIF_CAPTURE_PACKET_BLOCK_BYTES;
+	req.tp_block_nr = vc->config.ringBytes/((long long)vc->config.nSocketPerPort*VDIF_CAPTURE_PACKET_BLOCK_BYTES);
+	if(req.tp_block_nr < 4)
+	{
+		req.tp_block_nr = 4;
+	}
+	req.tp_frame_size = VDIF_CAPTURE_PACKET_FRAME_BYTES;
+	req.tp_frame_nr = req.tp_block_nr*(VDIF_CAPTURE_PACKET_BLOCK_BYTES/VDIF_CAPTURE_PACKET_FRAME_BYTES);
+	req.tp_retire_blk_tov = VDIF_CAPTURE_PACKET_RETIRE_MS;
+	if(setsockopt(R->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot set up a packet ring of %u blocks: %s\n", req.tp_block_nr, strerror(errno));
+
+		return -1;
+	}
+	R->nBlock = req.tp_block_nr;
+	R->mapBytes = (size_t)req.tp_block_nr*req.tp_block_size;
+	R->map = (unsigned char *)mmap(0, R->mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R->fd, 0);
+	if(R->map == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot map packet ring: %s\n", strerror(errno));
+		R->map = 0;
+
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_IP);
+	addr.sll_ifindex = ifIndex;
+	if(bind(R->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot bind packet socket to %s: %s\n", vc->config.packetInterface, strerror(errno));
+
+		return -1;
+	}
+
+	if(vc->config.nSocketPerPort > 1)
+	{
+		/* spread flows over the rings; must follow bind() */
+		int fanout = fanoutGroup | (PACKET_FANOUT_HASH << 16);
+
+		if(setsockopt(R->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0)
+		{
+			fprintf(stderr, "Error: newvdifcapture: cannot join packet fanout group: %s\n", strerror(errno));
+
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* waits up to timeoutMs for a block to be ready on any ring; returns 0 on timeout */
+static int waitCapturePackets(struct vdif_capture *vc, int timeoutMs)
+{
+	struct pollfd fds[VDIF_CAPTURE_MAX_SOCKETS];
+	int r;
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		fds[r].fd = vc->rings[r].fd;
+		fds[r].events = POLLIN | POLLERR;
+		fds[r].revents = 0;
+	}
+
+	return poll(fds, vc->nRing, timeoutMs) > 0;
+}
+
+/* learns the frame size from the first packet for a capture port.  Blocks holding no such packet are returned to the kernel */
+static int peekCapturePacketFrameSize(struct vdif_capture *vc)
+{
+	for(;;)
+	{
+		int r;
+
+		for(r = 0; r < vc->nRing; ++r)
+		{
+			struct vdif_capture_ring *R = vc->rings + r;
+			struct tpacket_block_desc *bd;
+			struct tpacket3_hdr *p;
+			unsigned int i;
+			int n;
+
+			bd = getCaptureBlock(R, R->nextBlock);
+			if(!isCaptureBlockReady(bd))
+			{
+				continue;
+			}
+			p = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+			for(i = 0; i < bd->hdr.bh1.num_pkts; ++i)
+			{
+				if(getCapturePacketPayload(vc, p, &n) && n > 0)
+				{
+					return n - vc->config.skipBytesFront - vc->config.skipBytesBack;
+				}
+				p = (struct tpacket3_hdr *)((unsigned char *)p + p->tp_next_offset);
+			}
+			returnCaptureBlock(bd);
+			++R->nextBlock;
+		}
+		waitCapturePackets(vc, VDIF_CAPTURE_POLL_MS);
+	}
+}
+
+/* hands out the VDIF frames of ring R's ready blocks in place as regions of iov; returns the number of regions used */
+static int takeCapturePackets(struct vdif_capture *vc, struct vdif_capture_ring *R, struct iovec *iov, int maxIov)
+{
+	const int packetSize = vc->frameSize + vc->config.skipBytesFront + vc->config.skipBytesBack;
+	int nIov = 0;
+
+	while(nIov < maxIov)
+	{
+		unsigned char *payload;
+		int n;
+
+		if(R->nPacketLeft == 0)
+		{
+			struct tpacket_block_desc *bd;
+
+			if(R->nBlockTaken >= R->nBlock)
+			{
+				break;
+			}
+			bd = getCaptureBlock(R, R->nextBlock + R->nBlockTaken);
+			if(!isCaptureBlockReady(bd))
+			{
+				break;
+			}
+			++R->nBlockTaken;
+			R->nPacketLeft = bd->hdr.bh1.num_pkts;
+			R->nextPacket = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+			continue;
+		}
+
+		payload = getCapturePacketPayload(vc, R->nextPacket, &n);
+		if(payload)
+		{
+			++R->stats.nPacket;
+			if(n == packetSize)
+			{
+				iov[nIov].iov_base = payload + vc->config.skipBytesFront;
+				iov[nIov].iov_len = vc->frameSize;
+				++nIov;
+				++R->stats.nFrame;
+				R->stats.nByte += vc->frameSize;
+			}
+			else
+			{
+				++R->stats.nBadPacket;
+			}
+		}
+		R->nextPacket = (struct tpacket3_hdr *)((unsigned char *)R->nextPacket + R->nextPacket->tp_next_offset);
+		--R->nPacketLeft;
+	}
+
+	return nIov;
+}
+
+/* returns to the kernel every block whose frames have all been handed out */
+static void releaseCapturePackets(struct vdif_capture_ring *R)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+	unsigned int nDone;
+
+	nDone = (R->nPacketLeft > 0) ? R->nBlockTaken - 1 : R->nBlockTaken;
+	if(nDone == 0)
+	{
+		return;
+	}
+	for(; nDone > 0; --nDone)
+	{
+		returnCaptureBlock(getCaptureBlock(R, R->nextBlock));
+		++R->nextBlock;
+		--R->nBlockTaken;
+	}
+
+	if(getsockopt(R->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+	{
+		R->stats.nKernelDrop += st.tp_drops;
+		R->stats.nRingFull += st.tp_freeze_q_cnt;
+	}
+}
+
+/* stops the kernel delivering more packets, so what is already in the rings can be drained */
+static void stopCapturePackets(struct vdif_capture *vc)
+{
+	struct sock_filter dropAll = { BPF_RET | BPF_K, 0, 0, 0 };
+	struct sock_fprog prog = { 1, &dropAll };
+	int r;
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		setsockopt(vc->rings[r].fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	}
+}
+
+static int newCapturePacketRings(struct vdif_capture *vc)
+{
+	int fanoutGroup = getpid() & 0xFFFF;
+	int r;
+
+	for(r = 0; r < vc->config.nSocketPerPort; ++r)
+	{
+		struct vdif_capture_ring *R = vc->rings + r;
+
+		R->vc = vc;
+		R->fd = -1;
+		++vc->nRing;
+		if(openCapturePacketRing(vc, R, fanoutGroup) < 0)
+		{
+			return -1;
+		}
+	}
+
+	vc->frameSize = (vc->config.frameSize > 0) ? vc->config.frameSize : peekCapturePacketFrameSize(vc);
+
+	return 0;
+}
+#endif
+
+struct vdif_capture *newvdifcapture(const struct vdif_capture_config *cfg)
+{
+	struct vdif_capture *vc;
+	int p, s, r;
+	long long slotsPerRing;
+
+	if(cfg->nPort <= 0 || cfg->nPort > VDIF_CAPTURE_MAX_PORTS || cfg->nSocketPerPort <= 0 || cfg->nPort*cfg->nSocketPerPort > VDIF_CAPTURE_MAX_SOCKETS)
+	{
+		fprintf(stderr, "Error: newvdifcapture: %d ports with %d sockets each is not allowed (at most %d ports and %d sockets)\n", cfg->nPort, cfg->nSocketPerPort, VDIF_CAPTURE_MAX_PORTS, VDIF_CAPTURE_MAX_SOCKETS);
+
+		return 0;
+	}
+	if(cfg->skipBytesFront < 0 || cfg->skipBytesBack < 0 || cfg->batchSize <= 0)
+	{
+		fprintf(stderr, "Error: newvdifcapture: bad skip bytes (%d, %d) or batch size (%d)\n", cfg->skipBytesFront, cfg->skipBytesBack, cfg->batchSize);
+
+		return 0;
+	}
+
+	vc = (struct vdif_capture *)calloc(1, sizeof(struct vdif_capture));
+	if(!vc)
+	{
+		fprintf(stderr, "Error: newvdifcapture: cannot allocate\n");
+
+		return 0;
+	}
+	vc->config = *cfg;
+	pthread_mutex_init(&vc->waitLock, 0);
+	pthread_cond_init(&vc->dataCond, 0);
+	pthread_cond_init(&vc->spaceCond, 0);
+
+	if(cfg->packetInterface[0])
+	{
+		vc->packetMode = 1;
+#ifdef HAVE_TPACKET_V3
+		if(newCapturePacketRings(vc) < 0 || vc->frameSize < VDIF_HEADER_BYTES)
+		{
+			fprintf(stderr, "Error: newvdifcapture: cannot capture from interface %s\n", cfg->packetInterface);
+			deletevdifcapture(vc);
+
+			return 0;
+		}
+
+		return vc;
+#else
+		fprintf(stderr, "Error: newvdifcapture: packet capture (TPACKET_V3) is not available in this build\n");
+		deletevdifcapture(vc);
+
+		return 0;
+#endif
+	}
+
+	for(p = 0; p < cfg->nPort; ++p)
+	{
+		for(s = 0; s < cfg->nSocketPerPort; ++s)
+		{
+			struct vdif_capture_ring *R = vc->rings + vc->nRing;
+
+			R->vc = vc;
+			R->port = cfg->ports[p];
+			R->fd = openCaptureSocket(cfg->ports[p], cfg->nSocketPerPort > 1, cfg->socketBufferBytes);
+			if(R->fd < 0)
+			{
+				deletevdifcapture(vc);
+
+				return 0;
+			}
+			++vc->nRing;
+		}
+	}
+
+	vc->frameSize = (cfg->frameSize > 0) ? cfg->frameSize : peekCaptureFrameSize(vc);
+	if(vc->frameSize < VDIF_HEADER_BYTES)
+	{
+		fprintf(stderr, "Error: newvdifcapture: frame size %d is too small\n", vc->frameSize);
+		deletevdifcapture(vc);
+
+		return 0;
+	}
+
+	vc->scratch = (unsigned char *)malloc(cfg->skipBytesFront > cfg->skipBytesBack ? cfg->skipBytesFront + 1 : cfg->skipBytesBack + 1);
+	slotsPerRing = cfg->ringBytes/((long long)vc->nRing*vc->frameSize);
+	if(!vc->scratch || slotsPerRing < 2*cfg->batchSize)
+	{
+		fprintf(stderr, "Error: newvdifcapture: ring of %lld bytes is too small for %d sockets\n", cfg->ringBytes, vc->nRing);
+		deletevdifcapture(vc);
+
+		return 0;
+	}
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		struct vdif_capture_ring *R = vc->rings + r;
+		int one = 1;
+
+		R->nSlot = slotsPerRing;
+		R->nSpill = 0;
+#ifdef UDP_GRO
+		if(cfg->useGRO && cfg->skipBytesFront == 0 && cfg->skipBytesBack == 0 &&
+		   setsockopt(R->fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == 0)
+		{
+			R->useGRO = 1;
+			R->nSpill = VDIF_CAPTURE_MAX_GRO_BYTES/vc->frameSize + 1;
+		}
+#endif
+		if(cfg->useGRO && !R->useGRO && r == 0)
+		{
+			fprintf(stderr, "Warning: newvdifcapture: UDP GRO is not available%s\n", (cfg->skipBytesFront || cfg->skipBytesBack) ? " with skip bytes" : "");
+		}
+		(void)one;
+
+		R->data = (unsigned char *)malloc((size_t)(R->nSlot + R->nSpill)*vc->frameSize);
+		if(!R->data)
+		{
+			fprintf(stderr, "Error: newvdifcapture: cannot allocate ring of %u frames\n", R->nSlot);
+			deletevdifcapture(vc);
+
+			return 0;
+		}
+	}
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		if(pthread_create(&vc->rings[r].thread, 0, vdifCaptureReceiver, vc->rings + r) != 0)
+		{
+			fprintf(stderr, "Error: newvdifcapture: cannot start receiver thread\n");
+			deletevdifcapture(vc);
+
+			return 0;
+		}
+		vc->rings[r].started = 1;
+	}
+
+	return vc;
+}
+
+int getvdifcaptureframesize(const struct vdif_capture *vc)
+{
+	return vc->frameSize;
+}
+
+/* appends the frames of ring R not yet handed out to iov; returns the number of regions used */
+static int takeCaptureFrames(struct vdif_capture *vc, struct vdif_capture_ring *R, struct iovec *iov, int maxIov)
+{
+	unsigned int first, n, slot, run;
+	int nIov = 0;
+
+	first = R->tail + R->pending;
+	n = loadCaptureCounter(&R->head) - first;
+	while(n > 0 && nIov < maxIov)
+	{
+		slot = first % R->nSlot;
+		run = R->nSlot - slot;
+		if(run > n)
+		{
+			run = n;
+		}
+		iov[nIov].iov_base = R->data + (size_t)slot*vc->frameSize;
+		iov[nIov].iov_len = (size_t)run*vc->frameSize;
+		++nIov;
+		R->pending += run;
+		first += run;
+		n -= run;
+	}
+
+	return nIov;
+}
+
+static int isvdifcaptureidle(struct vdif_capture *vc)
+{
+	int r;
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		if(loadCaptureCounter(&vc->rings[r].head) != vc->rings[r].tail + vc->rings[r].pending)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int getvdifcapture(struct vdif_capture *vc, struct iovec *iov, int maxIov, int timeoutMs)
+{
+	int nIov = 0;
+	int k;
+
+#ifdef HAVE_TPACKET_V3
+	if(vc->packetMode)
+	{
+		for(k = 0; k < 2 && nIov == 0; ++k)
+		{
+			int r;
+
+			if(k == 1)
+			{
+				/* once stopped, wait only for the kernel to retire its last partly filled block */
+				int wait = loadCaptureFlag(&vc->stop) ? 2*VDIF_CAPTURE_PACKET_RETIRE_MS : timeoutMs;
+
+				if(wait <= 0 || !waitCapturePackets(vc, wait))
+				{
+					return loadCaptureFlag(&vc->stop) ? -1 : 0;
+				}
+			}
+			for(r = 0; r < vc->nRing && nIov < maxIov; ++r)
+			{
+				nIov += takeCapturePackets(vc, vc->rings + (vc->nextRing + r) % vc->nRing, iov + nIov, maxIov - nIov);
+			}
+			vc->nextRing = (vc->nextRing + 1) % vc->nRing;
+		}
+
+		return nIov;
+	}
+#endif
+
+	if(isvdifcaptureidle(vc))
+	{
+		if(loadCaptureFlag(&vc->stop))
+		{
+			return -1;
+		}
+		if(timeoutMs <= 0)
+		{
+			return 0;
+		}
+
+		pthread_mutex_lock(&vc->waitLock);
+		storeCaptureFlag(&vc->consumerWaiting, 1);
+		if(isvdifcaptureidle(vc) && !loadCaptureFlag(&vc->stop))
+		{
+			waitCaptureCond(&vc->dataCond, &vc->waitLock, timeoutMs);
+		}
+		storeCaptureFlag(&vc->consumerWaiting, 0);
+		pthread_mutex_unlock(&vc->waitLock);
+	}
+
+	for(k = 0; k < vc->nRing && nIov < maxIov; ++k)
+	{
+		nIov += takeCaptureFrames(vc, vc->rings + (vc->nextRing + k) % vc->nRing, iov + nIov, maxIov - nIov);
+	}
+	vc->nextRing = (vc->nextRing + 1) % vc->nRing;
+
+	return nIov;
+}
+
+void releasevdifcapture(struct vdif_capture *vc)
+{
+	int r;
+
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		struct vdif_capture_ring *R = vc->rings + r;
+
+#ifdef HAVE_TPACKET_V3
+		if(vc->packetMode)
+		{
+			releaseCapturePackets(R);
+			continue;
+		}
+#endif
+		if(R->pending > 0)
+		{
+			storeCaptureCounter(&R->tail, R->tail + R->pending);
+			R->pending = 0;
+		}
+	}
+	wakeCaptureWaiters(&vc->receiversWaiting, &vc->waitLock, &vc->spaceCond);
+}
+
+void stopvdifcapture(struct vdif_capture *vc)
+{
+	int r;
+
+#ifdef HAVE_TPACKET_V3
+	if(vc->packetMode && !loadCaptureFlag(&vc->stop))
+	{
+		stopCapturePackets(vc);
+	}
+#endif
+	storeCaptureFlag(&vc->stop, 1);
+	pthread_mutex_lock(&vc->waitLock);
+	pthread_cond_broadcast(&vc->spaceCond);
+	pthread_cond_broadcast(&vc->dataCond);
+	pthread_mutex_unlock(&vc->waitLock);
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		if(vc->rings[r].started)
+		{
+			pthread_join(vc->rings[r].thread, 0);
+			vc->rings[r].started = 0;
+		}
+	}
+}
+
+void deletevdifcapture(struct vdif_capture *vc)
+{
+	int r;
+
+	if(!vc)
+	{
+		return;
+	}
+
+	stopvdifcapture(vc);
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		close(vc->rings[r].fd);
+		free(vc->rings[r].data);
+#ifdef HAVE_TPACKET_V3
+		if(vc->rings[r].map)
+		{
+			munmap(vc->rings[r].map, vc->rings[r].mapBytes);
+		}
+#endif
+	}
+	free(vc->scratch);
+	pthread_mutex_destroy(&vc->waitLock);
+	pthread_cond_destroy(&vc->dataCond);
+	pthread_cond_destroy(&vc->spaceCond);
+	free(vc);
+}
+
+void getvdifcapturestatistics(const struct vdif_capture *vc, struct vdif_capture_statistics *stats)
+{
+	int r;
+
+	memset(stats, 0, sizeof(struct vdif_capture_statistics));
+	for(r = 0; r < vc->nRing; ++r)
+	{
+		const struct vdif_capture_statistics *S = &vc->rings[r].stats;
+
+		stats->nPacket += __atomic_load_n(&S->nPacket, __ATOMIC_RELAXED);
+		stats->nFrame += __atomic_load_n(&S->nFrame, __ATOMIC_RELAXED);
+		stats->nByte += __atomic_load_n(&S->nByte, __ATOMIC_RELAXED);
+		stats->nBadPacket += __atomic_load_n(&S->nBadPacket, __ATOMIC_RELAXED);
+		stats->nKernelDrop += __atomic_load_n(&S->nKernelDrop, __ATOMIC_RELAXED);
+		stats->nRingFull += __atomic_load_n(&S->nRingFull, __ATOMIC_RELAXED);
+	}
+}
+
+void printvdifcapturestatistics(const struct vdif_capture_statistics *stats)
+{
+	printf("VDIF capture statistics:\n");
+	printf("  %lld packets received\n", stats->nPacket);
+	printf("  %lld frames (%lld bytes) captured\n", stats->nFrame, stats->nByte);
+	printf("  %lld packets of the wrong size discarded\n", stats->nBadPacket);
+	printf("  %lld packets dropped by the kernel\n", stats->nKernelDrop);
+	printf("  %lld waits for ring space\n", stats->nRingFull);
+}
+
+
+/* Reorder stage.  Each thread has a window of windowFrames frame slots; frame sequence number s (seconds*framesPerSecond
+ * + frame number) of that thread lives in slot s % windowFrames.  Row s is the set of slot s of every thread.  Rows are
+ * written in order, threads in increasing thread ID within a row, once a frame at least windowFrames newer arrives; any
+ * slot still empty then is written as an invalid fill frame made from the latest header of that thread. */
+
+#define VDIF_REORDER_OUTPUT_REGIONS	64
+
+struct vdif_reorder_thread
+{
+	int threadId;
+	unsigned char *frames;
+	unsigned char *present;
+	unsigned char header[VDIF_HEADER_BYTES];	/* latest header seen, the template for fill frames */
+};
+
+struct vdif_reorder
+{
+	int frameSize;
+	int framesPerSecond;
+	int windowFrames;
+	vdif_reorder_writer writer;
+	void *userData;
+	int nThread;
+	struct vdif_reorder_thread threads[VDIF_REORDER_MAX_THREADS];	/* kept in thread ID order */
+	short threadIndex[VDIF_MAX_THREAD_ID+1];
+	int started;			/* set of threads fixed and output begun */
+	int skipEmpty;			/* rows with no frames at all are skipped rather than filled (at start and after a resync) */
+	long long base;			/* sequence number of the oldest row not yet written */
+	long long maxSeq;		/* newest sequence number held */
+	struct iovec out[VDIF_REORDER_OUTPUT_REGIONS];
+	int nOut;
+	int error;
+	struct vdif_reorder_statistics stats;
+};
+
+struct vdif_reorder *newvdifreorder(int frameSize, int framesPerSecond, int windowFrames, vdif_reorder_writer writer, void *userData)
+{
+	struct vdif_reorder *vr;
+
+	if(frameSize < VDIF_HEADER_BYTES || framesPerSecond <= 0 || !writer)
+	{
+		fprintf(stderr, "Error: newvdifreorder: bad frame size (%d), frames per second (%d) or writer\n", frameSize, framesPerSecond);
+
+		return 0;
+	}
+
+	vr = (struct vdif_reorder *)calloc(1, sizeof(struct vdif_reorder));
+	if(!vr)
+	{
+		fprintf(stderr, "Error: newvdifreorder: cannot allocate\n");
+
+		return 0;
+	}
+	vr->frameSize = frameSize;
+	vr->framesPerSecond = framesPerSecond;
+	vr->windowFrames = (windowFrames > 0) ? windowFrames : VDIF_REORDER_DEFAULT_WINDOW;
+	vr->writer = writer;
+	vr->userData = userData;
+	memset(vr->threadIndex, -1, sizeof(vr->threadIndex));
+	vr->skipEmpty = 1;
+
+	return vr;
+}
+
+void deletevdifreorder(struct vdif_reorder *vr)
+{
+	int t;
+
+	if(!vr)
+	{
+		return;
+	}
+
+	for(t = 0; t < vr->nThread; ++t)
+	{
+		free(vr->threads[t].frames);
+		free(vr->threads[t].present);
+	}
+	free(vr);
+}
+
+static int writeReorderOutput(struct vdif_reorder *vr)
+{
+	if(vr->nOut > 0 && !vr->error)
+	{
+		if(vr->writer(vr->out, vr->nOut, vr->userData) < 0)
+		{
+			vr->error = 1;
+		}
+	}
+	vr->nOut = 0;
+
+	return vr->error ? -1 : 0;
+}
+
+static void addReorderOutput(struct vdif_reorder *vr, unsigned char *frame)
+{
+	if(vr->nOut > 0 && (unsigned char *)vr->out[vr->nOut-1].iov_base + vr->out[vr->nOut-1].iov_len == frame)
+	{
+		vr->out[vr->nOut-1].iov_len += vr->frameSize;
+
+		return;
+	}
+	if(vr->nOut == VDIF_REORDER_OUTPUT_REGIONS)
+	{
+		writeReorderOutput(vr);
+	}
+	vr->out[vr->nOut].iov_base = frame;
+	vr->out[vr->nOut].iov_len = vr->frameSize;
+	++vr->nOut;
+}
+
+/* queues row base for output, filling gaps, and advances base */
+static void emitReorderRow(struct vdif_reorder *vr)
+{
+	const int slot = vr->base % vr->windowFrames;
+	int t;
+
+	if(vr->skipEmpty)
+	{
+		for(t = 0; t < vr->nThread; ++t)
+		{
+			if(vr->threads[t].present[slot])
+			{
+				break;
+			}
+		}
+		if(t == vr->nThread)
+		{
+			++vr->base;
+
+			return;
+		}
+		vr->skipEmpty = 0;
+	}
+
+	for(t = 0; t < vr->nThread; ++t)
+	{
+		struct vdif_reorder_thread *T = vr->threads + t;
+		unsigned char *frame = T->frames + (size_t)slot*vr->frameSize;
+
+		if(T->present[slot])
+		{
+			T->present[slot] = 0;
+		}
+		else
+		{
+			vdif_header *header = (vdif_header *)frame;
+
+			memcpy(frame, T->header, VDIF_HEADER_BYTES);
+			setVDIFFrameEpochSecOffset(header, vr->base/vr->framesPerSecond);
+			setVDIFFrameNumber(header, vr->base%vr->framesPerSecond);
+			setVDIFFrameInvalid(header, 1);
+			++vr->stats.nFill;
+		}
+		addReorderOutput(vr, frame);
+		++vr->stats.nFrameOut;
+	}
+	++vr->base;
+}
+
+/* writes all rows before seq */
+static void emitReorderRows(struct vdif_reorder *vr, long long seq)
+{
+	while(vr->base < seq)
+	{
+		emitReorderRow(vr);
+		if(vr->base % vr->windowFrames == 0)
+		{
+			/* queued rows must be written before a fill frame can reuse their slots */
+			writeReorderOutput(vr);
+		}
+	}
+}
+
+static int addReorderThread(struct vdif_reorder *vr, int threadId)
+{
+	int t, k;
+
+	if(vr->nThread >= VDIF_REORDER_MAX_THREADS)
+	{
+		return -1;
+	}
+
+	/* keep threads in ID order so rows come out that way */
+	for(t = vr->nThread; t > 0 && vr->threads[t-1].threadId > threadId; --t)
+	{
+		vr->threads[t] = vr->threads[t-1];
+	}
+	vr->threads[t].threadId = threadId;
+	vr->threads[t].frames = (unsigned char *)calloc(vr->windowFrames, vr->frameSize);
+	vr->threads[t].present = (unsigned char *)calloc(vr->windowFrames, 1);
+	++vr->nThread;
+	for(k = t; k < vr->nThread; ++k)
+	{
+		vr->threadIndex[vr->threads[k].threadId] = k;
+	}
+	if(!vr->threads[t].frames || !vr->threads[t].present)
+	{
+		fprintf(stderr, "Error: newvdifreorder: cannot allocate window for thread %d\n", threadId);
+		vr->error = 1;
+
+		return -1;
+	}
+
+	return t;
+}
+
+static void addReorderFrame(struct vdif_reorder *vr, const unsigned char *frame)
+{
+	const vdif_header *header = (const vdif_header *)frame;
+	const long long maxJump = (long long)VDIF_REORDER_MAX_FILL_SECONDS*vr->framesPerSecond;
+	struct vdif_reorder_thread *T;
+	long long seq;
+	int t, slot;
+
+	++vr->stats.nFrameIn;
+	if(getVDIFFrameBytes(header) != vr->frameSize || getVDIFFrameNumber(header) >= vr->framesPerSecond)
+	{
+		++vr->stats.nBadFrame;
+
+		return;
+	}
+	seq = (long long)getVDIFFrameEpochSecOffset(header)*vr->framesPerSecond + getVDIFFrameNumber(header);
+
+	if(vr->nThread == 0 && !vr->started)
+	{
+		/* leave room for frames of the first row that arrive a little out of order */
+		vr->base = (seq > vr->windowFrames/2) ? seq - vr->windowFrames/2 : 0;
+		vr->maxSeq = seq;
+	}
+	else if(seq >= vr->base + vr->windowFrames + maxJump || seq < vr->base - maxJump)
+	{
+		/* too far ahead to fill, or so far behind that the sender must have restarted:
+		 * write out what is held and start again from here */
+		vr->started = 1;
+		emitReorderRows(vr, vr->maxSeq + 1);
+		writeReorderOutput(vr);
+		++vr->stats.nResync;
+		vr->base = (seq > vr->windowFrames/2) ? seq - vr->windowFrames/2 : 0;
+		vr->maxSeq = seq;
+		vr->skipEmpty = 1;
+	}
+	else if(seq < vr->base)
+	{
+		/* just behind the window */
+		++vr->stats.nLate;
+
+		return;
+	}
+
+	t = vr->threadIndex[getVDIFThreadID(header)];
+	if(t < 0)
+	{
+		/* the set of threads is fixed once output begins, so that every row has the same layout */
+		t = vr->started ? -1 : addReorderThread(vr, getVDIFThreadID(header));
+		if(t < 0)
+		{
+			++vr->stats.nUnknownThread;
+
+			return;
+		}
+	}
+
+	if(seq >= vr->base + vr->windowFrames)
+	{
+		vr->started = 1;
+		emitReorderRows(vr, seq - vr->windowFrames + 1);
+		writeReorderOutput(vr);	/* the slots are about to be reused */
+	}
+
+	T = vr->threads + t;
+	slot = seq % vr->windowFrames;
+	if(T->present[slot])
+	{
+		++vr->stats.nDuplicate;
+
+		return;
+	}
+	memcpy(T->frames + (size_t)slot*vr->frameSize, frame, vr->frameSize);
+	memcpy(T->header, frame, VDIF_HEADER_BYTES);
+	T->present[slot] = 1;
+	if(seq > vr->maxSeq)
+	{
+		vr->maxSeq = seq;
+	}
+}
+
+int addvdifreorderframes(struct vdif_reorder *vr, const struct iovec *iov, int nIov)
+{
+	int i;
+
+	for(i = 0; i < nIov; ++i)
+	{
+		const unsigned char *frame = (const unsigned char *)iov[i].iov_base;
+		size_t n;
+
+		for(n = 0; n + vr->frameSize <= iov[i].iov_len; n += vr->frameSize)
+		{
+			addReorderFrame(vr, frame + n);
+		}
+	}
+
+	return writeReorderOutput(vr);
+}
+
+int flushvdifreorder(struct vdif_reorder *vr)
+{
+	if(vr->nThread > 0)
+	{
+		vr->started = 1;
+		emitReorderRows(vr, vr->maxSeq + 1);
+	}
+
+	return writeReorderOutput(vr);
+}
+
+void getvdifreorderstatistics(const struct vdif_reorder *vr, struct vdif_reorder_statistics *stats)
+{
+	*stats = vr->stats;
+}
+
+void printvdifreorderstatistics(const struct vdif_reorder_statistics *stats)
+{
+	printf("VDIF reorder statistics:\n");
+	printf("  %lld frames in\n", stats->nFrameIn);
+	printf("  %lld frames written, of which %lld are fill frames\n", stats->nFrameOut, stats->nFill);
+	printf("  %lld duplicate frames dropped\n", stats->nDuplicate);
+	printf("  %lld frames dropped as too late for the reorder window\n", stats->nLate);
+	printf("  %lld frames with bad size or frame number dropped\n", stats->nBadFrame);
+	printf("  %lld frames of threads not present at the start dropped\n", stats->nUnknownThread);
+	printf("  %lld restarts after a jump in time\n", stats->nResync);
+}
@@ -30,8 +30,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <vdifio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "dateutils.h"
 #include "config.h"
 
@@ -85,15 +89,86 @@ int vdiffilesummarygetstartmjd(const struct vdif_file_summary *sum)
 	return ymd2mjd(2000 + sum->epoch/2, (sum->epoch%2)*6+1, 1) + sum->startSecond/86400;
 }
 
-int summarizevdiffile(struct vdif_file_summary *sum, const char *fileName, int frameSize)
+#define VDIF_SUMMARY_BUFFER_SIZE	2000000	/* 2 MB should encounter all threads of a usual VDIF file */
+
+static inline int isvdifsummaryframe(const struct vdif_header *vh, const struct vdif_file_summary *sum, int frameSize, const struct vdif_header *vh0)
 {
-	int bufferSize = 2000000;	/* 2 MB should encounter all threads of a usual VDIF file */
-	unsigned char *buffer;
-	struct stat st;
-	int rv, i, N;
-	FILE *in;
+	return getVDIFFrameBytes(vh) == frameSize &&
+	       getVDIFEpoch(vh) == sum->epoch &&
+	       getVDIFBitsPerSample(vh) == sum->nBit &&
+	       abs(getVDIFFrameEpochSecOffset(vh) - getVDIFFrameEpochSecOffset(vh0)) < 2;
+}
+
+/* accumulates threads and time range of the frames in buffer, starting at offset i, into sum */
+static void scanvdifsummarybuffer(struct vdif_file_summary *sum, char *hasThread, const unsigned char *buffer, int bufferSize, int i, int frameSize)
+{
+	const struct vdif_header *vh0 = (const struct vdif_header *)(buffer + i);	/* the prototype header */
+	int N;
+
+	N = bufferSize - frameSize - VDIF_HEADER_BYTES;
+
+	while(i < N)
+	{
+		const struct vdif_header *vh;
+		int f, s, o;
+
+		vh = (const struct vdif_header *)(buffer + i);
+
+		if(isvdifsummaryframe(vh, sum, frameSize, vh0))
+		{
+			s = getVDIFFrameEpochSecOffset(vh);
+			hasThread[getVDIFThreadID(vh)] = 1;
+			f = getVDIFFrameNumber(vh);
+
+			if(s < sum->startSecond)
+			{
+				sum->startSecond = s;
+				sum->startFrame = f;
+			}
+			else if(s == sum->startSecond && f < sum->startFrame)
+			{
+				sum->startFrame = f;
+			}
+
+			if(s > sum->endSecond)
+			{
+				sum->endSecond = s;
+				sum->endFrame = f;
+			}
+			else if(s == sum->endSecond && f > sum->endFrame)
+			{
+				sum->endFrame = f;
+			}
+
+			i += frameSize;
+		}
+		else if(i + frameSize < N && isvdifsummaryframe((const struct vdif_header *)(buffer + i + frameSize), sum, frameSize, vh0))
+		{
+			/* Not a good frame, but the next one is where it should be: a damaged or foreign frame */
+			i += frameSize;
+		}
+		else
+		{
+			/* Lost sync; search for the next pair of frames */
+			o = determinevdifframesync(buffer + i + 1, bufferSize - i - 1, frameSize, 0, 0);
+			if(o < 0)
+			{
+				break;
+			}
+			i += o + 1;
+		}
+	}
+}
+
+/* summarizes one file using the caller's buffer of 2*VDIF_SUMMARY_BUFFER_SIZE bytes, as files smaller than that are read whole.
+ * The head and tail are read with pread(); the tail is requested from the kernel before the head is read so the two reads
+ * proceed together. */
+static int summarizevdiffilebuffer(struct vdif_file_summary *sum, const char *fileName, int frameSize, unsigned char *buffer)
+{
+	int bufferSize = VDIF_SUMMARY_BUFFER_SIZE;
 	char hasThread[VDIF_MAX_THREAD_ID + 1];
-	struct vdif_header *vh0;	/* pointer to the prototype header */
+	struct stat st;
+	int rv, i, fd;
 
 	/* Initialize things */
 
@@ -102,41 +177,39 @@ int summarizevdiffile(struct vdif_file_summary *sum, const char *fileName, int f
 	memset(hasThread, 0, sizeof(hasThread));
 	sum->startSecond = 1<<30;
 
-	rv = stat(fileName, &st);
+	fd = open(fileName, O_RDONLY);
+	if(fd < 0)
+	{
+		return (stat(fileName, &st) < 0) ? -1 : -2;
+	}
+
+	rv = fstat(fd, &st);
 	if(rv < 0)
 	{
+		close(fd);
+
 		return -1;
 	}
 
 	sum->fileSize = st.st_size;
 
-	in = fopen(fileName, "r");
-	if(!in)
-	{
-		return -2;
-	}
-
 	if(sum->fileSize < 2*bufferSize)
 	{
 		bufferSize = sum->fileSize;
 	}
 
-	buffer = (unsigned char *)malloc(bufferSize);
-	if(!buffer)
+	if(sum->fileSize > bufferSize)
 	{
-		fclose(in);
-
-		return -3;
+		posix_fadvise(fd, sum->fileSize - bufferSize, bufferSize, POSIX_FADV_WILLNEED);
 	}
 
 
 	/* Get initial information */
 
-	rv = fread(buffer, 1, bufferSize, in);
+	rv = pread(fd, buffer, bufferSize, 0);
 	if(rv < bufferSize)
 	{
-		fclose(in);
-		free(buffer);
+		close(fd);
 
 		return -4;
 	}
@@ -148,176 +221,536 @@ int summarizevdiffile(struct vdif_file_summary *sum, const char *fileName, int f
 		frameSize = determinevdifframesize(buffer, bufferSize);
 		if(frameSize <= 0)
 		{
-			fclose(in);
-			free(buffer);
+			close(fd);
 
 			return -5;
 		}
 	}
 
 	sum->frameSize = frameSize;
-	N = bufferSize - frameSize - VDIF_HEADER_BYTES;
 
 	/* Work on beginning of file */
 
-	sum->firstFrameOffset = determinevdifframeoffset(buffer, bufferSize, frameSize);
+	sum->firstFrameOffset = determinevdifframesync(buffer, bufferSize, frameSize, 0, 0);
 	if(sum->firstFrameOffset < 0)
 	{
-		fclose(in);
-		free(buffer);
+		close(fd);
 
 		return -6;
 	}
-	vh0 = (struct vdif_header *)(buffer + sum->firstFrameOffset);
-	sum->epoch = getVDIFEpoch(vh0);
-	sum->nBit = getVDIFBitsPerSample(vh0);
+	sum->epoch = getVDIFEpoch((const struct vdif_header *)(buffer + sum->firstFrameOffset));
+	sum->nBit = getVDIFBitsPerSample((const struct vdif_header *)(buffer + sum->firstFrameOffset));
+
+	scanvdifsummarybuffer(sum, hasThread, buffer, bufferSize, sum->firstFrameOffset, frameSize);
 
-	for(i = sum->firstFrameOffset; i < N; )
+	/* Work on end of file, if file is long enough */
+	
+	if(sum->fileSize > bufferSize)
 	{
-		struct vdif_header *vh;
-		int f, s;
+		int offset;
 
-		vh = (struct vdif_header *)(buffer + i);
-		s = getVDIFFrameEpochSecOffset(vh);
-		
-		if(getVDIFFrameBytes(vh) == frameSize &&
-		   getVDIFEpoch(vh) == sum->epoch &&
-		   getVDIFBitsPerSample(vh) == sum->nBit &&
-		   abs(s - getVDIFFrameEpochSecOffset(vh0)) < 2)
+		rv = pread(fd, buffer, bufferSize, sum->fileSize - bufferSize);
+		if(rv < bufferSize)
 		{
-			hasThread[getVDIFThreadID(vh)] = 1;
-			f = getVDIFFrameNumber(vh);
+			close(fd);
 
-			if(s < sum->startSecond)
-			{
-				sum->startSecond = s;
-				sum->startFrame = f;
-			}
-			else if(s == sum->startSecond && f < sum->startFrame)
-			{
-				sum->startFrame = f;
-			}
+			return -8;
+		}
 
-			if(s > sum->endSecond)
-			{
-				sum->endSecond = s;
-				sum->endFrame = f;
-			}
-			else if(s == sum->endSecond && f > sum->endFrame)
+		offset = determinevdifframesync(buffer, bufferSize, frameSize, 0, 0);
+		if(offset < 0)
+		{
+			close(fd);
+
+			return -9;
+		}
+
+		scanvdifsummarybuffer(sum, hasThread, buffer, bufferSize, offset, frameSize);
+	}
+
+
+	/* Finalize summary */
+
+	for(i = 0; i <= VDIF_MAX_THREAD_ID; ++i)
+	{
+		if(hasThread[i])
+		{
+			if(sum->nThread < VDIF_SUMMARY_MAX_THREADS)
 			{
-				sum->endFrame = f;
+				sum->threadIds[sum->nThread] = i;
 			}
+			++sum->nThread;
+		}
+	}
 
-			i += frameSize;
+
+	/* Clean up */
+
+	close(fd);
+
+	return 0;
+}
+
+int summarizevdiffile(struct vdif_file_summary *sum, const char *fileName, int frameSize)
+{
+	unsigned char *buffer;
+	int rv;
+
+	buffer = (unsigned char *)malloc(2*VDIF_SUMMARY_BUFFER_SIZE);
+	if(!buffer)
+	{
+		resetvdiffilesummary(sum);
+
+		return -3;
+	}
+
+	rv = summarizevdiffilebuffer(sum, fileName, frameSize, buffer);
+
+	free(buffer);
+
+	return rv;
+}
+
+struct vdif_summary_batch
+{
+	struct vdif_file_summary *sums;
+	int *rv;
+	const char * const *fileNames;
+	int nFile;
+	int frameSize;
+	int next;		/* next file to be taken by a worker */
+	pthread_mutex_t lock;
+};
+
+static void *summarizevdiffilesworker(void *arg)
+{
+	struct vdif_summary_batch *B = (struct vdif_summary_batch *)arg;
+	unsigned char *buffer;
+
+	buffer = (unsigned char *)malloc(2*VDIF_SUMMARY_BUFFER_SIZE);
+
+	for(;;)
+	{
+		int f;
+
+		pthread_mutex_lock(&B->lock);
+		f = B->next++;
+		pthread_mutex_unlock(&B->lock);
+
+		if(f >= B->nFile)
+		{
+			break;
+		}
+		if(buffer)
+		{
+			B->rv[f] = summarizevdiffilebuffer(B->sums + f, B->fileNames[f], B->frameSize, buffer);
 		}
 		else
 		{
-			/* Not a good frame. */
-			++i;
+			resetvdiffilesummary(B->sums + f);
+			B->rv[f] = -3;
 		}
 	}
 
-	/* Work on end of file, if file is long enough */
-	
-	if(sum->fileSize > bufferSize)
+	free(buffer);
+
+	return 0;
+}
+
+int summarizevdiffiles(struct vdif_file_summary *sums, int *rv, const char * const *fileNames, int nFile, int frameSize, int nThread)
+{
+	struct vdif_summary_batch B;
+	pthread_t *threads;
+	int t, nStarted, nGood;
+
+	if(nFile <= 0)
 	{
-		int offset;
+		return 0;
+	}
+	if(nThread <= 0)
+	{
+		nThread = VDIF_SUMMARY_DEFAULT_THREADS;
+	}
+	if(nThread > nFile)
+	{
+		nThread = nFile;
+	}
 
-		rv = fseeko(in, sum->fileSize - bufferSize, SEEK_SET);
-		if(rv != 0)
+	B.sums = sums;
+	B.rv = rv;
+	B.fileNames = fileNames;
+	B.nFile = nFile;
+	B.frameSize = frameSize;
+	B.next = 0;
+	pthread_mutex_init(&B.lock, 0);
+
+	threads = (pthread_t *)malloc(nThread*sizeof(pthread_t));
+	nStarted = 0;
+	if(threads)
+	{
+		for(t = 0; t < nThread; ++t)
 		{
-			fclose(in);
-			free(buffer);
-
-			return -7;
+			if(pthread_create(threads + t, 0, summarizevdiffilesworker, &B) != 0)
+			{
+				break;
+			}
+			++nStarted;
 		}
+	}
+	if(nStarted == 0)
+	{
+		/* no threads to be had; do the work here */
+		summarizevdiffilesworker(&B);
+	}
+	for(t = 0; t < nStarted; ++t)
+	{
+		pthread_join(threads[t], 0);
+	}
+	free(threads);
+	pthread_mutex_destroy(&B.lock);
 
-		rv = fread(buffer, 1, bufferSize, in);
-		if(rv < bufferSize)
+	nGood = 0;
+	for(t = 0; t < nFile; ++t)
+	{
+		if(rv[t] == 0)
 		{
-			fclose(in);
-			free(buffer);
-
-			return -8;
+			++nGood;
 		}
+	}
 
-		offset = determinevdifframeoffset(buffer, bufferSize, frameSize);
-		if(offset < 0)
+	return nGood;
+}
+
+
+/* time of a frame as a single number that increases with time; with framesPerSecond known it is a frame count */
+static int64_t vdiffiletimekey(const struct vdif_header *vh, int framesPerSecond)
+{
+	if(framesPerSecond > 0)
+	{
+		return (int64_t)getVDIFFrameEpochSecOffset(vh)*framesPerSecond + getVDIFFrameNumber(vh);
+	}
+	else
+	{
+		return ((int64_t)getVDIFFrameEpochSecOffset(vh) << 24) | getVDIFFrameNumber(vh);
+	}
+}
+
+/* finds the first good frame at or after pos.  Returns 0 on success */
+static int probevdiffile(FILE *in, off_t pos, unsigned char *buffer, int bufferSize, int frameSize, int framesPerSecond, off_t *framePos, int64_t *key)
+{
+	int n, offset;
+
+	if(fseeko(in, pos, SEEK_SET) != 0)
+	{
+		return -1;
+	}
+	n = fread(buffer, 1, bufferSize, in);
+	offset = determinevdifframeoffset(buffer, n, frameSize);
+	if(offset < 0)
+	{
+		return -2;
+	}
+	*framePos = pos + offset;
+	*key = vdiffiletimekey((const struct vdif_header *)(buffer + offset), framesPerSecond);
+
+	return 0;
+}
+
+off_t seekvdiffiletime(FILE *in, int frameSize, int framesPerSecond, int second, int frame)
+{
+	const int nBack = 16;	/* frames looked at before the frame found, to catch threads written slightly out of order */
+	unsigned char *buffer;
+	int bufferSize;
+	struct stat st;
+	int64_t target, loKey, hiKey;
+	int64_t lo, hi;		/* frame slots: frame at lo is early, frame at hi is not */
+	off_t pos, hiPos;
+	int interpolate = (framesPerSecond > 0);
+	int i;
+
+	if(!in || frameSize <= VDIF_HEADER_BYTES || fstat(fileno(in), &st) != 0)
+	{
+		return -1;
+	}
+
+	bufferSize = (nBack > 4 ? nBack : 4)*frameSize;
+	buffer = (unsigned char *)malloc(bufferSize);
+	if(!buffer)
+	{
+		return -2;
+	}
+
+	if(framesPerSecond > 0)
+	{
+		target = (int64_t)second*framesPerSecond + frame;
+	}
+	else
+	{
+		target = ((int64_t)second << 24) | frame;
+	}
+
+	if(probevdiffile(in, 0, buffer, bufferSize, frameSize, framesPerSecond, &hiPos, &hiKey) != 0)
+	{
+		free(buffer);
+
+		return -3;
+	}
+
+	if(hiKey < target)
+	{
+		/* slot k is the frameSize bytes at k*frameSize after the first frame */
+		lo = 0;
+		loKey = hiKey;
+		pos = hiPos;
+		hi = (st.st_size - pos)/frameSize - 3;	/* a probe needs a following frame to confirm the one it finds */
+		if(hi <= 0 || probevdiffile(in, pos + hi*frameSize, buffer, bufferSize, frameSize, framesPerSecond, &hiPos, &hiKey) != 0)
 		{
-			fclose(in);
 			free(buffer);
 
-			return -9;
+			return -4;
 		}
-		vh0 = (struct vdif_header *)(buffer + offset);
-
-		for(i = 0; i < N; )
+		if(hiKey < target)
 		{
-			struct vdif_header *vh;
-			int f, s;
+			/* only the last few frames remain; look at each */
+			int n;
 
-			vh = (struct vdif_header *)(buffer + i);
-			s = getVDIFFrameEpochSecOffset(vh);
-			
-			if(getVDIFFrameBytes(vh) == frameSize &&
-			   getVDIFEpoch(vh) == sum->epoch &&
-			   getVDIFBitsPerSample(vh) == sum->nBit &&
-			   abs(s - getVDIFFrameEpochSecOffset(vh0)) < 2)
+			fseeko(in, hiPos, SEEK_SET);
+			n = fread(buffer, 1, bufferSize, in);
+			for(i = frameSize; i + VDIF_HEADER_BYTES <= n; i += frameSize)
 			{
-				hasThread[getVDIFThreadID(vh)] = 1;
-				f = getVDIFFrameNumber(vh);
+				const struct vdif_header *vh = (const struct vdif_header *)(buffer + i);
 
-				if(s < sum->startSecond)
-				{
-					sum->startSecond = s;
-					sum->startFrame = f;
-				}
-				else if(s == sum->startSecond && f < sum->startFrame)
+				if(getVDIFFrameBytes(vh) == frameSize && vdiffiletimekey(vh, framesPerSecond) >= target)
 				{
-					sum->startFrame = f;
+					break;
 				}
+			}
+			if(i + VDIF_HEADER_BYTES > n)
+			{
+				/* target is after the last frame */
+				free(buffer);
 
-				if(s > sum->endSecond)
-				{
-					sum->endSecond = s;
-					sum->endFrame = f;
-				}
-				else if(s == sum->endSecond && f > sum->endFrame)
-				{
-					sum->endFrame = f;
-				}
+				return -4;
+			}
+			hiPos += i;
+			lo = hi = 0;
+		}
 
-				i += frameSize;
+		/* alternate interpolation, which usually lands within a few frames, with bisection, which bounds the number of reads */
+		while(hi - lo > 1)
+		{
+			int64_t k, key;
+			off_t p;
+
+			if(interpolate && hiKey > loKey)
+			{
+				k = lo + (int64_t)((double)(target - loKey)*(hi - lo)/(hiKey - loKey));
 			}
 			else
 			{
-				/* Not a good frame. */
-				++i;
+				k = lo + (hi - lo)/2;
 			}
-		}
-	}
+			if(k <= lo)
+			{
+				k = lo + 1;
+			}
+			else if(k >= hi)
+			{
+				k = hi - 1;
+			}
+			interpolate = !interpolate && framesPerSecond > 0;
 
+			if(probevdiffile(in, pos + k*frameSize, buffer, bufferSize, frameSize, framesPerSecond, &p, &key) != 0)
+			{
+				free(buffer);
 
-	/* Finalize summary */
+				return -5;
+			}
+			if(key < target)
+			{
+				lo = k;
+				loKey = key;
+			}
+			else
+			{
+				hi = k;
+				hiKey = key;
+				hiPos = p;
+			}
+		}
+	}
 
-	for(i = 0; i <= VDIF_MAX_THREAD_ID; ++i)
+	/* step back over earlier frames that are also not early */
+	pos = hiPos - nBack*frameSize;
+	if(pos < 0)
 	{
-		if(hasThread[i])
+		pos = hiPos % frameSize;
+	}
+	if(fseeko(in, pos, SEEK_SET) == 0 && fread(buffer, 1, hiPos - pos, in) == (size_t)(hiPos - pos))
+	{
+		for(i = (hiPos - pos)/frameSize - 1; i >= 0; --i)
 		{
-			if(sum->nThread < VDIF_SUMMARY_MAX_THREADS)
+			const struct vdif_header *vh = (const struct vdif_header *)(buffer + i*frameSize);
+
+			if(getVDIFFrameBytes(vh) != frameSize || vdiffiletimekey(vh, framesPerSecond) < target)
 			{
-				sum->threadIds[sum->nThread] = i;
+				break;
 			}
-			++sum->nThread;
+			hiPos = pos + i*frameSize;
 		}
 	}
 
+	free(buffer);
 
-	/* Clean up */
+	if(fseeko(in, hiPos, SEEK_SET) != 0)
+	{
+		return -6;
+	}
 
-	free(buffer);
-	fclose(in);
+	return hiPos;
+}
+
+
+struct vdif_mmap_file *openvdifmmapfile(const char *fileName, long long window)
+{
+	struct vdif_mmap_file *vf;
+	struct stat st;
+	void *p;
+
+	vf = (struct vdif_mmap_file *)calloc(1, sizeof(struct vdif_mmap_file));
+	if(!vf)
+	{
+		fprintf(stderr, "Error: openvdifmmapfile: cannot allocate\n");
+
+		return 0;
+	}
+
+	vf->fd = open(fileName, O_RDONLY);
+	if(vf->fd < 0)
+	{
+		fprintf(stderr, "Error: openvdifmmapfile: cannot open %s\n", fileName);
+		free(vf);
+
+		return 0;
+	}
+	if(fstat(vf->fd, &st) < 0 || !S_ISREG(st.st_mode))
+	{
+		fprintf(stderr, "Error: openvdifmmapfile: %s is not a regular file\n", fileName);
+		close(vf->fd);
+		free(vf);
+
+		return 0;
+	}
+
+	vf->fileSize = st.st_size;
+	vf->window = (window > 0) ? window : VDIF_MMAP_DEFAULT_WINDOW;
+
+	if(vf->fileSize > 0)
+	{
+		p = mmap(0, vf->fileSize, PROT_READ, MAP_SHARED, vf->fd, 0);
+		if(p == MAP_FAILED)
+		{
+			fprintf(stderr, "Error: openvdifmmapfile: cannot map %s\n", fileName);
+			close(vf->fd);
+			free(vf);
+
+			return 0;
+		}
+		vf->data = (const unsigned char *)p;
+
+		/* hints only; failures do not matter */
+		madvise(p, vf->fileSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(p, vf->fileSize, MADV_HUGEPAGE);
+#endif
+	}
+
+	return vf;
+}
+
+void closevdifmmapfile(struct vdif_mmap_file *vf)
+{
+	if(vf)
+	{
+		if(vf->data)
+		{
+			munmap((void *)vf->data, vf->fileSize);
+		}
+		close(vf->fd);
+		free(vf);
+	}
+}
+
+/* keeps window bytes of readahead requested beyond pos, in steps of half a window, and drops pages more than a window behind */
+static void advisevdifmmapfile(struct vdif_mmap_file *vf)
+{
+	const long long pageSize = sysconf(_SC_PAGESIZE);
+	long long start, end;
+
+	if(vf->pos + vf->window/2 > vf->adviseEnd && vf->adviseEnd < vf->fileSize)
+	{
+		start = (vf->pos > vf->adviseEnd ? vf->pos : vf->adviseEnd) / pageSize * pageSize;
+		end = vf->pos + vf->window;
+		if(end > vf->fileSize)
+		{
+			end = vf->fileSize;
+		}
+		madvise((void *)(vf->data + start), end - start, MADV_WILLNEED);
+		vf->adviseEnd = end;
+	}
+
+	end = (vf->pos - vf->window) / pageSize * pageSize;
+	if(end - vf->releaseEnd >= vf->window/2)
+	{
+		madvise((void *)(vf->data + vf->releaseEnd), end - vf->releaseEnd, MADV_DONTNEED);
+		vf->releaseEnd = end;
+	}
+}
+
+int seekvdifmmapfile(struct vdif_mmap_file *vf, long long pos)
+{
+	if(pos < 0 || pos > vf->fileSize)
+	{
+		return -1;
+	}
+
+	/* start the readahead afresh from the new position */
+	vf->pos = pos;
+	vf->adviseEnd = pos;
+	vf->releaseEnd = (pos > vf->window) ? (pos - vf->window) / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE) : 0;
 
 	return 0;
 }
 
+const unsigned char *peekvdifmmapfile(struct vdif_mmap_file *vf, int maxBytes, int *nBytes)
+{
+	long long n;
+
+	n = vf->fileSize - vf->pos;
+	if(n <= 0 || maxBytes <= 0)
+	{
+		*nBytes = 0;
+
+		return 0;
+	}
+	if(n > maxBytes)
+	{
+		n = maxBytes;
+	}
+	*nBytes = n;
+
+	advisevdifmmapfile(vf);
+
+	return vf->data + vf->pos;
+}
+
+long long advancevdifmmapfile(struct vdif_mmap_file *vf, int nBytes)
+{
+	vf->pos += nBytes;
+	if(vf->pos > vf->fileSize)
+	{
+		vf->pos = vf->fileSize;
+	}
+
+	return vf->pos;
+}
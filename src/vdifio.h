@@ -37,19 +37,36 @@ extern "C" {
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
+#include <sys/uio.h>
 
 #define VDIF_HEADER_BYTES		32
 #define VDIF_LEGACY_HEADER_BYTES	16
 #define MAX_VDIF_FRAME_BYTES		9032
 #define VDIF_MAX_THREAD_ID		1023
 
-#define VDIF_SUMMARY_MAX_THREADS	64
+#define VDIF_SUMMARY_MAX_THREADS	(VDIF_MAX_THREAD_ID+1)
 #define VDIF_SUMMARY_FILE_LENGTH	256
+#define VDIF_SUMMARY_DEFAULT_THREADS	16
+#define VDIF_MMAP_DEFAULT_WINDOW	(64LL*1024*1024)
+
+#define VDIF_CAPTURE_MAX_PORTS		16
+#define VDIF_CAPTURE_MAX_SOCKETS	64
+#define VDIF_CAPTURE_INTERFACE_LENGTH	32
+
+#define VDIF_REORDER_DEFAULT_WINDOW	64	/* frames per thread */
+#define VDIF_REORDER_MAX_THREADS	64
+#define VDIF_REORDER_MAX_FILL_SECONDS	10	/* longer gaps restart the output rather than being filled */
+#define VDIF_CAPTURE_DEFAULT_RING_BYTES	(256LL*1024*1024)
+#define VDIF_CAPTURE_DEFAULT_BATCH	64
+#define VDIF_CAPTURE_DEFAULT_SOCKET_BUFFER	(64*1024*1024)
 
 #define VDIF_NOERROR			0
 #define VDIF_ERROR			1
 
 #define VDIF_ALMA_SYNC			0xA5AE5
+#define VDIF_SYNC_WORD			0xACABFEED	/* syncword of EDV 1, 3 and 4 */
+#define VDIF_SYNC_DEFAULT_FRAMES	8
+#define VDIF_SYNC_MAX_FRAMES		64
 
 /* *** implemented in vdifio.c *** */
 
@@ -261,11 +278,36 @@ int determinevdifframesize(const unsigned char *buffer, int bufferSize);
 
 int determinevdifframeoffset(const unsigned char *buffer, int bufferSize, int frameSize);
 
+/* looks for nFrame (VDIF_SYNC_DEFAULT_FRAMES if <= 0, at most VDIF_SYNC_MAX_FRAMES) back-to-back frames of frameSize bytes
+ * whose headers agree on format, are within a second of each other, have frame numbers advancing steadily within each
+ * thread and, if their EDV has one, an intact sync word.  The first such run, else the longest, is taken as the stream;
+ * returned is the offset of the earliest run of at least 2 frames that agrees with it, or -1 if there is none.  If confidence
+ * is not 0 it is set to the percentage of nFrame frames in the best run, reduced by a quarter if there were no sync words */
+int determinevdifframesync(const unsigned char *buffer, int bufferSize, int frameSize, int nFrame, int *confidence);
+
 
 /* *** implemented in cornerturners.c *** */
 
+enum VDIFCornerTurnerISA	// instruction set used by a corner turner
+{
+	VDIFCornerTurnerISAGeneric = 0,	// portable C
+	VDIFCornerTurnerISASSE41,	// x86-64 SSE4.1
+	VDIFCornerTurnerISAAVX2,	// x86-64 AVX2
+	VDIFCornerTurnerISAAVX512BW,	// x86-64 AVX-512BW
+	NumVDIFCornerTurnerISAs		// list terminator
+};
+
+/* returns the fastest corner turner for the given configuration that the current CPU supports */
 void (*getCornerTurner(int nThread, int nBit))(unsigned char *, const unsigned char * const *, int);
 
+/* returns the corner turner for the given configuration implemented with the given instruction set, or 0 if there is none or the CPU cannot run it */
+void (*getCornerTurnerISA(int nThread, int nBit, enum VDIFCornerTurnerISA isa))(unsigned char *, const unsigned char * const *, int);
+
+/* returns the best instruction set supported by both this build and the current CPU */
+enum VDIFCornerTurnerISA getBestCornerTurnerISA(void);
+
+const char *getCornerTurnerISAName(enum VDIFCornerTurnerISA isa);
+
 
 /* *** implemented in vdifmux.c *** */
 
@@ -277,6 +319,11 @@ void (*getCornerTurner(int nThread, int nBit))(unsigned char *, const unsigned c
 #define VDIF_MUX_FLAG_COMPLEX			0x20		/* if set, data is complex (so 2x as many bits per logical sample) */
 #define VDIF_MUX_FLAG_PROPAGATEVALIDITY		0x40		/* if set, change output VDIF to EDV 4 with per-input-thread validity */
 
+#define VDIF_MUX_MAX_THREADS			(VDIF_MAX_THREAD_ID+1)	/* maximum number of input threads that can be multiplexed */
+#define VDIF_MUX_MASK_WORDS			(VDIF_MUX_MAX_THREADS/64)	/* 64-bit words needed for a thread presence mask */
+#define VDIF_MUX_MAX_WORKERS			64		/* maximum number of compute threads for corner turning */
+#define VDIF_MUX_MIN_BYTES_PER_WORKER		(1<<20)		/* output bytes each corner turning thread must have to be started */
+
 
 struct vdif_mux {
   int inputFrameSize;					/* size of one input data frame, inc header */
@@ -295,8 +342,10 @@ struct vdif_mux {
   int fanoutFactor;					/* if > 1 _and_ if input frames have a single channel, will combine multiple threads into a single output channel; this is for DBBC3 */
   unsigned int flags;
   uint16_t chanIndex[VDIF_MAX_THREAD_ID+1];		/* map from threadId to channel number (0 to nThread-1) */
-  uint64_t goodMask;
+  uint64_t goodMask[VDIF_MUX_MASK_WORDS];		/* nThread 1s as LSBs of a multi-word bitmap (word 0 holds threads 0-63) */
+  int nMaskWord;					/* number of words of goodMask (and of each frame's presence mask) in use */
   void (*cornerTurner)(unsigned char *, const unsigned char * const *, int);
+  int nWorker;						/* number of compute threads used for corner turning; default 1.  Change with configurevdifmuxthreads() */
 };
 
 struct vdif_mux_statistics {
@@ -311,6 +360,7 @@ struct vdif_mux_statistics {
   long long bytesProcessed;		/* total bytes consumed from */
   long long nGoodFrame;			/* number of fully usable output frames */
   long long nPartialFrame;		/* number of partial frames produced (EDV4 only) */
+  long long maxLatency;			/* streaming only: most frame periods an output frame trailed the newest input frame by (a maximum, not a sum) */
   int nCall;				/* how many calls to vdifmux since last reset */
 
   /* These remaining fields are set each time */
@@ -336,16 +386,73 @@ int configurevdifmux(struct vdif_mux *vm, int inputFrameSize, int inputFramesPer
 int setvdifmuxinputchannels(struct vdif_mux *vm, int inputChannelsPerThread);
 int setvdifmuxfanoutfactor(struct vdif_mux *vm, int fanoutFactor);
 
+/* spread the corner turning (Stage 2) of vdifmux() over nWorker threads.  Output is identical to the single-threaded case.
+ * The threads are started and joined within each call, so a call uses only as many as give each at least
+ * VDIF_MUX_MIN_BYTES_PER_WORKER of output; calls producing less than twice that stay single-threaded. */
+int configurevdifmuxthreads(struct vdif_mux *vm, int nWorker);
+
 void printvdifmux(const struct vdif_mux *vm);
 
 int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int srcSize, const struct vdif_mux *vm, int64_t startOutputFrameNumber, struct vdif_mux_statistics *stats);
 
+/* as vdifmux() but with input gathered from nRegion separate regions; frames may not cross region boundaries */
+int vdifmuxv(unsigned char *dest, int destSize, const struct iovec *src, int nRegion, const struct vdif_mux *vm, int64_t startOutputFrameNumber, struct vdif_mux_statistics *stats);
+
 void printvdifmuxstatistics(const struct vdif_mux_statistics *stats);
 
 void resetvdifmuxstatistics(struct vdif_mux_statistics *stats);
 
 void testvdifcornerturners(int outputBytes, int nTest);
 
+/* Streaming interface to the multiplexer.  Unlike vdifmux(), frames not yet sorted are retained between
+ * calls, so the caller never needs to move unconsumed input around.  Input buffers are referenced in place
+ * where possible.  Typical use:
+ *
+ *   vs = newvdifmuxstream(&vm);
+ *   while(more data)
+ *     for(p = 0; p < n; p += pushvdifmuxstream(vs, buf + p, n - p, 0, 0))
+ *       write(pullvdifmuxstream(vs, dest, destSize, &stats) bytes of dest);
+ *     write(pullvdifmuxstream(vs, dest, destSize, &stats) bytes of dest);
+ *   flushvdifmuxstream(vs);
+ *   while((n = pullvdifmuxstream(vs, dest, destSize, &stats)) > 0) write(n bytes of dest);
+ *   deletevdifmuxstream(vs);
+ */
+struct vdif_mux_stream;
+
+struct vdif_mux_stream *newvdifmuxstream(const struct vdif_mux *vm);
+
+void deletevdifmuxstream(struct vdif_mux_stream *vs);
+
+/* returns number of bytes of src consumed, or < 0 on error.  See vdifmux.c for details */
+int pushvdifmuxstream(struct vdif_mux_stream *vs, const unsigned char *src, int srcSize, void (*release)(const unsigned char *, void *), void *userData);
+
+/* returns number of bytes of dest populated, or < 0 on error */
+int pullvdifmuxstream(struct vdif_mux_stream *vs, unsigned char *dest, int destSize, struct vdif_mux_statistics *stats);
+
+void flushvdifmuxstream(struct vdif_mux_stream *vs);
+
+/* realtime mode: output frames at most maxReorder frames behind the newest input; 0 restores normal sorting.  Call before pushing data */
+int setvdifmuxstreamlatency(struct vdif_mux_stream *vs, int maxReorder);
+
+
+/* *** implemented in cornerturners_unpack.c *** */
+
+/* Fused multiplex and unpack: the per-thread payloads that vdifmux() would corner turn are decoded directly into
+ * one array per output channel (vm->nOutputChan of them), skipping the packed multiplexed representation.  The
+ * result is identical to unpacking the vdifmux() output, except that samples of missing (null pointer) threads and
+ * of the padding threads beyond nThread are 0.  Complex data is written as interleaved real, imaginary pairs.
+ * levels maps each bitsPerSample code to a value; pass 0 for the defaults (-3.3359, -1, 1, 3.3359 for 2-bit float;
+ * offset binary for 4 and 8 bits).
+ * Supported for 1, 2, 4 and 8 bits per sample.  threadDataSize is the bytes of payload per thread.
+ * Returns the number of values written to each channel, or < 0 on error */
+int vdifmuxunpackfloat(float * const *chanData, const unsigned char * const *threadBuffers, int threadDataSize, const struct vdif_mux *vm, const float *levels);
+
+/* as above, with 8-bit integer output.  Default levels are -3, -1, 1, 3 for 2-bit data */
+int vdifmuxunpackint8(int8_t * const *chanData, const unsigned char * const *threadBuffers, int threadDataSize, const struct vdif_mux *vm, const int8_t *levels);
+
+/* returns the number of values per channel produced by the above for threadDataSize bytes per thread, or < 0 on error */
+int vdifmuxunpackvalues(const struct vdif_mux *vm, int threadDataSize);
+
 
 /* *** implemented in vdiffile.c *** */
 
@@ -390,6 +497,157 @@ static inline int vdiffilesummarygetbytespersecond(const struct vdif_file_summar
 
 int summarizevdiffile(struct vdif_file_summary *sum, const char *fileName, int frameSize);
 
+/* summarizes nFile files as above, nThread (VDIF_SUMMARY_DEFAULT_THREADS if <= 0) at a time.  sums[i] and rv[i] receive the
+ * summary of fileNames[i] and what summarizevdiffile() would have returned for it.  Returns the number of files summarized */
+int summarizevdiffiles(struct vdif_file_summary *sums, int *rv, const char * const *fileNames, int nFile, int frameSize, int nThread);
+
+/* positions in at the first frame whose time is not before frame of second (seconds since the file's VDIF reference epoch, as
+ * in struct vdif_file_summary), by interpolating and bisecting on frame headers.  framesPerSecond may be 0 if not known, at
+ * the cost of a few more reads.  Returns the new file position, or < 0 on error (-4 if the time is after the end of the file) */
+off_t seekvdiffiletime(FILE *in, int frameSize, int framesPerSecond, int second, int frame);
+
+/* Memory mapped reading of a VDIF file.  Data are returned as pointers into the mapping, valid until closevdifmmapfile(), so
+ * they can be given straight to vdifmux() or pushvdifmuxstream() without being copied out of the page cache.  Readahead of
+ * window bytes beyond the read position is requested as reading proceeds and pages well behind it are dropped from the
+ * mapping (they are simply read again if touched).  Typical use:
+ *
+ *   vf = openvdifmmapfile(fileName, 0);
+ *   while((src = peekvdifmmapfile(vf, chunkSize, &n)) != 0)
+ *   {
+ *     vdifmux(dest, destSize, src, n, &vm, nextFrame, &stats);
+ *     advancevdifmmapfile(vf, stats.srcUsed);
+ *   }
+ *   closevdifmmapfile(vf);
+ */
+struct vdif_mmap_file
+{
+	int fd;
+	const unsigned char *data;	/* the whole file, mapped read only */
+	long long fileSize;
+	long long pos;			/* next byte to be returned */
+	long long adviseEnd;		/* readahead has been requested up to here */
+	long long releaseEnd;		/* pages before here have been dropped */
+	long long window;		/* [bytes] readahead to keep ahead of pos */
+};
+
+/* window <= 0 selects VDIF_MMAP_DEFAULT_WINDOW.  Returns 0 on error */
+struct vdif_mmap_file *openvdifmmapfile(const char *fileName, long long window);
+
+void closevdifmmapfile(struct vdif_mmap_file *vf);
+
+/* returns 0 on success, < 0 if pos is outside the file */
+int seekvdifmmapfile(struct vdif_mmap_file *vf, long long pos);
+
+/* returns a pointer to the next *nBytes (at most maxBytes) bytes of the file without consuming them, or 0 at end of file */
+const unsigned char *peekvdifmmapfile(struct vdif_mmap_file *vf, int maxBytes, int *nBytes);
+
+/* consumes nBytes; returns the new position */
+long long advancevdifmmapfile(struct vdif_mmap_file *vf, int nBytes);
+
+
+/* *** implemented in vdifcapture.c *** */
+
+/* Multi-socket UDP VDIF capture.  Each socket has its own receiver thread that receives batches of packets with
+ * recvmmsg() straight into a ring of frame slots; the consumer takes whole runs of frames as iovecs (suitable for
+ * vdifmuxv() or writev()) without further copying.  With nSocketPerPort > 1 the sockets share each port through
+ * SO_REUSEPORT so the kernel spreads the flows over receiver threads.
+ *
+ * If packetInterface is set, frames are instead taken from AF_PACKET TPACKET_V3 rings mapped from the kernel
+ * (needs CAP_NET_RAW).  The Ethernet, IP and UDP headers and the skip bytes are stripped in place and each frame is
+ * handed out where the kernel put it, so nothing is copied; nSocketPerPort then sets the number of rings, which share
+ * the traffic through a PACKET_FANOUT group.  Only unfragmented IPv4 packets to one of the ports are taken. */
+
+struct vdif_capture_config
+{
+	int nPort;
+	int ports[VDIF_CAPTURE_MAX_PORTS];
+	int nSocketPerPort;
+	int frameSize;			/* 0 to take it from the first packet received */
+	int skipBytesFront;		/* bytes preceding the VDIF frame in each packet (e.g. a VTP sequence number) */
+	int skipBytesBack;		/* bytes following the VDIF frame in each packet */
+	long long ringBytes;		/* total over all sockets */
+	int batchSize;			/* packets per recvmmsg() call */
+	int socketBufferBytes;
+	int useGRO;			/* if non-zero, and there are no skip bytes, let the kernel coalesce packets (UDP_GRO) */
+	char packetInterface[VDIF_CAPTURE_INTERFACE_LENGTH];	/* e.g. "eth2" for zero-copy packet capture; empty for UDP sockets */
+};
+
+struct vdif_capture_statistics
+{
+	long long nPacket;
+	long long nFrame;
+	long long nByte;
+	long long nBadPacket;		/* wrong size or truncated */
+	long long nKernelDrop;		/* dropped by the kernel for lack of socket buffer */
+	long long nRingFull;		/* times a receiver (or in packet mode the kernel) had to wait for the consumer */
+};
+
+struct vdif_capture;
+
+void initvdifcaptureconfig(struct vdif_capture_config *cfg);
+
+/* opens the sockets and starts receiving.  Returns 0 on error */
+struct vdif_capture *newvdifcapture(const struct vdif_capture_config *cfg);
+
+int getvdifcaptureframesize(const struct vdif_capture *vc);
+
+/* fills iov with up to maxIov regions of whole captured frames, waiting up to timeoutMs for some to arrive.
+ * Returns the number of regions, 0 on timeout, or < 0 once capture has been stopped and all frames taken.
+ * The regions remain valid until releasevdifcapture() is called.  Frames from different sockets are not merged
+ * into time order. */
+int getvdifcapture(struct vdif_capture *vc, struct iovec *iov, int maxIov, int timeoutMs);
+
+/* returns all regions handed out by getvdifcapture() to the receivers */
+void releasevdifcapture(struct vdif_capture *vc);
+
+/* stops receiving; frames already captured can still be taken with getvdifcapture() */
+void stopvdifcapture(struct vdif_capture *vc);
+
+void deletevdifcapture(struct vdif_capture *vc);
+
+void getvdifcapturestatistics(const struct vdif_capture *vc, struct vdif_capture_statistics *stats);
+
+void printvdifcapturestatistics(const struct vdif_capture_statistics *stats);
+
+/* Reorder stage for captured frames.  Keeps a window of windowFrames frames (VDIF_REORDER_DEFAULT_WINDOW if <= 0) per
+ * thread keyed on (seconds, frame number) and passes frames on to writer strictly in time order, threads in increasing
+ * ID order within each frame time.  Duplicates and frames older than the window are dropped; missing frames are written
+ * as invalid fill frames.  The output then has every thread at every frame time, so frame n of thread k is at offset
+ * (n*nThread + k)*frameSize.  The set of threads is taken from those seen before output starts.  A jump of more than
+ * VDIF_REORDER_MAX_FILL_SECONDS forward, or back behind the window, is not filled; output restarts at the new time.  The
+ * output regions passed to writer are only valid during the call; it should return < 0 on error. */
+
+struct vdif_reorder_statistics
+{
+	long long nFrameIn;
+	long long nFrameOut;		/* including fill frames */
+	long long nFill;
+	long long nDuplicate;
+	long long nLate;		/* arrived less than VDIF_REORDER_MAX_FILL_SECONDS after their frame time was written */
+	long long nBadFrame;		/* wrong size or frame number out of range */
+	long long nUnknownThread;	/* from threads that appeared after output started */
+	long long nResync;
+};
+
+typedef int (*vdif_reorder_writer)(const struct iovec *iov, int nIov, void *userData);
+
+struct vdif_reorder;
+
+/* returns 0 on error */
+struct vdif_reorder *newvdifreorder(int frameSize, int framesPerSecond, int windowFrames, vdif_reorder_writer writer, void *userData);
+
+void deletevdifreorder(struct vdif_reorder *vr);
+
+/* takes regions of whole frames, such as those from getvdifcapture(); returns < 0 if the writer failed */
+int addvdifreorderframes(struct vdif_reorder *vr, const struct iovec *iov, int nIov);
+
+/* writes out everything held, filling any gaps; returns < 0 if the writer failed */
+int flushvdifreorder(struct vdif_reorder *vr);
+
+void getvdifreorderstatistics(const struct vdif_reorder *vr, struct vdif_reorder_statistics *stats);
+
+void printvdifreorderstatistics(const struct vdif_reorder_statistics *stats);
+
 
 #ifdef __cplusplus
 }
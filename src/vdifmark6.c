@@ -27,11 +27,19 @@
 //
 //============================================================================
 
-#include <stdio.h>
 #define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <glob.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "dateutils.h"
 #include "vdifmark6.h"
 
@@ -143,632 +151,2452 @@ static int getFirstBlocks(Mark6File *m6f)
 	return 0;
 }
 
-static void *mark6Reader(void *arg)
+/* The block index.  Saved as a Mark6IndexHeader followed by nBlock Mark6BlockIndexEntry, in host byte order.
+ * fileSize and fileTime record the data file the index was built from; a mismatch means it is stale. */
+
+#define MARK6_INDEX_MAGIC	"MK6IDX1"
+
+typedef struct
 {
-	Mark6File *m6f = (Mark6File *)arg;
+	char magic[8];
+	int32_t nBlock;
+	int32_t epoch;
+	int32_t version;		/* these three copied from the data file's Mark6Header */
+	int32_t maxBlockSize;
+	int32_t packetSize;
+	int32_t pad;
+	int64_t fileSize;
+	int64_t fileTime;
+} Mark6IndexHeader;
+
+static int isMark6IndexFileName(const char *fileName)
+{
+	size_t n = strlen(fileName);
+	size_t m = strlen(MARK6_INDEX_SUFFIX);
 
-	do
-	{
-		int v;
+	return n >= m && strcmp(fileName + n - m, MARK6_INDEX_SUFFIX) == 0;
+}
 
-		pthread_barrier_wait(&m6f->readBarrier);
+/* returns allocated name of the index of fileName */
+static char *getMark6IndexFileName(const char *fileName)
+{
+	const char *dir;
+	char *indexName;
+	size_t n;
 
-		v = fread(&m6f->readHeader, m6f->blockHeaderSize, 1, m6f->in);
-		if(v == 1)
-		{
-			m6f->readBytes = fread(m6f->readBuffer, 1, m6f->readHeader.wb_size - m6f->blockHeaderSize, m6f->in);
-		}
-		else
+	dir = getenv("MARK6_INDEX_DIR");
+	n = strlen(fileName) + strlen(MARK6_INDEX_SUFFIX) + (dir ? strlen(dir) + 2 : 1);
+	indexName = (char *)malloc(n);
+	if(!indexName)
+	{
+		return 0;
+	}
+	if(dir)
+	{
+		/* the same scan has the same file name on every disk, so flatten the whole path */
+		char *p;
+
+		snprintf(indexName, n, "%s/%s%s", dir, fileName, MARK6_INDEX_SUFFIX);
+		for(p = indexName + strlen(dir) + 1; *p; ++p)
 		{
-			m6f->readBytes = 0;
+			if(*p == '/')
+			{
+				*p = '_';
+			}
 		}
-		
-		pthread_barrier_wait(&m6f->readBarrier);
-	} while(!m6f->stopReading);
+	}
+	else
+	{
+		snprintf(indexName, n, "%s%s", fileName, MARK6_INDEX_SUFFIX);
+	}
 
-	return 0;
+	return indexName;
 }
 
-struct seekArgs
+static void fillMark6IndexHeader(Mark6IndexHeader *H, const Mark6File *m6f, int nBlock)
 {
-	Mark6File *m6f;
-	off_t position;		/* SEEK_SET argument */
-	int nFile;		/* number of files in the fileset */
-};
+	memset(H, 0, sizeof(Mark6IndexHeader));
+	memcpy(H->magic, MARK6_INDEX_MAGIC, sizeof(MARK6_INDEX_MAGIC));
+	H->nBlock = nBlock;
+	H->epoch = m6f->indexEpoch;
+	H->version = m6f->version;
+	H->maxBlockSize = m6f->maxBlockSize;
+	H->packetSize = m6f->packetSize;
+	H->fileSize = m6f->stat.st_size;
+	H->fileTime = m6f->stat.st_mtime;
+}
 
-/* Returns 0 on EOF */
-static ssize_t Mark6FileReadBlock(Mark6File *m6f, int slotIndex)
+/* loads the index of m6f if there is a current one.  Returns 0 on success */
+static int loadMark6FileIndex(Mark6File *m6f)
 {
-	Mark6BufferSlot *slot;
+	Mark6IndexHeader H, expect;
+	Mark6BlockIndexEntry *index;
+	char *indexName;
+	FILE *in;
+	int v;
 
-	slot = m6f->slot + slotIndex;
+	indexName = getMark6IndexFileName(m6f->fileName);
+	if(!indexName)
+	{
+		return -1;
+	}
+	in = fopen(indexName, "r");
+	free(indexName);
+	if(!in)
+	{
+		return -2;
+	}
 
-	pthread_barrier_wait(&m6f->readBarrier);
+	memset(&H, 0, sizeof(H));
+	v = fread(&H, sizeof(H), 1, in);
+	fillMark6IndexHeader(&expect, m6f, H.nBlock);
+	expect.epoch = H.epoch;
+	if(v != 1 || H.nBlock <= 0 || memcmp(&H, &expect, sizeof(H)) != 0)
+	{
+		fclose(in);
 
-	slot->payloadBytes = m6f->readBytes;
+		return -3;
+	}
 
-	if(slot->payloadBytes == 0)
+	index = (Mark6BlockIndexEntry *)malloc(H.nBlock*sizeof(Mark6BlockIndexEntry));
+	if(!index || fread(index, sizeof(Mark6BlockIndexEntry), H.nBlock, in) != (size_t)H.nBlock)
 	{
-		slot->index = 0;
-		slot->frame = 0;
+		free(index);
+		fclose(in);
+
+		return -4;
 	}
-	else
-	{
-		char *tmp;
-		vdif_header *vh;
-		
-		slot->payloadBytes -= (slot->payloadBytes % m6f->packetSize);
+	fclose(in);
 
-		memcpy(&slot->blockHeader, &m6f->readHeader, m6f->blockHeaderSize);
-		
-		tmp = slot->data;
-		slot->data = m6f->readBuffer;
-		m6f->readBuffer = tmp;
+	free(m6f->blockIndex);
+	m6f->blockIndex = index;
+	m6f->nBlockIndex = H.nBlock;
+	m6f->indexEpoch = H.epoch;
 
-		slot->index = 0;
+	return 0;
+}
 
-		vh = (vdif_header *)(slot->data);
-		slot->frame = vdifFrame(vh);
+/* writes the index of m6f; a partly written index is never left under the final name.  Returns 0 on success */
+static int saveMark6FileIndex(const Mark6File *m6f)
+{
+	Mark6IndexHeader H;
+	char *indexName, *tmpName;
+	FILE *out;
+	int ok;
+
+	indexName = getMark6IndexFileName(m6f->fileName);
+	if(!indexName)
+	{
+		return -1;
+	}
+	tmpName = (char *)malloc(strlen(indexName) + 8);
+	if(!tmpName)
+	{
+		free(indexName);
+
+		return -1;
 	}
+	sprintf(tmpName, "%s.tmp", indexName);
 
-	pthread_barrier_wait(&m6f->readBarrier);
+	out = fopen(tmpName, "w");
+	if(!out)
+	{
+		fprintf(stderr, "Warning: cannot write Mark6 block index %s: %s\n", indexName, strerror(errno));
+		free(tmpName);
+		free(indexName);
 
-	return slot->payloadBytes;
+		return -2;
+	}
+	fillMark6IndexHeader(&H, m6f, m6f->nBlockIndex);
+	ok = fwrite(&H, sizeof(H), 1, out) == 1;
+	ok = ok && fwrite(m6f->blockIndex, sizeof(Mark6BlockIndexEntry), m6f->nBlockIndex, out) == (size_t)m6f->nBlockIndex;
+	ok = (fclose(out) == 0) && ok;
+	if(ok)
+	{
+		ok = rename(tmpName, indexName) == 0;
+	}
+	if(!ok)
+	{
+		fprintf(stderr, "Warning: cannot write Mark6 block index %s: %s\n", indexName, strerror(errno));
+		unlink(tmpName);
+	}
+	free(tmpName);
+	free(indexName);
+
+	return ok ? 0 : -3;
 }
 
-static void *mark6Seeker(void *arg)
+/* reads every block header, and the first and last packet headers of each block, through a separate descriptor so
+ * the reader is undisturbed.  Returns 0 on success */
+static int scanMark6FileIndex(Mark6File *m6f)
 {
-	struct seekArgs *S = (struct seekArgs *)arg;
-	off_t pos;
-	int blockSize;
-	int targetBlock;
-	int slotIndex;
-	int i;
-
-	/*   1. wait for any ongoing reads to complete */
-	pthread_barrier_wait(&S->m6f->readBarrier);
+	Mark6BlockIndexEntry *index = 0;
+	int nIndex = 0, nAlloc = 0;
+	int64_t payloadBefore = 0;
+	off_t pos, fileSize;
+	char buf[sizeof(Mark6BlockHeader_ver2) + VDIF_HEADER_BYTES];
+	int fd;
 
-	/*   2. figure out where we need to be */ 
-	if(S->position == 0)
+	fd = open(m6f->fileName, O_RDONLY);
+	if(fd < 0)
 	{
-		pos = sizeof(Mark6Header);
+		return -1;
 	}
-	else
+	fileSize = m6f->stat.st_size;
+	m6f->indexEpoch = -1;
+
+	for(pos = sizeof(Mark6Header); pos + m6f->blockHeaderSize < fileSize; )
 	{
-		blockSize = S->m6f->maxBlockSize - ((S->m6f->maxBlockSize-S->m6f->blockHeaderSize) % S->m6f->packetSize);
-		targetBlock = S->position/(blockSize - S->m6f->blockHeaderSize);
-		pos = sizeof(Mark6Header) + blockSize*targetBlock/S->nFile;
+		Mark6BlockHeader_ver2 header;
+		Mark6BlockIndexEntry *E;
+		off_t payload;
+		int32_t size;
 
-		if(pos >= S->m6f->stat.st_size)
+		if(pread(fd, buf, m6f->blockHeaderSize + VDIF_HEADER_BYTES, pos) != m6f->blockHeaderSize + VDIF_HEADER_BYTES)
 		{
-			targetBlock = S->m6f->stat.st_size/(blockSize - S->m6f->blockHeaderSize)/S->nFile;
-			pos = sizeof(Mark6Header) + blockSize*targetBlock;
+			break;
 		}
-
-		/* Iterate up to 5 times to get a better position */
-		for(i = 0; i < 5; ++i)
+		header.wb_size = m6f->maxBlockSize;	/* version 1 block headers have no size */
+		memcpy(&header, buf, m6f->blockHeaderSize);
+		size = header.wb_size;
+		if(size <= m6f->blockHeaderSize || size > m6f->maxBlockSize)
 		{
-			int32_t block;
-			int deltaBlock;
+			break;
+		}
+		payload = size - m6f->blockHeaderSize;
+		if(pos + size > fileSize)
+		{
+			payload = fileSize - pos - m6f->blockHeaderSize;
+		}
+		payload -= payload % m6f->packetSize;
+		if(payload <= 0)
+		{
+			break;
+		}
+		if(nIndex > 0 && header.blocknum <= index[nIndex-1].blocknum)
+		{
+			fprintf(stderr, "Warning: %s: block numbers are not increasing; not indexing\n", m6f->fileName);
+			nIndex = 0;
 
-			fseeko(S->m6f->in, pos, SEEK_SET);
-			fread(&block, sizeof(int32_t), 1, S->m6f->in);
+			break;
+		}
 
-			deltaBlock = block - targetBlock;
+		if(nIndex >= nAlloc)
+		{
+			Mark6BlockIndexEntry *p;
 
-			/* if it is within 4 blocks of the target and positioned earlier than that, then call it good enough */
-			if(deltaBlock <= 0 && deltaBlock > -(4*S->nFile))
+			nAlloc = nAlloc ? 2*nAlloc : 1024;
+			p = (Mark6BlockIndexEntry *)realloc(index, nAlloc*sizeof(Mark6BlockIndexEntry));
+			if(!p)
 			{
-				break;
-			}
+				nIndex = 0;
 
-			if(deltaBlock < S->nFile && deltaBlock > 0)
-			{
-				pos -= blockSize;
-			}
-			else
-			{
-				pos -= blockSize * (deltaBlock/S->nFile);
+				break;
 			}
+			index = p;
 		}
-	}
-
-	/*   3. reposition the file at the correct location */
-	fseeko(S->m6f->in, pos, SEEK_SET);
+		E = index + nIndex;
+		E->offset = pos;
+		E->payloadBefore = payloadBefore;
+		E->blocknum = header.blocknum;
+		E->payloadBytes = payload;
+		E->firstFrame = vdifFrame((vdif_header *)(buf + m6f->blockHeaderSize));
+		if(m6f->indexEpoch < 0)
+		{
+			m6f->indexEpoch = getVDIFEpoch((vdif_header *)(buf + m6f->blockHeaderSize));
+		}
+		if(pread(fd, buf, VDIF_HEADER_BYTES, pos + m6f->blockHeaderSize + payload - m6f->packetSize) != VDIF_HEADER_BYTES)
+		{
+			break;
+		}
+		E->lastFrame = vdifFrame((vdif_header *)buf);
 
-	/*   4. give control back to reader thread */
-	pthread_barrier_wait(&S->m6f->readBarrier);
+		++nIndex;
+		payloadBefore += payload;
+		pos += size;
+	}
+	close(fd);
 
-	/*   5. explicitly load the next block for each slot */
-	for(slotIndex = 0; slotIndex < MARK6_BUFFER_SLOTS; ++slotIndex)
+	if(nIndex == 0)
 	{
-		Mark6FileReadBlock(S->m6f, slotIndex);
+		free(index);
+
+		return -2;
 	}
 
+	free(m6f->blockIndex);
+	m6f->blockIndex = index;
+	m6f->nBlockIndex = nIndex;
+
 	return 0;
 }
 
-static void deallocateMark6File(Mark6File *m6f)
+/* returns the position in the file of the first block numbered at least blocknum, or the file size if there is none */
+static off_t findMark6IndexBlock(const Mark6File *m6f, int32_t blocknum)
 {
-	int s;
+	int a = 0, b = m6f->nBlockIndex;
 
-	if(m6f->in)
-	{
-		fclose(m6f->in);
-		m6f->in = 0;
-	}
-	if(m6f->fileName)
-	{
-		free(m6f->fileName);
-		m6f->fileName = 0;
-	}
-	for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+	while(a < b)
 	{
-		if(m6f->slot[s].data)
+		int m = (a + b)/2;
+
+		if(m6f->blockIndex[m].blocknum < blocknum)
 		{
-			free(m6f->slot[s].data);
-			m6f->slot[s].data = 0;
+			a = m + 1;
+		}
+		else
+		{
+			b = m;
 		}
 	}
-	if(m6f->readBuffer)
-	{
-		free(m6f->readBuffer);
-		m6f->readBuffer = 0;
-	}
-	m6f->version = -1;
-}
 
-/* this assumes *m6f is already allocated but that the structures within are not. */
-/* no attempt is made here to free existing data */
+	return (a < m6f->nBlockIndex) ? m6f->blockIndex[a].offset : m6f->stat.st_size;
+}
 
-/* returns 0 on success, or error code otherwise */
-int openMark6File(Mark6File *m6f, const char *filename)
+/* returns the payload of all blocks of the file numbered below blocknum */
+static int64_t getMark6IndexPayloadBefore(const Mark6File *m6f, int32_t blocknum)
 {
-	Mark6Header header;
-	pthread_attr_t attr;
-	int slotIndex;
+	int a = 0, b = m6f->nBlockIndex;
 
-	stat(filename, &m6f->stat);
-	m6f->in = fopen(filename, "r");
-	if(!m6f->in)
+	while(a < b)
 	{
-		deallocateMark6File(m6f);
+		int m = (a + b)/2;
 
-		return -1;
+		if(m6f->blockIndex[m].blocknum < blocknum)
+		{
+			a = m + 1;
+		}
+		else
+		{
+			b = m;
+		}
 	}
-	m6f->fileName = strdup(filename);
-	fread(&header, sizeof(header), 1, m6f->in);
-	m6f->version = header.version;
-	m6f->blockHeaderSize = mark6BlockHeaderSize(header.version);
-	if(m6f->blockHeaderSize <= 0)
+	if(a == 0)
 	{
-		deallocateMark6File(m6f);
-
-		return -2;
+		return 0;
 	}
-	m6f->readHeader.wb_size = m6f->maxBlockSize;
-	m6f->maxBlockSize = header.block_size;
-	m6f->packetSize = header.packet_size;
-	m6f->readBuffer = (char *)malloc(m6f->maxBlockSize-m6f->blockHeaderSize);
-	if(!m6f->readBuffer)
-	{
-		deallocateMark6File(m6f);
 
-		return -5;
-	}
+	return m6f->blockIndex[a-1].payloadBefore + m6f->blockIndex[a-1].payloadBytes;
+}
 
-	if(getFirstBlocks(m6f) < 0)
-	{
-		deallocateMark6File(m6f);
+/* for a file whose blocks are all maxBlockSize (the usual case), bisects on the first packet of blocks to find the last
+ * block starting no later than frame.  Returns its position, or -1 if the blocks turn out not to be evenly spaced */
+static off_t findMark6FileTimeByProbe(const Mark6File *m6f, uint64_t frame)
+{
+	char buf[sizeof(Mark6BlockHeader_ver2) + VDIF_HEADER_BYTES];
+	off_t blockSize, nBlock, lo, hi;
+	int fd;
 
-		return -4;
+	blockSize = m6f->maxBlockSize - ((m6f->maxBlockSize - m6f->blockHeaderSize) % m6f->packetSize);
+	nBlock = (m6f->stat.st_size - (off_t)sizeof(Mark6Header) - m6f->blockHeaderSize - m6f->packetSize)/blockSize + 1;
+	if(nBlock <= 1)
+	{
+		return sizeof(Mark6Header);
 	}
 
-	for(slotIndex = 0; slotIndex < MARK6_BUFFER_SLOTS; ++slotIndex)
+	fd = open(m6f->fileName, O_RDONLY);
+	if(fd < 0)
 	{
-		Mark6BufferSlot *slot;
+		return -1;
+	}
 
-		slot = m6f->slot + slotIndex;
+	/* block lo starts no later than frame; block hi starts after it (or is past the end) */
+	lo = 0;
+	hi = nBlock;
+	while(hi - lo > 1)
+	{
+		Mark6BlockHeader_ver2 header;
+		const vdif_header *vh = (const vdif_header *)(buf + m6f->blockHeaderSize);
+		off_t m = lo + (hi - lo)/2;
 
-		slot->data = (char *)malloc(m6f->maxBlockSize-m6f->blockHeaderSize);
-		if(!slot->data)
+		if(pread(fd, buf, m6f->blockHeaderSize + VDIF_HEADER_BYTES, sizeof(Mark6Header) + m*blockSize) != m6f->blockHeaderSize + VDIF_HEADER_BYTES)
 		{
-			deallocateMark6File(m6f);
+			close(fd);
 
-			return -3;
+			return -1;
 		}
+		header.wb_size = blockSize;	/* version 1 block headers have no size */
+		memcpy(&header, buf, m6f->blockHeaderSize);
+		if((header.wb_size != blockSize && m < nBlock - 1) || getVDIFFrameBytes(vh) != m6f->packetSize)
+		{
+			close(fd);
 
-		slot->blockHeader.blocknum = -1;
-		slot->blockHeader.wb_size = m6f->maxBlockSize;
-
-		slot->payloadBytes = 0;	/* nothing read yet */
+			return -1;
+		}
+		if(vdifFrame((vdif_header *)vh) <= frame)
+		{
+			lo = m;
+		}
+		else
+		{
+			hi = m;
+		}
 	}
+	close(fd);
 
-	/* start reading thread */
-	pthread_barrier_init(&m6f->readBarrier, 0, 2);
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	pthread_create(&m6f->readThread, &attr, mark6Reader, m6f);
-	pthread_attr_destroy(&attr);
-	pthread_barrier_wait(&m6f->readBarrier);
-
-	return 0;
+	return sizeof(Mark6Header) + lo*blockSize;
 }
 
-/* m6f is not freed itself in this call, but all internal structures are freed. */
-int closeMark6File(Mark6File *m6f)
+/* returns the position in the file of the first block that may hold packets not before frame.  Uses the block index,
+ * or failing that bisects on block headers, or failing that builds the index in memory */
+static off_t findMark6FileTime(Mark6File *m6f, uint64_t frame)
 {
-	if(!m6f)
+	int a, b;
+
+	if(!m6f->blockIndex)
 	{
-		fprintf(stderr, "Error: closeMark6File called with null pointer\n");
+		off_t pos;
 
-		return -1;
+		pos = findMark6FileTimeByProbe(m6f, frame);
+		if(pos >= 0)
+		{
+			return pos;
+		}
+		if(scanMark6FileIndex(m6f) != 0)
+		{
+			return sizeof(Mark6Header);
+		}
 	}
-	m6f->stopReading = 1;
-	if(m6f->in)
+
+	a = 0;
+	b = m6f->nBlockIndex;
+	while(a < b)
 	{
-		pthread_barrier_wait(&m6f->readBarrier);
-		pthread_join(m6f->readThread, 0);
+		int m = (a + b)/2;
+
+		if(m6f->blockIndex[m].lastFrame < frame)
+		{
+			a = m + 1;
+		}
+		else
+		{
+			b = m;
+		}
 	}
 
-	deallocateMark6File(m6f);
+	return (a < m6f->nBlockIndex) ? m6f->blockIndex[a].offset : m6f->stat.st_size;
+}
 
-	return 0;
+/* The read-ahead ring.  ringHead and ringTail only ever increase; block i lives at ring[i % nRing].
+ * Each is written by one side only, so passing blocks needs no lock.  A side that finds the ring
+ * full (reader) or empty (gatherer) sets its waiting flag and sleeps; the other side checks that
+ * flag after each publish or release.  Flags and counters use sequentially consistent atomics so
+ * that one of the two always sees the other's store and no wakeup is lost. */
+
+static inline unsigned int loadMark6Counter(const unsigned int *c)
+{
+	return __atomic_load_n(c, __ATOMIC_SEQ_CST);
 }
 
-void printMark6File(const Mark6File *m6f)
+static inline void storeMark6Counter(unsigned int *c, unsigned int v)
 {
-	printf("Mark6 file:\n");
+	__atomic_store_n(c, v, __ATOMIC_SEQ_CST);
+}
+
+static inline int loadMark6Flag(const int *f)
+{
+	return __atomic_load_n(f, __ATOMIC_SEQ_CST);
+}
+
+static inline void storeMark6Flag(int *f, int v)
+{
+	__atomic_store_n(f, v, __ATOMIC_SEQ_CST);
+}
+
+static void wakeMark6Waiter(int *waiting, pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+	if(loadMark6Flag(waiting))
+	{
+		pthread_mutex_lock(lock);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(lock);
+	}
+}
+
+/* appends buf to a growable list of buffers.  Returns 0 on success */
+static int pushMark6Buffer(char ***list, int *n, int *alloc, char *buf)
+{
+	if(*n >= *alloc)
+	{
+		int newAlloc = (*alloc > 0) ? 2*(*alloc) : 16;
+		char **p = (char **)realloc(*list, newAlloc*sizeof(char *));
+
+		if(!p)
+		{
+			return -1;
+		}
+		*list = p;
+		*alloc = newAlloc;
+	}
+	(*list)[(*n)++] = buf;
+
+	return 0;
+}
+
+static void freeMark6Buffers(char ***list, int *n, int *alloc)
+{
+	int i;
+
+	for(i = 0; i < *n; ++i)
+	{
+		free((*list)[i]);
+	}
+	free(*list);
+	*list = 0;
+	*n = *alloc = 0;
+}
+
+static char *allocMark6Buffer(const Mark6File *m6f)
+{
+	void *p;
+
+	if(posix_memalign(&p, MARK6_IO_ALIGN, m6f->maxBlockSize + 2*MARK6_IO_ALIGN) != 0)
+	{
+		return 0;
+	}
+
+	return (char *)p;
+}
+
+static void *mark6Reader(void *arg)
+{
+	Mark6File *m6f = (Mark6File *)arg;
+	unsigned int head = m6f->ringHead;
+
+	for(;;)
+	{
+		Mark6ReadBlock *block;
+		int v;
+
+		if((int)(head - loadMark6Counter(&m6f->ringTail)) >= m6f->nRing)
+		{
+			pthread_mutex_lock(&m6f->waitLock);
+			storeMark6Flag(&m6f->readerWaiting, 1);
+			while((int)(head - loadMark6Counter(&m6f->ringTail)) >= m6f->nRing && !loadMark6Flag(&m6f->stopReading))
+			{
+				pthread_cond_wait(&m6f->spaceCond, &m6f->waitLock);
+			}
+			storeMark6Flag(&m6f->readerWaiting, 0);
+			pthread_mutex_unlock(&m6f->waitLock);
+		}
+		if(loadMark6Flag(&m6f->stopReading))
+		{
+			break;
+		}
+
+		block = m6f->ring + head % m6f->nRing;
+		block->data = block->buffer;
+
+		block->header.wb_size = m6f->maxBlockSize;	/* version 1 block headers have no size */
+		v = fread(&block->header, m6f->blockHeaderSize, 1, m6f->in);
+		if(v == 1 && block->header.wb_size > m6f->blockHeaderSize && block->header.wb_size <= m6f->maxBlockSize)
+		{
+			block->bytes = fread(block->data, 1, block->header.wb_size - m6f->blockHeaderSize, m6f->in);
+		}
+		else
+		{
+			block->bytes = 0;
+		}
+
+		if(block->bytes <= 0)
+		{
+			storeMark6Flag(&m6f->readDone, 1);
+			wakeMark6Waiter(&m6f->gathererWaiting, &m6f->waitLock, &m6f->dataCond);
+
+			break;
+		}
+
+		storeMark6Counter(&m6f->ringHead, ++head);
+		wakeMark6Waiter(&m6f->gathererWaiting, &m6f->waitLock, &m6f->dataCond);
+	}
+
+	return 0;
+}
+
+static int startMark6Reader(Mark6File *m6f)
+{
+	pthread_attr_t attr;
+	int v;
+
+	if(m6f->reading)
+	{
+		return 0;
+	}
+
+	m6f->stopReading = 0;
+	m6f->readDone = 0;
+	m6f->readerLock = &m6f->waitLock;
+	m6f->readerCond = &m6f->spaceCond;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	v = pthread_create(&m6f->readThread, &attr, mark6Reader, m6f);
+	pthread_attr_destroy(&attr);
+
+	m6f->reading = (v == 0);
+
+	return (v == 0) ? 0 : -1;
+}
+
+/* stops the reader after any block in progress; blocks already read stay in the ring */
+static void stopMark6Reader(Mark6File *m6f)
+{
+	if(!m6f->reading)
+	{
+		return;
+	}
+
+	storeMark6Flag(&m6f->stopReading, 1);
+	pthread_mutex_lock(&m6f->waitLock);
+	pthread_cond_signal(&m6f->spaceCond);
+	pthread_mutex_unlock(&m6f->waitLock);
+	pthread_join(m6f->readThread, 0);
+	m6f->reading = 0;
+}
+
+static void freeMark6Ring(Mark6ReadBlock *ring, int nRing)
+{
+	int i;
+
+	if(ring)
+	{
+		for(i = 0; i < nRing; ++i)
+		{
+			free(ring[i].buffer);
+		}
+		free(ring);
+	}
+}
+
+/* (re)allocates the ring with nRing blocks, keeping unconsumed blocks.  Reader must be stopped.  Returns 0 on success */
+static int resizeMark6Ring(Mark6File *m6f, int nRing)
+{
+	Mark6ReadBlock *ring;
+	int pending, i;
+
+	pending = m6f->ringHead - m6f->ringTail;
+	if(nRing < pending)
+	{
+		nRing = pending;
+	}
+
+	ring = (Mark6ReadBlock *)calloc(nRing, sizeof(Mark6ReadBlock));
+	if(!ring)
+	{
+		return -1;
+	}
+	for(i = 0; i < pending; ++i)
+	{
+		Mark6ReadBlock *old = m6f->ring + (m6f->ringTail + i) % m6f->nRing;
+
+		ring[i] = *old;
+		old->buffer = 0;
+	}
+	for(i = pending; i < nRing; ++i)
+	{
+		ring[i].buffer = ring[i].data = allocMark6Buffer(m6f);
+		if(!ring[i].buffer)
+		{
+			for(; i > pending; --i)
+			{
+				free(ring[i-1].buffer);
+			}
+			/* give the pending blocks back */
+			for(i = 0; i < pending; ++i)
+			{
+				m6f->ring[(m6f->ringTail + i) % m6f->nRing].buffer = ring[i].buffer;
+			}
+			free(ring);
+
+			return -2;
+		}
+	}
+
+	freeMark6Ring(m6f->ring, m6f->nRing);
+	m6f->ring = ring;
+	m6f->nRing = nRing;
+	m6f->ringHead = pending;
+	m6f->ringTail = 0;
+
+	return 0;
+}
+
+struct seekArgs
+{
+	Mark6File *m6f;
+	off_t position;		/* SEEK_SET argument */
+	int nFile;		/* number of files in the fileset */
+	int restartReader;	/* if 0, leave reading to the caller (io_uring) */
+	int32_t targetBlock;	/* if >= 0, the exact block to start at, found from the block indexes */
+	int byTime;		/* if set, ignore the above and go to targetFrame */
+	uint64_t targetFrame;	/* vdifFrame() value */
+};
+
+#ifdef HAVE_IO_URING
+
+/* io_uring reader: one thread keeps block reads for all files of a gatherer queued in a single
+ * io_uring, replacing the per-file reader threads.  Each file's read-ahead ring is filled as before,
+ * with this thread as its single producer.  Block boundaries are only known once a block header has
+ * been read, so reads beyond the first outstanding one are placed assuming the next block is the size
+ * of the last; on a wrong guess the later reads are dropped and reading resumes at the right place.
+ * Files are opened a second time with O_DIRECT when the file system allows it.  Reads then start at
+ * the MARK6_IO_ALIGN boundary below the block and the payload is found within the buffer.
+ *
+ * The kernel interface is used directly (no liburing); IORING_OP_READ needs Linux 5.6 or newer. */
+
+typedef struct
+{
+	int fd;
+	off_t next;			/* file offset of the next block to request */
+	off_t done;			/* file offset just past the last published block */
+	int stride;			/* size assumed for blocks not yet seen */
+	unsigned int submitted;		/* ring blocks requested so far (count, like ringHead) */
+	unsigned int head;		/* local copy of ringHead */
+	int inFlight;
+	int resync;			/* a guess was wrong: requests from discardFrom on are ignored until inFlight is 0 */
+	unsigned int discardFrom;
+	off_t resyncOffset;
+	int eof;			/* request eofAt found the end of the file */
+	unsigned int eofAt;
+	off_t *offset;			/* [nRing] file offset of each requested block */
+	char *complete;			/* [nRing] set once a requested block has been read and checked */
+} Mark6UringFile;
+
+typedef struct
+{
+	Mark6Gatherer *m6g;
+	int ringFd;
+	unsigned int sqEntries;
+	unsigned int cqEntries;		/* reads in flight are kept to this so no completion can be dropped */
+	unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned int *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	void *sqMap, *cqMap;
+	size_t sqMapSize, cqMapSize, sqesMapSize;
+	unsigned int toSubmit;
+	int inFlight;
+	Mark6UringFile *files;
+	int stop;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;		/* the reader sleeps here when every ring is full */
+	pthread_cond_t cond;
+} Mark6Uring;
+
+static int setupMark6Uring(Mark6Uring *U, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	U->ringFd = syscall(__NR_io_uring_setup, entries, &p);
+	if(U->ringFd < 0)
+	{
+		return -1;
+	}
+
+	U->sqMapSize = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	U->cqMapSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	U->sqesMapSize = p.sq_entries*sizeof(struct io_uring_sqe);
+	U->sqMap = mmap(0, U->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, U->ringFd, IORING_OFF_SQ_RING);
+	U->cqMap = mmap(0, U->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, U->ringFd, IORING_OFF_CQ_RING);
+	U->sqes = (struct io_uring_sqe *)mmap(0, U->sqesMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, U->ringFd, IORING_OFF_SQES);
+	if(U->sqMap == MAP_FAILED || U->cqMap == MAP_FAILED || U->sqes == MAP_FAILED)
+	{
+		if(U->sqMap != MAP_FAILED) munmap(U->sqMap, U->sqMapSize);
+		if(U->cqMap != MAP_FAILED) munmap(U->cqMap, U->cqMapSize);
+		if(U->sqes != MAP_FAILED) munmap(U->sqes, U->sqesMapSize);
+		close(U->ringFd);
+
+		return -2;
+	}
+
+	U->sqEntries = p.sq_entries;
+	U->cqEntries = p.cq_entries;
+	U->sqHead = (unsigned int *)((char *)U->sqMap + p.sq_off.head);
+	U->sqTail = (unsigned int *)((char *)U->sqMap + p.sq_off.tail);
+	U->sqMask = (unsigned int *)((char *)U->sqMap + p.sq_off.ring_mask);
+	U->sqArray = (unsigned int *)((char *)U->sqMap + p.sq_off.array);
+	U->cqHead = (unsigned int *)((char *)U->cqMap + p.cq_off.head);
+	U->cqTail = (unsigned int *)((char *)U->cqMap + p.cq_off.tail);
+	U->cqMask = (unsigned int *)((char *)U->cqMap + p.cq_off.ring_mask);
+	U->cqes = (struct io_uring_cqe *)((char *)U->cqMap + p.cq_off.cqes);
+	U->toSubmit = 0;
+	U->inFlight = 0;
+
+	return 0;
+}
+
+static void teardownMark6Uring(Mark6Uring *U)
+{
+	munmap(U->sqes, U->sqesMapSize);
+	munmap(U->cqMap, U->cqMapSize);
+	munmap(U->sqMap, U->sqMapSize);
+	close(U->ringFd);
+}
+
+/* queues a read of the block at uf->next into ring block number uf->submitted.  Returns 0 if the submission queue is full
+ * or as many reads are in flight as the completion queue can hold */
+static int queueMark6UringRead(Mark6Uring *U, int fileIndex)
+{
+	Mark6File *F = U->m6g->mk6Files + fileIndex;
+	Mark6UringFile *uf = U->files + fileIndex;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, i;
+	off_t start;
+	int delta;
+
+	tail = *U->sqTail;
+	if(tail - __atomic_load_n(U->sqHead, __ATOMIC_ACQUIRE) >= U->sqEntries || (unsigned int)U->inFlight >= U->cqEntries)
+	{
+		return 0;
+	}
+
+	i = uf->submitted % F->nRing;
+	start = uf->next & ~(off_t)(MARK6_IO_ALIGN - 1);
+	delta = uf->next - start;
+
+	sqe = U->sqes + (tail & *U->sqMask);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = uf->fd;
+	sqe->off = start;
+	sqe->addr = (uint64_t)(uintptr_t)F->ring[i].buffer;
+	sqe->len = (delta + F->maxBlockSize + MARK6_IO_ALIGN - 1) & ~(MARK6_IO_ALIGN - 1);
+	sqe->user_data = ((uint64_t)fileIndex << 32) | uf->submitted;
+	U->sqArray[tail & *U->sqMask] = tail & *U->sqMask;
+	__atomic_store_n(U->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	uf->offset[i] = uf->next;
+	uf->complete[i] = 0;
+	uf->next += uf->stride;
+	++uf->submitted;
+	++uf->inFlight;
+	++U->inFlight;
+	++U->toSubmit;
+
+	return 1;
+}
+
+/* queues reads for every file with room in its ring.  Returns number queued */
+static int fillMark6Uring(Mark6Uring *U)
+{
+	int f, n = 0;
+
+	for(f = 0; f < U->m6g->nFile; ++f)
+	{
+		Mark6File *F = U->m6g->mk6Files + f;
+		Mark6UringFile *uf = U->files + f;
+
+		while(!uf->eof && !uf->resync && (int)(uf->submitted - loadMark6Counter(&F->ringTail)) < F->nRing)
+		{
+			if(!queueMark6UringRead(U, f))
+			{
+				return n;
+			}
+			++n;
+		}
+	}
+
+	return n;
+}
+
+static void endMark6UringFile(Mark6UringFile *uf, unsigned int seq)
+{
+	if(!uf->eof || seq < uf->eofAt)
+	{
+		uf->eof = 1;
+		uf->eofAt = seq;
+	}
+	if(!uf->resync || seq < uf->discardFrom)
+	{
+		uf->resync = 1;
+		uf->discardFrom = seq;
+		uf->resyncOffset = 0;
+	}
+}
+
+static void completeMark6UringRead(Mark6Uring *U, const struct io_uring_cqe *cqe)
+{
+	const int fileIndex = cqe->user_data >> 32;
+	const unsigned int seq = cqe->user_data & 0xFFFFFFFF;
+	Mark6File *F = U->m6g->mk6Files + fileIndex;
+	Mark6UringFile *uf = U->files + fileIndex;
+	Mark6ReadBlock *block;
+	unsigned int i;
+	int delta, avail, wb;
+
+	--uf->inFlight;
+	--U->inFlight;
+
+	if(uf->resync && seq >= uf->discardFrom)
+	{
+		return;
+	}
+
+	i = seq % F->nRing;
+	block = F->ring + i;
+	delta = uf->offset[i] & (MARK6_IO_ALIGN - 1);
+	avail = cqe->res - delta;
+
+	if(cqe->res < 0)
+	{
+		fprintf(stderr, "Error: Mark6 io_uring read of %s at offset %lld failed: %s\n", F->fileName, (long long)(uf->offset[i]), strerror(-cqe->res));
+		endMark6UringFile(uf, seq);
+
+		return;
+	}
+	if(avail < F->blockHeaderSize)
+	{
+		endMark6UringFile(uf, seq);
+
+		return;
+	}
+
+	block->header.wb_size = F->maxBlockSize;	/* version 1 block headers have no size */
+	memcpy(&block->header, block->buffer + delta, F->blockHeaderSize);
+	wb = block->header.wb_size;
+	if(wb <= F->blockHeaderSize || wb > F->maxBlockSize)
+	{
+		endMark6UringFile(uf, seq);
+
+		return;
+	}
+
+	block->data = block->buffer + delta + F->blockHeaderSize;
+	block->bytes = (avail < wb ? avail : wb) - F->blockHeaderSize;
+	uf->complete[i] = 1;
+
+	if(avail < wb)
+	{
+		/* partial block at end of file */
+		endMark6UringFile(uf, seq + 1);
+	}
+	else if(uf->submitted == seq + 1)
+	{
+		/* nothing placed after this block yet */
+		uf->next = uf->offset[i] + wb;
+		uf->stride = wb;
+	}
+	else if(uf->offset[(seq + 1) % F->nRing] != uf->offset[i] + wb)
+	{
+		uf->stride = wb;
+		if(!uf->resync || seq + 1 <= uf->discardFrom)
+		{
+			uf->resync = 1;
+			uf->discardFrom = seq + 1;
+			uf->resyncOffset = uf->offset[i] + wb;
+			if(uf->eof && uf->eofAt >= uf->discardFrom)
+			{
+				/* that end of file was seen at a wrong offset */
+				uf->eof = 0;
+			}
+		}
+	}
+}
+
+/* hands completed blocks to the gatherer in order */
+static void publishMark6UringFile(Mark6Uring *U, int fileIndex)
+{
+	Mark6File *F = U->m6g->mk6Files + fileIndex;
+	Mark6UringFile *uf = U->files + fileIndex;
+	unsigned int head = uf->head;
+
+	while(head != uf->submitted && !(uf->resync && head == uf->discardFrom) && uf->complete[head % F->nRing])
+	{
+		const Mark6ReadBlock *block = F->ring + head % F->nRing;
+
+		uf->complete[head % F->nRing] = 0;
+		uf->done = uf->offset[head % F->nRing] + block->header.wb_size;
+		++head;
+	}
+	if(head != uf->head)
+	{
+		uf->head = head;
+		storeMark6Counter(&F->ringHead, head);
+		wakeMark6Waiter(&F->gathererWaiting, &F->waitLock, &F->dataCond);
+	}
+
+	if(uf->resync && uf->inFlight == 0)
+	{
+		/* all requests past the bad guess are back; none are in flight, so their ring blocks can be reused */
+		if(uf->eof)
+		{
+			uf->submitted = uf->discardFrom;
+			if(head == uf->eofAt && !F->readDone)
+			{
+				storeMark6Flag(&F->readDone, 1);
+				wakeMark6Waiter(&F->gathererWaiting, &F->waitLock, &F->dataCond);
+			}
+		}
+		else
+		{
+			uf->submitted = uf->discardFrom;
+			uf->next = uf->resyncOffset;
+			uf->resync = 0;
+		}
+	}
+}
+
+static void reapMark6Uring(Mark6Uring *U)
+{
+	unsigned int head, tail;
+	int f;
+
+	head = *U->cqHead;
+	tail = __atomic_load_n(U->cqTail, __ATOMIC_ACQUIRE);
+	for(; head != tail; ++head)
+	{
+		completeMark6UringRead(U, U->cqes + (head & *U->cqMask));
+	}
+	__atomic_store_n(U->cqHead, head, __ATOMIC_RELEASE);
+
+	for(f = 0; f < U->m6g->nFile; ++f)
+	{
+		publishMark6UringFile(U, f);
+	}
+}
+
+static int enterMark6Uring(Mark6Uring *U, unsigned int minComplete)
+{
+	int v;
+
+	v = syscall(__NR_io_uring_enter, U->ringFd, U->toSubmit, minComplete, minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+	if(v >= 0)
+	{
+		U->toSubmit -= v;
+	}
+	else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	{
+		fprintf(stderr, "Error: Mark6 io_uring_enter failed: %s\n", strerror(errno));
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sleeps until some file's ring has room or the reader is stopped */
+static void waitMark6UringSpace(Mark6Uring *U)
+{
+	int f, ready = 0;
+
+	pthread_mutex_lock(&U->lock);
+	for(f = 0; f < U->m6g->nFile; ++f)
+	{
+		storeMark6Flag(&U->m6g->mk6Files[f].readerWaiting, 1);
+	}
+	while(!ready && !loadMark6Flag(&U->stop))
+	{
+		for(f = 0; f < U->m6g->nFile; ++f)
+		{
+			const Mark6File *F = U->m6g->mk6Files + f;
+			const Mark6UringFile *uf = U->files + f;
+
+			if(!uf->eof && !uf->resync && (int)(uf->submitted - loadMark6Counter(&F->ringTail)) < F->nRing)
+			{
+				ready = 1;
+			}
+		}
+		if(!ready)
+		{
+			pthread_cond_wait(&U->cond, &U->lock);
+		}
+	}
+	for(f = 0; f < U->m6g->nFile; ++f)
+	{
+		storeMark6Flag(&U->m6g->mk6Files[f].readerWaiting, 0);
+	}
+	pthread_mutex_unlock(&U->lock);
+}
+
+static void *mark6UringReader(void *arg)
+{
+	Mark6Uring *U = (Mark6Uring *)arg;
+
+	while(!loadMark6Flag(&U->stop))
+	{
+		fillMark6Uring(U);
+		if(U->inFlight == 0)
+		{
+			waitMark6UringSpace(U);
+
+			continue;
+		}
+		if(enterMark6Uring(U, 1) < 0)
+		{
+			break;
+		}
+		reapMark6Uring(U);
+	}
+
+	/* let outstanding reads land before their buffers can be touched again */
+	while(U->inFlight > 0)
+	{
+		if(enterMark6Uring(U, 1) < 0)
+		{
+			break;
+		}
+		reapMark6Uring(U);
+	}
+
+	return 0;
+}
+
+static int startMark6Uring(Mark6Uring *U)
+{
+	Mark6Gatherer *m6g = U->m6g;
+	unsigned int entries, total = 0;
+	int f;
+
+	U->files = (Mark6UringFile *)calloc(m6g->nFile, sizeof(Mark6UringFile));
+	if(!U->files)
+	{
+		return -1;
+	}
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		total += m6g->mk6Files[f].nRing;
+	}
+	for(entries = 1; entries < total && entries < 4096; entries *= 2);
+	if(setupMark6Uring(U, entries) < 0)
+	{
+		free(U->files);
+		U->files = 0;
+
+		return -2;
+	}
+
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		Mark6File *F = m6g->mk6Files + f;
+		Mark6UringFile *uf = U->files + f;
+
+		if(F->version < 0)
+		{
+			/* file failed to open */
+			uf->fd = -1;
+			uf->eof = 1;
+			F->readDone = 1;
+
+			continue;
+		}
+
+		uf->fd = open(F->fileName, O_RDONLY | O_DIRECT);
+		if(uf->fd < 0)
+		{
+			uf->fd = open(F->fileName, O_RDONLY);
+		}
+		uf->offset = (off_t *)calloc(F->nRing, sizeof(off_t));
+		uf->complete = (char *)calloc(F->nRing, 1);
+		uf->next = uf->done = ftello(F->in);
+		uf->stride = F->maxBlockSize;
+		uf->submitted = uf->head = F->ringHead;
+		if(uf->fd < 0 || !uf->offset || !uf->complete)
+		{
+			fprintf(stderr, "Error: startMark6Uring: cannot set up reading of %s\n", F->fileName);
+			endMark6UringFile(uf, uf->submitted);
+		}
+
+		F->stopReading = 0;
+		F->readDone = 0;
+		F->readerLock = &U->lock;
+		F->readerCond = &U->cond;
+	}
+
+	U->stop = 0;
+	if(pthread_create(&U->thread, 0, mark6UringReader, U) != 0)
+	{
+		for(f = 0; f < m6g->nFile; ++f)
+		{
+			if(U->files[f].fd >= 0)
+			{
+				close(U->files[f].fd);
+			}
+			free(U->files[f].offset);
+			free(U->files[f].complete);
+		}
+		free(U->files);
+		U->files = 0;
+		teardownMark6Uring(U);
+
+		return -3;
+	}
+	U->running = 1;
+
+	return 0;
+}
+
+/* stops the io_uring reader; blocks already read stay in the rings and each FILE is left positioned after them */
+static void stopMark6Uring(Mark6Uring *U)
+{
+	int f;
+
+	if(!U->running)
+	{
+		return;
+	}
+
+	storeMark6Flag(&U->stop, 1);
+	pthread_mutex_lock(&U->lock);
+	pthread_cond_signal(&U->cond);
+	pthread_mutex_unlock(&U->lock);
+	pthread_join(U->thread, 0);
+	U->running = 0;
+
+	for(f = 0; f < U->m6g->nFile; ++f)
+	{
+		Mark6File *F = U->m6g->mk6Files + f;
+		Mark6UringFile *uf = U->files + f;
+
+		if(F->in)
+		{
+			fseeko(F->in, uf->done, SEEK_SET);
+		}
+		if(uf->fd >= 0)
+		{
+			close(uf->fd);
+		}
+		free(uf->offset);
+		free(uf->complete);
+	}
+	free(U->files);
+	U->files = 0;
+	teardownMark6Uring(U);
+}
+
+static void deleteMark6Uring(Mark6Gatherer *m6g)
+{
+	Mark6Uring *U = (Mark6Uring *)m6g->uring;
+
+	stopMark6Uring(U);
+	pthread_mutex_destroy(&U->lock);
+	pthread_cond_destroy(&U->cond);
+	free(U);
+	m6g->uring = 0;
+}
+
+#endif
+
+/* stop and start whichever reader the gatherer uses */
+static void stopMark6GathererReaders(Mark6Gatherer *m6g)
+{
+	int f;
+
+#ifdef HAVE_IO_URING
+	if(m6g->uring)
+	{
+		stopMark6Uring((Mark6Uring *)m6g->uring);
+	}
+#endif
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		stopMark6Reader(m6g->mk6Files + f);
+	}
+}
+
+static void startMark6GathererReaders(Mark6Gatherer *m6g)
+{
+	int f;
+
+#ifdef HAVE_IO_URING
+	if(m6g->uring)
+	{
+		if(startMark6Uring((Mark6Uring *)m6g->uring) == 0)
+		{
+			return;
+		}
+		fprintf(stderr, "Warning: cannot restart Mark6 io_uring reader; reverting to one thread per file\n");
+		deleteMark6Uring(m6g);
+	}
+#endif
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		if(!m6g->mk6Files[f].readDone)
+		{
+			startMark6Reader(m6g->mk6Files + f);
+		}
+	}
+}
+
+/* Returns 0 on EOF */
+static ssize_t Mark6FileReadBlock(Mark6File *m6f, int slotIndex)
+{
+	Mark6BufferSlot *slot;
+	unsigned int tail = m6f->ringTail;
+
+	slot = m6f->slot + slotIndex;
+
+	if(loadMark6Counter(&m6f->ringHead) == tail && !loadMark6Flag(&m6f->readDone))
+	{
+		pthread_mutex_lock(&m6f->waitLock);
+		storeMark6Flag(&m6f->gathererWaiting, 1);
+		while(loadMark6Counter(&m6f->ringHead) == tail && !loadMark6Flag(&m6f->readDone))
+		{
+			pthread_cond_wait(&m6f->dataCond, &m6f->waitLock);
+		}
+		storeMark6Flag(&m6f->gathererWaiting, 0);
+		pthread_mutex_unlock(&m6f->waitLock);
+	}
+
+	if(loadMark6Counter(&m6f->ringHead) == tail)
+	{
+		/* reader has reached the end of the file */
+		slot->payloadBytes = 0;
+		slot->index = 0;
+		slot->frame = 0;
+	}
+	else
+	{
+		Mark6ReadBlock *block;
+		char *tmp;
+		vdif_header *vh;
+
+		block = m6f->ring + tail % m6f->nRing;
+
+		slot->payloadBytes = block->bytes - (block->bytes % m6f->packetSize);
+
+		memcpy(&slot->blockHeader, &block->header, m6f->blockHeaderSize);
+
+		/* swap buffers rather than copy; the ring gets the slot's spent buffer unless mark6GatherV() regions still point into it */
+		slot->data = block->data;
+		tmp = slot->buffer;
+		slot->buffer = block->buffer;
+		block->buffer = tmp;
+		if(slot->held)
+		{
+			char *spare = m6f->nSpare > 0 ? m6f->spareBuffers[--m6f->nSpare] : allocMark6Buffer(m6f);
+
+			if(spare && pushMark6Buffer(&m6f->heldBuffers, &m6f->nHeld, &m6f->heldAlloc, tmp) == 0)
+			{
+				block->buffer = spare;
+			}
+			else
+			{
+				fprintf(stderr, "Error: Mark6FileReadBlock: out of memory; data referenced by mark6GatherV() for %s will be overwritten\n", m6f->fileName);
+				free(spare);
+			}
+			slot->held = 0;
+		}
+
+		slot->index = 0;
+
+		vh = (vdif_header *)(slot->data);
+		slot->frame = vdifFrame(vh);
+
+		storeMark6Counter(&m6f->ringTail, tail + 1);
+		wakeMark6Waiter(&m6f->readerWaiting, m6f->readerLock, m6f->readerCond);
+	}
+
+	return slot->payloadBytes;
+}
+
+static void *mark6Seeker(void *arg)
+{
+	struct seekArgs *S = (struct seekArgs *)arg;
+	off_t pos;
+	int blockSize;
+	int targetBlock;
+	int slotIndex;
+	int i;
+
+	/*   1. stop the reader once any ongoing read completes */
+	stopMark6Reader(S->m6f);
+
+	/*   2. figure out where we need to be */ 
+	if(S->byTime)
+	{
+		pos = findMark6FileTime(S->m6f, S->targetFrame);
+	}
+	else if(S->position == 0)
+	{
+		pos = sizeof(Mark6Header);
+	}
+	else if(S->targetBlock >= 0)
+	{
+		pos = findMark6IndexBlock(S->m6f, S->targetBlock);
+	}
+	else
+	{
+		blockSize = S->m6f->maxBlockSize - ((S->m6f->maxBlockSize-S->m6f->blockHeaderSize) % S->m6f->packetSize);
+		targetBlock = S->position/(blockSize - S->m6f->blockHeaderSize);
+		pos = sizeof(Mark6Header) + blockSize*(targetBlock/S->nFile);
+
+		if(pos >= S->m6f->stat.st_size)
+		{
+			targetBlock = S->m6f->stat.st_size/(blockSize - S->m6f->blockHeaderSize)/S->nFile;
+			pos = sizeof(Mark6Header) + blockSize*targetBlock;
+		}
+
+		/* Iterate up to 5 times to get a better position */
+		for(i = 0; i < 5; ++i)
+		{
+			int32_t block;
+			int deltaBlock;
+
+			fseeko(S->m6f->in, pos, SEEK_SET);
+			fread(&block, sizeof(int32_t), 1, S->m6f->in);
+
+			deltaBlock = block - targetBlock;
+
+			/* if it is within 4 blocks of the target and positioned earlier than that, then call it good enough */
+			if(deltaBlock <= 0 && deltaBlock > -(4*S->nFile))
+			{
+				break;
+			}
+
+			if(deltaBlock < S->nFile && deltaBlock > 0)
+			{
+				pos -= blockSize;
+			}
+			else
+			{
+				pos -= blockSize * (deltaBlock/S->nFile);
+			}
+		}
+	}
+
+	/*   3. reposition the file at the correct location */
+	fseeko(S->m6f->in, pos, SEEK_SET);
+
+	/*   4. discard what was read ahead and restart the reader thread */
+	S->m6f->ringHead = S->m6f->ringTail = 0;
+	if(!S->restartReader)
+	{
+		return 0;
+	}
+	startMark6Reader(S->m6f);
+
+	/*   5. explicitly load the next block for each slot */
+	for(slotIndex = 0; slotIndex < MARK6_BUFFER_SLOTS; ++slotIndex)
+	{
+		Mark6FileReadBlock(S->m6f, slotIndex);
+	}
+
+	return 0;
+}
+
+static void deallocateMark6File(Mark6File *m6f)
+{
+	int s;
+
+	if(m6f->in)
+	{
+		fclose(m6f->in);
+		m6f->in = 0;
+	}
+	if(m6f->fileName)
+	{
+		free(m6f->fileName);
+		m6f->fileName = 0;
+	}
+	for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+	{
+		if(m6f->slot[s].buffer)
+		{
+			free(m6f->slot[s].buffer);
+			m6f->slot[s].buffer = 0;
+			m6f->slot[s].data = 0;
+		}
+	}
+	freeMark6Ring(m6f->ring, m6f->nRing);
+	m6f->ring = 0;
+	m6f->nRing = 0;
+	freeMark6Buffers(&m6f->heldBuffers, &m6f->nHeld, &m6f->heldAlloc);
+	freeMark6Buffers(&m6f->spareBuffers, &m6f->nSpare, &m6f->spareAlloc);
+	free(m6f->blockIndex);
+	m6f->blockIndex = 0;
+	m6f->nBlockIndex = 0;
+	m6f->version = -1;
+}
+
+/* the lock and conditions the reader and gatherer sleep on.  POSIX does not allow these to be moved or copied, so a file
+ * that is to be moved must have them destroyed first and initialized again at its new address */
+static void initMark6FileSync(Mark6File *m6f)
+{
+	pthread_mutex_init(&m6f->waitLock, 0);
+	pthread_cond_init(&m6f->dataCond, 0);
+	pthread_cond_init(&m6f->spaceCond, 0);
+}
+
+static void destroyMark6FileSync(Mark6File *m6f)
+{
+	pthread_mutex_destroy(&m6f->waitLock);
+	pthread_cond_destroy(&m6f->dataCond);
+	pthread_cond_destroy(&m6f->spaceCond);
+}
+
+/* this assumes *m6f is already allocated but that the structures within are not. */
+/* no attempt is made here to free existing data */
+
+/* returns 0 on success, or error code otherwise */
+int openMark6File(Mark6File *m6f, const char *filename)
+{
+	Mark6Header header;
+	int slotIndex;
+
+	m6f->ring = 0;
+	m6f->nRing = 0;
+	m6f->reading = 0;
+	m6f->heldBuffers = m6f->spareBuffers = 0;
+	m6f->nHeld = m6f->heldAlloc = m6f->nSpare = m6f->spareAlloc = 0;
+	m6f->blockIndex = 0;
+	m6f->nBlockIndex = 0;
+
+	stat(filename, &m6f->stat);
+	m6f->in = fopen(filename, "r");
+	if(!m6f->in)
+	{
+		deallocateMark6File(m6f);
+
+		return -1;
+	}
+	m6f->fileName = strdup(filename);
+	fread(&header, sizeof(header), 1, m6f->in);
+	m6f->version = header.version;
+	m6f->blockHeaderSize = mark6BlockHeaderSize(header.version);
+	if(m6f->blockHeaderSize <= 0)
+	{
+		deallocateMark6File(m6f);
+
+		return -2;
+	}
+	m6f->maxBlockSize = header.block_size;
+	m6f->packetSize = header.packet_size;
+	m6f->ringHead = m6f->ringTail = 0;
+	if(resizeMark6Ring(m6f, MARK6_DEFAULT_READAHEAD) < 0)
+	{
+		deallocateMark6File(m6f);
+
+		return -5;
+	}
+
+	if(loadMark6FileIndex(m6f) == 0 && m6f->nBlockIndex >= 2)
+	{
+		m6f->block1 = m6f->blockIndex[0].blocknum;
+		m6f->block2 = m6f->blockIndex[1].blocknum;
+	}
+	else if(getFirstBlocks(m6f) < 0)
+	{
+		deallocateMark6File(m6f);
+
+		return -4;
+	}
+
+	for(slotIndex = 0; slotIndex < MARK6_BUFFER_SLOTS; ++slotIndex)
+	{
+		Mark6BufferSlot *slot;
+
+		slot = m6f->slot + slotIndex;
+
+		slot->buffer = slot->data = allocMark6Buffer(m6f);
+		if(!slot->buffer)
+		{
+			deallocateMark6File(m6f);
+
+			return -3;
+		}
+
+		slot->blockHeader.blocknum = -1;
+		slot->blockHeader.wb_size = m6f->maxBlockSize;
+
+		slot->payloadBytes = 0;	/* nothing read yet */
+	}
+
+	/* start reading thread */
+	initMark6FileSync(m6f);
+	if(startMark6Reader(m6f) < 0)
+	{
+		destroyMark6FileSync(m6f);
+		deallocateMark6File(m6f);
+
+		return -6;
+	}
+
+	return 0;
+}
+
+/* m6f is not freed itself in this call, but all internal structures are freed. */
+int closeMark6File(Mark6File *m6f)
+{
+	if(!m6f)
+	{
+		fprintf(stderr, "Error: closeMark6File called with null pointer\n");
+
+		return -1;
+	}
+	if(m6f->in)
+	{
+		stopMark6Reader(m6f);
+		destroyMark6FileSync(m6f);
+	}
+
+	deallocateMark6File(m6f);
+
+	return 0;
+}
+
+void printMark6File(const Mark6File *m6f)
+{
+	printf("Mark6 file:\n");
 	if(m6f == 0)
 	{
-		printf("  Null\n");
+		printf("  Null\n");
+	}
+	else
+	{
+		int s;
+		printf("  Filename = %s\n", m6f->fileName);
+		printf("  Mark6 version = %d\n", m6f->version);
+		printf("  Max block size = %d\n", m6f->maxBlockSize);
+		printf("  Block header size = %d\n", m6f->blockHeaderSize);
+		printf("  First two block numbers = %d, %d\n", m6f->block1, m6f->block2);
+		printf("  File size = %lld\n", (long long)(m6f->stat.st_size));
+		printf("  Packet size = %d\n", m6f->packetSize);
+		printf("  Read-ahead = %d blocks, %u ready\n", m6f->nRing, loadMark6Counter(&m6f->ringHead) - m6f->ringTail);
+		printf("  Indexed blocks = %d\n", m6f->nBlockIndex);
+
+		for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+		{
+			printf("  Slot %d\n", s);
+			printf("    Payload bytes = %d (bytes currently residing in core)\n", m6f->slot[s].payloadBytes);
+			printf("    Current block number = %d\n", m6f->slot[s].blockHeader.blocknum);
+			printf("    Current index within block = %d\n", m6f->slot[s].index);
+			printf("    Second = %d\n", (int)(m6f->slot[s].frame >> 24));
+			printf("    Frame in second = %d\n", (int)(m6f->slot[s].frame & 0xFFFFFF));
+		}
+	}
+}
+
+
+Mark6Gatherer *newMark6Gatherer()
+{
+	Mark6Gatherer *m6g;
+
+	m6g = (Mark6Gatherer *)calloc(1, sizeof(Mark6Gatherer));
+	if(!m6g)
+	{
+		fprintf(stderr, "Error: cannot allocate %d bytes for Mark6Gatherer\n", (int)(sizeof(Mark6Gatherer)));
+
+		return 0;
+	}
+
+	m6g->nFile = 0;
+	m6g->mk6Files = 0;
+	m6g->packetSize = 0;
+	m6g->mergeHeap = 0;
+	m6g->mergeHeapSize = 0;
+
+	return m6g;
+}
+
+off_t getMark6GathererFileSize(const Mark6Gatherer *m6g)
+{
+	off_t size = 0;
+	int i;
+
+	for(i = 0; i < m6g->nFile; ++i)
+	{
+		size += m6g->mk6Files[i].stat.st_size;
+	}
+
+	return size;
+}
+
+Mark6Gatherer *openMark6Gatherer(int nFile, char **fileList)
+{
+	Mark6Gatherer *m6g;
+	int nBad;
+
+	m6g = newMark6Gatherer();
+	if(!m6g)
+	{
+		fprintf(stderr, "Error: cannot create empty Mark6Gatherer\n");
+
+		return 0;
+	}
+
+	nBad = addMark6GathererFiles(m6g, nFile, fileList);
+	if(nBad > 0)
+	{
+		fprintf(stderr, "Cannot create Mark6Gatherer because %d/%d files could not be opened\n", nBad, nFile);
+		closeMark6Gatherer(m6g);
+
+		return 0;
+	}
+	m6g->packetSize = m6g->mk6Files[0].packetSize;
+
+	if(getenv("MARK6_INDEX") && atoi(getenv("MARK6_INDEX")) > 0)
+	{
+		indexMark6Gatherer(m6g, 1);
+	}
+
+	if(getenv("MARK6_IOURING") && atoi(getenv("MARK6_IOURING")) > 0)
+	{
+		setMark6GathererIOUring(m6g, 1);
+	}
+
+	return m6g;
+}
+
+/* pass, e.g., /mnt/disks/?/?/data/exp1_stn1_scan1.vdif */
+Mark6Gatherer *openMark6GathererFromTemplate(const char *fileTemplate)
+{
+	const int MaxFilenameSize = 256;
+	char fileName[MaxFilenameSize];
+	glob_t G;
+	int v;
+	Mark6Gatherer *m6g;
+
+	if(fileTemplate[0] == '/')
+	{
+		snprintf(fileName, MaxFilenameSize, "%s", fileTemplate);
+	}
+	else
+	{
+		snprintf(fileName, MaxFilenameSize, "%s/%s", getMark6Root(), fileTemplate);
+	}
+
+	v = glob(fileName, GLOB_NOSORT, 0, &G);
+	if(v == 0)
+	{
+		char **files;
+		size_t i, n;
+
+		/* a template may also match the block indexes next to the files */
+		files = (char **)malloc(G.gl_pathc*sizeof(char *));
+		for(i = n = 0; files && i < G.gl_pathc; ++i)
+		{
+			if(!isMark6IndexFileName(G.gl_pathv[i]))
+			{
+				files[n++] = G.gl_pathv[i];
+			}
+		}
+		m6g = files ? openMark6Gatherer(n, files) : 0;
+
+		free(files);
+		globfree(&G);
+	}
+	else
+	{
+		fprintf(stderr, "Cannot create Mark6Gatherer because %s matched no files\n", fileName);
+
+		return 0;
+	}
+
+	if(m6g)
+	{
+		if(m6g->nFile == 0)
+		{
+			closeMark6Gatherer(m6g);
+
+			return 0;
+		}
+
+		m6g->packetSize = m6g->mk6Files[0].packetSize;
+	}
+
+	return m6g;
+}
+
+int addMark6GathererFiles(Mark6Gatherer *m6g, int nFile, char **fileList)
+{
+	Mark6File *files;
+	int i;
+	int nBad = 0;
+	int startFile;
+
+	/* the realloc below may move the files from under their readers, and takes their lock and conditions with them */
+	stopMark6GathererReaders(m6g);
+	for(i = 0; i < m6g->nFile; ++i)
+	{
+		if(m6g->mk6Files[i].in)
+		{
+			destroyMark6FileSync(m6g->mk6Files + i);
+		}
+	}
+
+	startFile = m6g->nFile;
+
+	files = (Mark6File *)realloc(m6g->mk6Files, (startFile + nFile)*sizeof(Mark6File));
+	if(files)
+	{
+		m6g->mk6Files = files;
+		m6g->nFile += nFile;
+		memset(m6g->mk6Files + startFile, 0, nFile*sizeof(Mark6File));
 	}
 	else
+	{
+		fprintf(stderr, "Error: cannot (re)allocate %d * %d bytes for Mark6Files\n", startFile + nFile, (int)sizeof(Mark6File));
+		nBad = nFile;
+		nFile = 0;
+	}
+	for(i = 0; i < startFile; ++i)
+	{
+		Mark6File *m6f = m6g->mk6Files + i;
+
+		if(m6f->in)
+		{
+			/* readers that get restarted repoint these; finished ones must not be left pointing at the old copy */
+			initMark6FileSync(m6f);
+			m6f->readerLock = &m6f->waitLock;
+			m6f->readerCond = &m6f->spaceCond;
+		}
+	}
+	if(nFile == 0)
+	{
+		startMark6GathererReaders(m6g);
+
+		return nBad;
+	}
+
+	for(i = 0; i < nFile; ++i)
+	{
+		int v;
+
+		v = openMark6File(m6g->mk6Files + startFile + i, fileList[i]);
+
+		if(v < 0)
+		{
+			fprintf(stderr, "Mark6 file %s cannot be opened.  Error code = %d\n", fileList[i], v);
+			++nBad;
+		}
+		else
+		{
+			/* its reader thread has started; the io_uring reader takes over below if in use */
+			if(m6g->uring)
+			{
+				stopMark6Reader(m6g->mk6Files + startFile + i);
+			}
+		}
+	}
+	startMark6GathererReaders(m6g);
+
+	for(i = startFile; i < m6g->nFile; ++i)
 	{
 		int s;
-		printf("  Filename = %s\n", m6f->fileName);
-		printf("  Mark6 version = %d\n", m6f->version);
-		printf("  Max block size = %d\n", m6f->maxBlockSize);
-		printf("  Block header size = %d\n", m6f->blockHeaderSize);
-		printf("  First two block numbers = %d, %d\n", m6f->block1, m6f->block2);
-		printf("  File size = %lld\n", (long long)(m6f->stat.st_size));
-		printf("  Packet size = %d\n", m6f->packetSize);
 
+		if(m6g->mk6Files[i].version < 0)
+		{
+			continue;	/* not opened */
+		}
 		for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
 		{
-			printf("  Slot %d\n", s);
-			printf("    Payload bytes = %d (bytes currently residing in core)\n", m6f->slot[s].payloadBytes);
-			printf("    Current block number = %d\n", m6f->slot[s].blockHeader.blocknum);
-			printf("    Current index within block = %d\n", m6f->slot[s].index);
-			printf("    Second = %d\n", (int)(m6f->slot[s].frame >> 24));
-			printf("    Frame in second = %d\n", (int)(m6f->slot[s].frame & 0xFFFFFF));
+			Mark6FileReadBlock(m6g->mk6Files + i, s);
 		}
 	}
+	m6g->packetSize = m6g->mk6Files[0].packetSize;
+
+	return nBad;
 }
 
+/* return 1 if all files are present (with no extras) and 0 otherwise */
+int isMark6GatherComplete(const Mark6Gatherer *m6g)
+{
+	int f;
+	int a = 0, b = 1000000;
 
-Mark6Gatherer *newMark6Gatherer()
+	if(m6g->nFile == 0)
+	{
+		return 0;
+	}
+
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		if(m6g->mk6Files[f].block1 > a)
+		{
+			a = m6g->mk6Files[f].block1;
+		}
+		if(m6g->mk6Files[f].block2 < b)
+		{
+			b = m6g->mk6Files[f].block2;
+		}
+	}
+
+	if(b == a+1 && b == m6g->nFile)
+	{
+		return 1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+int closeMark6Gatherer(Mark6Gatherer *m6g)
 {
-	Mark6Gatherer *m6g;
+	int i;
 
-	m6g = (Mark6Gatherer *)calloc(1, sizeof(Mark6Gatherer));
 	if(!m6g)
 	{
-		fprintf(stderr, "Error: cannot allocate %d bytes for Mark6Gatherer\n", (int)(sizeof(Mark6Gatherer)));
+		fprintf(stderr, "Error: closeMark6Gatherer called with null pointer\n");
 
-		return 0;
+		return -1;
+	}
+	stopMark6GathererReaders(m6g);
+#ifdef HAVE_IO_URING
+	if(m6g->uring)
+	{
+		deleteMark6Uring(m6g);
+	}
+#endif
+	for(i = 0; i < m6g->nFile; ++i)
+	{
+		closeMark6File(m6g->mk6Files + i);
 	}
 
-	m6g->nFile = 0;
+	free(m6g->mk6Files);
 	m6g->mk6Files = 0;
-	m6g->packetSize = 0;
 
-	return m6g;
+	m6g->nFile = 0;
+
+	free(m6g->mergeHeap);
+	free(m6g);
+
+	return 0;
 }
 
-off_t getMark6GathererFileSize(const Mark6Gatherer *m6g)
+void printMark6Gatherer(const Mark6Gatherer *m6g)
 {
-	off_t size = 0;
 	int i;
 
-	for(i = 0; i < m6g->nFile; ++i)
+	printf("Mark6Gatherer:\n");
+	if(m6g == 0)
 	{
-		size += m6g->mk6Files[i].stat.st_size;
+		printf("  Null\n");
 	}
+	else
+	{
+		printf("  packetSize = %d\n", m6g->packetSize);
+		printf("  nFile = %d\n", m6g->nFile);
+		for(i = 0; i < m6g->nFile; ++i)
+		{
+			printMark6File(m6g->mk6Files + i);
+		}
+	}
+}
 
-	return size;
+/* returns the number of the block containing byte position of the gathered stream, or -1 unless all files are indexed */
+static int32_t findMark6GathererBlock(const Mark6Gatherer *m6g, off_t position)
+{
+	int32_t a, b;
+	int f;
+
+	if(m6g->nFile == 0 || !m6g->mk6Files[0].blockIndex)
+	{
+		return -1;
+	}
+	a = m6g->mk6Files[0].blockIndex[0].blocknum;
+	b = a + 1;
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		const Mark6File *F = m6g->mk6Files + f;
+
+		if(!F->blockIndex)
+		{
+			return -1;
+		}
+		if(F->blockIndex[0].blocknum < a)
+		{
+			a = F->blockIndex[0].blocknum;
+		}
+		if(F->blockIndex[F->nBlockIndex-1].blocknum >= b)
+		{
+			b = F->blockIndex[F->nBlockIndex-1].blocknum + 1;
+		}
+	}
+
+	/* find the last block number whose preceding blocks hold no more than position bytes */
+	while(a + 1 < b)
+	{
+		int32_t m = a + (b - a)/2;
+		int64_t before = 0;
+
+		for(f = 0; f < m6g->nFile; ++f)
+		{
+			before += getMark6IndexPayloadBefore(m6g->mk6Files + f, m);
+		}
+		if(before <= position)
+		{
+			a = m;
+		}
+		else
+		{
+			b = m;
+		}
+	}
+
+	return a;
 }
 
-Mark6Gatherer *openMark6Gatherer(int nFile, char **fileList)
+/* repositions every file as proto describes, in parallel */
+static void runMark6Seekers(Mark6Gatherer *m6g, const struct seekArgs *proto)
 {
-	Mark6Gatherer *m6g;
-	int nBad;
+	pthread_attr_t attr;
+	pthread_t *seekThread;
+	struct seekArgs *S;
+	int t;
 
-	m6g = newMark6Gatherer();
-	if(!m6g)
+	if(m6g->uring)
 	{
-		fprintf(stderr, "Error: cannot create empty Mark6Gatherer\n");
+		stopMark6GathererReaders(m6g);
+	}
 
-		return 0;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	seekThread = (pthread_t *)malloc(m6g->nFile*sizeof(pthread_t));
+	S = (struct seekArgs *)malloc(m6g->nFile*sizeof(struct seekArgs));
+
+	for(t = 0; t < m6g->nFile; ++t)
+	{
+		S[t] = *proto;
+		S[t].m6f = &m6g->mk6Files[t];
+		S[t].nFile = m6g->nFile;
+		S[t].restartReader = !m6g->uring;
+		pthread_create(seekThread + t, &attr, mark6Seeker, S + t);
 	}
 
-	nBad = addMark6GathererFiles(m6g, nFile, fileList);
-	if(nBad > 0)
+	pthread_attr_destroy(&attr);
+
+	for(t = 0; t < m6g->nFile; ++t)
 	{
-		fprintf(stderr, "Cannot create Mark6Gatherer because %d/%d files could not be opened\n", nBad, nFile);
-		closeMark6Gatherer(m6g);
+		pthread_join(seekThread[t], 0);
+	}
 
-		return 0;
+	free(seekThread);
+	free(S);
+
+	if(m6g->uring)
+	{
+		int s;
+
+		startMark6GathererReaders(m6g);
+		for(t = 0; t < m6g->nFile; ++t)
+		{
+			for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+			{
+				Mark6FileReadBlock(m6g->mk6Files + t, s);
+			}
+		}
+	}
+}
+
+int seekMark6Gather(Mark6Gatherer *m6g, off_t position)
+{
+	struct seekArgs proto;
+
+	if(!m6g)
+	{
+		return -1;
+	}
+	if(position >= getMark6GathererFileSize(m6g))
+	{
+		return -2;
 	}
-	m6g->packetSize = m6g->mk6Files[0].packetSize;
 
-	return m6g;
+	memset(&proto, 0, sizeof(proto));
+	proto.position = position;
+	proto.targetBlock = findMark6GathererBlock(m6g, position);
+	runMark6Seekers(m6g, &proto);
+
+	return 0;
 }
 
-/* pass, e.g., /mnt/disks/?/?/data/exp1_stn1_scan1.vdif */
-Mark6Gatherer *openMark6GathererFromTemplate(const char *fileTemplate)
+int seekMark6GatherTime(Mark6Gatherer *m6g, int second, int frame)
 {
-	const int MaxFilenameSize = 256;
-	char fileName[MaxFilenameSize];
-	glob_t G;
-	int v;
-	Mark6Gatherer *m6g;
+	struct seekArgs proto;
+	int f, s, nData = 0;
 
-	if(fileTemplate[0] == '/')
-	{
-		snprintf(fileName, MaxFilenameSize, "%s", fileTemplate);
-	}
-	else
+	if(!m6g)
 	{
-		snprintf(fileName, MaxFilenameSize, "%s/%s", getMark6Root(), fileTemplate);
+		return -1;
 	}
 
-	v = glob(fileName, GLOB_NOSORT, 0, &G);
-	if(v == 0)
-	{
-		m6g = openMark6Gatherer(G.gl_pathc, G.gl_pathv);
+	memset(&proto, 0, sizeof(proto));
+	proto.byTime = 1;
+	proto.targetFrame = ((uint64_t)second << 24) | frame;
+	runMark6Seekers(m6g, &proto);
 
-		globfree(&G);
-	}
-	else
+	/* each file now starts at the block holding the time; drop the packets before it */
+	for(f = 0; f < m6g->nFile; ++f)
 	{
-		fprintf(stderr, "Cannot create Mark6Gatherer because %s matched no files\n", fileName);
-
-		return 0;
-	}
+		Mark6File *F = m6g->mk6Files + f;
 
-	if(m6g)
-	{
-		if(m6g->nFile == 0)
+		for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
 		{
-			closeMark6Gatherer(m6g);
+			Mark6BufferSlot *slot = F->slot + s;
 
-			return 0;
+			while(slot->payloadBytes > 0 && slot->frame < proto.targetFrame)
+			{
+				slot->index += m6g->packetSize;
+				if(slot->index >= slot->payloadBytes)
+				{
+					Mark6FileReadBlock(F, s);
+				}
+				else
+				{
+					slot->frame = vdifFrame((vdif_header *)(slot->data + slot->index));
+				}
+			}
+			if(slot->payloadBytes > 0)
+			{
+				++nData;
+			}
 		}
-
-		m6g->packetSize = m6g->mk6Files[0].packetSize;
 	}
 
-	return m6g;
+	return (nData > 0) ? 0 : -2;
 }
 
-int addMark6GathererFiles(Mark6Gatherer *m6g, int nFile, char **fileList)
+struct indexArgs
 {
-	int i;
-	int nBad = 0;
-	int startFile;
+	Mark6File *m6f;
+	int save;
+	int started;		/* a thread is running the scan */
+	int rv;
+};
 
-	startFile = m6g->nFile;
-	m6g->nFile += nFile;
+static void *mark6Indexer(void *arg)
+{
+	struct indexArgs *A = (struct indexArgs *)arg;
 
-	m6g->mk6Files = (Mark6File *)realloc(m6g->mk6Files, m6g->nFile*sizeof(Mark6File));
-	if(!m6g->mk6Files)
+	A->rv = scanMark6FileIndex(A->m6f);
+	if(A->rv == 0 && A->save)
 	{
-		fprintf(stderr, "Error: cannot (re)allocate %d * %d bytes for Mark6Files\n", nFile, (int)sizeof(Mark6File));
-	
-		return 0;
+		saveMark6FileIndex(A->m6f);
 	}
-	memset(m6g->mk6Files + startFile, 0, nFile*sizeof(Mark6File));
 
-	for(i = 0; i < nFile; ++i)
+	return 0;
+}
+
+int indexMark6Gatherer(Mark6Gatherer *m6g, int save)
+{
+	pthread_t *indexThread;
+	struct indexArgs *A;
+	int t, nIndexed = 0;
+
+	if(!m6g)
 	{
-		int v;
+		return -1;
+	}
 
-		v = openMark6File(m6g->mk6Files + startFile + i, fileList[i]);
+	indexThread = (pthread_t *)malloc(m6g->nFile*sizeof(pthread_t));
+	A = (struct indexArgs *)calloc(m6g->nFile, sizeof(struct indexArgs));
+	if(!indexThread || !A)
+	{
+		free(indexThread);
+		free(A);
 
-		if(v < 0)
-		{
-			fprintf(stderr, "Mark6 file %s cannot be opened.  Error code = %d\n", fileList[i], v);
-			++nBad;
-		}
-		else
+		return -2;
+	}
+
+	/* the files are normally on separate disks, so scan them all at once */
+	for(t = 0; t < m6g->nFile; ++t)
+	{
+		A[t].m6f = &m6g->mk6Files[t];
+		A[t].save = save;
+		A[t].rv = -1;
+		if(A[t].m6f->version >= 0 && !A[t].m6f->blockIndex)
 		{
-			int s;
-			for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+			A[t].started = (pthread_create(indexThread + t, 0, mark6Indexer, A + t) == 0);
+			if(!A[t].started)
 			{
-				Mark6FileReadBlock(m6g->mk6Files + i, s);
+				mark6Indexer(A + t);
 			}
 		}
 	}
-	m6g->packetSize = m6g->mk6Files[0].packetSize;
+	for(t = 0; t < m6g->nFile; ++t)
+	{
+		if(A[t].started)
+		{
+			pthread_join(indexThread[t], 0);
+		}
+		if(A[t].rv == 0)
+		{
+			++nIndexed;
+		}
+	}
 
-	return nBad;
+	free(indexThread);
+	free(A);
+
+	return nIndexed;
 }
 
-/* return 1 if all files are present (with no extras) and 0 otherwise */
-int isMark6GatherComplete(const Mark6Gatherer *m6g)
+int setMark6GathererReadAhead(Mark6Gatherer *m6g, int nBlock)
 {
-	int f;
-	int a = 0, b = 1000000;
+	int f, rv = 0;
 
-	if(m6g->nFile == 0)
+	if(!m6g)
 	{
-		return 0;
+		return -1;
+	}
+	if(nBlock < 1)
+	{
+		fprintf(stderr, "Error: setMark6GathererReadAhead: read-ahead must be at least 1 block; %d given\n", nBlock);
+
+		return -2;
 	}
 
+	stopMark6GathererReaders(m6g);
 	for(f = 0; f < m6g->nFile; ++f)
 	{
-		if(m6g->mk6Files[f].block1 > a)
-		{
-			a = m6g->mk6Files[f].block1;
-		}
-		if(m6g->mk6Files[f].block2 < b)
+		Mark6File *F = m6g->mk6Files + f;
+
+		if(resizeMark6Ring(F, nBlock) < 0)
 		{
-			b = m6g->mk6Files[f].block2;
+			fprintf(stderr, "Error: setMark6GathererReadAhead: cannot allocate %d blocks for %s\n", nBlock, F->fileName);
+			rv = -3;
 		}
 	}
+	startMark6GathererReaders(m6g);
 
-	if(b == a+1 && b == m6g->nFile)
+	return rv;
+}
+
+int setMark6GathererIOUring(Mark6Gatherer *m6g, int useIOUring)
+{
+	if(!m6g)
 	{
-		return 1;
+		return -1;
 	}
-	else
+	if(!useIOUring == !m6g->uring)
 	{
 		return 0;
 	}
-}
-
-int closeMark6Gatherer(Mark6Gatherer *m6g)
-{
-	int i;
 
-	if(!m6g)
+#ifdef HAVE_IO_URING
+	if(useIOUring)
 	{
-		fprintf(stderr, "Error: closeMark6Gatherer called with null pointer\n");
+		Mark6Uring *U;
 
-		return -1;
+		U = (Mark6Uring *)calloc(1, sizeof(Mark6Uring));
+		if(!U)
+		{
+			return -2;
+		}
+		U->m6g = m6g;
+		pthread_mutex_init(&U->lock, 0);
+		pthread_cond_init(&U->cond, 0);
+
+		stopMark6GathererReaders(m6g);
+		if(startMark6Uring(U) < 0)
+		{
+			fprintf(stderr, "Warning: setMark6GathererIOUring: io_uring is not usable; keeping one reader thread per file\n");
+			pthread_mutex_destroy(&U->lock);
+			pthread_cond_destroy(&U->cond);
+			free(U);
+			startMark6GathererReaders(m6g);
+
+			return -3;
+		}
+		m6g->uring = U;
 	}
-	for(i = 0; i < m6g->nFile; ++i)
+	else
 	{
-		closeMark6File(m6g->mk6Files + i);
+		deleteMark6Uring(m6g);
+		startMark6GathererReaders(m6g);
 	}
 
-	free(m6g->mk6Files);
-	m6g->mk6Files = 0;
+	return 0;
+#else
+	fprintf(stderr, "Warning: setMark6GathererIOUring: this vdifio was built without io_uring support\n");
 
-	m6g->nFile = 0;
+	return -4;
+#endif
+}
 
-	free(m6g);
+/* The gather is a k-way merge of all slots of all files by frame.  Slots are kept in a binary min-heap of
+ * slot numbers (fileIndex*MARK6_BUFFER_SLOTS + slotIndex) ordered by frame, ties going to the lower slot
+ * number, so the order is the same as a scan over files and slots would give. */
 
-	return 0;
+static inline Mark6BufferSlot *mark6HeapSlot(const Mark6Gatherer *m6g, int e)
+{
+	return m6g->mk6Files[e / MARK6_BUFFER_SLOTS].slot + (e % MARK6_BUFFER_SLOTS);
 }
 
-void printMark6Gatherer(const Mark6Gatherer *m6g)
+static inline int mark6HeapBefore(const Mark6Gatherer *m6g, int a, int b)
 {
-	int i;
+	uint64_t fa = mark6HeapSlot(m6g, a)->frame;
+	uint64_t fb = mark6HeapSlot(m6g, b)->frame;
 
-	printf("Mark6Gatherer:\n");
-	if(m6g == 0)
-	{
-		printf("  Null\n");
-	}
-	else
+	return fa < fb || (fa == fb && a < b);
+}
+
+static void siftDownMark6Heap(const Mark6Gatherer *m6g, int *heap, int nHeap, int i)
+{
+	int e = heap[i];
+
+	for(;;)
 	{
-		printf("  packetSize = %d\n", m6g->packetSize);
-		printf("  nFile = %d\n", m6g->nFile);
-		for(i = 0; i < m6g->nFile; ++i)
+		int c = 2*i + 1;
+
+		if(c >= nHeap)
 		{
-			printMark6File(m6g->mk6Files + i);
+			break;
+		}
+		if(c + 1 < nHeap && mark6HeapBefore(m6g, heap[c+1], heap[c]))
+		{
+			++c;
+		}
+		if(!mark6HeapBefore(m6g, heap[c], e))
+		{
+			break;
 		}
+		heap[i] = heap[c];
+		i = c;
 	}
+	heap[i] = e;
 }
 
-int seekMark6Gather(Mark6Gatherer *m6g, off_t position)
+/* fills m6g->mergeHeap with all slots holding data; returns number of slots in heap or < 0 on error */
+static int buildMark6Heap(Mark6Gatherer *m6g)
 {
-	pthread_attr_t attr;
-	pthread_t *seekThread;
-	struct seekArgs *S;
-	int t;
+	int e, i, nHeap = 0;
 
-	if(!m6g)
-	{
-		return -1;
-	}
-	if(position >= getMark6GathererFileSize(m6g))
+	if(m6g->mergeHeapSize < m6g->nFile*MARK6_BUFFER_SLOTS)
 	{
-		return -2;
-	}
+		int *heap = (int *)realloc(m6g->mergeHeap, m6g->nFile*MARK6_BUFFER_SLOTS*sizeof(int));
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	seekThread = (pthread_t *)malloc(m6g->nFile*sizeof(pthread_t));
-	S = (struct seekArgs *)malloc(m6g->nFile*sizeof(struct seekArgs));
+		if(!heap)
+		{
+			return -1;
+		}
+		m6g->mergeHeap = heap;
+		m6g->mergeHeapSize = m6g->nFile*MARK6_BUFFER_SLOTS;
+	}
 
-	for(t = 0; t < m6g->nFile; ++t)
+	for(e = 0; e < m6g->nFile*MARK6_BUFFER_SLOTS; ++e)
 	{
-		S[t].m6f = &m6g->mk6Files[t];
-		S[t].nFile = m6g->nFile;
-		S[t].position = position;
-		pthread_create(seekThread + t, &attr, mark6Seeker, S + t);
+		if(mark6HeapSlot(m6g, e)->payloadBytes > 0)
+		{
+			m6g->mergeHeap[nHeap++] = e;
+		}
 	}
-
-	pthread_attr_destroy(&attr);
-
-	for(t = 0; t < m6g->nFile; ++t)
+	for(i = nHeap/2 - 1; i >= 0; --i)
 	{
-		pthread_join(seekThread[t], 0);
+		siftDownMark6Heap(m6g, m6g->mergeHeap, nHeap, i);
 	}
 
-	free(seekThread);
-	free(S);
-
-	return 0;
+	return nHeap;
 }
 
-int mark6Gather(Mark6Gatherer *m6g, void *buf, size_t count)
+/* merges up to count bytes of packets, either copied to buf or, if buf is 0, described by up to maxIov regions (*nIov set).
+ * Returns bytes gathered */
+static size_t mergeMark6Gather(Mark6Gatherer *m6g, char *buf, struct iovec *iov, int maxIov, int *nIov, size_t count)
 {
 	size_t n = 0;
+	int *heap;
+	int nHeap;
 
 	count -= (count % m6g->packetSize);
 
-	while(n < count)
+	/* slots may have been refilled (seek, new files) since the last call, so start from a fresh heap */
+	nHeap = buildMark6Heap(m6g);
+	if(nHeap < 0)
 	{
-		int f, s, fileIndex, slotIndex;
-		uint64_t lowestFrame;
+		fprintf(stderr, "Error: mark6Gather: cannot allocate merge heap for %d files\n", m6g->nFile);
+
+		return 0;
+	}
+	heap = m6g->mergeHeap;
+
+	while(n < count && nHeap > 0)
+	{
+		int e = heap[0];
 		Mark6File *F;
 		Mark6BufferSlot *slot;
+		char *packet;
 
-		lowestFrame = m6g->mk6Files[0].slot[0].frame+1;
-		fileIndex = -1;
-		slotIndex = -1;
-
-		for(f = 0; f < m6g->nFile; ++f)
+		F = &m6g->mk6Files[e / MARK6_BUFFER_SLOTS];
+		slot = mark6HeapSlot(m6g, e);
+		packet = slot->data + slot->index;
+		if(buf)
 		{
-			for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
-			{
-				if(m6g->mk6Files[f].slot[s].payloadBytes > 0 && m6g->mk6Files[f].slot[s].frame < lowestFrame)
-				{
-					lowestFrame = m6g->mk6Files[f].slot[s].frame;
-					fileIndex = f;
-					slotIndex = s;
-				}
-			}
+			memcpy(buf, packet, m6g->packetSize);
+			buf += m6g->packetSize;
 		}
-		if(fileIndex < 0)
+		else
 		{
-			return n;
+			if(*nIov > 0 && (char *)iov[*nIov-1].iov_base + iov[*nIov-1].iov_len == packet)
+			{
+				iov[*nIov-1].iov_len += m6g->packetSize;
+			}
+			else if(*nIov < maxIov)
+			{
+				iov[*nIov].iov_base = packet;
+				iov[*nIov].iov_len = m6g->packetSize;
+				++(*nIov);
+			}
+			else
+			{
+				break;
+			}
+			slot->held = 1;
 		}
-
-		F = &m6g->mk6Files[fileIndex];
-		slot = F->slot + slotIndex;
-		memcpy(buf, slot->data + slot->index, m6g->packetSize);
-		buf += m6g->packetSize;
 		n += m6g->packetSize;
 		slot->index += m6g->packetSize;
 		if(slot->index >= slot->payloadBytes)
 		{
-			Mark6FileReadBlock(F, slotIndex);
+			Mark6FileReadBlock(F, e % MARK6_BUFFER_SLOTS);
+			if(slot->payloadBytes == 0)
+			{
+				/* this slot is done: replace with last heap element */
+				heap[0] = heap[--nHeap];
+			}
 		}
 		else
 		{
 			vdif_header *vh = (vdif_header *)(slot->data + slot->index);
 			slot->frame = vdifFrame(vh);
 		}
+		if(nHeap > 1)
+		{
+			siftDownMark6Heap(m6g, heap, nHeap, 0);
+		}
 	}
 
 	return n;
 }
 
+int mark6Gather(Mark6Gatherer *m6g, void *buf, size_t count)
+{
+	return mergeMark6Gather(m6g, (char *)buf, 0, 0, 0, count);
+}
+
+int mark6GatherV(Mark6Gatherer *m6g, struct iovec *iov, int maxIov, size_t count)
+{
+	int nIov = 0;
+
+	mergeMark6Gather(m6g, 0, iov, maxIov, &nIov, count);
+
+	return nIov;
+}
+
+void releaseMark6Gather(Mark6Gatherer *m6g)
+{
+	int f, s;
+
+	for(f = 0; f < m6g->nFile; ++f)
+	{
+		Mark6File *F = m6g->mk6Files + f;
+
+		while(F->nHeld > 0)
+		{
+			char *b = F->heldBuffers[--F->nHeld];
+
+			if(pushMark6Buffer(&F->spareBuffers, &F->nSpare, &F->spareAlloc, b) < 0)
+			{
+				free(b);
+			}
+		}
+		for(s = 0; s < MARK6_BUFFER_SLOTS; ++s)
+		{
+			F->slot[s].held = 0;
+		}
+	}
+}
+
 struct sumArgs
 {
 	Mark6File *m6f;
@@ -1135,6 +2963,16 @@ int getMark6FileList(char ***fileList)
 		}
 	}
 
+	/* leave out block indexes */
+	for(i = v = 0; i < n; ++i)
+	{
+		if(!isMark6IndexFileName(ptrs[i]))
+		{
+			ptrs[v++] = ptrs[i];
+		}
+	}
+	n = v;
+
 	/* sort */
 	qsort(ptrs, n, sizeof(char *), cstring_cmp);
 
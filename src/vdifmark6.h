@@ -43,8 +43,10 @@ extern "C" {
 #include "vdifio.h"
 
 #define MARK6_SYNC		0xfeed6666
-#define MAX_VDIF_MUX_SLOTS	64
 #define MARK6_BUFFER_SLOTS	10
+#define MARK6_DEFAULT_READAHEAD	2	/* blocks per file read ahead of the gatherer; change with setMark6GathererReadAhead() */
+#define MARK6_IO_ALIGN		4096	/* alignment of block buffers, as needed for O_DIRECT reads */
+#define MARK6_INDEX_SUFFIX	".m6idx"	/* appended to a file's name to make the name of its block index */
 
 typedef struct
 {
@@ -66,15 +68,35 @@ typedef struct
 	int32_t blocknum;
 } Mark6BlockHeader_ver1;
 
+typedef struct
+{
+	int64_t offset;			/* [bytes] file position of the block header */
+	int64_t payloadBefore;		/* [bytes] payload of all earlier blocks in the file */
+	int32_t blocknum;
+	int32_t payloadBytes;		/* [bytes] whole packets in the block, as the gatherer will deliver them */
+	uint64_t firstFrame;		/* vdifFrame() of the first and last packets */
+	uint64_t lastFrame;
+} Mark6BlockIndexEntry;
+
 typedef struct
 {
 	int payloadBytes;			/* [bytes] actual number of payload bytes (usually == payload_size) */
 	int index;				/* index into data[] */
 	uint64_t frame;				/* from VDIF header */
 	char *data;				/* points to payload within buffer */
+	char *buffer;				/* MARK6_IO_ALIGN aligned allocation that data points into */
+	int held;				/* buffer is referenced by regions handed out by mark6GatherV() */
 	Mark6BlockHeader_ver2 blockHeader;	/* header corresponding to recent data */
 } Mark6BufferSlot;
 
+typedef struct
+{
+	Mark6BlockHeader_ver2 header;
+	char *data;				/* payload, within buffer */
+	char *buffer;				/* MARK6_IO_ALIGN aligned, maxBlockSize + 2*MARK6_IO_ALIGN bytes */
+	int bytes;				/* payload bytes actually read */
+} Mark6ReadBlock;
+
 typedef struct
 {
 	FILE *in;				/* actual file descriptor */
@@ -86,16 +108,36 @@ typedef struct
 	struct stat stat;			/* stat, as read before file open */
 	int32_t block1, block2;			/* set at open: the first two block numbers in the file */
 
+	Mark6BlockIndexEntry *blockIndex;	/* every block of the file in order, or 0 if not indexed.  See indexMark6Gatherer() */
+	int nBlockIndex;
+	int indexEpoch;				/* VDIF reference epoch of the first packet of the file */
+
 	Mark6BufferSlot slot[MARK6_BUFFER_SLOTS];	/* Allow MARK6_BUFFER_SLOTS blocks to be visible to gatherer at once */
 
-	/* some parallel-read infrastructure */
+	/* some parallel-read infrastructure: readThread fills a single producer, single consumer ring of nRing blocks
+	 * that Mark6FileReadBlock() empties.  The lock and conditions are only used to sleep on an empty or full ring */
 	int stopReading;			/* if > 0, get out of read loop */
+	int reading;				/* readThread is running */
 	pthread_t readThread;
-	pthread_barrier_t readBarrier;
-	Mark6BlockHeader_ver2 readHeader;	/* header corresponding to recent data */
-	char *readBuffer;			/* same size as data[] above */
-	int readBytes;				/* how many bytes were actually read */
-
+	Mark6ReadBlock *ring;
+	int nRing;				/* read-ahead depth [blocks] */
+	unsigned int ringHead;			/* count of blocks published; written only by readThread */
+	unsigned int ringTail;			/* count of blocks consumed; written only by the gatherer */
+	int readDone;				/* set by readThread at end of file */
+	int readerWaiting;			/* readThread is asleep on a full ring */
+	int gathererWaiting;			/* gatherer is asleep on an empty ring */
+	pthread_mutex_t waitLock;
+	pthread_cond_t dataCond;
+	pthread_cond_t spaceCond;
+	pthread_mutex_t *readerLock;		/* where the reader sleeps: &waitLock and &spaceCond, or those shared by all files when using io_uring */
+	pthread_cond_t *readerCond;
+
+	/* zero-copy gather: spent slot buffers still referenced by mark6GatherV() regions wait in heldBuffers
+	 * until releaseMark6Gather() moves them to spareBuffers for reuse */
+	char **heldBuffers;
+	int nHeld, heldAlloc;
+	char **spareBuffers;
+	int nSpare, spareAlloc;
 
 } Mark6File;
 
@@ -104,6 +146,9 @@ typedef struct
         int nFile;
 	Mark6File *mk6Files;
 	int packetSize;
+	void *uring;				/* io_uring reader replacing the per-file threads, or 0.  See setMark6GathererIOUring() */
+	int *mergeHeap;				/* scratch for mark6Gather(): heap of slots ordered by frame */
+	int mergeHeapSize;			/* allocated length of mergeHeap */
 } Mark6Gatherer;
 
 
@@ -141,8 +186,115 @@ void printMark6Gatherer(const Mark6Gatherer *m6g);
 
 int seekMark6Gather(Mark6Gatherer *m6g, off_t position);
 
+/* positions the gatherer so the first packet returned is the first not before frame of second (seconds since the VDIF
+ * reference epoch).  Uses the block indexes where present, otherwise bisects on block headers.  Returns 0 on success,
+ * or -2 if there is no data at or after that time */
+int seekMark6GatherTime(Mark6Gatherer *m6g, int second, int frame);
+
+/* builds the block index of each file that does not have one, and if save is set writes it alongside the file as
+ * <fileName>MARK6_INDEX_SUFFIX (or, if environment variable MARK6_INDEX_DIR is set, in that directory) so later opens
+ * load it instead.  An index is only used while the file's size and modification time match.  With every file
+ * indexed, seekMark6Gather() goes straight to the exact block.  Also done at open if environment variable MARK6_INDEX
+ * is set.  Returns the number of files indexed, or < 0 on error */
+int indexMark6Gatherer(Mark6Gatherer *m6g, int save);
+
+/* set the number of blocks read ahead of the gatherer on each file.  Blocks already read are kept */
+int setMark6GathererReadAhead(Mark6Gatherer *m6g, int nBlock);
+
+/* if useIOUring, read all files from one thread through io_uring (with O_DIRECT where the file system allows)
+ * instead of one thread per file.  Also selected at open by setting environment variable MARK6_IOURING.
+ * Returns 0 on success, or < 0 if io_uring is not available, in which case the per-file threads stay in use */
+int setMark6GathererIOUring(Mark6Gatherer *m6g, int useIOUring);
+
 int mark6Gather(Mark6Gatherer *m6g, void *buf, size_t count);
 
+/* zero-copy form of mark6Gather(): instead of copying up to count bytes of packets, describes them in order as at most
+ * maxIov regions within the gatherer's buffers, suitable for vdifmuxv().  Consecutive packets from one block share a region.
+ * Returns the number of regions filled; 0 at end of data.  Regions remain valid, across further calls, until
+ * releaseMark6Gather() is called */
+int mark6GatherV(Mark6Gatherer *m6g, struct iovec *iov, int maxIov, size_t count);
+
+/* allows reuse of all buffers referenced by regions from mark6GatherV() */
+void releaseMark6Gather(Mark6Gatherer *m6g);
+
+
+
+/* *** implemented in vdifmark6mux.c *** */
+
+/* Multiplexing of threads from several Mark6 streams (each a separately recorded set of files) into single-thread VDIF.
+ * Streams and the assignment of (stream, thread) pairs to output slots are read from a template of lines such as:
+ *   mountPoint = /mnt/disks/1		(prefixed to the directory of streams that follow)
+ *   frameSize = 8032			(required)
+ *   bitsPerSample = 2			(required; also chansPerThread, interleaveFactor and EDV4 = 0 or 1, default 1)
+ *   stream0 = 1/data			(files are <mountPoint>/<stream directory>/<fileParameter>)
+ *   slot0 = 0,0				(output slot 0 is thread 0 of stream0; output channels are in slot order)
+ */
+
+struct vdif_mark6_mux_stream
+{
+	Mark6Gatherer *m6g;
+	int slotIndex[VDIF_MAX_THREAD_ID+1];	/* output slot of each thread, or -1 if not used */
+	struct iovec *iov;			/* packets gathered for the current call */
+	int nIov, maxIov;
+};
+
+struct vdif_mark6_mux
+{
+	int inputFrameSize;
+	int inputDataSize;
+	int outputFrameSize;
+	int outputDataSize;
+	int inputFramesPerSecond;
+	int frameGranularity;
+	int bitsPerSample;
+	int bitsPerSlot;
+	int nSort;
+	int nGap;
+	int nSlot;
+	int nOutputChan;
+	uint64_t goodMask[VDIF_MUX_MASK_WORDS];	/* bit s%64 of word s/64 is set if slot s is defined */
+	int flags;				/* VDIF_MUX_FLAG_* */
+	int nStream;
+	struct vdif_mark6_mux_stream *streams;
+	int relabel;				/* set if a thread Id is used by slots of several streams; then frames are copied to staging and given their slot number as thread Id */
+	struct vdif_mux vm;			/* multiplexes the slots in slot order */
+	unsigned char *leftover;		/* input not consumed by the previous call */
+	int nLeftover;
+	int leftoverSize;
+	unsigned char *staging;			/* relabelled copies of the frames of one call; used only if relabel is set */
+	long long stagingSize;
+	struct iovec *regions;			/* input of one call, merged in time order */
+	int maxRegion;
+};
+
+struct vdif_mark6_mux_statistics
+{
+	struct vdif_mux_statistics mux;		/* from the underlying vdifmuxv() */
+	int nStream;
+	long long *nGatheredByte;		/* per stream */
+	long long *nUnmappedFrame;		/* per stream: frames of threads not assigned to a slot */
+};
+
+struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const char *fileParameter, int inputFramesPerSecond);
+
+void deletevdifmark6mux(struct vdif_mark6_mux *vm);
+
+void printvdifmark6mux(const struct vdif_mark6_mux *vm);
+
+/* multiplexes the next roughly destSize bytes of output from all streams, which are read in parallel.  Packets are used where
+ * the gatherers hold them, which are never modified; only input left unconsumed is copied, to be used by the next call (and,
+ * if vmm->relabel is set, every frame of a slot).  startOutputFrameNumber is as for vdifmux().  Returns the number of input
+ * bytes processed, 0 at end of data, or < 0 on error */
+int vdifmark6mux(unsigned char *dest, int destSize, struct vdif_mark6_mux *vmm, int64_t startOutputFrameNumber, struct vdif_mark6_mux_statistics *stats);
+
+struct vdif_mark6_mux_statistics *newvdifmark6muxstatistics(const struct vdif_mark6_mux *vm);
+
+void deletevdifmark6muxstatistics(struct vdif_mark6_mux_statistics *stats);
+
+void printvdifmark6muxstatistics(const struct vdif_mark6_mux_statistics *stats);
+
+void resetvdifmark6muxstatistics(struct vdif_mark6_mux_statistics *stats);
+
 
 /* scan name should be the template file to match */
 int summarizevdifmark6(struct vdif_file_summary *sum, const char *scanName, int frameSize);
@@ -20,7 +20,7 @@
 // SVN properties (DO NOT CHANGE)
 //
 // $Id$
-// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/vdifio.h $
+// $HeadURL: https://svn.atnf.csiro.au/difx/libraries/vdifio/trunk/src/vdifmark6mux.c $
 // $LastChangedRevision$
 // $Author$
 // $LastChangedDate$
@@ -30,9 +30,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <glob.h>
 #include <regex.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "vdifmark6.h"
 
 /* returns pointer to start of non-whitespace text, or 0 if no content is found */
@@ -85,41 +85,6 @@ static char *trimLine(char *line)
 	return 0;
 }
 
-/* greatest common divisor, from wikipedia */
-static unsigned int gcd(unsigned int u, unsigned int v)
-{
-  // simple cases (termination)
-  if (u == v)
-    return u;
-  if (u == 0)
-    return v;
-  if (v == 0)
-    return u;
- 
-  // look for factors of 2
-  if ((~u) & 1) // u is even
-  {
-    if (v & 1) // v is odd
-    {
-      return gcd(u >> 1, v);
-    }
-    else // both u and v are even
-    {
-      return gcd(u >> 1, v >> 1) << 1;
-    }
-  }
-  if ((~v) & 1) // u is odd, v is even
-  {  
-    return gcd(u, v >> 1);
-  }
-  // reduce larger argument
-  if (u > v)
-  {  
-    return gcd((u - v) >> 1, v);
-  }
-  return gcd((v - u) >> 1, u);
-}
-
 struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const char *fileParameter, int inputFramesPerSecond)
 {
 	const int MaxLineLength = 1024;
@@ -135,10 +100,11 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 	char mountPoint[MaxFilenameLength];
 	int chansPerThread = 1;
 	int interleaveFactor = 1;
-	char slotUsed[MAX_VDIF_MUX_SLOTS];
+	char slotUsed[VDIF_MUX_MAX_THREADS];
+	int slotThread[VDIF_MUX_MAX_THREADS];	/* input thread Id of each slot */
 	int v;
 
-	memset(slotUsed, 0, MAX_VDIF_MUX_SLOTS);
+	memset(slotUsed, 0, sizeof(slotUsed));
 
 	mountPoint[0] = 0;
 	vm = (struct vdif_mark6_mux *)calloc(1, sizeof(struct vdif_mark6_mux));
@@ -148,6 +114,7 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 		return 0;
 	}
 	vm->inputFramesPerSecond = inputFramesPerSecond;
+	vm->flags = VDIF_MUX_FLAG_PROPAGATEVALIDITY;	/* EDV4 output, as vmux makes by default */
 
 	in = fopen(templateFilename, "r");
 	if(!in)
@@ -202,8 +169,7 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 		}
 		if(regexec(&streamMatch, txt, 3, subexpressions, 0) == 0)
 		{
-			int n, v, t;
-			glob_t globOut;
+			int n, t;
 			char globPattern[MaxFilenameLength];
 			int streamId;
 			const char *streamData;
@@ -247,17 +213,17 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 				break;
 			}
 	
-			v = glob(globPattern, 0, 0, &globOut);
-			if(v != 0)
+			if(stream->m6g)
 			{
-				fprintf(stderr, "Error: configurevdifmark6mux: globbing on %s returned %d\n", globPattern, v);
+				fprintf(stderr, "Error: configurevdifmark6mux: line %d: stream%d is being redefined.  This is not allowed.\n", lineNum, streamId);
 				deletevdifmark6mux(vm);
 				vm = 0;
 
 				break;
 			}
 
-			if(globOut.gl_pathc <= 0)
+			stream->m6g = openMark6GathererFromTemplate(globPattern);
+			if(!stream->m6g)
 			{
 				fprintf(stderr, "Error: no files found for stream%d\n", streamId);
 				deletevdifmark6mux(vm);
@@ -265,10 +231,6 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 
 				break;
 			}
-
-			stream->m6d = openMark6(globOut.gl_pathc, globOut.gl_pathv);
-
-			globfree(&globOut);
 		}
 		else if(regexec(&slotMatch, txt, 4, subexpressions, 0) == 0)
 		{
@@ -282,15 +244,15 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 			streamId = atoi(txt + subexpressions[2].rm_so);
 			threadId = atoi(txt + subexpressions[3].rm_so);
 
-			if(slotId < 0 || slotId >= MAX_VDIF_MUX_SLOTS)
+			if(slotId < 0 || slotId > VDIF_MAX_THREAD_ID)
 			{
-				fprintf(stderr, "Error: configurevdifmark6mux: slot %d not supported.  The maximum number of slots is %d.  Note slot numbers start at 0.\n", slotId, MAX_VDIF_MUX_SLOTS);
+				fprintf(stderr, "Error: configurevdifmark6mux: slot %d not supported.  Slot numbers must be in the range 0 to %d, inclusive.\n", slotId, VDIF_MAX_THREAD_ID);
 				deletevdifmark6mux(vm);
 				vm = 0;
 
 				break;
 			}
-			if(streamId < 0 || streamId >= vm->nStream || vm->streams[streamId].m6d == 0)
+			if(streamId < 0 || streamId >= vm->nStream || vm->streams[streamId].m6g == 0)
 			{
 				fprintf(stderr, "Error: configurevdifmark6mux: line %d: slot %d references stream %d which is not (yet) defined.\n", lineNum, slotId, streamId);
 				deletevdifmark6mux(vm);
@@ -324,8 +286,9 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 			}
 
 			vm->streams[streamId].slotIndex[threadId] = slotId;
-			vm->goodMask |= (1 << slotId);
+			vm->goodMask[slotId >> 6] |= (uint64_t)1 << (slotId & 63);
 			++slotUsed[slotId];
+			slotThread[slotId] = threadId;
 			++vm->nSlot;
 		}
 		else if(regexec(&paramMatch, txt, 3, subexpressions, 0) == 0)
@@ -389,6 +352,25 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 					break;
 				}
 			}
+			else if(strcmp(param, "EDV4") == 0)
+			{
+				if(strcmp(value, "1") == 0)
+				{
+					vm->flags |= VDIF_MUX_FLAG_PROPAGATEVALIDITY;
+				}
+				else if(strcmp(value, "0") == 0)
+				{
+					vm->flags &= ~VDIF_MUX_FLAG_PROPAGATEVALIDITY;
+				}
+				else
+				{
+					fprintf(stderr, "Error: configurevdifmark6mux: line %d: provided EDV4 must be 0 or 1\n", lineNum);
+					deletevdifmark6mux(vm);
+					vm = 0;
+
+					break;
+				}
+			}
 			else if(strcmp(param, "interleaveFactor") == 0)
 			{
 				interleaveFactor = atoi(value);
@@ -430,20 +412,27 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 
 	if(vm)
 	{
-		if(vm->inputFrameSize < 0)
+		if(vm->inputFrameSize <= 0)
 		{
 			fprintf(stderr, "Error: configurevdifmark6mux: requred parameter 'frameSize' not provided in %s\n", templateFilename);
 			deletevdifmark6mux(vm);
 
 			return 0;
 		}
-		else if(vm->bitsPerSample < 0)
+		else if(vm->bitsPerSample <= 0)
 		{
 			fprintf(stderr, "Error: configurevdifmark6mux: requred parameter 'bitsPerSample' not provided in %s\n", templateFilename);
 			deletevdifmark6mux(vm);
 			
 			return 0;
 		}
+		else if(vm->nSlot == 0)
+		{
+			fprintf(stderr, "Error: configurevdifmark6mux: no slots are defined in %s\n", templateFilename);
+			deletevdifmark6mux(vm);
+
+			return 0;
+		}
 		else if(vm->nSlot % interleaveFactor != 0)
 		{
 			fprintf(stderr, "Error: configurevdifmark6mux: 'interleaveFactor' (provided as %d) must divide evenly into number of slots (%d)\n", interleaveFactor, vm->nSlot);
@@ -456,20 +445,80 @@ struct vdif_mark6_mux *configurevdifmark6mux(const char *templateFilename, const
 	if(vm)
 	{
 		/* things seemed OK... */
+		int slots[VDIF_MUX_MAX_THREADS];
+		int s, t;
 
-		vm->nOutputChan = 1;
-		if(vm->nSlot > 1)
+		vm->nSort = 10;
+		vm->nGap = 10;
+		for(s = 0; s < vm->nStream; ++s)
 		{
-			/* round nOutputChan up to next power of 2 */
-			for(vm->nOutputChan = 1; vm->nOutputChan < vm->nSlot; vm->nOutputChan *= 2) { }
+			Mark6Gatherer *G = vm->streams[s].m6g;
+
+			if(!G)
+			{
+				continue;
+			}
+			if(G->packetSize != vm->inputFrameSize)
+			{
+				fprintf(stderr, "Error: configurevdifmark6mux: stream%d has packet size %d but frameSize is %d\n", s, G->packetSize, vm->inputFrameSize);
+				deletevdifmark6mux(vm);
+
+				return 0;
+			}
+			if(G->nFile > 0 && G->mk6Files[0].slot[0].payloadBytes > 0 && getVDIFComplex((const vdif_header *)(G->mk6Files[0].slot[0].data)))
+			{
+				vm->flags |= VDIF_MUX_FLAG_COMPLEX;
+			}
 		}
+
+		/* frames can keep their own thread Id unless it is used by more than one stream */
+		for(t = 0; t <= VDIF_MAX_THREAD_ID && !vm->relabel; ++t)
+		{
+			int n = 0;
+
+			for(s = 0; s < vm->nStream; ++s)
+			{
+				if(vm->streams[s].m6g && vm->streams[s].slotIndex[t] >= 0)
+				{
+					++n;
+				}
+			}
+			if(n > 1)
+			{
+				vm->relabel = 1;
+			}
+		}
+
+		/* the slots are multiplexed as threads, in slot order */
+		for(s = vm->nSlot = 0; s < VDIF_MUX_MAX_THREADS; ++s)
+		{
+			if(slotUsed[s])
+			{
+				slots[vm->nSlot++] = vm->relabel ? s : slotThread[s];
+			}
+		}
+		v = configurevdifmux(&vm->vm, vm->inputFrameSize, inputFramesPerSecond, vm->bitsPerSample, vm->nSlot, slots, vm->nSort, vm->nGap, vm->flags);
+		if(v == 0 && chansPerThread != 1)
+		{
+			v = setvdifmuxinputchannels(&vm->vm, chansPerThread);
+		}
+		if(v == 0 && interleaveFactor != 1)
+		{
+			v = setvdifmuxfanoutfactor(&vm->vm, interleaveFactor);
+		}
+		if(v != 0)
+		{
+			fprintf(stderr, "Error: configurevdifmark6mux: cannot configure multiplexer for %d slots (error %d)\n", vm->nSlot, v);
+			deletevdifmark6mux(vm);
+
+			return 0;
+		}
+
 		vm->bitsPerSlot = chansPerThread*vm->bitsPerSample;
-		vm->nOutputChan = chansPerThread*vm->nSlot/interleaveFactor;
-		vm->outputDataSize = vm->inputDataSize*vm->nSlot;
-		vm->outputFrameSize = vm->outputDataSize + VDIF_HEADER_BYTES;
-		vm->frameGranularity = inputFramesPerSecond/gcd(inputFramesPerSecond, 1000000000);
-		vm->nSort = 10;
-		vm->nGap = 10;
+		vm->nOutputChan = vm->vm.nOutputChan;
+		vm->outputDataSize = vm->vm.outputDataSize;
+		vm->outputFrameSize = vm->vm.outputFrameSize;
+		vm->frameGranularity = vm->vm.frameGranularity;
 	}
 
 	return vm;
@@ -485,14 +534,18 @@ void deletevdifmark6mux(struct vdif_mark6_mux *vm)
 		{
 			for(i = 0; i < vm->nStream; ++i)
 			{
-				if(vm->streams[i].m6d)
+				if(vm->streams[i].m6g)
 				{
-					closeMark6(vm->streams[i].m6d);
-					vm->streams[i].m6d = 0;
+					closeMark6Gatherer(vm->streams[i].m6g);
+					vm->streams[i].m6g = 0;
 				}
+				free(vm->streams[i].iov);
 			}
 			free(vm->streams);
 		}
+		free(vm->leftover);
+		free(vm->staging);
+		free(vm->regions);
 
 		free(vm);
 	}
@@ -502,7 +555,7 @@ void printvdifmark6mux(const struct vdif_mark6_mux *vm)
 {
 	if(vm)
 	{
-		int s;
+		int s, w;
 
 		printf("vdif_mark6_mux:\n");
 		printf("  inputFrameSize = %d\n", vm->inputFrameSize);
@@ -517,20 +570,33 @@ void printvdifmark6mux(const struct vdif_mark6_mux *vm)
 		printf("  nGap = %d\n", vm->nGap);
 		printf("  nSlot = %d\n", vm->nSlot);
 		printf("  nOutputChan = %d\n", vm->nOutputChan);
-		printf("  goodMask = 0x%" PRIx64 "\n", vm->goodMask);
+		printf("  goodMask = 0x");
+		for(s = 0, w = 0; s < VDIF_MUX_MASK_WORDS; ++s)
+		{
+			if(vm->goodMask[s] != 0)
+			{
+				w = s;	/* highest word with a slot defined */
+			}
+		}
+		for(s = w; s >= 0; --s)
+		{
+			printf("%016" PRIx64, vm->goodMask[s]);
+		}
+		printf("\n");
 		printf("  flags = 0x%02x\n", vm->flags);
+		printf("  relabel = %d\n", vm->relabel);
 		printf("  nStream = %d\n", vm->nStream);
 		for(s = 0; s < vm->nStream; ++s)
 		{
 			printf("    stream%d:\n", s);
-			if(vm->streams[s].m6d)
+			if(vm->streams[s].m6g)
 			{
 				int i;
 
-				printf("      nFile = %d:\n", vm->streams[s].m6d->nFile);
-				for(i = 0; i < vm->streams[s].m6d->nFile; ++i)
+				printf("      nFile = %d:\n", vm->streams[s].m6g->nFile);
+				for(i = 0; i < vm->streams[s].m6g->nFile; ++i)
 				{
-					printf("        %s\n", vm->streams[s].m6d->mk6Files[i].fileName);
+					printf("        %s\n", vm->streams[s].m6g->mk6Files[i].fileName);
 				}
 				printf("      thread to slot map:\n");
 				for(i = 0; i <= VDIF_MAX_THREAD_ID; ++i)
@@ -553,48 +619,397 @@ void printvdifmark6mux(const struct vdif_mark6_mux *vm)
 	}
 }
 
-int vdifmark6mux(unsigned char *dest, int destSize, const struct vdif_mark6_mux *vmm, int64_t startOutputFrameNumber, struct vdif_mux_statistics *stats)
+/* frame number since the epoch second, as vdifmux() counts it */
+static inline int64_t mark6muxframe(const vdif_header *vh, int framesPerSecond)
 {
-	int srcSize;
-	int nThread;
-	int nSlot;	/* nThread rounded up to power of 2 */
-	struct vdif_mux *vm;
-	int s, v;
-	const vdif_header *vh;
+	return (int64_t)getVDIFFrameEpochSecOffset(vh)*framesPerSecond + getVDIFFrameNumber(vh);
+}
+
+struct mark6muxgather
+{
+	struct vdif_mark6_mux *vmm;
+	struct vdif_mark6_mux_stream *stream;
+	int64_t endFrame;		/* gather until a frame at least this late is seen; if < 0, until nFrame frames have passed */
+	int nFrame;
+	size_t piece;			/* bytes asked of mark6GatherV() at a time */
+	long long nByte;
+};
+
+/* gathers one stream's packets in place, leaving them untouched */
+static void *mark6muxgather(void *arg)
+{
+	struct mark6muxgather *A = (struct mark6muxgather *)arg;
+	struct vdif_mark6_mux_stream *S = A->stream;
+	const struct vdif_mark6_mux *vmm = A->vmm;
+	int64_t endFrame = A->endFrame;
+
+	S->nIov = 0;
+	for(;;)
+	{
+		int i, n;
+
+		if(S->maxIov - S->nIov < 64)
+		{
+			struct iovec *p = (struct iovec *)realloc(S->iov, (2*S->maxIov + 64)*sizeof(struct iovec));
+
+			if(!p)
+			{
+				fprintf(stderr, "Error: vdifmark6mux: cannot allocate region list\n");
+
+				break;
+			}
+			S->iov = p;
+			S->maxIov = 2*S->maxIov + 64;
+		}
+		n = mark6GatherV(S->m6g, S->iov + S->nIov, S->maxIov - S->nIov, A->piece);
+		if(n == 0)
+		{
+			break;
+		}
+		for(i = S->nIov; i < S->nIov + n; ++i)
+		{
+			A->nByte += S->iov[i].iov_len;
+		}
+		S->nIov += n;
+
+		/* stop once this stream has passed the end of what the call can output */
+		{
+			const struct iovec *last = S->iov + S->nIov - 1;
+			const vdif_header *vh = (const vdif_header *)((const unsigned char *)(last->iov_base) + last->iov_len - vmm->inputFrameSize);
 
-	vm = &(vmm->vm);
+			if(getVDIFFrameBytes(vh) == vmm->inputFrameSize)
+			{
+				if(endFrame < 0)
+				{
+					endFrame = mark6muxframe((const vdif_header *)(S->iov[0].iov_base), vmm->inputFramesPerSecond) + A->nFrame;
+				}
+				if(mark6muxframe(vh, vmm->inputFramesPerSecond) >= endFrame)
+				{
+					break;
+				}
+			}
+		}
+	}
 
-	/* compute list of threads based on slotIndex in the vdif_mark6_mux_streams */
+	return 0;
+}
 
+/* appends len bytes at p to the merged input, extending the last region if they follow on from it.  Returns 0 on success */
+static int addmark6muxregion(struct vdif_mark6_mux *vmm, int *nRegion, unsigned char *p, size_t len)
+{
+	if(*nRegion > 0 && (unsigned char *)(vmm->regions[*nRegion-1].iov_base) + vmm->regions[*nRegion-1].iov_len == p)
+	{
+		vmm->regions[*nRegion-1].iov_len += len;
 
-	srcSize = nSlot * destSize * vm->inputFrameSize;
-	if(srcSize > vmm->scratchSize)
+		return 0;
+	}
+	if(*nRegion >= vmm->maxRegion)
 	{
-		vmm->scratchSize = srcSize;
-		vmm->scratch = realloc(vmm->scratch, srcSize);
+		struct iovec *r = (struct iovec *)realloc(vmm->regions, (2*vmm->maxRegion + 64)*sizeof(struct iovec));
+
+		if(!r)
+		{
+			return -1;
+		}
+		vmm->regions = r;
+		vmm->maxRegion = 2*vmm->maxRegion + 64;
 	}
+	vmm->regions[*nRegion].iov_base = p;
+	vmm->regions[*nRegion].iov_len = len;
+	++(*nRegion);
+
+	return 0;
+}
 
-	/* initialize the scratch, ensuring all packets are invalid */
-	memset(vmm->scratch, 1, srcSize);
+/* Each call gathers from every stream, in parallel and in place, enough frames to fill dest, then merges the streams'
+ * packets by time into one list of regions for vdifmuxv(), leaving out frames of threads without a slot.  The gatherers'
+ * buffers are only read: if frames must be relabelled with their slot number they are first copied to staging.  What
+ * vdifmuxv() leaves unconsumed is copied aside and leads the next call's input; then the gatherers may reuse their buffers. */
+int vdifmark6mux(unsigned char *dest, int destSize, struct vdif_mark6_mux *vmm, int64_t startOutputFrameNumber, struct vdif_mark6_mux_statistics *stats)
+{
+	struct mark6muxgather *A;
+	pthread_t *gatherThread;
+	int *started;
+	struct vdif_mux vm;
+	int64_t endFrame = -1;
+	int nFrame;
+	int nRegion = 0;
+	int *cur;		/* per stream: region being merged ... */
+	size_t *off;		/* ... and offset within it */
+	int s, v, more = 0;
+	long long remain;
+	long long nStaging = 0;	/* bytes gathered, then bytes staged */
+	unsigned char *frame;
+	int leftoverNeeded;
+
+	if(!vmm || !stats || stats->nStream != vmm->nStream)
+	{
+		fprintf(stderr, "Error: vdifmark6mux: bad arguments\n");
+
+		return -1;
+	}
 
-	/* identify startOutputFrameNumber if not specified */
-	if(startOutputFrameNumber < 0)
+	nFrame = destSize/vmm->outputFrameSize + vmm->nSort + 1;
+	if(startOutputFrameNumber >= 0)
 	{
+		endFrame = startOutputFrameNumber + nFrame;
+	}
+	else if(vmm->nLeftover >= vmm->inputFrameSize && getVDIFFrameBytes((const vdif_header *)(vmm->leftover)) == vmm->inputFrameSize)
+	{
+		endFrame = mark6muxframe((const vdif_header *)(vmm->leftover), vmm->inputFramesPerSecond) + nFrame;
+	}
+
+	A = (struct mark6muxgather *)calloc(vmm->nStream, sizeof(struct mark6muxgather));
+	gatherThread = (pthread_t *)malloc(vmm->nStream*sizeof(pthread_t));
+	started = (int *)calloc(vmm->nStream, sizeof(int));
+	cur = (int *)calloc(vmm->nStream, sizeof(int));
+	off = (size_t *)calloc(vmm->nStream, sizeof(size_t));
+	if(!A || !gatherThread || !started || !cur || !off)
+	{
+		fprintf(stderr, "Error: vdifmark6mux: cannot allocate per-stream state for %d streams\n", vmm->nStream);
+		free(A);
+		free(gatherThread);
+		free(started);
+		free(cur);
+		free(off);
+
+		return -2;
+	}
+
+	for(;;)
+	{
+		/* Stage 1: gather all streams at once */
+		for(s = 0; s < vmm->nStream; ++s)
+		{
+			A[s].vmm = vmm;
+			A[s].stream = vmm->streams + s;
+			A[s].endFrame = endFrame;
+			A[s].nFrame = nFrame;
+			A[s].piece = (destSize/4/vmm->inputFrameSize + 1)*vmm->inputFrameSize;
+			vmm->streams[s].nIov = 0;
+			if(vmm->streams[s].m6g)
+			{
+				started[s] = (pthread_create(gatherThread + s, 0, mark6muxgather, A + s) == 0);
+				if(!started[s])
+				{
+					mark6muxgather(A + s);
+				}
+			}
+		}
+		for(s = 0; s < vmm->nStream; ++s)
+		{
+			if(started[s])
+			{
+				pthread_join(gatherThread[s], 0);
+			}
+			stats->nGatheredByte[s] += A[s].nByte;
+			nStaging += A[s].nByte;
+			if(vmm->streams[s].nIov > 0)
+			{
+				more = 1;
+			}
+		}
+
+		/* Stage 2: merge by time, behind what was left over */
+		v = 0;
+		if(vmm->relabel && nStaging > vmm->stagingSize)
+		{
+			free(vmm->staging);
+			vmm->staging = (unsigned char *)malloc(nStaging);
+			vmm->stagingSize = vmm->staging ? nStaging : 0;
+			if(!vmm->staging)
+			{
+				v = -1;
+			}
+		}
+		nStaging = 0;
+		if(v == 0 && vmm->nLeftover > 0)
+		{
+			v = addmark6muxregion(vmm, &nRegion, vmm->leftover, vmm->nLeftover);
+		}
+		for(;;)
+		{
+			int best = -1;
+			int64_t bestFrame = 0;
+
+			for(s = 0; s < vmm->nStream; ++s)
+			{
+				const struct vdif_mark6_mux_stream *S = vmm->streams + s;
+				const vdif_header *vh;
+				int64_t f;
+
+				if(cur[s] >= S->nIov)
+				{
+					continue;
+				}
+				vh = (const vdif_header *)((const unsigned char *)(S->iov[cur[s]].iov_base) + off[s]);
+				if(getVDIFFrameBytes(vh) != vmm->inputFrameSize)
+				{
+					/* not a frame; pass it on straight away */
+					best = s;
+
+					break;
+				}
+				f = mark6muxframe(vh, vmm->inputFramesPerSecond);
+				if(best < 0 || f < bestFrame)
+				{
+					best = s;
+					bestFrame = f;
+				}
+			}
+			if(best < 0 || v < 0)
+			{
+				break;
+			}
+			frame = (unsigned char *)(vmm->streams[best].iov[cur[best]].iov_base) + off[best];
+			if(getVDIFFrameBytes((const vdif_header *)frame) != vmm->inputFrameSize)
+			{
+				/* not VDIF, e.g. fill pattern; leave it for vdifmuxv() to sort out */
+				v = addmark6muxregion(vmm, &nRegion, frame, vmm->inputFrameSize);
+			}
+			else
+			{
+				int slot = vmm->streams[best].slotIndex[getVDIFThreadID((const vdif_header *)frame)];
+
+				if(slot < 0)
+				{
+					/* left out, as another stream may use its thread Id */
+					++stats->nUnmappedFrame[best];
+				}
+				else if(vmm->relabel)
+				{
+					memcpy(vmm->staging + nStaging, frame, vmm->inputFrameSize);
+					setVDIFThreadID((vdif_header *)(vmm->staging + nStaging), slot);
+					v = addmark6muxregion(vmm, &nRegion, vmm->staging + nStaging, vmm->inputFrameSize);
+					nStaging += vmm->inputFrameSize;
+				}
+				else
+				{
+					v = addmark6muxregion(vmm, &nRegion, frame, vmm->inputFrameSize);
+				}
+			}
+			off[best] += vmm->inputFrameSize;
+			if(off[best] >= vmm->streams[best].iov[cur[best]].iov_len)
+			{
+				++cur[best];
+				off[best] = 0;
+			}
+		}
+		if(v < 0 || nRegion > 0 || !more)
+		{
+			break;
+		}
+
+		/* everything gathered was of threads without a slot; let it go and gather the next stretch */
 		for(s = 0; s < vmm->nStream; ++s)
 		{
-			int frameNumber;
+			if(vmm->streams[s].m6g)
+			{
+				releaseMark6Gather(vmm->streams[s].m6g);
+			}
+			started[s] = 0;
+			cur[s] = 0;
+			off[s] = 0;
+			A[s].nByte = 0;
+		}
+		more = 0;
+		nStaging = 0;
+	}
+	free(A);
+	free(gatherThread);
+	free(started);
+	free(cur);
+	free(off);
 
-			vh = (const vdif_header *)(vmm->streams[s].m6d->mk6Files[vmm->streams[s].currentFileNum]
-			frameNumber = (int64_t)(getVDIFFrameEpochSecOffset(vh)) * vm->inputFramesPerSecond + getVDIFFrameNumber(vh);
+	if(v < 0)
+	{
+		fprintf(stderr, "Error: vdifmark6mux: cannot allocate memory to merge %d streams\n", vmm->nStream);
+
+		return -3;
+	}
+	if(nRegion == 0 || (!more && vmm->nLeftover < vmm->inputFrameSize))
+	{
+		/* end of data */
+		for(s = 0; s < vmm->nStream; ++s)
+		{
+			if(vmm->streams[s].m6g)
+			{
+				releaseMark6Gather(vmm->streams[s].m6g);
+			}
 		}
+		vmm->nLeftover = 0;
+
+		return 0;
 	}
 
-	/* loop over streams, copying frames to scratch as appropriate */
-	for(s = 0; s < vmm->nStream; ++s)
+	/* Stage 3: multiplex */
+	vm = vmm->vm;
+	if(!more)
+	{
+		vm.flags |= VDIF_MUX_FLAG_GOTOEND;
+	}
+	v = vdifmuxv(dest, destSize, vmm->regions, nRegion, &vm, startOutputFrameNumber, &stats->mux);
+
+	/* Stage 4: keep what was not used, then let the gatherers have their buffers back */
+	leftoverNeeded = (v < 0 || (!more && stats->mux.srcUsed == 0)) ? 0 : stats->mux.srcSize - stats->mux.srcUsed;
+	if(leftoverNeeded > vmm->leftoverSize)
 	{
+		unsigned char *p = (unsigned char *)malloc(leftoverNeeded);
+
+		if(!p)
+		{
+			fprintf(stderr, "Error: vdifmark6mux: cannot allocate %d bytes for unused input\n", leftoverNeeded);
+			leftoverNeeded = 0;
+		}
+		else
+		{
+			/* regions[0] may be the old leftover, so copy before freeing it */
+			remain = stats->mux.srcUsed;
+			vmm->nLeftover = 0;
+			for(s = 0; s < nRegion; ++s)
+			{
+				long long len = vmm->regions[s].iov_len;
+
+				if(remain < len)
+				{
+					memcpy(p + vmm->nLeftover, (unsigned char *)(vmm->regions[s].iov_base) + remain, len - remain);
+					vmm->nLeftover += len - remain;
+				}
+				remain = (remain > len) ? remain - len : 0;
+			}
+			free(vmm->leftover);
+			vmm->leftover = p;
+			vmm->leftoverSize = leftoverNeeded;
+		}
 	}
+	else
+	{
+		/* copying forward is safe even where regions[0] is the leftover buffer itself */
+		remain = stats->mux.srcUsed;
+		vmm->nLeftover = 0;
+		for(s = 0; s < nRegion && vmm->nLeftover < leftoverNeeded; ++s)
+		{
+			long long len = vmm->regions[s].iov_len;
 
-	v = vdifmux(dest, destSize, vmm->scratch, srcSize, vm, startOutputFrameNumber, stats);
+			if(remain < len)
+			{
+				memmove(vmm->leftover + vmm->nLeftover, (unsigned char *)(vmm->regions[s].iov_base) + remain, len - remain);
+				vmm->nLeftover += len - remain;
+			}
+			remain = (remain > len) ? remain - len : 0;
+		}
+	}
+	if(leftoverNeeded == 0)
+	{
+		vmm->nLeftover = 0;
+	}
+	for(s = 0; s < vmm->nStream; ++s)
+	{
+		if(vmm->streams[s].m6g)
+		{
+			releaseMark6Gather(vmm->streams[s].m6g);
+		}
+	}
 
 	return v;
 }
@@ -604,20 +1019,49 @@ struct vdif_mark6_mux_statistics *newvdifmark6muxstatistics(const struct vdif_ma
 	struct vdif_mark6_mux_statistics *stats;
 
 	stats = (struct vdif_mark6_mux_statistics *)calloc(1, sizeof(struct vdif_mark6_mux_statistics));
+	if(!stats)
+	{
+		return 0;
+	}
+	stats->nStream = vm->nStream;
+	stats->nGatheredByte = (long long *)calloc(vm->nStream + 1, sizeof(long long));
+	stats->nUnmappedFrame = (long long *)calloc(vm->nStream + 1, sizeof(long long));
+	if(!stats->nGatheredByte || !stats->nUnmappedFrame)
+	{
+		deletevdifmark6muxstatistics(stats);
 
-/* FIXME */
+		return 0;
+	}
+	resetvdifmuxstatistics(&stats->mux);
 
 	return stats;
 }
 
 void deletevdifmark6muxstatistics(struct vdif_mark6_mux_statistics *stats)
 {
+	if(stats)
+	{
+		free(stats->nGatheredByte);
+		free(stats->nUnmappedFrame);
+		free(stats);
+	}
 }
 
 void printvdifmark6muxstatistics(const struct vdif_mark6_mux_statistics *stats)
 {
+	int s;
+
+	printf("vdif_mark6_mux statistics:\n");
+	for(s = 0; s < stats->nStream; ++s)
+	{
+		printf("  stream%d: %lld bytes gathered, %lld frames of unused threads\n", s, stats->nGatheredByte[s], stats->nUnmappedFrame[s]);
+	}
+	printvdifmuxstatistics(&stats->mux);
 }
 
 void resetvdifmark6muxstatistics(struct vdif_mark6_mux_statistics *stats)
 {
+	memset(stats->nGatheredByte, 0, stats->nStream*sizeof(long long));
+	memset(stats->nUnmappedFrame, 0, stats->nStream*sizeof(long long));
+	resetvdifmuxstatistics(&stats->mux);
 }
@@ -41,8 +41,14 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
 #include <vdifio.h>
 #include "config.h"
+#include "cornerturners.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #ifdef WORDS_BIGENDIAN
@@ -53,6 +59,94 @@
 
 #define MAGIC_BAD_THREAD	20000
 
+/* don't bother starting a compute thread for fewer than this many output frames, whatever their size */
+#define VDIF_MUX_MIN_FRAMES_PER_WORKER	4
+
+
+/* Thread presence masks are bitmaps of vm->nMaskWord 64-bit words, thread t in bit t%64 of word t/64.
+ * The whole-mask tests accumulate over all words without branching so the compiler can vectorize them.
+ */
+static inline int vdifmuxmasktest(const uint64_t *mask, int t)
+{
+	return (mask[t >> 6] >> (t & 63)) & 1;
+}
+
+static inline void vdifmuxmaskset(uint64_t *mask, int t)
+{
+	mask[t >> 6] |= 1ULL << (t & 63);
+}
+
+static inline void vdifmuxmaskclear(uint64_t *mask, int t)
+{
+	mask[t >> 6] &= ~(1ULL << (t & 63));
+}
+
+/* returns true if all threads are present */
+static inline int vdifmuxmaskcomplete(const struct vdif_mux *vm, const uint64_t *mask)
+{
+	uint64_t d = 0;
+	int w;
+
+	for(w = 0; w < vm->nMaskWord; ++w)
+	{
+		d |= mask[w] ^ vm->goodMask[w];
+	}
+
+	return d == 0;
+}
+
+/* returns true if no threads are present */
+static inline int vdifmuxmaskempty(const struct vdif_mux *vm, const uint64_t *mask)
+{
+	uint64_t d = 0;
+	int w;
+
+	for(w = 0; w < vm->nMaskWord; ++w)
+	{
+		d |= mask[w];
+	}
+
+	return d == 0;
+}
+
+/* Number of input threads represented by each bit of an EDV4 validity mask.  This is normally the
+ * fanout factor, but is doubled as needed so that the mask fits in the 64 bits of the header.
+ */
+static int vdifmuxvaliditygroup(const struct vdif_mux *vm)
+{
+	int g;
+
+	for(g = vm->fanoutFactor; (vm->nThread + g - 1)/g > 64; g *= 2);
+
+	return g;
+}
+
+/* Reduces a thread presence mask to an EDV4 validity mask: bit k set if all threads represented by bit k are present */
+static uint64_t vdifmuxvaliditymask(const struct vdif_mux *vm, const uint64_t *mask)
+{
+	uint64_t validity;
+	int g, i, j, k;
+
+	if(vm->nMaskWord == 1 && vm->fanoutFactor == 1)
+	{
+		return mask[0];
+	}
+
+	g = vdifmuxvaliditygroup(vm);
+	validity = 0;
+	for(i = k = 0; i < vm->nThread; i += g, ++k)
+	{
+		uint64_t m = 1;
+
+		for(j = i; j < i + g && j < vm->nThread; ++j)
+		{
+			m &= vdifmuxmasktest(mask, j);
+		}
+		validity |= (m << k);
+	}
+
+	return validity;
+}
 
 /* greatest common divisor, from wikipedia */
 static unsigned int gcd(unsigned int u, unsigned int v)
@@ -98,6 +192,29 @@ static void set_nOutputChan(struct vdif_mux *vm)
 	vm->nOutputChan *= vm->inputChannelsPerThread;
 }
 
+/* Selects the corner turner.  Beyond VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS threads, corner turning is done in groups
+ * of that many threads (see cornerturn_wide()) and cornerTurner is the one used for each group.
+ */
+static int setvdifmuxcornerturner(struct vdif_mux *vm, int nThread, int nBit)
+{
+	if(abs(nThread) > VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS)
+	{
+		vm->cornerTurner = getTemplateCornerTurner(VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS, nBit);
+	}
+	else
+	{
+		vm->cornerTurner = getCornerTurner(nThread, nBit);
+	}
+	if(vm->cornerTurner == 0)
+	{
+		fprintf(stderr, "No corner turner implemented for %d threads and %d bits\n", nThread, nBit);
+		
+		return -1;
+	}
+
+	return 0;
+}
+
 
 
 /* Params are:
@@ -128,9 +245,9 @@ int configurevdifmux(struct vdif_mux *vm, int inputFrameSize, int inputFramesPer
 	int i;
 	int nBit;	/* bits to corner turn together */
 
-	if(nThread > sizeof(vm->goodMask)*8)
+	if(abs(nThread) > VDIF_MUX_MAX_THREADS)
 	{
-		fprintf(stderr, "Error: configurevdifmux: cannot run vdifmux on more than %d threads; %d requested.\n", (int)sizeof(vm->goodMask)*8, nThread);
+		fprintf(stderr, "Error: configurevdifmux: cannot run vdifmux on more than %d threads; %d requested.\n", VDIF_MUX_MAX_THREADS, nThread);
 
 		return -3;
 	}
@@ -145,11 +262,8 @@ int configurevdifmux(struct vdif_mux *vm, int inputFrameSize, int inputFramesPer
 	}
 
 	nBit = bitsPerSample * vm->complexFactor;
-	vm->cornerTurner = getCornerTurner(nThread, nBit);
-	if(vm->cornerTurner == 0)
+	if(setvdifmuxcornerturner(vm, nThread, nBit) < 0)
 	{
-		fprintf(stderr, "No corner turner implemented for %d threads and %d bits\n", nThread, nBit);
-		
 		return -1;
 	}
 
@@ -172,6 +286,9 @@ int configurevdifmux(struct vdif_mux *vm, int inputFrameSize, int inputFramesPer
 	/* by default, and in most cases, don't merge multiple threads into a single channel.  Can be overridden with a call to setvdifmuxfanoutfactor */
 	vm->fanoutFactor = 1;
 
+	/* by default do all corner turning in the calling thread.  Can be overridden with a call to configurevdifmuxthreads */
+	vm->nWorker = 1;
+
 
 	set_nOutputChan(vm);
 
@@ -213,7 +330,13 @@ int configurevdifmux(struct vdif_mux *vm, int inputFrameSize, int inputFramesPer
 		vm->chanIndex[threadIds[i]] = i;
 	}
 
-	vm->goodMask = (1ULL << nThread) - 1;	/* nThread 1s as LSBs and 0s above that */
+	/* nThread 1s as LSBs and 0s above that */
+	vm->nMaskWord = (nThread + 63)/64;
+	memset(vm->goodMask, 0, sizeof(vm->goodMask));
+	for(i = 0; i < nThread; ++i)
+	{
+		vdifmuxmaskset(vm->goodMask, i);
+	}
 
 	return 0;
 }
@@ -248,11 +371,8 @@ int setvdifmuxinputchannels(struct vdif_mux *vm, int inputChannelsPerThread)
 	set_nOutputChan(vm);
 
 	nBit = vm->bitsPerSample*vm->inputChannelsPerThread*vm->complexFactor;
-	vm->cornerTurner = getCornerTurner(vm->nThread, nBit);
-	if(vm->cornerTurner == 0)
+	if(setvdifmuxcornerturner(vm, vm->nThread, nBit) < 0)
 	{
-		fprintf(stderr, "No corner turner implemented for %d threads and %d bits\n", vm->nThread, nBit);
-		
 		return -1;
 	}
 
@@ -297,6 +417,28 @@ int setvdifmuxfanoutfactor(struct vdif_mux *vm, int fanoutFactor)
 	return 0;
 }
 
+/* Allows the corner turning stage of vdifmux() to be spread over multiple CPU cores */
+int configurevdifmuxthreads(struct vdif_mux *vm, int nWorker)
+{
+	if(!vm)
+	{
+		fprintf(stderr, "Error: configurevdifmuxthreads called with null vdif_mux structure\n");
+
+		return -1;
+	}
+
+	if(nWorker < 1 || nWorker > VDIF_MUX_MAX_WORKERS)
+	{
+		fprintf(stderr, "Error: configurevdifmuxthreads: nWorker=%d is out of range 1..%d\n", nWorker, VDIF_MUX_MAX_WORKERS);
+
+		return -2;
+	}
+
+	vm->nWorker = nWorker;
+
+	return 0;
+}
+
 void printvdifmux(const struct vdif_mux *vm)
 {
 	if(vm)
@@ -318,7 +460,13 @@ void printvdifmux(const struct vdif_mux *vm)
 		printf("  nThread = %d\n", vm->nThread);
 		printf("  nOutputChan = %d\n", vm->nOutputChan);
 		printf("  fanoutFactor = %d\n", vm->fanoutFactor);
-		printf("  goodMask = 0x%" PRIx64 "\n", vm->goodMask);
+		printf("  nWorker = %d\n", vm->nWorker);
+		printf("  goodMask = 0x");
+		for(i = vm->nMaskWord-1; i >= 0; --i)
+		{
+			printf("%016" PRIx64, vm->goodMask[i]);
+		}
+		printf("\n");
 		printf("  flags = 0x%02x\n", vm->flags);
 		printf("  thread to channel map:\n");
 		if(vm->inputChannelsPerThread == 1)
@@ -350,6 +498,377 @@ void printvdifmux(const struct vdif_mux *vm)
 	}
 }
 
+/* Description of one block of output frames to be corner turned, possibly in its own thread */
+struct vdifmuxwork
+{
+	unsigned char *dest;
+	const unsigned char *src;
+	const struct vdif_mux *vm;
+	const vdif_header *outputHeader;
+	const uint64_t *mask;			/* [nFrame*vm->nMaskWord] thread presence for each output frame */
+	const unsigned char * const *threadBuffers;	/* [nFrame*nThread] pointers to each thread's payload */
+	int64_t startFrameNumber;		/* frame number corresponding to dest[0] */
+	int startIndex;				/* first output frame to process */
+	int endIndex;				/* one beyond last output frame to process */
+
+	/* results */
+	int nGoodOutput;
+	int nBadOutput;
+	int nPartialOutput;
+};
+
+/* Corner turns one output frame's worth of data, handing wide configurations to cornerturn_wide() */
+static inline void vdifmuxcornerturnframe(const struct vdif_mux *vm, unsigned char *outputBuffer, const unsigned char * const *threadBuffers)
+{
+	if(vm->nThread > VDIF_TEMPLATE_CORNERTURNER_MAX_THREADS)
+	{
+		cornerturn_wide(vm->cornerTurner, outputBuffer, threadBuffers, vm->outputDataSize, vm->nThread, vm->bitsPerSample*vm->inputChannelsPerThread*vm->complexFactor);
+	}
+	else
+	{
+		vm->cornerTurner(outputBuffer, threadBuffers, vm->outputDataSize);
+	}
+}
+
+/* Stage 2 of vdifmux: corner turn and populate headers for output frames startIndex to endIndex-1.
+ * Each output frame is independent of the others so any number of these can run concurrently on
+ * non-overlapping ranges.
+ */
+static void *vdifmuxcornerturn(void *arg)
+{
+	struct vdifmuxwork *W = (struct vdifmuxwork *)arg;
+	const struct vdif_mux *vm = W->vm;
+	int64_t frameNumber;
+	int seconds, frameNum;
+	int f;
+
+	frameNumber = W->startFrameNumber + W->startIndex;
+	seconds = frameNumber/vm->inputFramesPerSecond;
+	frameNum = frameNumber%vm->inputFramesPerSecond;
+
+	for(f = W->startIndex; f < W->endIndex; ++f)
+	{
+		unsigned char *frame = W->dest + vm->outputFrameSize*f;	/* points to rearrangement destination */
+		const unsigned char * const *threadBuffers = W->threadBuffers + f*vm->nThread;
+		const uint64_t *mask = W->mask + f*vm->nMaskWord;
+
+		/* generate header for output frame */
+		memcpy(frame, (const char *)(W->outputHeader), VDIF_HEADER_BYTES);
+		setVDIFFrameEpochSecOffset((vdif_header *)frame, seconds);
+		setVDIFFrameNumber((vdif_header *)frame, frameNum);
+
+		if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
+		{
+			if(!vdifmuxmaskempty(vm, mask))
+			{
+				vdif_edv4_header *edv4 = (vdif_edv4_header *)frame;
+
+				edv4->validitymask = vdifmuxvaliditymask(vm, mask);
+
+				if(vdifmuxmaskcomplete(vm, mask))
+				{
+					vdifmuxcornerturnframe(vm, frame + VDIF_HEADER_BYTES, threadBuffers);
+
+					++W->nGoodOutput;
+				}
+				else
+				{
+					const unsigned char *partialBuffers[VDIF_MUX_MAX_THREADS];
+					int i;
+
+					/* point to random data rather than nowhere for invalid frames */
+					for(i = 0; i < vm->nThread; ++i)
+					{
+						partialBuffers[i] = vdifmuxmasktest(mask, i) ? threadBuffers[i] : W->src;
+					}
+
+					vdifmuxcornerturnframe(vm, frame + VDIF_HEADER_BYTES, partialBuffers);
+
+					++W->nPartialOutput;
+				}
+			}
+			else
+			{
+				/* Set invalid bit */
+				setVDIFFrameInvalid((vdif_header *)frame, 1);
+
+				++W->nBadOutput;
+			}
+		}
+		else
+		{
+			if(vdifmuxmaskcomplete(vm, mask))
+			{
+				vdifmuxcornerturnframe(vm, frame + VDIF_HEADER_BYTES, threadBuffers);
+
+				++W->nGoodOutput;
+			}
+			else
+			{
+				/* Set invalid bit */
+				setVDIFFrameInvalid((vdif_header *)frame, 1);
+
+				++W->nBadOutput;
+			}
+		}
+
+		++frameNum;
+		if(frameNum >= vm->inputFramesPerSecond)
+		{
+			++seconds;
+			frameNum -= vm->inputFramesPerSecond;
+		}
+	}
+
+	return 0;
+}
+
+/* Stage 2 of vdifmux: populate headers and corner turn output frames 0 to nFrame-1 of dest,
+ * spreading the work over vm->nWorker threads.  mask and threadBuffers come from Stage 1.
+ */
+static void vdifmuxstage2(unsigned char *dest, const unsigned char *src, const struct vdif_mux *vm, const vdif_header *outputHeader, int64_t startFrameNumber, int nFrame, const uint64_t *mask, const unsigned char * const *threadBuffers, int *nGoodOutput, int *nBadOutput, int *nPartialOutput)
+{
+	int nWorker, w;
+	struct vdifmuxwork work[VDIF_MUX_MAX_WORKERS];
+	pthread_t workThread[VDIF_MUX_MAX_WORKERS];
+	int threadStarted[VDIF_MUX_MAX_WORKERS];
+
+	nWorker = vm->nWorker;
+	if(nWorker > nFrame/VDIF_MUX_MIN_FRAMES_PER_WORKER)
+	{
+		/* not enough work to be worth spreading around */
+		nWorker = nFrame/VDIF_MUX_MIN_FRAMES_PER_WORKER;
+	}
+	if(nWorker > (int64_t)nFrame*vm->outputFrameSize/VDIF_MUX_MIN_BYTES_PER_WORKER)
+	{
+		/* workers are started afresh for each call, so each must have enough output to repay that */
+		nWorker = (int64_t)nFrame*vm->outputFrameSize/VDIF_MUX_MIN_BYTES_PER_WORKER;
+	}
+	if(nWorker < 1)
+	{
+		nWorker = 1;
+	}
+
+	for(w = 0; w < nWorker; ++w)
+	{
+		work[w].dest = dest;
+		work[w].src = src;
+		work[w].vm = vm;
+		work[w].outputHeader = outputHeader;
+		work[w].mask = mask;
+		work[w].threadBuffers = threadBuffers;
+		work[w].startFrameNumber = startFrameNumber;
+		work[w].startIndex = (int)((int64_t)nFrame*w/nWorker);
+		work[w].endIndex = (int)((int64_t)nFrame*(w+1)/nWorker);
+		work[w].nGoodOutput = 0;
+		work[w].nBadOutput = 0;
+		work[w].nPartialOutput = 0;
+	}
+
+	/* the calling thread handles the first block of frames itself */
+	for(w = 1; w < nWorker; ++w)
+	{
+		threadStarted[w] = (pthread_create(workThread + w, 0, vdifmuxcornerturn, work + w) == 0);
+		if(!threadStarted[w])
+		{
+			/* could not start thread; do the work here instead */
+			vdifmuxcornerturn(work + w);
+		}
+	}
+	vdifmuxcornerturn(work);
+	for(w = 0; w < nWorker; ++w)
+	{
+		if(w > 0 && threadStarted[w])
+		{
+			pthread_join(workThread[w], 0);
+		}
+		*nGoodOutput += work[w].nGoodOutput;
+		*nBadOutput += work[w].nBadOutput;
+		*nPartialOutput += work[w].nPartialOutput;
+	}
+}
+
+/* Possible outcomes of examining the input stream at a particular location */
+enum VDIFMuxFrameClass
+{
+	VDIFMuxFrameGood = 0,		/* a frame from one of the threads being multiplexed */
+	VDIFMuxFrameInvalid,		/* a frame with its invalid bit set (only with VDIF_MUX_FLAG_ENABLEVALIDITY); skip it */
+	VDIFMuxFrameFill,		/* fill pattern at end of frame; skip whole frame */
+	VDIFMuxFrameFillStart,		/* fill pattern at the start; skip 8 bytes */
+	VDIFMuxFrameNotVDIF,		/* not a frame of the expected type; skip 4 bytes and look again */
+	VDIFMuxFrameWrongThread		/* a good frame, but not from a thread being multiplexed; skip it */
+};
+
+/* Looks at the inputFrameSize bytes starting at cur and determines what they are.  For a good frame chanId is set. */
+static inline enum VDIFMuxFrameClass classifyvdifmuxframe(const struct vdif_mux *vm, const unsigned char *cur, int *chanId)
+{
+	const vdif_header *vh = (const vdif_header *)cur;
+
+	if( (vm->flags & VDIF_MUX_FLAG_ENABLEVALIDITY) && (getVDIFFrameInvalid(vh) > 0) )
+	{
+		return VDIFMuxFrameInvalid;
+	}
+	if(*((uint32_t *)(cur+vm->inputFrameSize-4)) == FILL_PATTERN)
+	{
+		return VDIFMuxFrameFill;
+	}
+	if(*((uint32_t *)cur) == FILL_PATTERN)
+	{
+		return VDIFMuxFrameFillStart;
+	}
+	if(getVDIFFrameBytes(vh) != vm->inputFrameSize ||
+	   getVDIFNumChannels(vh) != vm->inputChannelsPerThread ||
+	   getVDIFBitsPerSample(vh) != vm->bitsPerSample)
+	{
+		return VDIFMuxFrameNotVDIF;
+	}
+
+	*chanId = vm->chanIndex[getVDIFThreadID(vh)];
+	if(*chanId == MAGIC_BAD_THREAD)
+	{
+		return VDIFMuxFrameWrongThread;
+	}
+
+	return VDIFMuxFrameGood;
+}
+
+/* Steps over data that is not usable VDIF the way Stage 1 would, 4 bytes at a time (8 for the start of
+ * fill pattern), stopping at the first offset that classifyvdifmuxframe() reports as anything else.
+ * Candidate offsets o < limit with o + inputFrameSize <= size are considered.  Returns the number of
+ * bytes stepped over; *nFill is incremented by the part of that that was fill pattern.
+ *
+ * Where SSE2 is available, the frame length, channel count, bits per sample, invalid bit and fill
+ * pattern checks are made on four consecutive candidate offsets at once, which allows junk data to
+ * be passed over at close to memory speed.
+ */
+static int resyncvdifmux(const struct vdif_mux *vm, const unsigned char *data, int size, int limit, int *nFill)
+{
+	const int last = size - vm->inputFrameSize;	/* last candidate offset */
+	int o = 0;
+
+#ifdef __SSE2__
+	uint32_t headerMask, headerWord2, headerWord3;
+	__m128i fill, validity, mask2, word2, word3;
+	int log2Chan;
+
+	for(log2Chan = 0; (1 << log2Chan) < vm->inputChannelsPerThread; ++log2Chan);
+	if((1 << log2Chan) == vm->inputChannelsPerThread && vm->inputFrameSize % 8 == 0)
+	{
+		/* word 2: frame length in units of 8 bytes and log2(channels); word 3: bits per sample - 1 */
+		headerMask = 0x1FFFFFFF;
+		headerWord2 = (vm->inputFrameSize/8) | (log2Chan << 24);
+		headerWord3 = (uint32_t)(vm->bitsPerSample - 1) << 26;
+	}
+	else
+	{
+		/* no header can match */
+		headerMask = 0;
+		headerWord2 = 1;
+		headerWord3 = 0;
+	}
+	fill = _mm_set1_epi32((int)FILL_PATTERN);
+	validity = _mm_set1_epi32((vm->flags & VDIF_MUX_FLAG_ENABLEVALIDITY) ? -1 : 0);
+	mask2 = _mm_set1_epi32((int)headerMask);
+	word2 = _mm_set1_epi32((int)headerWord2);
+	word3 = _mm_set1_epi32((int)headerWord3);
+#endif
+
+	while(o < limit && o <= last)
+	{
+		int chanId;
+
+#ifdef __SSE2__
+		if(o + 12 < limit && o + 12 <= last)
+		{
+			/* lane k of each of these is the relevant word of the frame that would start at o + 4*k */
+			__m128i w0 = _mm_loadu_si128((const __m128i *)(data + o));
+			__m128i w2 = _mm_loadu_si128((const __m128i *)(data + o + 8));
+			__m128i w3 = _mm_loadu_si128((const __m128i *)(data + o + 12));
+			__m128i we = _mm_loadu_si128((const __m128i *)(data + o + vm->inputFrameSize - 4));
+			__m128i hit;
+			int m;
+
+			hit = _mm_or_si128(_mm_cmpeq_epi32(w0, fill), _mm_cmpeq_epi32(we, fill));
+			hit = _mm_or_si128(hit, _mm_and_si128(validity, _mm_srai_epi32(w0, 31)));
+			hit = _mm_or_si128(hit, _mm_and_si128(
+				_mm_cmpeq_epi32(_mm_and_si128(w2, mask2), word2),
+				_mm_cmpeq_epi32(_mm_and_si128(w3, _mm_set1_epi32(0x7C000000)), word3)));
+			m = _mm_movemask_ps(_mm_castsi128_ps(hit));
+			if(m == 0)
+			{
+				o += 16;
+
+				continue;
+			}
+			o += 4*__builtin_ctz(m);
+		}
+#endif
+
+		switch(classifyvdifmuxframe(vm, data + o, &chanId))
+		{
+		case VDIFMuxFrameNotVDIF:
+			o += 4;
+			break;
+		case VDIFMuxFrameFillStart:
+			o += 8;
+			*nFill += 8;
+			break;
+		default:
+			return o;
+		}
+	}
+
+	return o;
+}
+
+/* Generate the prototype output header based on the first good input frame header vh */
+static void setvdifmuxoutputheader(const struct vdif_mux *vm, vdif_header *outputHeader, const vdif_header *vh)
+{
+	memcpy(outputHeader, vh, 16);
+	if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
+	{
+		/* FIXME: handle heirarchical multiplexing */
+
+		vdif_edv4_header *edv4 = (vdif_edv4_header *)outputHeader;
+
+		edv4->dummy = 0;
+		edv4->masklength = (vm->nThread + vdifmuxvaliditygroup(vm) - 1)/vdifmuxvaliditygroup(vm);
+		edv4->eversion = 4;
+		edv4->syncword = 0xACABFEED;
+		edv4->validitymask = 0;
+	}
+	else
+	{
+		memset(((char *)outputHeader) + 16, 0, 16);
+	}
+
+	setVDIFNumChannels(outputHeader, vm->nOutputChan);
+	setVDIFThreadID(outputHeader, 0);
+	setVDIFFrameBytes(outputHeader, vm->outputFrameSize);
+	setVDIFFrameInvalid(outputHeader, 0);
+}
+
+/* returns offset of ptr into the concatenation of the nRegion regions of src */
+static int vdifmuxsrcoffset(const struct iovec *src, int nRegion, int srcSize, const unsigned char *ptr)
+{
+	int offset = srcSize;
+	int r;
+
+	/* search backwards as this is used to back up from near the end of the input */
+	for(r = nRegion-1; r >= 0; --r)
+	{
+		const unsigned char *base = (const unsigned char *)(src[r].iov_base);
+
+		offset -= src[r].iov_len;
+		if(ptr >= base && ptr < base + src[r].iov_len)
+		{
+			return offset + (ptr - base);
+		}
+	}
+
+	return srcSize;
+}
+
 /* Params are:
  *
  * dest:
@@ -384,15 +903,36 @@ void printvdifmux(const struct vdif_mux *vm)
  */
 int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int srcSize, const struct vdif_mux *vm, int64_t startOutputFrameNumber, struct vdif_mux_statistics *stats)
 {
-	int threadId;
-	int nValidFrame = 0;			/* counts number of valid input frames found so far */
-	int nSkip = 0;				/* counts number of bytes skipped (not what we are looking for) */
-	int nFill = 0;				/* counts number of bytes skipped that were fill pattern */
+	struct iovec region;
+
+	region.iov_base = (void *)src;
+	region.iov_len = srcSize;
+
+	return vdifmuxv(dest, destSize, &region, 1, vm, startOutputFrameNumber, stats);
+}
+
+/* As vdifmux() but the input is taken from a list of nRegion regions rather than one contiguous array.
+ * The regions are treated as consecutive parts of one stream, except that no VDIF frame may cross a
+ * region boundary; any bytes at the end of a region too short to hold a frame are skipped (unless in the last region).
+ * This allows multiplexing directly from (e.g.) Mark6 blocks or UDP packets without first copying them together.
+ *
+ * The return value and stats->srcSize and stats->srcUsed count bytes within the concatenated regions.
+ */
+int vdifmuxv(unsigned char *dest, int destSize, const struct iovec *src, int nRegion, const struct vdif_mux *vm, int64_t startOutputFrameNumber, struct vdif_mux_statistics *stats)
+{
+	int srcSize = 0;			/* total length of all regions */
+	int r = 0;				/* index of current region */
+	int regionStart = 0;			/* offset of current region's start within the concatenated regions */
+	int regionEnd;				/* offset of current region's end */
+	const unsigned char *fillData = 0;	/* data used in place of missing threads */
+	int nValidFrame = 0;			/* counts number of valid input frames found so far */
+	int nSkip = 0;				/* counts number of bytes skipped (not what we are looking for) */
+	int nFill = 0;				/* counts number of bytes skipped that were fill pattern */
 	int nDup = 0;				/* number of duplicate frames found */
 	int nInvalidFrame = 0;			/* counts number of VDIF frames skipped because of invalid bits */
 	int64_t startFrameNumber;		/* = seconds*inputFramesPerSecond + frameNumber */
 
-	int i;					/* index into src */
+	int i;					/* index into the concatenated regions of src */
 	int f;
 	int N;					/* max value to allow i to be */
 	int highestDestIndex = 0;
@@ -404,11 +944,35 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 	int nBadOutput = 0;
 	int nPartialOutput = 0;
 	int nWrongThread = 0;
-	int seconds, frameNum;
 	vdif_header outputHeader;
 	int epoch = -1;
 	int highestSortedDestIndex = -1;
 	int vhUnset = 1;
+	uint64_t *maskStore;			/* side index: presence mask for each output frame ... */
+	const unsigned char **threadBufferStore;	/* ... and pointer to each thread's payload */
+	uint64_t *mask;				/* [destIndex*vm->nMaskWord]; starts within maskStore */
+	const unsigned char **threadBuffers;	/* [destIndex*nThread + chanId]; starts within threadBufferStore */
+
+	if(nRegion < 0 || (nRegion > 0 && !src))
+	{
+		fprintf(stderr, "Error: vdifmuxv: bad list of %d source regions\n", nRegion);
+
+		return -1;
+	}
+	for(r = 0; r < nRegion; ++r)
+	{
+		srcSize += src[r].iov_len;
+		if(!fillData && src[r].iov_len >= (size_t)vm->inputDataSize)
+		{
+			fillData = (const unsigned char *)(src[r].iov_base);
+		}
+	}
+	if(!fillData)
+	{
+		fillData = nRegion > 0 ? (const unsigned char *)(src[0].iov_base) : dest;
+	}
+	r = 0;
+	regionEnd = nRegion > 0 ? src[0].iov_len : 0;
 
 	N = srcSize - vm->inputFrameSize;
 
@@ -436,69 +1000,92 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 	}
 
 	maxDestIndex = destSize/vm->outputFrameSize - 1;
+	if(maxDestIndex < 0)
+	{
+		maxDestIndex = -1;
+	}
 
 	startFrameNumber = startOutputFrameNumber;
 
-	/* clear mask of presence */
-	for(i = 0; i <= maxDestIndex; ++i)
+	/* The index is kept separate from dest so that dest is written only once, by Stage 2.
+	 * Room is left for sliding the start forward by up to a full dest without moving anything.
+	 */
+	maskStore = (uint64_t *)calloc((2*(maxDestIndex+1) + 1)*vm->nMaskWord, sizeof(uint64_t));
+	threadBufferStore = (const unsigned char **)malloc((2*(maxDestIndex+1) + 1)*vm->nThread*sizeof(const unsigned char *));
+	if(!maskStore || !threadBufferStore)
 	{
-		uint64_t *p = (uint64_t *)(dest + vm->outputFrameSize*i);
-		p[3] = 0;
+		fprintf(stderr, "Error: vdifmuxv: cannot allocate index for %d output frames\n", maxDestIndex+1);
+		free(maskStore);
+		free(threadBufferStore);
+
+		return -2;
 	}
+	mask = maskStore;
+	threadBuffers = threadBufferStore;
 
 	/* Stage 1: find good data and put in output array. */
 	for(i = 0; i <= N;)
 	{
-		const unsigned char *cur = src + i;
-		const vdif_header *vh = (const vdif_header *)cur;
+		const unsigned char *cur;
+		const vdif_header *vh;
 		int64_t frameNumber;
 		int destIndex;		/* frame index into destination array */
 		int chanId;
 
-		if( (vm->flags & VDIF_MUX_FLAG_ENABLEVALIDITY) && (getVDIFFrameInvalid(vh) > 0) )
+		if(i > regionEnd - vm->inputFrameSize)
 		{
-			i += vm->inputFrameSize;
-			++nInvalidFrame;
+			/* no more room for a frame in this region; frames don't cross regions so move on to next one */
+			nSkip += regionEnd - i;
+			i = regionEnd;
+			++r;
+			regionStart = regionEnd;
+			regionEnd += src[r].iov_len;
 
 			continue;
 		}
+		cur = (const unsigned char *)(src[r].iov_base) + (i - regionStart);
+		vh = (const vdif_header *)cur;
 
-		if(*((uint32_t *)(cur+vm->inputFrameSize-4)) == FILL_PATTERN)
+		switch(classifyvdifmuxframe(vm, cur, &chanId))
 		{
+		case VDIFMuxFrameInvalid:
+			i += vm->inputFrameSize;
+			++nInvalidFrame;
+
+			continue;
+		case VDIFMuxFrameFill:
 			/* Fill pattern at end of frame or invalid bit is set */
 			i += vm->inputFrameSize;
 			nFill += vm->inputFrameSize;
 
 			continue;
-		}
-		if(*((uint32_t *)cur) == FILL_PATTERN)
-		{
+		case VDIFMuxFrameFillStart:
 			/* Fill pattern at beginning of frame */
 			i += 8;
 			nFill += 8;
 
 			continue;
-		}
-		if(getVDIFFrameBytes(vh) != vm->inputFrameSize ||
-		   getVDIFNumChannels(vh) != vm->inputChannelsPerThread ||
-		   getVDIFBitsPerSample(vh) != vm->bitsPerSample)
-		{
-			i += 4;
-			nSkip += 4;
+		case VDIFMuxFrameNotVDIF:
+			{
+				int nResyncFill = 0;
+				int n;
 
-			continue;
-		}
+				n = resyncvdifmux(vm, cur, regionEnd - i, regionEnd - i, &nResyncFill);
+				i += n;
+				nFill += nResyncFill;
+				nSkip += n - nResyncFill;
+			}
 
-		/* If we are here, it looks like we have a VDIF frame to work with */
-		threadId = getVDIFThreadID(vh);
-		chanId = vm->chanIndex[threadId];
-		if(chanId == MAGIC_BAD_THREAD)
-		{
+			continue;
+		case VDIFMuxFrameWrongThread:
 			/* Not one of the threads we are looking for */
 			i += vm->inputFrameSize;
 			++nWrongThread;
 
 			continue;
+		case VDIFMuxFrameGood:
+			/* If we are here, it looks like we have a VDIF frame to work with */
+			break;
 		}
 
 		frameNumber = (int64_t)(getVDIFFrameEpochSecOffset(vh)) * vm->inputFramesPerSecond + getVDIFFrameNumber(vh);
@@ -511,29 +1098,8 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 
 		if(vhUnset)
 		{
-			memcpy(&outputHeader, vh, 16);
-			if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
-			{
-				/* FIXME: handle heirarchical multiplexing */
-
-				vdif_edv4_header *edv4 = (vdif_edv4_header *)(&outputHeader);
-
-				edv4->dummy = 0;
-				edv4->masklength = vm->nThread/vm->fanoutFactor;
-				edv4->eversion = 4;
-				edv4->syncword = 0xACABFEED;
-				edv4->validitymask = 0;
-			}
-			else
-			{
-				memset(((char *)&outputHeader) + 16, 0, 16);
-			}
-
 			/* use this first good frame to generate the prototype VDIF header for the output */
-			setVDIFNumChannels(&outputHeader, vm->nOutputChan);
-			setVDIFThreadID(&outputHeader, 0);
-			setVDIFFrameBytes(&outputHeader, vm->outputFrameSize);
-			setVDIFFrameInvalid(&outputHeader, 0);
+			setvdifmuxoutputheader(vm, &outputHeader, vh);
 			epoch = getVDIFEpoch(&outputHeader);
 
 			vhUnset = 0;
@@ -572,8 +1138,6 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 		}
 		else /* here we have a usable packet */
 		{
-			uint64_t *p = (uint64_t *)(dest + vm->outputFrameSize*destIndex);
-			
 			if(destIndex > highestDestIndex + vm->nGap)
 			{
 				if(nValidFrame > vm->nSort || startOutputFrameNumber >= 0)
@@ -597,11 +1161,9 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 					startFrameNumber -= (startFrameNumber % vm->frameGranularity);	/* to ensure first frame starts on integer ns */
 
 					/* clear mask of presence */
-					for(destIndex = 0; destIndex < highestDestIndex; ++destIndex)
-					{
-						p = (uint64_t *)(dest + vm->outputFrameSize*destIndex);
-						p[3] = 0;
-					}
+					memset(mask, 0, (highestDestIndex+1)*vm->nMaskWord*sizeof(uint64_t));
+					mask = maskStore;
+					threadBuffers = threadBufferStore;
 					highestDestIndex = 0;
 
 					/* at this point we're starting over, so there are no valid frames. */
@@ -609,22 +1171,18 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 					nValidFrame = 0;	
 
 					destIndex = frameNumber - startFrameNumber;
-					p = (uint64_t *)(dest + vm->outputFrameSize*destIndex);
 				}
 			}
 
 			/* set mask indicating valid data in place */
-			if(p[3] & (1 << chanId))
+			if(vdifmuxmasktest(mask + destIndex*vm->nMaskWord, chanId))
 			{
 				++nDup;
 			}
 			else
 			{
-				/* NOTE!  We're using just a bit of the dest buffer to store pointers to the original data payloads */
-				const unsigned char **threadBuffers = (const unsigned char **)(dest + vm->outputFrameSize*destIndex + VDIF_HEADER_BYTES);
-
-				p[3] |= (1 << chanId);
-				threadBuffers[chanId] = cur + VDIF_HEADER_BYTES;	/* store pointer to data for later corner turning */
+				vdifmuxmaskset(mask + destIndex*vm->nMaskWord, chanId);
+				threadBuffers[destIndex*vm->nThread + chanId] = cur + VDIF_HEADER_BYTES;	/* store pointer to data for later corner turning */
 				
 				++nValidFrame;
 
@@ -640,9 +1198,7 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 
 					for(firstUsed = 0; firstUsed <= highestDestIndex; ++firstUsed)
 					{
-						p = (uint64_t *)(dest + vm->outputFrameSize*firstUsed);
-
-						if(p[3] > 0)
+						if(!vdifmuxmaskempty(vm, mask + firstUsed*vm->nMaskWord))
 						{
 							break;
 						}
@@ -654,33 +1210,8 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 						firstUsed -= (firstUsed % vm->frameGranularity);
 
 						/* slide data forward */
-						for(f = firstUsed; f <= highestDestIndex; ++f)
-						{
-							int e = f-firstUsed;
-							uint64_t *q;
-
-							p = (uint64_t *)(dest + vm->outputFrameSize*e);
-							q = (uint64_t *)(dest + vm->outputFrameSize*f);
-							p[3] = q[3];
-
-							if(p[3] != 0)
-							{
-								const unsigned char * const *threadBuffers2;
-
-								threadBuffers  = (const unsigned char **)(dest + vm->outputFrameSize*e + VDIF_HEADER_BYTES);
-								threadBuffers2 = (const unsigned char **)(dest + vm->outputFrameSize*f + VDIF_HEADER_BYTES);
-								memcpy(threadBuffers, threadBuffers2, vm->nThread*sizeof(const unsigned char *));
-							}
-						}
-
-						/* zero any remaining masks */
-						for(f = highestDestIndex+1-firstUsed; f <= highestDestIndex ; ++f)
-						{
-							uint64_t *q;
-
-							q = (uint64_t *)(dest + vm->outputFrameSize*f);
-							q[3] = 0;
-						}
+						mask += firstUsed*vm->nMaskWord;
+						threadBuffers += firstUsed*vm->nThread;
 
 						/* change a few other indexes */
 						highestDestIndex -= firstUsed;
@@ -702,13 +1233,10 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 	if(nValidFrame < vm->nSort && startOutputFrameNumber < 0)
 	{
 		int firstUsed;
-		uint64_t *p;
 
 		for(firstUsed = 0; firstUsed <= highestDestIndex; ++firstUsed)
 		{
-			p = (uint64_t *)(dest + vm->outputFrameSize*firstUsed);
-
-			if(p[3] == vm->goodMask)
+			if(vdifmuxmaskcomplete(vm, mask + firstUsed*vm->nMaskWord))
 			{
 				break;
 			}
@@ -719,34 +1247,8 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 			firstUsed -= (firstUsed % vm->frameGranularity);
 
 			/* slide data forward */
-			for(f = firstUsed; f <= highestDestIndex; ++f)
-			{
-				int e = f-firstUsed;
-				uint64_t *q;
-
-				p = (uint64_t *)(dest + vm->outputFrameSize*e);
-				q = (uint64_t *)(dest + vm->outputFrameSize*f);
-				p[3] = q[3];
-
-				if(p[3] != 0)
-				{
-					const unsigned char **threadBuffers;
-					const unsigned char **threadBuffers2;
-
-					threadBuffers  = (const unsigned char **)(dest + vm->outputFrameSize*e + VDIF_HEADER_BYTES);
-					threadBuffers2 = (const unsigned char **)(dest + vm->outputFrameSize*f + VDIF_HEADER_BYTES);
-					memcpy(threadBuffers, threadBuffers2, vm->nThread*sizeof(const unsigned char *));
-				}
-			}
-
-			/* zero any remaining masks */
-			for(f = highestDestIndex+1-firstUsed; f <= highestDestIndex ; ++f)
-			{
-				uint64_t *q;
-
-				q = (uint64_t *)(dest + vm->outputFrameSize*f);
-				q[3] = 0;
-			}
+			mask += firstUsed*vm->nMaskWord;
+			threadBuffers += firstUsed*vm->nThread;
 
 			/* change a few other indexes */
 			highestDestIndex -= firstUsed;
@@ -760,31 +1262,27 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 	{
 		for(f = highestDestIndex; f > highestSortedDestIndex; --f)
 		{
-			const uint64_t *p = (const uint64_t *)(dest + vm->outputFrameSize*f);
-			uint64_t mask = p[3];
-
 			if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
 			{
-				if(mask == 0)
+				if(vdifmuxmaskempty(vm, mask + f*vm->nMaskWord))
 				{
 					highestDestIndex = f-1;
 				}
 			}
 			else
 			{
-				if(mask != vm->goodMask)
+				if(!vdifmuxmaskcomplete(vm, mask + f*vm->nMaskWord))
 				{
-					const unsigned char * const *threadBuffers = (const unsigned char **)(dest + vm->outputFrameSize*f + VDIF_HEADER_BYTES);
 					int t;
 					
 					highestDestIndex = f-1;
 					for(t = 0; t < vm->nThread; ++t)
 					{
-						if(mask & (1<<t))
+						if(vdifmuxmasktest(mask + f*vm->nMaskWord, t))
 						{
 							int d;
 
-							d = threadBuffers[t] - src - VDIF_HEADER_BYTES;	/* this is number of bytes into input stream */
+							d = vdifmuxsrcoffset(src, nRegion, srcSize, threadBuffers[f*vm->nThread + t] - VDIF_HEADER_BYTES);	/* this is number of bytes into input stream */
 							if(d < bytesProcessed)
 							{
 								bytesProcessed = d;
@@ -802,31 +1300,27 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 
 		if(minDestIndex >= 0) for(f = highestDestIndex; f >= minDestIndex; --f)
 		{
-			const uint64_t *p = (const uint64_t *)(dest + vm->outputFrameSize*f);
-			uint64_t mask = p[3];
-
 			if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
 			{
-				if(mask == 0)
+				if(vdifmuxmaskempty(vm, mask + f*vm->nMaskWord))
 				{
 					highestDestIndex = f-1;
 				}
 			}
 			else
 			{
-				if(mask != vm->goodMask)
+				if(!vdifmuxmaskcomplete(vm, mask + f*vm->nMaskWord))
 				{
-					const unsigned char * const *threadBuffers = (const unsigned char **)(dest + vm->outputFrameSize*f + VDIF_HEADER_BYTES);
 					int t;
 					
 					highestDestIndex = f-1;
 					for(t = 0; t < vm->nThread; ++t)
 					{
-						if(mask & (1<<t))
+						if(vdifmuxmasktest(mask + f*vm->nMaskWord, t))
 						{
 							int d;
 
-							d = threadBuffers[t] - src - VDIF_HEADER_BYTES;	/* this is number of bytes into input stream */
+							d = vdifmuxsrcoffset(src, nRegion, srcSize, threadBuffers[f*vm->nThread + t] - VDIF_HEADER_BYTES);	/* this is number of bytes into input stream */
 							if(d < bytesProcessed)
 							{
 								bytesProcessed = d;
@@ -846,116 +1340,10 @@ int vdifmux(unsigned char *dest, int destSize, const unsigned char *src, int src
 	}
 
 	/* Stage 2: do the corner turning and header population */
+	vdifmuxstage2(dest, fillData, vm, &outputHeader, startFrameNumber, highestDestIndex+1, mask, threadBuffers, &nGoodOutput, &nBadOutput, &nPartialOutput);
 
-	seconds = startFrameNumber/vm->inputFramesPerSecond;
-	frameNum = startFrameNumber%vm->inputFramesPerSecond;
-
-	for(f = 0; f <= highestDestIndex; ++f)
-	{
-		unsigned char *frame = dest + vm->outputFrameSize*f;	/* points to rearrangement destination */
-		const uint64_t *p = (const uint64_t *)frame;
-		uint64_t mask;
-
-		mask = p[3];
-
-		/* generate header for output frame */
-		memcpy(frame, (const char *)&outputHeader, VDIF_HEADER_BYTES);
-		setVDIFFrameEpochSecOffset((vdif_header *)frame, seconds);
-		setVDIFFrameNumber((vdif_header *)frame, frameNum);
-
-		if(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY)
-		{
-			if(mask != 0)
-			{
-				const unsigned char **threadBuffers = (const unsigned char **)(frame + VDIF_HEADER_BYTES);
-				vdif_edv4_header *edv4 = (vdif_edv4_header *)frame;
-				if(vm->fanoutFactor > 1)
-				{
-					int k;
-
-					edv4->validitymask = 0;
-					for(i = k = 0; i < vm->nThread; i += vm->fanoutFactor, ++k)
-					{
-						int m;
-						int j;
-						
-						m = 1;
-						for(j = 0; j < vm->fanoutFactor; ++j)
-						{
-							m &= (mask >> (i+j));
-						}
-						edv4->validitymask |= (m << k);
-					}
-				}
-				else
-				{
-					edv4->validitymask = mask;
-				}
-
-				if(mask != vm->goodMask)
-				{
-					int64_t i;
-					/* point to random data rather than nowhere for invalid frames */
-
-					for(i = 0; i < vm->nThread; ++i)
-					{
-						if( (mask & (1LL << i)) == 0)
-						{
-							threadBuffers[i] = src;
-						}
-					}
-
-				}
-
-				/* Note: The following function only works because all of the corner turners make a copy of the
-				 * thread pointers before beginning */
-				vm->cornerTurner(frame + VDIF_HEADER_BYTES, threadBuffers, vm->outputDataSize);
-
-				if(mask == vm->goodMask)
-				{
-					++nGoodOutput;
-				}
-				else
-				{
-					++nPartialOutput;
-				}
-			}
-			else
-			{
-				/* Set invalid bit */
-				setVDIFFrameInvalid((vdif_header *)frame, 1);
-
-				++nBadOutput;
-			}
-		}
-		else
-		{
-			if(mask == vm->goodMask)
-			{
-				const unsigned char * const *threadBuffers = (const unsigned char * const *)(frame + VDIF_HEADER_BYTES);
-
-				/* Note: The following function only works because all of the corner turners make a copy of the
-				 * thread pointers before beginning */
-				vm->cornerTurner(frame + VDIF_HEADER_BYTES, threadBuffers, vm->outputDataSize);
-
-				++nGoodOutput;
-			}
-			else
-			{
-				/* Set invalid bit */
-				setVDIFFrameInvalid((vdif_header *)frame, 1);
-
-				++nBadOutput;
-			}
-		}
-
-		++frameNum;
-		if(frameNum >= vm->inputFramesPerSecond)
-		{
-			++seconds;
-			frameNum -= vm->inputFramesPerSecond;
-		}
-	}
+	free(maskStore);
+	free(threadBufferStore);
 
 	if(stats)
 	{
@@ -1004,6 +1392,7 @@ void printvdifmuxstatistics(const struct vdif_mux_statistics *stats)
 		printf("  Total number of bytes processed    = %lld\n", stats->bytesProcessed);
 		printf("  Total number of good output frames = %lld\n", stats->nGoodFrame);
 		printf("  Total number of partial out frames = %lld\n", stats->nPartialFrame);
+		printf("  Worst output latency (frames)      = %lld\n", stats->maxLatency);
 		printf("Properties of output data from recent call:\n");
 		printf("  Input frame size                   = %d\n", stats->inputFrameSize);
 		printf("  Output frame size                  = %d\n", stats->outputFrameSize);
@@ -1029,3 +1418,782 @@ void resetvdifmuxstatistics(struct vdif_mux_statistics *stats)
 	}
 }
 
+
+
+/* *** Streaming multiplexer *** */
+
+/* One buffer handed to pushvdifmuxstream().  Frames within it are referenced in place until output. */
+struct vdif_mux_stream_buffer
+{
+	const unsigned char *data;
+	int nRef;				/* number of pending frames pointing into this buffer */
+	int active;				/* set while still inside pushvdifmuxstream() */
+	void (*release)(const unsigned char *, void *);
+	void *userData;
+	struct vdif_mux_stream_buffer *next;
+};
+
+struct vdif_mux_stream
+{
+	struct vdif_mux vm;			/* private copy of the multiplexer configuration */
+	int nSlot;				/* size of the frame sorting ring; a power of 2 */
+	int nSortFrame;				/* number of output frames a frame must trail the newest one by to be considered final */
+	int maxReorder;				/* if > 0, realtime mode with this reorder window (frames); see setvdifmuxstreamlatency() */
+	uint64_t *mask;				/* [nSlot*vm.nMaskWord] presence of each thread */
+	const unsigned char **payload;		/* [nSlot*nThread] pointer to each thread's data */
+	struct vdif_mux_stream_buffer **owner;	/* [nSlot*nThread] buffer holding each payload, or 0 if it is in store */
+	unsigned char *store;			/* [nSlot*nThread*inputDataSize] private payload copies; allocated when first needed */
+	unsigned char *zeros;			/* [inputDataSize] stands in for missing threads */
+	struct vdif_mux_stream_buffer *buffers;	/* buffers that are still referenced */
+
+	int started;				/* set once the first good frame is seen */
+	int sorted;				/* set once the first nSort good frames have been seen, or flushed */
+	int flushed;				/* no more data is coming; output everything */
+	int jump;				/* a gap larger than nGap was seen; drain before accepting more data */
+	int64_t startFrameNumber;		/* frame number of next frame to output */
+	int64_t highestFrameNumber;		/* highest frame number seen so far */
+	int64_t firstFrameNumber;		/* frame number of the first good frame since starting */
+	int nSortValid;				/* good frames seen before sorted was set */
+
+	unsigned char *tail;			/* [2*inputFrameSize] bytes left over from the end of the previous push */
+	int nTail;
+
+	vdif_header outputHeader;
+	int headerSet;				/* set once outputHeader has been generated from the first good frame */
+	int epoch;
+
+	/* accumulated since the last call to pullvdifmuxstream() */
+	struct vdif_mux_statistics pending;
+};
+
+static void releasevdifmuxstreambuffer(struct vdif_mux_stream *vs, struct vdif_mux_stream_buffer *buf)
+{
+	struct vdif_mux_stream_buffer **b;
+
+	if(buf->nRef > 0 || buf->active)
+	{
+		return;
+	}
+
+	for(b = &vs->buffers; *b; b = &(*b)->next)
+	{
+		if(*b == buf)
+		{
+			*b = buf->next;
+			break;
+		}
+	}
+	if(buf->release)
+	{
+		buf->release(buf->data, buf->userData);
+	}
+	free(buf);
+}
+
+/* forget about thread t of frame number f */
+static void dropvdifmuxstreamframe(struct vdif_mux_stream *vs, int64_t f, int t)
+{
+	int s = f & (vs->nSlot-1);
+	struct vdif_mux_stream_buffer *buf = vs->owner[s*vs->vm.nThread + t];
+
+	vdifmuxmaskclear(vs->mask + s*vs->vm.nMaskWord, t);
+	if(buf)
+	{
+		vs->owner[s*vs->vm.nThread + t] = 0;
+		--buf->nRef;
+		releasevdifmuxstreambuffer(vs, buf);
+	}
+}
+
+/* keep a private copy of thread t of frame number f so that its buffer can be released */
+static int detachvdifmuxstreamframe(struct vdif_mux_stream *vs, int64_t f, int t, const unsigned char *data)
+{
+	int s = f & (vs->nSlot-1);
+	int i = s*vs->vm.nThread + t;
+	unsigned char *dest;
+
+	if(!vs->store)
+	{
+		vs->store = (unsigned char *)malloc((size_t)vs->nSlot*vs->vm.nThread*vs->vm.inputDataSize);
+		if(!vs->store)
+		{
+			fprintf(stderr, "Error: vdifmux stream: cannot allocate %lld bytes for frame storage\n", (long long)vs->nSlot*vs->vm.nThread*vs->vm.inputDataSize);
+
+			return -1;
+		}
+	}
+	dest = vs->store + (size_t)i*vs->vm.inputDataSize;
+	if(dest != data)
+	{
+		memcpy(dest, data, vs->vm.inputDataSize);
+	}
+	vs->payload[i] = dest;
+	if(vs->owner[i])
+	{
+		struct vdif_mux_stream_buffer *buf = vs->owner[i];
+
+		vs->owner[i] = 0;
+		--buf->nRef;
+		releasevdifmuxstreambuffer(vs, buf);
+	}
+
+	return 0;
+}
+
+/* throw away all pending frames and start over */
+static void restartvdifmuxstream(struct vdif_mux_stream *vs)
+{
+	int64_t f;
+	int t;
+
+	if(vs->started)
+	{
+		for(f = vs->startFrameNumber; f <= vs->highestFrameNumber; ++f)
+		{
+			for(t = 0; t < vs->vm.nThread; ++t)
+			{
+				dropvdifmuxstreamframe(vs, f, t);
+			}
+		}
+	}
+	vs->started = 0;
+	vs->sorted = 0;
+	vs->jump = 0;
+	vs->nSortValid = 0;
+}
+
+/* (Re)allocates the frame sorting ring, which must be empty, to suit vs->nSortFrame.  Returns 0 on success. */
+static int allocvdifmuxstreamring(struct vdif_mux_stream *vs)
+{
+	const struct vdif_mux *vm = &vs->vm;
+	int span;
+
+	free(vs->mask);
+	free(vs->payload);
+	free(vs->owner);
+	free(vs->store);
+	vs->store = 0;
+
+	/* the ring must span the initial nSort margin, the sort window, the largest tolerated gap and granularity alignment */
+	span = vm->nSort + vs->nSortFrame + vm->nGap + 2*vm->frameGranularity + 1;
+	for(vs->nSlot = 1; vs->nSlot < span; vs->nSlot *= 2);
+
+	vs->mask = (uint64_t *)calloc((size_t)vs->nSlot*vm->nMaskWord, sizeof(uint64_t));
+	vs->payload = (const unsigned char **)calloc((size_t)vs->nSlot*vm->nThread, sizeof(const unsigned char *));
+	vs->owner = (struct vdif_mux_stream_buffer **)calloc((size_t)vs->nSlot*vm->nThread, sizeof(struct vdif_mux_stream_buffer *));
+	if(!vs->mask || !vs->payload || !vs->owner)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns a newly allocated streaming multiplexer for the given (already configured) vdif_mux, or 0 on error.
+ * The configuration is copied, so vm need not persist.
+ */
+struct vdif_mux_stream *newvdifmuxstream(const struct vdif_mux *vm)
+{
+	struct vdif_mux_stream *vs;
+
+	if(!vm)
+	{
+		fprintf(stderr, "Error: newvdifmuxstream called with null vdif_mux structure\n");
+
+		return 0;
+	}
+	if(vm->nSort <= 0 || vm->nGap < 0)
+	{
+		fprintf(stderr, "Error: newvdifmuxstream: nSort must be positive and nGap must not be negative; got %d and %d\n", vm->nSort, vm->nGap);
+
+		return 0;
+	}
+
+	vs = (struct vdif_mux_stream *)calloc(1, sizeof(struct vdif_mux_stream));
+	if(!vs)
+	{
+		fprintf(stderr, "Error: newvdifmuxstream: cannot allocate memory\n");
+
+		return 0;
+	}
+	memcpy(&vs->vm, vm, sizeof(struct vdif_mux));
+
+	vs->nSortFrame = (vm->nSort + vm->nThread - 1)/vm->nThread;
+
+	vs->zeros = (unsigned char *)calloc(1, vm->inputDataSize);
+	vs->tail = (unsigned char *)malloc(2*vm->inputFrameSize);
+	if(allocvdifmuxstreamring(vs) < 0 || !vs->zeros || !vs->tail)
+	{
+		fprintf(stderr, "Error: newvdifmuxstream: cannot allocate memory\n");
+		deletevdifmuxstream(vs);
+
+		return 0;
+	}
+
+	return vs;
+}
+
+/* Switches the streaming multiplexer into (maxReorder > 0) or out of (maxReorder = 0) realtime mode.
+ * In realtime mode an output frame is final as soon as it is complete or the newest input frame is
+ * maxReorder frames later than it, whichever comes first; incomplete frames are then output as partial
+ * (EDV4) or invalid frames and any pieces arriving afterwards are discarded.  Output also starts once
+ * the input spans maxReorder frames rather than waiting for nSort good frames.  Output thus trails input
+ * by at most maxReorder frame periods, provided pullvdifmuxstream() is called after each push with room
+ * for the frames that are ready; the latency actually seen is reported in the maxLatency statistic.
+ *
+ * Must be called before any data is pushed, or after a flush has been fully drained.
+ *
+ * Returns 0 on success or < 0 on error.
+ */
+int setvdifmuxstreamlatency(struct vdif_mux_stream *vs, int maxReorder)
+{
+	if(!vs || maxReorder < 0)
+	{
+		fprintf(stderr, "Error: setvdifmuxstreamlatency: bad parameters\n");
+
+		return -1;
+	}
+	if(vs->started || vs->buffers || vs->nTail > 0)
+	{
+		fprintf(stderr, "Error: setvdifmuxstreamlatency: cannot change latency while data is pending\n");
+
+		return -2;
+	}
+
+	vs->maxReorder = maxReorder;
+	if(maxReorder > 0)
+	{
+		vs->nSortFrame = maxReorder;
+	}
+	else
+	{
+		vs->nSortFrame = (vs->vm.nSort + vs->vm.nThread - 1)/vs->vm.nThread;
+	}
+	if(allocvdifmuxstreamring(vs) < 0)
+	{
+		fprintf(stderr, "Error: setvdifmuxstreamlatency: cannot allocate memory\n");
+
+		return -3;
+	}
+
+	return 0;
+}
+
+/* Frees the streaming multiplexer.  Any pending frames are discarded and their buffers released. */
+void deletevdifmuxstream(struct vdif_mux_stream *vs)
+{
+	if(vs)
+	{
+		if(vs->mask && vs->owner)
+		{
+			restartvdifmuxstream(vs);
+		}
+		while(vs->buffers)
+		{
+			/* should not happen, but make sure nobody is left waiting */
+			vs->buffers->nRef = 0;
+			vs->buffers->active = 0;
+			releasevdifmuxstreambuffer(vs, vs->buffers);
+		}
+		free(vs->mask);
+		free(vs->payload);
+		free(vs->owner);
+		free(vs->store);
+		free(vs->zeros);
+		free(vs->tail);
+		free(vs);
+	}
+}
+
+/* End of the initial nSort period: the earliest frame acceptable is known, so scrunch forward */
+static void sortvdifmuxstream(struct vdif_mux_stream *vs)
+{
+	int64_t f;
+
+	for(f = vs->startFrameNumber; f <= vs->highestFrameNumber; ++f)
+	{
+		if(!vdifmuxmaskempty(&vs->vm, vs->mask + (f & (vs->nSlot-1))*vs->vm.nMaskWord))
+		{
+			break;
+		}
+	}
+	f -= (f % vs->vm.frameGranularity);
+	if(f > vs->startFrameNumber)
+	{
+		vs->startFrameNumber = f;
+	}
+	vs->sorted = 1;
+}
+
+/* Add one good frame to the sorting ring.  If buf is 0 the frame is copied into private storage.
+ * Returns 0 if the frame was accepted (or discarded as a duplicate or late arrival) and -1 if
+ * there is no room for it until output is pulled.
+ */
+static int addvdifmuxstreamframe(struct vdif_mux_stream *vs, const unsigned char *cur, int chanId, struct vdif_mux_stream_buffer *buf)
+{
+	const struct vdif_mux *vm = &vs->vm;
+	const vdif_header *vh = (const vdif_header *)cur;
+	int64_t frameNumber;
+	int s, i;
+
+	frameNumber = (int64_t)(getVDIFFrameEpochSecOffset(vh)) * vm->inputFramesPerSecond + getVDIFFrameNumber(vh);
+
+	if(vs->started && frameNumber > vs->highestFrameNumber + vm->nGap)
+	{
+		if(!vs->sorted)
+		{
+			/* still in the initial nSort period: start over here, as vdifmux() would */
+			vs->pending.nSkippedByte += (long long)vs->nSortValid*vm->inputFrameSize;
+			vs->pending.nValidFrame -= vs->nSortValid;
+			restartvdifmuxstream(vs);
+		}
+		else
+		{
+			/* output everything pending before continuing with the new data */
+			vs->jump = 1;
+
+			return -1;
+		}
+	}
+
+	if(!vs->started)
+	{
+		if(!vs->headerSet)
+		{
+			/* use this first good frame to generate the prototype VDIF header for the output */
+			setvdifmuxoutputheader(vm, &vs->outputHeader, vh);
+			vs->epoch = getVDIFEpoch(&vs->outputHeader);
+			vs->headerSet = 1;
+		}
+		vs->startFrameNumber = frameNumber - vm->nSort;
+		if(vs->startFrameNumber < 0)
+		{
+			vs->startFrameNumber = 0;
+		}
+		vs->startFrameNumber -= (vs->startFrameNumber % vm->frameGranularity);	/* to ensure first frame starts on integer ns */
+		vs->highestFrameNumber = frameNumber;
+		vs->firstFrameNumber = frameNumber;
+		vs->started = 1;
+	}
+
+	if(frameNumber < vs->startFrameNumber)
+	{
+		/* too late; that frame has already been output */
+		if(vs->sorted)
+		{
+			++vs->pending.nDiscardedFrame;
+		}
+		else
+		{
+			vs->pending.nSkippedByte += vm->inputFrameSize;
+		}
+
+		return 0;
+	}
+	if(frameNumber - vs->startFrameNumber >= vs->nSlot && !vs->sorted)
+	{
+		/* no room to wait for the full nSort frames */
+		sortvdifmuxstream(vs);
+	}
+	if(frameNumber - vs->startFrameNumber >= vs->nSlot)
+	{
+		/* need to output some frames first */
+		return -1;
+	}
+
+	s = frameNumber & (vs->nSlot-1);
+	i = s*vm->nThread + chanId;
+	if(vdifmuxmasktest(vs->mask + s*vm->nMaskWord, chanId))
+	{
+		++vs->pending.nDuplicateFrame;
+
+		return 0;
+	}
+
+	vdifmuxmaskset(vs->mask + s*vm->nMaskWord, chanId);
+	if(buf)
+	{
+		vs->payload[i] = cur + VDIF_HEADER_BYTES;
+		vs->owner[i] = buf;
+		++buf->nRef;
+	}
+	else if(detachvdifmuxstreamframe(vs, frameNumber, chanId, cur + VDIF_HEADER_BYTES) < 0)
+	{
+		vdifmuxmaskclear(vs->mask + s*vm->nMaskWord, chanId);
+
+		return -1;
+	}
+	++vs->pending.nValidFrame;
+	if(frameNumber > vs->highestFrameNumber)
+	{
+		vs->highestFrameNumber = frameNumber;
+	}
+
+	if(!vs->sorted && (++vs->nSortValid >= vm->nSort || (vs->maxReorder > 0 && vs->highestFrameNumber - vs->firstFrameNumber >= vs->maxReorder)))
+	{
+		sortvdifmuxstream(vs);
+	}
+
+	return 0;
+}
+
+/* Scan for frames in [data, data+size) and add them to the ring.  buf is 0 for data that is not retained.
+ * Returns number of bytes consumed; stops early if a frame cannot be accepted until output is pulled,
+ * or in realtime mode as soon as there is a frame ready to be output.
+ */
+static int scanvdifmuxstream(struct vdif_mux_stream *vs, const unsigned char *data, int size, int limit, struct vdif_mux_stream_buffer *buf)
+{
+	const struct vdif_mux *vm = &vs->vm;
+	int i;
+
+	for(i = 0; i < limit && i <= size - vm->inputFrameSize;)
+	{
+		int chanId;
+
+		if(vs->maxReorder > 0 && vs->sorted && vs->highestFrameNumber - vs->startFrameNumber >= vs->maxReorder)
+		{
+			/* realtime mode: the oldest frame is now final, so have it pulled before going on */
+			break;
+		}
+
+		switch(classifyvdifmuxframe(vm, data + i, &chanId))
+		{
+		case VDIFMuxFrameInvalid:
+			i += vm->inputFrameSize;
+			++vs->pending.nInvalidFrame;
+			break;
+		case VDIFMuxFrameFill:
+			i += vm->inputFrameSize;
+			vs->pending.nFillByte += vm->inputFrameSize;
+			break;
+		case VDIFMuxFrameFillStart:
+			i += 8;
+			vs->pending.nFillByte += 8;
+			break;
+		case VDIFMuxFrameNotVDIF:
+			{
+				int nResyncFill = 0;
+				int n;
+
+				n = resyncvdifmux(vm, data + i, size - i, limit - i, &nResyncFill);
+				i += n;
+				vs->pending.nFillByte += nResyncFill;
+				vs->pending.nSkippedByte += n - nResyncFill;
+			}
+			break;
+		case VDIFMuxFrameWrongThread:
+			i += vm->inputFrameSize;
+			++vs->pending.nWrongThread;
+			break;
+		case VDIFMuxFrameGood:
+			if(addvdifmuxstreamframe(vs, data + i, chanId, buf) < 0)
+			{
+				return i;
+			}
+			i += vm->inputFrameSize;
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* Params are:
+ *
+ * vs:
+ *	streaming multiplexer from newvdifmuxstream()
+ * src:
+ *	pointer to input (multi-thread) VDIF data.  Need not start or end on a frame boundary.
+ * srcSize:
+ *	length of the input (src) array.
+ * release:
+ *	if not 0, frames are used in place and release(src, userData) is called once nothing in
+ *	src is referenced any more; src must not be changed until then.  Release may be called before
+ *	this function returns.  If 0, any frames still needed are copied before returning.
+ * userData:
+ *	passed to release
+ *
+ * Returns:
+ *  < 0 on error
+ *  number of bytes of src consumed.  This will be less than srcSize if output needs to be pulled
+ *  before more data can be accepted; in that case call pullvdifmuxstream() and then push the remainder
+ *  (src + return value).  Unconsumed bytes are not referenced.
+ */
+int pushvdifmuxstream(struct vdif_mux_stream *vs, const unsigned char *src, int srcSize, void (*release)(const unsigned char *, void *), void *userData)
+{
+	int frameSize;
+	struct vdif_mux_stream_buffer *buf;
+	int i = 0;
+	int stalled = 0;			/* set if output must be pulled before continuing */
+
+	if(!vs || srcSize < 0)
+	{
+		fprintf(stderr, "Error: pushvdifmuxstream: bad parameters\n");
+
+		return -1;
+	}
+	frameSize = vs->vm.inputFrameSize;
+	if(vs->flushed)
+	{
+		/* start of a new stream */
+		vs->flushed = 0;
+	}
+
+	buf = (struct vdif_mux_stream_buffer *)calloc(1, sizeof(struct vdif_mux_stream_buffer));
+	if(!buf)
+	{
+		fprintf(stderr, "Error: pushvdifmuxstream: cannot allocate memory\n");
+
+		return -2;
+	}
+	buf->data = src;
+	buf->active = 1;
+	buf->release = release;
+	buf->userData = userData;
+	buf->next = vs->buffers;
+	vs->buffers = buf;
+
+	/* First deal with frames straddling the end of the previous push.  Only these get copied. */
+	if(vs->nTail > 0 && !vs->jump)
+	{
+		int n, used;
+
+		n = srcSize < frameSize ? srcSize : frameSize;
+		memcpy(vs->tail + vs->nTail, src, n);
+		used = scanvdifmuxstream(vs, vs->tail, vs->nTail + n, vs->nTail, 0);
+		if(used >= vs->nTail)
+		{
+			/* done with the tail; continue in src */
+			i = used - vs->nTail;
+			vs->nTail = 0;
+		}
+		else if(vs->nTail + n - used < frameSize && n == srcSize)
+		{
+			/* all of src fits in the tail and still there is not a whole frame */
+			memmove(vs->tail, vs->tail + used, vs->nTail + n - used);
+			vs->nTail += n - used;
+			i = srcSize;
+		}
+		else
+		{
+			/* stopped early; keep what is left of the old tail */
+			memmove(vs->tail, vs->tail + used, vs->nTail - used);
+			vs->nTail -= used;
+			stalled = 1;
+		}
+	}
+	else if(vs->jump)
+	{
+		stalled = 1;
+	}
+
+	if(!stalled && i < srcSize)
+	{
+		int used;
+
+		used = scanvdifmuxstream(vs, src + i, srcSize - i, srcSize, buf);
+		if(i + used < srcSize && srcSize - i - used < frameSize)
+		{
+			/* whatever is left is too short to be a frame; keep it for next time */
+			memcpy(vs->tail, src + i + used, srcSize - i - used);
+			vs->nTail = srcSize - i - used;
+			i = srcSize;
+		}
+		else
+		{
+			i += used;
+		}
+	}
+
+	vs->pending.srcSize += srcSize;
+	vs->pending.srcUsed += i;
+	vs->pending.bytesProcessed += i;
+
+	if(!release && buf->nRef > 0)
+	{
+		int64_t f;
+		int t;
+
+		/* caller wants the buffer back now, so make copies of anything still needed */
+		for(f = vs->startFrameNumber; f <= vs->highestFrameNumber; ++f)
+		{
+			int s = f & (vs->nSlot-1);
+
+			for(t = 0; t < vs->vm.nThread; ++t)
+			{
+				if(vs->owner[s*vs->vm.nThread + t] == buf)
+				{
+					if(detachvdifmuxstreamframe(vs, f, t, vs->payload[s*vs->vm.nThread + t]) < 0)
+					{
+						dropvdifmuxstreamframe(vs, f, t);
+					}
+				}
+			}
+		}
+	}
+	buf->active = 0;
+	releasevdifmuxstreambuffer(vs, buf);
+
+	return i;
+}
+
+/* Indicate that no more data will be pushed.  Subsequent calls to pullvdifmuxstream() will produce all pending frames. */
+void flushvdifmuxstream(struct vdif_mux_stream *vs)
+{
+	if(vs)
+	{
+		vs->flushed = 1;
+		vs->pending.nSkippedByte += vs->nTail;
+		vs->nTail = 0;
+	}
+}
+
+/* Params are:
+ *
+ * vs:
+ *	streaming multiplexer from newvdifmuxstream()
+ * dest:
+ *	pointer to output (multiplexed, single-thread) VDIF data.
+ * destSize:
+ *	the size of the output (dest) array.
+ * stats:
+ *	statistics and information about the processing.  The accumulating fields include everything
+ *	pushed since the previous pull; the rest describe the output of this call.
+ *
+ * Produces as many output frames as are final and fit in dest.  A frame is final once it is complete,
+ * or the newest frame seen is enough later than it (set by nSort, or by setvdifmuxstreamlatency() in
+ * realtime mode), or the stream has been flushed.
+ * Output frame numbers are contiguous except following a gap of more than nGap frames in the input.
+ *
+ * Returns:
+ *  < 0 on error
+ *  number of bytes of dest populated
+ */
+int pullvdifmuxstream(struct vdif_mux_stream *vs, unsigned char *dest, int destSize, struct vdif_mux_statistics *stats)
+{
+	const struct vdif_mux *vm;
+	int maxFrames;
+	int nFrame = 0;
+	int nGoodOutput = 0;
+	int nBadOutput = 0;
+	int nPartialOutput = 0;
+	int64_t startFrameNumber = -1;
+	int64_t latency = 0;
+	int f, t;
+
+	if(!vs || !dest || destSize < 0)
+	{
+		fprintf(stderr, "Error: pullvdifmuxstream: bad parameters\n");
+
+		return -1;
+	}
+	vm = &vs->vm;
+	maxFrames = destSize/vm->outputFrameSize;
+
+	if(vs->started && (vs->sorted || vs->flushed || vs->jump))
+	{
+		const int drain = vs->flushed || vs->jump;
+
+		startFrameNumber = vs->startFrameNumber;
+		for(nFrame = 0; nFrame < maxFrames; ++nFrame)
+		{
+			int64_t frameNumber = startFrameNumber + nFrame;
+			int s = frameNumber & (vs->nSlot-1);
+
+			if(frameNumber > vs->highestFrameNumber)
+			{
+				break;
+			}
+			if(!drain && !vdifmuxmaskcomplete(vm, vs->mask + s*vm->nMaskWord) && vs->highestFrameNumber - frameNumber < vs->nSortFrame)
+			{
+				/* more pieces of this frame may still arrive */
+				break;
+			}
+		}
+	}
+
+	if(nFrame > 0)
+	{
+		int s = startFrameNumber & (vs->nSlot-1);
+		int n1 = nFrame;
+
+		/* the first frame output has waited longest */
+		latency = vs->highestFrameNumber - startFrameNumber;
+
+		/* the ring serves directly as the Stage 2 index, in two pieces if it wraps */
+		if(s + n1 > vs->nSlot)
+		{
+			n1 = vs->nSlot - s;
+		}
+		vdifmuxstage2(dest, vs->zeros, vm, &vs->outputHeader, startFrameNumber, n1, vs->mask + s*vm->nMaskWord, vs->payload + s*vm->nThread, &nGoodOutput, &nBadOutput, &nPartialOutput);
+		if(n1 < nFrame)
+		{
+			vdifmuxstage2(dest + n1*vm->outputFrameSize, vs->zeros, vm, &vs->outputHeader, startFrameNumber + n1, nFrame - n1, vs->mask, vs->payload, &nGoodOutput, &nBadOutput, &nPartialOutput);
+		}
+
+		/* now the input data can be let go */
+		for(f = 0; f < nFrame; ++f)
+		{
+			int64_t frameNumber = startFrameNumber + f;
+			const uint64_t *mask = vs->mask + (frameNumber & (vs->nSlot-1))*vm->nMaskWord;
+
+			if(!vdifmuxmaskcomplete(vm, mask) && !(vm->flags & VDIF_MUX_FLAG_PROPAGATEVALIDITY))
+			{
+				/* partial frames can't be used without EDV4 */
+				for(t = 0; t < vm->nThread; ++t)
+				{
+					if(vdifmuxmasktest(mask, t))
+					{
+						++vs->pending.nDiscardedFrame;
+					}
+				}
+			}
+			for(t = 0; t < vm->nThread; ++t)
+			{
+				dropvdifmuxstreamframe(vs, frameNumber, t);
+			}
+		}
+		vs->startFrameNumber += nFrame;
+	}
+
+	if((vs->flushed || vs->jump) && vs->started && vs->startFrameNumber > vs->highestFrameNumber)
+	{
+		/* drained; the next frame starts a new sequence */
+		restartvdifmuxstream(vs);
+	}
+
+	if(stats)
+	{
+		stats->nValidFrame += vs->pending.nValidFrame;
+		stats->nInvalidFrame += vs->pending.nInvalidFrame;
+		stats->nDiscardedFrame += vs->pending.nDiscardedFrame;
+		stats->nWrongThread += vs->pending.nWrongThread;
+		stats->nDuplicateFrame += vs->pending.nDuplicateFrame;
+		stats->nSkippedByte += vs->pending.nSkippedByte;
+		stats->nFillByte += vs->pending.nFillByte;
+		stats->bytesProcessed += vs->pending.bytesProcessed;
+		stats->nGoodFrame += nGoodOutput;
+		stats->nPartialFrame += nPartialOutput;
+		if(latency > stats->maxLatency)
+		{
+			stats->maxLatency = latency;
+		}
+
+		stats->srcSize = vs->pending.srcSize;
+		stats->srcUsed = vs->pending.srcUsed;
+		stats->destSize = destSize;
+		stats->destUsed = nFrame*vm->outputFrameSize;
+		stats->inputFrameSize = vm->inputFrameSize;
+		stats->outputFrameSize = vm->outputFrameSize;
+		stats->outputFrameGranularity = vm->frameGranularity;
+		stats->outputFramesPerSecond = vm->inputFramesPerSecond;
+		stats->nOutputFrame = nFrame;
+		stats->epoch = vs->epoch;
+		stats->startFrameNumber = (nFrame > 0) ? startFrameNumber : -1;
+
+		++stats->nCall;
+	}
+	memset(&vs->pending, 0, sizeof(vs->pending));
+
+	return nFrame*vm->outputFrameSize;
+}
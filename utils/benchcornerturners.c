@@ -0,0 +1,400 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Walter Brisken                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <vdifio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+const char program[] = "benchcornerturners";
+const char author[]  = "Walter Brisken <wbrisken@nrao.edu>";
+const char version[] = "0.1";
+const char verdate[] = "20261017";
+
+/* output sizes swept by default: from comfortably L1 resident to well beyond any last level cache */
+static const int defaultSizes[] = { 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864, 0 };
+
+static const int allBits[] = { 1, 2, 4, 8, 16, 32, 64, 128, 0 };
+
+#define MAX_SIZES		32
+#define MAX_BENCH_THREADS	64	/* corner turners exist for up to this many threads */
+
+enum OutputFormat
+{
+	FormatCSV,
+	FormatJSON
+};
+
+static void usage(const char *pgm)
+{
+	printf("%s ver. %s  %s  %s\n\n", program, version, author, verdate);
+	printf("A utility to benchmark every corner turner that getCornerTurner() or\n"
+		"getCornerTurnerISA() can return, on every instruction set this CPU supports.\n\n");
+	printf("Usage: %s [options]\n\n", pgm);
+	printf("Options can include:\n\n");
+	printf("  --help\n");
+	printf("  -h            Print this help info and quit\n\n");
+	printf("  --csv         Write results as CSV [default]\n\n");
+	printf("  --json        Write results as JSON\n\n");
+	printf("  --output <f>\n");
+	printf("  -o <f>        Write results to file <f> rather than stdout\n\n");
+	printf("  --threads <t>\n");
+	printf("  -t <t>        Only benchmark corner turners for <t> threads (negative\n"
+	       "                values select alternate portable versions)\n\n");
+	printf("  --bits <b>\n");
+	printf("  -b <b>        Only benchmark corner turners for <b> bits per sample\n\n");
+	printf("  --isa <i>\n");
+	printf("  -i <i>        Only benchmark instruction set <i> (generic, SSE4.1, AVX2,\n"
+	       "                AVX-512BW)\n\n");
+	printf("  --sizes <s>\n");
+	printf("  -s <s>        Comma-separated list of output sizes in bytes\n"
+	       "                [default = 4096,16384,...,67108864]\n\n");
+	printf("  --time <sec>\n");
+	printf("  -T <sec>      Minimum time to spend on each measurement [default = 0.05]\n\n");
+	printf("Throughput is in GB/s of output (1 GB = 10^9 bytes).  Cycles per byte are\n"
+	       "time stamp counter cycles, so they match core cycles only when the core runs\n"
+	       "at the nominal clock rate; they are -1 where no such counter is available.\n\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* returns number of sizes parsed, or -1 on error */
+static int parsesizes(int *sizes, const char *str)
+{
+	int n = 0;
+
+	while(*str)
+	{
+		char *end;
+		long v;
+
+		v = strtol(str, &end, 10);
+		if(end == str || v < 64 || v > (1L << 30) || n >= MAX_SIZES - 1)
+		{
+			return -1;
+		}
+		sizes[n++] = (int)(v - v % 64);
+		str = end;
+		if(*str == ',')
+		{
+			++str;
+		}
+	}
+	sizes[n] = 0;
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	enum OutputFormat format = FormatCSV;
+	const char *outFile = 0;
+	int threadSel = 0;
+	int bitSel = 0;
+	enum VDIFCornerTurnerISA isaSel = NumVDIFCornerTurnerISAs;	/* all of them */
+	double minTime = 0.05;
+	int sizes[MAX_SIZES];
+	int maxSize = 0;
+	unsigned char *inputPool;
+	unsigned char *outputBuffer;
+	const unsigned char *threadBuffers[MAX_BENCH_THREADS];
+	FILE *out;
+	enum VDIFCornerTurnerISA isa, bestISA;
+	int nResult = 0;
+	int a, i, bi, nt;
+
+	memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+
+	for(a = 1; a < argc; ++a)
+	{
+		if(strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0)
+		{
+			usage(argv[0]);
+
+			return EXIT_SUCCESS;
+		}
+		else if(strcmp(argv[a], "--csv") == 0)
+		{
+			format = FormatCSV;
+		}
+		else if(strcmp(argv[a], "--json") == 0)
+		{
+			format = FormatJSON;
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-o") == 0 || strcmp(argv[a], "--output") == 0))
+		{
+			outFile = argv[++a];
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-t") == 0 || strcmp(argv[a], "--threads") == 0))
+		{
+			threadSel = atoi(argv[++a]);
+			if(threadSel == 0)
+			{
+				fprintf(stderr, "Error: number of threads must be a non-zero integer.  Was '%s'\n", argv[a]);
+
+				return EXIT_FAILURE;
+			}
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-b") == 0 || strcmp(argv[a], "--bits") == 0))
+		{
+			bitSel = atoi(argv[++a]);
+			if(bitSel <= 0)
+			{
+				fprintf(stderr, "Error: bits per sample must be a positive integer.  Was '%s'\n", argv[a]);
+
+				return EXIT_FAILURE;
+			}
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-i") == 0 || strcmp(argv[a], "--isa") == 0))
+		{
+			++a;
+			for(isa = VDIFCornerTurnerISAGeneric; isa < NumVDIFCornerTurnerISAs; ++isa)
+			{
+				if(strcasecmp(argv[a], getCornerTurnerISAName(isa)) == 0)
+				{
+					isaSel = isa;
+				}
+			}
+			if(isaSel == NumVDIFCornerTurnerISAs)
+			{
+				fprintf(stderr, "Error: unknown instruction set '%s'\n", argv[a]);
+
+				return EXIT_FAILURE;
+			}
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-s") == 0 || strcmp(argv[a], "--sizes") == 0))
+		{
+			if(parsesizes(sizes, argv[++a]) <= 0)
+			{
+				fprintf(stderr, "Error: cannot parse size list '%s'; sizes must be between 64 bytes and 1 GB\n", argv[a]);
+
+				return EXIT_FAILURE;
+			}
+		}
+		else if(a < argc - 1 && (strcmp(argv[a], "-T") == 0 || strcmp(argv[a], "--time") == 0))
+		{
+			minTime = atof(argv[++a]);
+			if(minTime <= 0.0)
+			{
+				fprintf(stderr, "Error: measurement time must be positive.  Was '%s'\n", argv[a]);
+
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown option '%s'.  Run with -h for help.\n", argv[a]);
+
+			return EXIT_FAILURE;
+		}
+	}
+
+	for(i = 0; sizes[i]; ++i)
+	{
+		if(sizes[i] > maxSize)
+		{
+			maxSize = sizes[i];
+		}
+	}
+
+	/* Each of ut (nThread rounded up to a power of 2) threads supplies outputBytes/ut bytes.  The threads are packed into one
+	 * pool, separated by a cache line, so that the total memory touched is twice the output size as it would be in vdifmux. */
+	inputPool = (unsigned char *)malloc(maxSize + 64*MAX_BENCH_THREADS);
+	outputBuffer = (unsigned char *)malloc(maxSize);
+	if(!inputPool || !outputBuffer)
+	{
+		fprintf(stderr, "Error: cannot allocate %d bytes of buffers\n", 2*maxSize);
+
+		return EXIT_FAILURE;
+	}
+	srand(1);
+	for(i = 0; i < maxSize + 64*MAX_BENCH_THREADS; ++i)
+	{
+		inputPool[i] = rand() >> 7;
+	}
+	memset(outputBuffer, 0, maxSize);
+
+	if(outFile)
+	{
+		out = fopen(outFile, "w");
+		if(!out)
+		{
+			fprintf(stderr, "Error: cannot open %s for write\n", outFile);
+
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		out = stdout;
+	}
+
+	bestISA = getBestCornerTurnerISA();
+	if(format == FormatJSON)
+	{
+		fprintf(out, "{\n  \"program\": \"%s\",\n  \"version\": \"%s\",\n  \"bestISA\": \"%s\",\n  \"minTime\": %g,\n  \"results\": [",
+			program, version, getCornerTurnerISAName(bestISA), minTime);
+	}
+	else
+	{
+		fprintf(out, "isa,nThread,nBit,selected,outputBytes,reps,seconds,GBps,cyclesPerByte\n");
+	}
+
+	for(bi = 0; allBits[bi]; ++bi)
+	{
+		const int b = allBits[bi];
+
+		if(bitSel && b != bitSel)
+		{
+			continue;
+		}
+
+		for(nt = -MAX_BENCH_THREADS; nt <= MAX_BENCH_THREADS; ++nt)
+		{
+			void (*best)(unsigned char *, const unsigned char * const *, int);
+			int ut;
+
+			if(nt == 0 || (threadSel && nt != threadSel))
+			{
+				continue;
+			}
+			for(ut = 1; ut < abs(nt); ut *= 2);
+			best = getCornerTurner(nt, b);
+
+			for(isa = VDIFCornerTurnerISAGeneric; isa <= bestISA; ++isa)
+			{
+				void (*cornerTurner)(unsigned char *, const unsigned char * const *, int);
+
+				if(isaSel != NumVDIFCornerTurnerISAs && isa != isaSel)
+				{
+					continue;
+				}
+				cornerTurner = getCornerTurnerISA(nt, b, isa);
+				if(!cornerTurner)
+				{
+					continue;
+				}
+
+				for(i = 0; sizes[i]; ++i)
+				{
+					/* give each of the ut threads a whole number of 16 byte words, which suits all corner turners */
+					const int unit = 16*ut;
+					const int outputBytes = sizes[i] - sizes[i] % unit;
+					const int threadBytes = outputBytes/ut;
+					long long reps = 0, batch = 1;
+					double t0, t1;
+					uint64_t c0, c1;
+					int t;
+
+					if(outputBytes <= 0)
+					{
+						continue;
+					}
+					for(t = 0; t < ut; ++t)
+					{
+						threadBuffers[t] = inputPool + t*(threadBytes + 64);
+					}
+
+					/* warm up caches and any lazily mapped pages */
+					cornerTurner(outputBuffer, threadBuffers, outputBytes);
+
+					t0 = now();
+					c0 = cycles();
+					do
+					{
+						long long r;
+
+						for(r = 0; r < batch; ++r)
+						{
+							cornerTurner(outputBuffer, threadBuffers, outputBytes);
+						}
+						reps += batch;
+						batch *= 2;
+						t1 = now();
+					} while(t1 - t0 < minTime);
+					c1 = cycles();
+
+					if(format == FormatJSON)
+					{
+						fprintf(out, "%s\n    { \"isa\": \"%s\", \"nThread\": %d, \"nBit\": %d, \"selected\": %s, \"outputBytes\": %d, \"reps\": %lld, \"seconds\": %.6f, \"GBps\": %.4f, \"cyclesPerByte\": %.4f }",
+							nResult > 0 ? "," : "", getCornerTurnerISAName(isa), nt, b, cornerTurner == best ? "true" : "false",
+							outputBytes, reps, t1 - t0, reps*(double)outputBytes/(t1 - t0)*1.0e-9,
+							c1 > c0 ? (double)(c1 - c0)/(reps*(double)outputBytes) : -1.0);
+					}
+					else
+					{
+						fprintf(out, "%s,%d,%d,%d,%d,%lld,%.6f,%.4f,%.4f\n",
+							getCornerTurnerISAName(isa), nt, b, cornerTurner == best,
+							outputBytes, reps, t1 - t0, reps*(double)outputBytes/(t1 - t0)*1.0e-9,
+							c1 > c0 ? (double)(c1 - c0)/(reps*(double)outputBytes) : -1.0);
+					}
+					fflush(out);
+					++nResult;
+				}
+			}
+		}
+	}
+
+	if(format == FormatJSON)
+	{
+		fprintf(out, "\n  ]\n}\n");
+	}
+
+	if(out != stdout)
+	{
+		fclose(out);
+	}
+	free(inputPool);
+	free(outputBuffer);
+
+	return EXIT_SUCCESS;
+}
@@ -30,31 +30,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <errno.h>
-#include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "vdifio.h"
 
 const char program[] = "captureUDPVDIF";
 const char author[]  = "Adam Deller <adeller@nrao.edu>";
-const char version[] = "0.1";
-const char verdate[] = "20100319";
+const char version[] = "0.2";
+const char verdate[] = "20261017";
 
-#define BUFFERSEGBYTES 1000000
-#define NUMSEGMENTS    4
+#define MAXREGIONS 1024  //packet capture hands out one region per frame
+
+static volatile sig_atomic_t stopcapture = 0;
 
 typedef struct {
-  int keepwriting, ready, fillsegment;
-  int udpframesize, framespersegment;
-  char * filename;
-  pthread_cond_t writeinitcond;
-  char * receivebuffers[NUMSEGMENTS];
-  pthread_mutex_t locks[NUMSEGMENTS];
-} writethreaddata;
+  FILE * fp;
+  long long byteswritten;
+} outputfile;
 
 static void usage()
 {
@@ -62,253 +55,248 @@ static void usage()
           author, verdate);
   fprintf(stderr, "A program to capture VDIF frames encapsulated in UDP frames from a network stream\n");
   fprintf(stderr, "A pure VDIF stream of packets is dumped to disk - optionally data is sniffed and written also.\n");
-  fprintf(stderr, "\nUsage: %s <VDIF input port> <VDIF output file> [skipbytesfront] [skipbytesback]\n", program);
-  fprintf(stderr, "\n<VDIF input port> is the port on which the frames will be coming in over (use 12002 for EVLA)\n");
+  fprintf(stderr, "\nUsage: %s [options] <VDIF input port(s)> <VDIF output file> [skipbytesfront] [skipbytesback]\n", program);
+  fprintf(stderr, "\n<VDIF input port(s)> is the port, or comma separated list of up to %d ports, on which the frames\n", VDIF_CAPTURE_MAX_PORTS);
+  fprintf(stderr, "    will be coming in over (use 12002 for EVLA)\n");
   fprintf(stderr, "\n<VDIF output file> is the name of the VDIF file to write\n");
   fprintf(stderr, "\n[skipbytesfront=0] is the number of bytes to skip over before each frame\n");
   fprintf(stderr, "\n[skipbytesback=0] is the number of bytes to skip over after each frame\n");
-  fprintf(stderr, "\nNot sure if by default the skipbytesfront/back should be zeroed?\n");
+  fprintf(stderr, "\noptions can include:\n");
+  fprintf(stderr, "  --sockets <n>\n");
+  fprintf(stderr, "  -s <n>        Receive each port on <n> sockets, each with its own thread [1]\n");
+  fprintf(stderr, "  --gro\n");
+  fprintf(stderr, "  -g            Let the kernel coalesce packets (UDP GRO; needs zero skip bytes)\n");
+  fprintf(stderr, "  --ring <MB>\n");
+  fprintf(stderr, "  -r <MB>       Size of the capture ring in MB [%lld]\n", VDIF_CAPTURE_DEFAULT_RING_BYTES/(1024*1024));
+  fprintf(stderr, "  --interface <name>\n");
+  fprintf(stderr, "  -i <name>     Zero-copy capture from this interface (AF_PACKET TPACKET_V3; needs CAP_NET_RAW)\n");
+  fprintf(stderr, "                With -i, --sockets sets the number of packet rings sharing the traffic\n");
+  fprintf(stderr, "  --framesize <n>\n");
+  fprintf(stderr, "  -f <n>        VDIF frame size; by default taken from the first packet\n");
+  fprintf(stderr, "  --reorder <fps>\n");
+  fprintf(stderr, "  -o <fps>      Write frames strictly in time order, dropping duplicates and filling gaps\n");
+  fprintf(stderr, "                with invalid frames; <fps> is the frames per second per thread\n");
+  fprintf(stderr, "  --window <n>\n");
+  fprintf(stderr, "  -w <n>        Reorder window in frames per thread [%d]\n", VDIF_REORDER_DEFAULT_WINDOW);
+  fprintf(stderr, "\nCapture stops on interrupt (ctrl-C); frames already received are written before exiting.\n");
 }
 
-void * launchNewWriteThread(void * w)
+static void stophandler(int sig)
 {
-  FILE * output;
-  writethreaddata * wtd = (writethreaddata*)w;
-  int perr, writesegment, wrotebytes;
+  (void)sig;
+  stopcapture = 1;
+}
 
-  //open the output file
-  output = fopen(wtd->filename, "w");
-  if(output == NULL)
+static int writeframes(const struct iovec *iov, int nIov, void *data)
+{
+  outputfile *out = (outputfile *)data;
+  int i;
+
+  for(i = 0; i < nIov; ++i)
   {
-    fprintf(stderr, "Cannot open output file %s\n", wtd->filename);
-    exit(EXIT_FAILURE);
+    if(fwrite(iov[i].iov_base, 1, iov[i].iov_len, out->fp) != iov[i].iov_len)
+    {
+      fprintf(stderr, "Problem writing output file - aborting\n");
+      return -1;
+    }
+    out->byteswritten += iov[i].iov_len;
   }
 
-  //lock what we need
-  perr = pthread_mutex_lock(&(wtd->locks[NUMSEGMENTS-1]));
-  if(perr != 0) {
-    fprintf(stderr, "Error doing initial mutex locking - aborting!\n");
-    exit(EXIT_FAILURE);
-  }
-  wtd->ready = 1;
-  perr = pthread_cond_signal(&(wtd->writeinitcond));
-  if (perr != 0)
-    fprintf(stderr, "Error trying to signal main thread to wake up!!!");
-  writesegment = 0;  
+  return 0;
+}
 
-  //loop through writing as it becomes available
-  while(wtd->keepwriting || writesegment != wtd->fillsegment) {
-    perr = pthread_mutex_lock(&(wtd->locks[writesegment]));
-    if(perr != 0) {
-      fprintf(stderr, "Write thread error locking segment %d - aborting!\n", writesegment);
-      exit(EXIT_FAILURE);
-    }
-    perr = pthread_mutex_unlock(&(wtd->locks[(writesegment+NUMSEGMENTS-1)%NUMSEGMENTS]));
-    if(perr != 0) {
-      fprintf(stderr, "Write thread error unlocking segment %d - aborting!\n", 
-              (writesegment+NUMSEGMENTS-1)%NUMSEGMENTS);
-      exit(EXIT_FAILURE);
+static int parseports(struct vdif_capture_config *cfg, const char *list)
+{
+  const char *p = list;
+  char *end;
+
+  cfg->nPort = 0;
+  while(*p)
+  {
+    if(cfg->nPort >= VDIF_CAPTURE_MAX_PORTS)
+    {
+      fprintf(stderr, "Too many ports; at most %d are allowed\n", VDIF_CAPTURE_MAX_PORTS);
+      return -1;
     }
-    wrotebytes = fwrite(wtd->receivebuffers[writesegment], 1, wtd->udpframesize*wtd->framespersegment, output);
-    if(wrotebytes < wtd->udpframesize*wtd->framespersegment) {
-      fprintf(stderr, "Problem writing %dth segment - only wrote %d bytes\n", writesegment, wrotebytes);
-      break;
+    cfg->ports[cfg->nPort] = strtol(p, &end, 10);
+    if(end == p || cfg->ports[cfg->nPort] <= 0 || cfg->ports[cfg->nPort] > 65535 || (*end != ',' && *end != 0))
+    {
+      fprintf(stderr, "Bad port list: %s\n", list);
+      return -1;
     }
-    writesegment = (writesegment+1)%NUMSEGMENTS;
+    ++cfg->nPort;
+    p = (*end == ',') ? end + 1 : end;
   }
 
-  //release last lock and close the output file
-  fclose(output);
-
-  return 0;
+  return cfg->nPort > 0 ? 0 : -1;
 }
 
 int main(int argc, char **argv)
 {
-  //UDP socket related variables
-  int serversock, status, socketnumber, receivedbytes, udpbufbytes, udpport;
-  int currentframes;
-  int done;
-  vdif_header *header;
-  struct sockaddr_in server;    /* Socket address */
-  struct msghdr msg;
-  struct iovec iov[1];
-  char* iobase;
+  struct vdif_capture_config cfg;
+  struct vdif_capture_statistics stats;
+  struct vdif_reorder_statistics reorderstats;
+  struct vdif_capture *vc;
+  struct vdif_reorder *vr = NULL;
+  struct iovec iov[MAXREGIONS];
+  const vdif_header *header;
+  const char *filename = 0;
+  outputfile output;
+  int a, n, nArg = 0;
+  int first = 1;
+  int reorderfps = 0, reorderwindow = 0;
+
+  initvdifcaptureconfig(&cfg);
 
-  //non-UDP socket related variables
-  int skipbytesfront, skipbytesback;
-  int perr, i;
-  writethreaddata wtd;
-  pthread_t writethread;
-  long long framesread;
+  for(a = 1; a < argc; ++a)
+  {
+    if(strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0)
+    {
+      usage();
+      return EXIT_SUCCESS;
+    }
+    else if(strcmp(argv[a], "-g") == 0 || strcmp(argv[a], "--gro") == 0)
+    {
+      cfg.useGRO = 1;
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-s") == 0 || strcmp(argv[a], "--sockets") == 0))
+    {
+      cfg.nSocketPerPort = atoi(argv[++a]);
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-r") == 0 || strcmp(argv[a], "--ring") == 0))
+    {
+      cfg.ringBytes = atoll(argv[++a])*1024LL*1024LL;
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-o") == 0 || strcmp(argv[a], "--reorder") == 0))
+    {
+      reorderfps = atoi(argv[++a]);
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-w") == 0 || strcmp(argv[a], "--window") == 0))
+    {
+      reorderwindow = atoi(argv[++a]);
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-i") == 0 || strcmp(argv[a], "--interface") == 0))
+    {
+      snprintf(cfg.packetInterface, VDIF_CAPTURE_INTERFACE_LENGTH, "%s", argv[++a]);
+    }
+    else if(a < argc - 1 && (strcmp(argv[a], "-f") == 0 || strcmp(argv[a], "--framesize") == 0))
+    {
+      cfg.frameSize = atoi(argv[++a]);
+    }
+    else if(argv[a][0] == '-')
+    {
+      fprintf(stderr, "Unknown option %s\n", argv[a]);
+      return EXIT_FAILURE;
+    }
+    else
+    {
+      switch(nArg)
+      {
+      case 0:
+        if(parseports(&cfg, argv[a]) < 0)
+          return EXIT_FAILURE;
+        break;
+      case 1:
+        filename = argv[a];
+        break;
+      case 2:
+        cfg.skipBytesFront = atoi(argv[a]);
+        break;
+      case 3:
+        cfg.skipBytesBack = atoi(argv[a]);
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+      }
+      ++nArg;
+    }
+  }
 
   //check the command line arguments
-  if(argc < 3 || argc > 5)
+  if(nArg < 2)
   {
     usage();
 
     return EXIT_FAILURE;
   }
 
-  //store some variables, allocate some arrays
-  skipbytesfront   = 0;
-  skipbytesback    = 0;
-  udpport          = atoi(argv[1]);
-  wtd.filename     = argv[2];
-  wtd.udpframesize = -1;
-  pthread_cond_init(&(wtd.writeinitcond), NULL);
-  for(i=0;i<NUMSEGMENTS;++i) {
-    wtd.receivebuffers[i] = (char*)malloc(BUFFERSEGBYTES);
-    pthread_mutex_init(&(wtd.locks[i]), NULL);
-  }
-  if(argc > 3)
-    skipbytesfront = atoi(argv[3]);
-  if(argc > 4)
-    skipbytesback = atoi(argv[4]);
-
-  //lock the first segment, launch the writer thread on the last segment
-  perr = pthread_mutex_lock(&(wtd.locks[0]));
-  if(perr != 0) {
-    fprintf(stderr, "Error doing initial mutex locking - aborting!\n");
-    exit(EXIT_FAILURE);
-  }
-  perr = pthread_mutex_lock(&(wtd.locks[1]));
-  if(perr != 0) {
-    fprintf(stderr, "Error doing initial mutex locking - aborting!\n");
-    exit(EXIT_FAILURE);
-  }
-  wtd.keepwriting = 1;
-  wtd.ready       = 0;
-  wtd.filename    = argv[2];
-  //launch the writer thread
-  perr = pthread_create(&writethread, NULL, launchNewWriteThread, (void *)(&wtd));
-  if(perr != 0) {
-    fprintf(stderr, "Error in launching writethread!!!");
-    exit(EXIT_FAILURE);
-  }
-  while(!wtd.ready) {
-    perr = pthread_cond_wait(&(wtd.writeinitcond), &(wtd.locks[1]));
-    if (perr != 0)
-      fprintf(stderr, "Error waiting on writethreadstarted condition!!!!");
-  }
-  perr = pthread_mutex_unlock(&(wtd.locks[1]));
-  if(perr != 0) {
-    fprintf(stderr, "Error doing initial mutex unlocking - aborting!\n");
+  //open the output file
+  output.fp = fopen(filename, "w");
+  output.byteswritten = 0;
+  if(output.fp == NULL)
+  {
+    fprintf(stderr, "Cannot open output file %s\n", filename);
     exit(EXIT_FAILURE);
   }
 
-  //open the UDP socket
-  udpbufbytes = 32*1024*1024;
-  memset((char *)&server,0,sizeof(server));
-  server.sin_family = AF_INET;
-  server.sin_port = htons((unsigned short)udpport); /* Which port number to use */  
-  serversock = socket(AF_INET,SOCK_DGRAM, IPPROTO_UDP); 
-  if (serversock==-1) {
-    fprintf(stderr, "Cannot create UDP socket to read VDIF packets!\n");
+  //open the UDP sockets and start the receiver threads; with no frame size given this waits for the first packet
+  vc = newvdifcapture(&cfg);
+  if(vc == NULL)
+  {
+    fprintf(stderr, "Cannot start capture - aborting\n");
+    fclose(output.fp);
     exit(EXIT_FAILURE);
   }
-  status = setsockopt(serversock, SOL_SOCKET, SO_RCVBUF, (char *) &udpbufbytes, sizeof(udpbufbytes));
-  if (status!=0) {
-    fprintf(stderr, "Cannot setsocket SO_RCVBUF socket\n");
-    close(serversock);
-    exit(EXIT_FAILURE);
-  } 
-  status = bind(serversock, (struct sockaddr *)&server, sizeof(server));
-  if (status!=0) {
-    fprintf(stderr, "Cannot bind UDP socket\n");
-    close(serversock);
-    exit(EXIT_FAILURE);
-  } 
-  socketnumber = serversock;
-  done = 0;
-  wtd.fillsegment = 0;
-  currentframes = 0;
-  wtd.udpframesize = 0;
+  if(reorderfps > 0)
+  {
+    vr = newvdifreorder(getvdifcaptureframesize(vc), reorderfps, reorderwindow, writeframes, &output);
+    if(vr == NULL)
+    {
+      fprintf(stderr, "Cannot start reordering - aborting\n");
+      deletevdifcapture(vc);
+      fclose(output.fp);
+      exit(EXIT_FAILURE);
+    }
+  }
+  //from here an interrupt stops capture cleanly
+  signal(SIGINT, stophandler);
+  signal(SIGTERM, stophandler);
 
-  //loop through reading frames
-  printf("Finished initialising socket etc - about to start reading data\n");
-  framesread = 0;
-  iobase = wtd.receivebuffers[wtd.fillsegment];
-  while(!done) {
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_iov     = &iov[0];
-    msg.msg_iovlen  = 1;
-    iov[0].iov_base = iobase;
-    iov[0].iov_len  = BUFFERSEGBYTES - currentframes*wtd.udpframesize;
+  if(cfg.packetInterface[0])
+    printf("Finished initialising %d packet ring(s) on %s - capturing %d byte frames\n", cfg.nSocketPerPort, cfg.packetInterface, getvdifcaptureframesize(vc));
+  else
+    printf("Finished initialising %d socket(s) etc - capturing %d byte frames\n", cfg.nPort*cfg.nSocketPerPort, getvdifcaptureframesize(vc));
 
-    receivedbytes = recvmsg(socketnumber,&msg,MSG_WAITALL);
-    if (receivedbytes==-1) { // Error reading socket
-      if (errno == EINTR)
-        continue;
-      fprintf(stderr, "Some problem reading socket - aborting\n");
-      done = 1;
-      continue;
-    } else if (receivedbytes==0) {  // Socket closed remotely
-      fprintf(stderr, "Remote socket closed - aborting\n");
-      done=1;
-      continue;
-    } else if (receivedbytes!=(wtd.udpframesize + skipbytesfront + skipbytesback)) {
-      if(wtd.udpframesize != 0) { //not the first packet - something bad happened
-        fprintf(stderr, "Received %d bytes vs framesize %d+%d+%d - aborting\n", receivedbytes, wtd.udpframesize, skipbytesfront, skipbytesback);
-        done = 1;
-        continue;
-      }
-      else { //was the first time - set framebytes
-        wtd.udpframesize = receivedbytes - skipbytesfront - skipbytesback;
-        wtd.framespersegment = BUFFERSEGBYTES/wtd.udpframesize;
-	header = (vdif_header*)iobase;
-        printf("Setting framebytes to %d, framespersegment to %d\n", wtd.udpframesize, wtd.framespersegment);
-        printf("Starting from front, framebytes is %d, MJD is %d, seconds is %d, num channels is %d\n", 
-               getVDIFFrameBytes(header),
-               getVDIFFrameMJD(header),
-               getVDIFFrameSecond(header),
-               getVDIFNumChannels(header));
-	header = (vdif_header*)(iobase+8);
-        printf("Starting from 8 bytes in, framebytes is %d, MJD is %d, seconds is %d, num channels is %d\n",
-               getVDIFFrameBytes(header),
-               getVDIFFrameMJD(header),
-               getVDIFFrameSecond(header),
-               getVDIFNumChannels(header));
-	header = (vdif_header*)(iobase+skipbytesfront);
-        printf("Starting from 'skipbytesfront' in, framebytes is %d, MJD is %d, seconds is %d, num channels is %d\n",
-               getVDIFFrameBytes(header),
-               getVDIFFrameMJD(header),
-               getVDIFFrameSecond(header),
-               getVDIFNumChannels(header));
-	printf("The hex value of that first byte is %llx\n", 
-               *((unsigned long long*)(iobase)));
-      }
+  //loop through writing frames as they arrive; after a stop request drain what has been captured
+  for(;;)
+  {
+    if(stopcapture)
+    {
+      stopvdifcapture(vc);
+      stopcapture = 0;
     }
-    //if we get here its ok
-    if(skipbytesfront != 0) //move the stuff in memory if needed
-      memmove(iobase, iobase+skipbytesfront, wtd.udpframesize);
-    ++currentframes;
-    ++framesread;
-    iobase += wtd.udpframesize;
-    if(currentframes >= wtd.framespersegment) {
-      perr = pthread_mutex_lock(&(wtd.locks[(wtd.fillsegment+1)%NUMSEGMENTS]));
-      if(perr != 0) {
-        fprintf(stderr, "Main thread error locking segment %d - aborting!\n", (wtd.fillsegment+1)%NUMSEGMENTS);
-        wtd.keepwriting = 0;
-        done = 1;
-      }
-      perr = pthread_mutex_unlock(&(wtd.locks[wtd.fillsegment]));
-      if(perr != 0) {
-        fprintf(stderr, "Main thread error unlocking segment %d - aborting!\n", wtd.fillsegment);
-        wtd.keepwriting = 0;
-        done = 1;
-      }
-      wtd.fillsegment = (wtd.fillsegment+1)%NUMSEGMENTS;
-      iobase = wtd.receivebuffers[wtd.fillsegment];
-      currentframes = 0;
+    n = getvdifcapture(vc, iov, MAXREGIONS, 200);
+    if(n < 0)
+      break;
+    if(first && n > 0)
+    {
+      header = (const vdif_header *)iov[0].iov_base;
+      printf("First frame: framebytes is %d, MJD is %d, seconds is %d, num channels is %d\n",
+             getVDIFFrameBytes(header),
+             getVDIFFrameMJD(header),
+             getVDIFFrameSecond(header),
+             getVDIFNumChannels(header));
+      first = 0;
     }
+    if((vr ? addvdifreorderframes(vr, iov, n) : writeframes(iov, n, &output)) < 0)
+      stopcapture = 1;
+    releasevdifcapture(vc);
   }
 
-  pthread_mutex_unlock(&(wtd.locks[wtd.fillsegment]));
-  printf("Read and wrote %lld frames\n", framesread);
-  perr = pthread_join(writethread, NULL);
-  if(perr != 0)
-    fprintf(stderr, "Error in joining writethread!!!");
+  if(vr)
+    flushvdifreorder(vr);
+  fclose(output.fp);
+  printf("Wrote %lld frames\n", output.byteswritten/getvdifcaptureframesize(vc));
+  getvdifcapturestatistics(vc, &stats);
+  printvdifcapturestatistics(&stats);
+  if(vr)
+  {
+    getvdifreorderstatistics(vr, &reorderstats);
+    printvdifreorderstatistics(&reorderstats);
+    deletevdifreorder(vr);
+  }
+  deletevdifcapture(vc);
 
-    return EXIT_SUCCESS;
+  return EXIT_SUCCESS;
 }
@@ -0,0 +1,185 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Walter Brisken                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+//===========================================================================
+// SVN properties (DO NOT CHANGE)
+//
+// $Id$
+// $HeadURL: $
+// $LastChangedRevision$
+// $Author$
+// $LastChangedDate$
+//
+//============================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vdifio.h>
+#include <vdifmark6.h>
+
+const char program[] = "mk6mux";
+const char author[]  = "Walter Brisken <wbrisken@nrao.edu>";
+const char version[] = "0.1";
+const char verdate[] = "20261017";
+
+const int defaultChunkSize = 2000000;
+
+int main(int argc, char **argv)
+{
+	unsigned char *dest;
+	unsigned char *fill;
+	FILE *out;
+	int destChunkSize = defaultChunkSize;
+	int framesPerSecond;
+	long long nextFrame = -1;
+	const char *templateFile;
+	const char *fileParameter;
+	const char *outFile;
+	struct vdif_mark6_mux *vmm;
+	struct vdif_mark6_mux_statistics *stats;
+
+	if(argc < 5)
+	{
+		fprintf(stderr, "\n%s ver. %s  %s  %s\n\n", program, version, author, verdate);
+		fprintf(stderr, "Usage: %s <templateFile> <fileParameter> <framesPerSecond> <outputFile> [<chunkSize>]\n", argv[0]);
+		fprintf(stderr, "\nA program to multiplex threads from one or more Mark6 streams, as laid out\n"
+				"in a template file, into a multi-channel, single thread VDIF file.\n"
+				"Output is the same as vmux would make from the time-merged input.\n\n");
+		fprintf(stderr, "<templateFile> names the streams and maps (stream, thread) pairs to output\n    slots; see configurevdifmark6mux() in vdifmark6.h\n\n");
+		fprintf(stderr, "<fileParameter> is the file name pattern to select within each stream\n\n");
+		fprintf(stderr, "<framesPerSecond> is the number of frames per second in the input\n    for each thread (and is thus the number of output frames per\n    second as well)\n\n");
+		fprintf(stderr, "<outputFile> is the name of the output, single-thread VDIF file,\n    or - for stdout\n\n");
+		fprintf(stderr, "<chunkSize> is (roughly) how many bytes to operate on at a time\n    [default=%d]\n\n", defaultChunkSize);
+
+		return 0;
+	}
+
+	templateFile = argv[1];
+	fileParameter = argv[2];
+	framesPerSecond = atoi(argv[3]);
+	outFile = argv[4];
+	if(argc > 5)
+	{
+		destChunkSize = atoi(argv[5]);
+	}
+
+	vmm = configurevdifmark6mux(templateFile, fileParameter, framesPerSecond);
+	if(!vmm)
+	{
+		fprintf(stderr, "Error configuring multiplexer from %s\n", templateFile);
+
+		return EXIT_FAILURE;
+	}
+	destChunkSize -= destChunkSize % vmm->outputFrameSize;
+	if(destChunkSize <= 0)
+	{
+		fprintf(stderr, "Error: chunkSize must be at least one output frame (%d bytes)\n", vmm->outputFrameSize);
+		deletevdifmark6mux(vmm);
+
+		return EXIT_FAILURE;
+	}
+
+	if(strcmp(outFile, "-") != 0)
+	{
+		out = fopen(outFile, "w");
+		if(!out)
+		{
+			fprintf(stderr, "Can't open %s for write.\n", outFile);
+			deletevdifmark6mux(vmm);
+
+			return EXIT_FAILURE;
+		}
+		printvdifmark6mux(vmm);
+	}
+	else
+	{
+		out = stdout;
+	}
+
+	stats = newvdifmark6muxstatistics(vmm);
+	dest = (unsigned char *)malloc(destChunkSize);
+	fill = (unsigned char *)malloc(vmm->outputFrameSize);
+	if(!stats || !dest || !fill)
+	{
+		fprintf(stderr, "Error: cannot allocate buffers\n");
+		deletevdifmark6muxstatistics(stats);
+		deletevdifmark6mux(vmm);
+		free(dest);
+		free(fill);
+		if(out != stdout)
+		{
+			fclose(out);
+		}
+
+		return EXIT_FAILURE;
+	}
+
+	for(;;)
+	{
+		int V;
+
+		V = vdifmark6mux(dest, destChunkSize, vmm, nextFrame, stats);
+		if(V <= 0)
+		{
+			break;
+		}
+
+		if(stats->mux.startFrameNumber < 0)
+		{
+			/* bytes were consumed, but no useful output was generated */
+
+			continue;
+		}
+
+		/* if we encountered fill pattern at the seam between two chunks we will need to write some dummy frames */
+		if(nextFrame >= 0 && nextFrame != stats->mux.startFrameNumber)
+		{
+			int nJump = (int)(stats->mux.startFrameNumber - nextFrame);
+			int j;
+
+			fprintf(stderr, "JUMP %d\n", nJump);
+
+			memcpy(fill, dest, VDIF_HEADER_BYTES);
+			for(j = 0; j < nJump; ++j)
+			{
+				setVDIFFrameSecond((vdif_header *)fill, (nextFrame+j)/framesPerSecond);
+				setVDIFFrameNumber((vdif_header *)fill, (nextFrame+j)%framesPerSecond);
+				setVDIFFrameInvalid((vdif_header *)fill, 1);
+				fwrite(fill, 1, stats->mux.outputFrameSize, out);
+			}
+		}
+
+		fwrite(dest, 1, stats->mux.destUsed, out);
+
+		nextFrame = stats->mux.startFrameNumber + stats->mux.nOutputFrame;
+	}
+
+	if(out != stdout)
+	{
+		printvdifmark6muxstatistics(stats);
+		fclose(out);
+	}
+
+	deletevdifmark6muxstatistics(stats);
+	deletevdifmark6mux(vmm);
+	free(dest);
+	free(fill);
+
+	return 0;
+}
@@ -35,8 +35,8 @@
 
 const char program[] = "mk6vmux";
 const char author[]  = "Walter Brisken <wbrisken@nrao.edu>";
-const char version[] = "0.1";
-const char verdate[] = "20150923";
+const char version[] = "0.3";
+const char verdate[] = "20261017";
 
 const int defaultChunkSize = 2000000;
 
@@ -44,6 +44,9 @@ int main(int argc, char **argv)
 {
 	unsigned char *src;
 	unsigned char *dest;
+	unsigned char *fill;
+	struct iovec *regions;
+	int nRegion, maxRegion;
 	FILE *out;
 	int n, rv;
 	int threads[32];
@@ -60,6 +63,7 @@ int main(int argc, char **argv)
 	const char *inFile;
 	const char *outFile;
 	off_t offset = 0;
+	int startSecond = -1, startFrame = 0;
 	int bitsPerSample = 0;
 	int nChanPerThread;
 	const vdif_header *vh;
@@ -81,7 +85,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "<framesPerSecond> is the number of frames per second in the input\n    file for each thread (and is thus the number of output frames per\n    second as well)\n\n");
 		fprintf(stderr, "<threadList> is a comma-separated list of integers in range 0 to 1023;\n    the order of the numbers is significant and dictates the order of\n    channels in the output data\n\n");
 		fprintf(stderr, "<outputFile> is the name of the output, single-thread VDIF file,\n    or - for stdout\n\n");
-		fprintf(stderr, "<offset> is an optional offset into the input file (in bytes)\n\n");
+		fprintf(stderr, "<offset> is an optional offset into the input file (in bytes), or a time\n    <second>:<frame> (seconds since the VDIF epoch) to start at\n\n");
 		fprintf(stderr, "<chunkSize> is (roughly) how many bytes to operate on at a time\n    [default=%d]\n\n", defaultChunkSize);
 		fprintf(stderr, "Note: as of version 0.5 this program supports multi-channel multi-thread input data\n\n");
 
@@ -138,7 +142,11 @@ int main(int argc, char **argv)
 
 	if(argc > 6)
 	{
-		offset = atoll(argv[6]);
+		if(sscanf(argv[6], "%d:%d", &startSecond, &startFrame) != 2)
+		{
+			startSecond = -1;
+			offset = atoll(argv[6]);
+		}
 	}
 	if(argc > 7)
 	{
@@ -158,7 +166,17 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if(offset > 0)
+	if(startSecond >= 0)
+	{
+		if(seekMark6GatherTime(G, startSecond, startFrame) != 0)
+		{
+			fprintf(stderr, "Error: no data at or after time %d:%d\n", startSecond, startFrame);
+			closeMark6Gatherer(G);
+
+			return EXIT_FAILURE;
+		}
+	}
+	else if(offset > 0)
 	{
 		int r;
 		
@@ -191,8 +209,11 @@ int main(int argc, char **argv)
 
 	srcChunkSize = srcChunkSize - (srcChunkSize % G->packetSize);
 
+	/* packets are multiplexed in place from the gatherer's buffers; src only holds what vdifmux leaves unconsumed */
 	src = (unsigned char *)malloc(srcChunkSize);
 	dest = (unsigned char *)malloc(destChunkSize);
+	maxRegion = srcChunkSize/G->packetSize + 1;
+	regions = (struct iovec *)malloc(maxRegion*sizeof(struct iovec));
 
 	/* read just enough of the stream to peek at a frame header */
 
@@ -243,14 +264,28 @@ int main(int argc, char **argv)
 	{
 		printvdifmux(&vm);
 	}
+
+	fill = (unsigned char *)malloc(vm.outputFrameSize);
 	
 	resetvdifmuxstatistics(&stats);
 	
 	for(;;)
 	{
-		int V;
+		int V, r, i, p;
 
-		n = mark6Gather(G, src+leftover, srcChunkSize-leftover);
+		nRegion = 0;
+		if(leftover > 0)
+		{
+			regions[0].iov_base = src;
+			regions[0].iov_len = leftover;
+			nRegion = 1;
+		}
+		r = mark6GatherV(G, regions+nRegion, maxRegion-nRegion, srcChunkSize-leftover);
+		for(n = 0, i = nRegion; i < nRegion+r; ++i)
+		{
+			n += regions[i].iov_len;
+		}
+		nRegion += r;
 		if(n < 1)
 		{
 			if(leftover < inputframesize)
@@ -267,13 +302,28 @@ int main(int argc, char **argv)
 		{
 			nSort = -nSort;
 		}
-		V = vdifmux(dest, destChunkSize, src, n+leftover, &vm, nextFrame, &stats);
+		V = vdifmuxv(dest, destChunkSize, regions, nRegion, &vm, nextFrame, &stats);
 
 		if(V < 0)
 		{
 			break;
 		}
 
+		/* keep the unconsumed tail, then let the gatherer reuse its buffers.  Copying forward is safe even though regions[0] may be src */
+		leftover = 0;
+		for(i = 0, p = 0; i < nRegion; p += regions[i].iov_len, ++i)
+		{
+			int a = (stats.srcUsed > p) ? stats.srcUsed - p : 0;
+			int b = regions[i].iov_len;
+
+			if(a < b)
+			{
+				memmove(src+leftover, (unsigned char *)regions[i].iov_base + a, b-a);
+				leftover += b-a;
+			}
+		}
+		releaseMark6Gather(G);
+
 		if(stats.startFrameNumber < 0)
 		{
 			if(stats.srcUsed > 0)
@@ -300,26 +350,18 @@ int main(int argc, char **argv)
 
 			printf("JUMP %d\n", nJump);
 
-			/* borrow one output frame of src memory... */
-			memcpy(src, dest, VDIF_HEADER_BYTES);
+			memcpy(fill, dest, VDIF_HEADER_BYTES);
 			for(j = 0; j < nJump; ++j)
 			{
-				setVDIFFrameSecond((vdif_header *)src, (nextFrame+j)/framesPerSecond);
-				setVDIFFrameNumber((vdif_header *)src, (nextFrame+j)%framesPerSecond);
-				setVDIFFrameInvalid((vdif_header *)src, 1);
-				fwrite(src, 1, stats.outputFrameSize, out);
+				setVDIFFrameSecond((vdif_header *)fill, (nextFrame+j)/framesPerSecond);
+				setVDIFFrameNumber((vdif_header *)fill, (nextFrame+j)%framesPerSecond);
+				setVDIFFrameInvalid((vdif_header *)fill, 1);
+				fwrite(fill, 1, stats.outputFrameSize, out);
 			}
 		}
 
 		fwrite(dest, 1, stats.destUsed, out);
 
-		leftover = stats.srcSize - stats.srcUsed;
-
-		if(leftover > 0)
-		{
-			memmove(src, src+stats.srcUsed, leftover);
-		}
-
 		nextFrame = stats.startFrameNumber + stats.nOutputFrame;
 		
 		if(nSort < 0)
@@ -338,6 +380,8 @@ int main(int argc, char **argv)
 
 	free(src);
 	free(dest);
+	free(fill);
+	free(regions);
 
 	return 0;
 }
@@ -41,11 +41,193 @@ const char verdate[] = "20131021";
 static void usage(const char *pgm)
 {
 	printf("%s ver. %s  %s  %s\n\n", program, version, author, verdate);
-	printf("A utility to test internal corner turners\n\n");
+	printf("A utility to test internal corner turners and the fused multiplex and unpack\n\n");
 	printf("Usage: %s\n\n", pgm);
 	printf("\n");
 }
 
+/* the sample code of value p of the multiplexed data, or -1 if it belongs to a padding thread and should unpack as 0 */
+static int expectedunpackvalue(const unsigned char *muxed, int p, const struct vdif_mux *vm, int ut)
+{
+	const int W = vm->inputChannelsPerThread*vm->complexFactor;
+	const int b = vm->bitsPerSample;
+
+	if((p/W) % ut >= vm->nThread)
+	{
+		return -1;
+	}
+
+	return (muxed[p*b/8] >> (p*b % 8)) & ((1 << b) - 1);
+}
+
+/* compares vdifmuxunpackfloat() and vdifmuxunpackint8() with corner turning followed by a table unpack.
+ * Returns number of bad passes, or -1 if vdifmux() has no corner turner for the case */
+static int testunpackcase(int nThread, int bitsPerSample, int nChan, int fanout, int isComplex, unsigned char * const *threadData, int threadDataSize)
+{
+	const unsigned char *threadBuffers[32];
+	struct vdif_mux vm;
+	int threadIds[32];
+	float levelsFloat[256];
+	int8_t levelsInt8[256];
+	float *chanFloat[128];
+	int8_t *chanInt8[128];
+	unsigned char *muxed;
+	int ut, nValue, nChanValue, c, t, p, pass;
+	int nBad = 0;
+
+	if(!getCornerTurner(nThread, bitsPerSample*nChan*(isComplex ? 2 : 1)))
+	{
+		return -1;
+	}
+	for(t = 0; t < nThread; ++t)
+	{
+		threadIds[t] = t;
+		threadBuffers[t] = threadData[t];
+	}
+	if(configurevdifmux(&vm, threadDataSize + VDIF_HEADER_BYTES, 1000, bitsPerSample, nThread, threadIds, 4, 100, isComplex ? VDIF_MUX_FLAG_COMPLEX : 0) != 0 ||
+	   (nChan > 1 && setvdifmuxinputchannels(&vm, nChan) != 0) ||
+	   (fanout > 1 && setvdifmuxfanoutfactor(&vm, fanout) != 0))
+	{
+		printf("%d bits  %d threads  %d chan/thread  fanout %d  %s: cannot configure\n", bitsPerSample, nThread, nChan, fanout, isComplex ? "complex" : "real");
+
+		return 1;
+	}
+
+	for(ut = 1; ut < nThread; ut *= 2);
+	nValue = ut*threadDataSize*8/bitsPerSample;
+	nChanValue = vdifmuxunpackvalues(&vm, threadDataSize);
+	if(nChanValue*vm.nOutputChan != nValue)
+	{
+		printf("%d bits  %d threads  %d chan/thread  fanout %d  %s: %d values per channel for %d channels; expected %d in all\n", bitsPerSample, nThread, nChan, fanout, isComplex ? "complex" : "real", nChanValue, vm.nOutputChan, nValue);
+
+		return 1;
+	}
+
+	for(c = 0; c < (1 << bitsPerSample); ++c)
+	{
+		levelsFloat[c] = c - 0.5*(1 << bitsPerSample) + 0.25;
+		levelsInt8[c] = (int8_t)(c - (1 << (bitsPerSample - 1)));
+	}
+	muxed = (unsigned char *)malloc(ut*threadDataSize);
+	for(c = 0; c < vm.nOutputChan; ++c)
+	{
+		chanFloat[c] = (float *)malloc(nChanValue*sizeof(float));
+		chanInt8[c] = (int8_t *)malloc(nChanValue);
+	}
+
+	vm.cornerTurner(muxed, threadBuffers, ut*threadDataSize);
+
+	/* the second pass drops the last thread, which should then unpack as 0 */
+	for(pass = 0; pass < 2; ++pass)
+	{
+		int nWrong = 0;
+
+		if(pass == 1)
+		{
+			threadBuffers[nThread - 1] = 0;
+		}
+		vdifmuxunpackfloat(chanFloat, threadBuffers, threadDataSize, &vm, levelsFloat);
+		vdifmuxunpackint8(chanInt8, threadBuffers, threadDataSize, &vm, levelsInt8);
+		for(p = 0; p < nValue; ++p)
+		{
+			const int cf = vm.complexFactor;
+			const int q = p/cf;
+			const int chan = q % vm.nOutputChan;
+			const int index = (q/vm.nOutputChan)*cf + p % cf;
+			int code = expectedunpackvalue(muxed, p, &vm, ut);
+
+			if(pass == 1 && (p/(vm.inputChannelsPerThread*cf)) % ut == nThread - 1)
+			{
+				code = -1;
+			}
+			if(chanFloat[chan][index] != (code < 0 ? 0.0f : levelsFloat[code]) ||
+			   chanInt8[chan][index] != (code < 0 ? 0 : levelsInt8[code]))
+			{
+				++nWrong;
+			}
+		}
+		if(nWrong > 0)
+		{
+			printf("%d bits  %d threads  %d chan/thread  fanout %d  %s%s: %d values of %d were wrong.\n", bitsPerSample, nThread, nChan, fanout, isComplex ? "complex" : "real", pass == 1 ? "  (last thread missing)" : "", nWrong, nValue);
+			++nBad;
+		}
+	}
+
+	free(muxed);
+	for(c = 0; c < vm.nOutputChan; ++c)
+	{
+		free(chanFloat[c]);
+		free(chanInt8[c]);
+	}
+
+	return nBad;
+}
+
+static void testunpack(void)
+{
+	const int bits[] = { 1, 2, 4, 8, 0 };
+	const int chans[] = { 1, 2, 4, 0 };
+	const int fanouts[] = { 1, 2, 4, 0 };
+	const int threadDataSize = 256;
+	unsigned char *threadData[32];
+	int nt, bi, ci, fi, isComplex, t;
+	int nCase = 0, nBad = 0, nSkip = 0;
+
+	srand(12345);
+	for(t = 0; t < 32; ++t)
+	{
+		int i;
+
+		threadData[t] = (unsigned char *)malloc(threadDataSize);
+		for(i = 0; i < threadDataSize; ++i)
+		{
+			threadData[t][i] = rand() & 0xFF;
+		}
+	}
+
+	for(isComplex = 0; isComplex <= 1; ++isComplex)
+	{
+		for(bi = 0; bits[bi]; ++bi)
+		{
+			for(ci = 0; chans[ci]; ++ci)
+			{
+				for(fi = 0; fanouts[fi]; ++fi)
+				{
+					if(chans[ci] > 1 && fanouts[fi] > 1)
+					{
+						/* not allowed together */
+						continue;
+					}
+					for(nt = 1; nt <= 32; ++nt)
+					{
+						if(nt % fanouts[fi] != 0)
+						{
+							continue;
+						}
+						int v = testunpackcase(nt, bits[bi], chans[ci], fanouts[fi], isComplex, threadData, threadDataSize);
+
+						if(v < 0)
+						{
+							++nSkip;
+						}
+						else
+						{
+							nBad += (v > 0);
+							++nCase;
+						}
+					}
+				}
+			}
+		}
+	}
+	printf("Fused multiplex and unpack: %d of %d cases were wrong; %d cases have no corner turner to compare with.\n", nBad, nCase, nSkip);
+
+	for(t = 0; t < 32; ++t)
+	{
+		free(threadData[t]);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int outputBytes = 102400;
@@ -58,6 +240,7 @@ int main(int argc, char **argv)
 	}
 
 	testvdifcornerturners(outputBytes, nTest);
+	testunpack();
 
 	return EXIT_SUCCESS;
 }
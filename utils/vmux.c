@@ -30,15 +30,130 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <vdifio.h>
 
 const char program[] = "vmux";
 const char author[]  = "Walter Brisken <wbrisken@nrao.edu>";
-const char version[] = "0.7";
-const char verdate[] = "20151117";
+const char version[] = "0.11";
+const char verdate[] = "20261017";
 
 const int defaultChunkSize = 2000000;
 
+/* Input is read into a pool of buffers that the multiplexer references in place until it is done with them */
+struct inputbuffer
+{
+	unsigned char *data;
+	int nRef;		/* one per push still referencing the data, plus one while being filled/pushed */
+	struct inputbuffer *next;
+};
+
+static void releaseinputbuffer(const unsigned char *data, void *userData)
+{
+	(void)data;
+	--((struct inputbuffer *)userData)->nRef;
+}
+
+/* mapped input stays valid until the map is closed, after the multiplexer is deleted, so there is nothing to release.
+ * Passing this rather than no callback lets the multiplexer reference the pages instead of copying each pending frame */
+static void releasemappedinput(const unsigned char *data, void *userData)
+{
+	(void)data;
+	(void)userData;
+}
+
+static struct inputbuffer *getinputbuffer(struct inputbuffer **pool, int size)
+{
+	struct inputbuffer *b;
+
+	for(b = *pool; b; b = b->next)
+	{
+		if(b->nRef == 0)
+		{
+			return b;
+		}
+	}
+
+	b = (struct inputbuffer *)calloc(1, sizeof(struct inputbuffer));
+	if(!b)
+	{
+		return 0;
+	}
+	b->data = (unsigned char *)malloc(size);
+	if(!b->data)
+	{
+		free(b);
+
+		return 0;
+	}
+	b->next = *pool;
+	*pool = b;
+
+	return b;
+}
+
+static void freeinputbuffers(struct inputbuffer *pool)
+{
+	while(pool)
+	{
+		struct inputbuffer *next = pool->next;
+
+		free(pool->data);
+		free(pool);
+		pool = next;
+	}
+}
+
+/* pull all available output from the multiplexer and write it, filling any gaps with invalid frames.  Returns < 0 on error */
+static int writemuxoutput(struct vdif_mux_stream *vs, unsigned char *dest, int destChunkSize, unsigned char *fill, struct vdif_mux_statistics *stats, FILE *out, long long *nextFrame, int framesPerSecond, int verbose)
+{
+	for(;;)
+	{
+		int V;
+
+		V = pullvdifmuxstream(vs, dest, destChunkSize, stats);
+		if(V < 0)
+		{
+			return V;
+		}
+		if(V == 0)
+		{
+			return 0;
+		}
+
+		if(verbose > 2 && out != stdout)
+		{
+			printvdifmuxstatistics(stats);
+		}
+
+		/* if we encountered a gap in the input we will need to write some dummy frames */
+		if(*nextFrame >= 0 && *nextFrame != stats->startFrameNumber)
+		{
+			int nJump = (int)(stats->startFrameNumber - *nextFrame);
+			int j;
+
+			printf("JUMP %d\n", nJump);
+
+			memcpy(fill, dest, VDIF_HEADER_BYTES);
+			if(((vdif_edv4_header *)fill)->eversion == 4)
+			{
+				((vdif_edv4_header *)fill)->validitymask = 0;
+			}
+			for(j = 0; j < nJump; ++j)
+			{
+				setVDIFFrameSecond((vdif_header *)fill, (*nextFrame+j)/framesPerSecond);
+				setVDIFFrameNumber((vdif_header *)fill, (*nextFrame+j)%framesPerSecond);
+				setVDIFFrameInvalid((vdif_header *)fill, 1);
+				fwrite(fill, 1, stats->outputFrameSize, out);
+			}
+		}
+
+		fwrite(dest, 1, stats->destUsed, out);
+
+		*nextFrame = stats->startFrameNumber + stats->nOutputFrame;
+	}
+}
+
 void usage(const char *pgm)
 {
 	fprintf(stderr, "\n%s ver. %s  %s  %s\n\n", program, version, author, verdate);
@@ -53,7 +168,7 @@ void usage(const char *pgm)
 	fprintf(stderr, "<framesPerSecond> is the number of frames per second in the input\n    file for each thread (and is thus the number of output frames per\n    second as well)\n\n");
 	fprintf(stderr, "<threadList> is a comma-separated list of integers in range 0 to 1023;\n    the order of the numbers is significant and dictates the order of\n    channels in the output data\n\n");
 	fprintf(stderr, "<outputFile> is the name of the output, single-thread VDIF file,\n    or - for stdout\n\n");
-	fprintf(stderr, "<offset> is an optional offset into the input file (in bytes)\n\n");
+	fprintf(stderr, "<offset> is an optional offset into the input file (in bytes), or a time\n    <second>:<frame> (seconds since the VDIF epoch) to start at\n\n");
 	fprintf(stderr, "<chunkSize> is (roughly) how many bytes to operate on at a time\n    [default=%d]\n\n", defaultChunkSize);
 	fprintf(stderr, "Options can include:\n");
 	fprintf(stderr, "  --help\n");
@@ -68,23 +183,30 @@ void usage(const char *pgm)
 	fprintf(stderr, "  -e        Use of EDV4 (per-thread validity) in output [default]\n\n");
 	fprintf(stderr, "  --fanout <f>\n");
 	fprintf(stderr, "  -f <f>    Set fanout factor to <f> (used for some DBBC3 data) [default = 1]\n\n");
+	fprintf(stderr, "  --threads <t>\n");
+	fprintf(stderr, "  -t <t>    Use <t> threads for corner turning [default = 1]\n\n");
+	fprintf(stderr, "  --latency <l>\n");
+	fprintf(stderr, "  -l <l>    Realtime mode: emit each output frame no more than <l> frames\n            behind the newest input, as partial/invalid if incomplete\n\n");
 	fprintf(stderr, "Note: as of version 0.5 this program supports multi-channel multi-thread input data\n\n");
 }
 
 int main(int argc, char **argv)
 {
-	unsigned char *src;
+	struct inputbuffer *pool = 0;
+	struct inputbuffer *buf;
 	unsigned char *dest;
+	unsigned char *fill;
 	FILE *in, *out;
+	struct vdif_mmap_file *mf = 0;	/* set when reading a file through a memory map */
 	int verbose = 1;
 	int n, rv;
-	int threads[32];
+	int threads[VDIF_MUX_MAX_THREADS];
 	int nThread;
 	int inputframesize = 0;
 	int nGap = 100;
 	int nSort = 20;
 	struct vdif_mux_statistics stats;
-	int leftover;
+	struct vdif_mux_stream *vs;
 	int srcChunkSize = defaultChunkSize*5/4;
 	int destChunkSize = defaultChunkSize;
 	int hasChunkSize = 0;
@@ -95,10 +217,14 @@ int main(int argc, char **argv)
 	const char *threadString = 0;
 	off_t offset = 0;
 	int hasOffset = 0;
+	int startSecond = -1, startFrame = 0;
 	int bitsPerSample = 0;
 	int nChanPerThread;
 	int fanoutFactor = 1;
-	const vdif_header *vh;
+	int nWorker = 1;
+	int maxReorder = 0;
+	vdif_header header;
+	const vdif_header *vh = &header;
 	struct vdif_mux vm;
 	int flags = VDIF_MUX_FLAG_PROPAGATEVALIDITY;
 	int a;
@@ -147,6 +273,28 @@ int main(int argc, char **argv)
 					return EXIT_FAILURE;
 				}
 			}
+			else if(a < argc - 1 && (strcmp(argv[a], "-t") == 0 || strcmp(argv[a], "--threads") == 0))
+			{
+				++a;
+				nWorker = atoi(argv[a]);
+				if(nWorker < 1)
+				{
+					fprintf(stderr, "Error: number of threads must be positive integer.  Was '%s'\n", argv[a]);
+
+					return EXIT_FAILURE;
+				}
+			}
+			else if(a < argc - 1 && (strcmp(argv[a], "-l") == 0 || strcmp(argv[a], "--latency") == 0))
+			{
+				++a;
+				maxReorder = atoi(argv[a]);
+				if(maxReorder < 1)
+				{
+					fprintf(stderr, "Error: latency must be positive integer number of frames.  Was '%s'\n", argv[a]);
+
+					return EXIT_FAILURE;
+				}
+			}
 			else
 			{
 				fprintf(stderr, "Error: argument %d unknown option '%s'\n", a, argv[a]);
@@ -209,10 +357,21 @@ int main(int argc, char **argv)
 		else if(hasOffset == 0)
 		{
 			hasOffset = 1;
-			offset = atoll(argv[a]);
-			if(verbose > 2)
+			if(sscanf(argv[a], "%d:%d", &startSecond, &startFrame) == 2)
+			{
+				if(verbose > 2)
+				{
+					printf("Arg %d: Start time = second %d frame %d\n", a, startSecond, startFrame);
+				}
+			}
+			else
 			{
-				printf("Arg %d: Offset = %Ld\n", a, (long long)offset);
+				startSecond = -1;
+				offset = atoll(argv[a]);
+				if(verbose > 2)
+				{
+					printf("Arg %d: Offset = %Ld\n", a, (long long)offset);
+				}
 			}
 		}
 		else if(hasChunkSize == 0)
@@ -235,7 +394,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	for(n = nThread = 0; nThread < 32; ++nThread)
+	for(n = nThread = 0; nThread < VDIF_MUX_MAX_THREADS; ++nThread)
 	{
 		int c, p, i;
 		if(threadString[n] == ',')
@@ -280,7 +439,7 @@ int main(int argc, char **argv)
 
 	if(strcmp(inFile, "-") == 0)
 	{
-		if(offset != 0)
+		if(offset != 0 || startSecond >= 0)
 		{
 			fprintf(stderr, "Error: cannot set offset when reading from stdin.\n");
 
@@ -299,6 +458,21 @@ int main(int argc, char **argv)
 
 			return EXIT_FAILURE;
 		}
+		else if(startSecond >= 0)
+		{
+			offset = seekvdiffiletime(in, inputframesize, framesPerSecond, startSecond, startFrame);
+			if(offset < 0)
+			{
+				fprintf(stderr, "Error: cannot find time %d:%d in %s (error %lld)\n", startSecond, startFrame, inFile, (long long)offset);
+				fclose(in);
+
+				return EXIT_FAILURE;
+			}
+			if(verbose > 1)
+			{
+				printf("Time %d:%d found at offset %lld\n", startSecond, startFrame, (long long)offset);
+			}
+		}
 		else if(offset > 0)
 		{
 			int r;
@@ -331,20 +505,45 @@ int main(int argc, char **argv)
 		out = stdout;
 	}
 
-	src = (unsigned char *)malloc(srcChunkSize);
+	if(maxReorder > 0)
+	{
+		/* in realtime mode input is passed on as soon as it arrives, so bypass stdio buffering */
+		setvbuf(in, 0, _IONBF, 0);
+	}
+
+	if(in != stdin && maxReorder == 0)
+	{
+		/* a file of fixed size can be multiplexed straight out of the page cache */
+		mf = openvdifmmapfile(inFile, 0);
+		if(mf && seekvdifmmapfile(mf, ftello(in)) < 0)
+		{
+			closevdifmmapfile(mf);
+			mf = 0;
+		}
+	}
+
 	dest = (unsigned char *)malloc(destChunkSize);
 
 	/* read just enough of the stream to peek at a frame header */
-	n = fread(src, 1, VDIF_HEADER_BYTES, in);
+	if(mf)
+	{
+		const unsigned char *h = peekvdifmmapfile(mf, VDIF_HEADER_BYTES, &n);
+
+		if(n == VDIF_HEADER_BYTES)
+		{
+			memcpy(&header, h, VDIF_HEADER_BYTES);
+		}
+	}
+	else
+	{
+		n = fread(&header, 1, VDIF_HEADER_BYTES, in);
+	}
 	if(n != VDIF_HEADER_BYTES)
 	{
 		fprintf(stderr, "Error reading first header.  Only %d of %d bytes were read\n", n, VDIF_HEADER_BYTES);
 
 		return EXIT_FAILURE;
 	}
-	leftover = VDIF_HEADER_BYTES;
-
-	vh = (const vdif_header *)src;
 
 	if(bitsPerSample <= 0)
 	{
@@ -393,100 +592,137 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if(nWorker > 1)
+	{
+		rv = configurevdifmuxthreads(&vm, nWorker);
+		if(rv < 0)
+		{
+			fprintf(stderr, "Error setting number of corner turning threads to %d\n", nWorker);
+
+			return EXIT_FAILURE;
+		}
+	}
+
 	if(verbose > 0 && strcmp(outFile, "-") != 0)
 	{
 		printvdifmux(&vm);
 	}
 	
+	vs = newvdifmuxstream(&vm);
+	fill = (unsigned char *)malloc(vm.outputFrameSize);
+	if(!vs || !fill)
+	{
+		fprintf(stderr, "Error: cannot allocate the multiplexer stream\n");
+
+		return EXIT_FAILURE;
+	}
+
+	if(maxReorder > 0 && setvdifmuxstreamlatency(vs, maxReorder) < 0)
+	{
+		fprintf(stderr, "Error setting multiplexer latency to %d frames\n", maxReorder);
+
+		return EXIT_FAILURE;
+	}
+
 	resetvdifmuxstatistics(&stats);
-	
+
+	if(!mf)
+	{
+		/* the header already read is the start of the first frame */
+		pushvdifmuxstream(vs, (const unsigned char *)&header, VDIF_HEADER_BYTES, 0, 0);
+	}
+
 	for(;;)
 	{
-		int V;
+		const unsigned char *src;
+		int p;
 
-		n = fread(src+leftover, 1, srcChunkSize-leftover, in);
-		if(n < 1)
+		if(mf)
 		{
-			if(leftover < inputframesize)
+			/* mapped data stays valid until the map is closed, so needs no reference counting */
+			buf = 0;
+			src = peekvdifmmapfile(mf, srcChunkSize, &n);
+		}
+		else
+		{
+			buf = getinputbuffer(&pool, srcChunkSize);
+			if(!buf)
 			{
+				fprintf(stderr, "Error: cannot allocate input buffer\n");
+
 				break;
 			}
+
+			if(maxReorder > 0)
+			{
+				/* take whatever is available rather than waiting for a full chunk */
+				n = read(fileno(in), buf->data, srcChunkSize);
+			}
 			else
 			{
-				n = 0;
+				n = fread(buf->data, 1, srcChunkSize, in);
 			}
+			src = buf->data;
 		}
-
-		if(n < srcChunkSize-leftover)
-		{
-			nSort = -nSort;
-		}
-		V = vdifmux(dest, destChunkSize, src, n+leftover, &vm, nextFrame, &stats);
-
-		if(V < 0)
+		if(n < 1)
 		{
 			break;
 		}
 
-		if(verbose > 2 && out != stdout)
+		if(buf)
 		{
-			printvdifmuxstatistics(&stats);
+			++buf->nRef;
 		}
-
-		if(stats.startFrameNumber < 0)
+		for(p = 0; p < n; )
 		{
-			if(stats.srcUsed > 0)
-			{
-				/* bytes were consumed, but no useful output was generated */
+			int c;
 
-				continue;
+			if(buf)
+			{
+				++buf->nRef;
 			}
-			else
+			c = pushvdifmuxstream(vs, src + p, n - p, buf ? releaseinputbuffer : releasemappedinput, buf);
+			if(c < 0)
 			{
-				/* here no bytes were consumed.  This is probably not a good thing */
-
-				fprintf(stderr, "Weird: %d/%d bytes were consumed.  Stopping.\n", stats.srcUsed, stats.srcSize);
+				if(buf)
+				{
+					--buf->nRef;
+				}
+				fprintf(stderr, "Error: pushvdifmuxstream returned %d\n", c);
 
 				break;
 			}
-		}
-
-		/* if we encountered fill pattern at the seam between two chunkSizes we will need to write some dummy frames */
-		if(nextFrame >= 0 && nextFrame != stats.startFrameNumber)
-		{
-			int nJump = (int)(stats.startFrameNumber - nextFrame);
-			int j;
-
-			printf("JUMP %d\n", nJump);
+			p += c;
 
-			/* borrow one output frame of src memory... */
-			memcpy(src, dest, VDIF_HEADER_BYTES);
-			for(j = 0; j < nJump; ++j)
+			if(writemuxoutput(vs, dest, destChunkSize, fill, &stats, out, &nextFrame, framesPerSecond, verbose) < 0)
 			{
-				setVDIFFrameSecond((vdif_header *)src, (nextFrame+j)/framesPerSecond);
-				setVDIFFrameNumber((vdif_header *)src, (nextFrame+j)%framesPerSecond);
-				setVDIFFrameInvalid((vdif_header *)src, 1);
-				fwrite(src, 1, stats.outputFrameSize, out);
+				break;
+			}
+			if(maxReorder > 0)
+			{
+				fflush(out);
 			}
 		}
-
-		fwrite(dest, 1, stats.destUsed, out);
-
-		leftover = stats.srcSize - stats.srcUsed;
-
-		if(leftover > 0)
+		if(buf)
 		{
-			memmove(src, src+stats.srcUsed, leftover);
+			--buf->nRef;
+		}
+		if(mf)
+		{
+			advancevdifmmapfile(mf, p);
 		}
 
-		nextFrame = stats.startFrameNumber + stats.nOutputFrame;
-		
-		if(nSort < 0)
+		if(p < n)
 		{
 			break;
 		}
 	}
 
+	flushvdifmuxstream(vs);
+	writemuxoutput(vs, dest, destChunkSize, fill, &stats, out, &nextFrame, framesPerSecond, verbose);
+	deletevdifmuxstream(vs);
+	closevdifmmapfile(mf);
+
 	if(in != stdin)
 	{
 		fclose(in);
@@ -498,8 +734,9 @@ int main(int argc, char **argv)
 		fclose(out);
 	}
 
-	free(src);
+	freeinputbuffers(pool);
 	free(dest);
+	free(fill);
 
 	return 0;
 }
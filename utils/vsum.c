@@ -37,8 +37,8 @@
 
 const char program[] = "vsum";
 const char author[]  = "Walter Brisken <wbrisken@nrao.edu>";
-const char version[] = "0.5";
-const char verdate[] = "20150919";
+const char version[] = "0.6";
+const char verdate[] = "20261017";
 
 static void usage(const char *pgm)
 {
@@ -51,23 +51,12 @@ static void usage(const char *pgm)
 	printf("    -s or --shortsum  print a short summary, also usable for input to vex2difx\n");
 	printf("    -6 or --mark6     operate directly on Mark6 module data\n");
 	printf("    --allmark6        operate directly on all Mark6 scans found on mounted modules\n");
+	printf("    -t <n> or --threads <n>  summarize up to <n> files at once [%d]\n", VDIF_SUMMARY_DEFAULT_THREADS);
 	printf("\n");
 }
 
-void summarizeFile(const char *fileName, int shortSum, int isMark6)
+static void printSummary(const char *fileName, const struct vdif_file_summary *sum, int r, int shortSum, int isMark6)
 {
-	struct vdif_file_summary sum;
-	int r;
-
-	if(isMark6)
-	{
-		r = summarizevdifmark6(&sum, fileName, 0);
-	}
-	else
-	{
-		r = summarizevdiffile(&sum, fileName, 0);
-	}
-
 	if(r < 0)
 	{
 		fprintf(stderr, "File %s VDIF summary failed with return value %d\n\n", fileName, r);
@@ -78,8 +67,8 @@ void summarizeFile(const char *fileName, int shortSum, int isMark6)
 		double mjd1, mjd2;
 		char fullFileName[MaxFilenameLength];
 
-		mjd1 = vdiffilesummarygetstartmjd(&sum) + (sum.startSecond % 86400)/86400.0;
-		mjd2 = mjd1 + (sum.endSecond - sum.startSecond + 1)/86400.0;
+		mjd1 = vdiffilesummarygetstartmjd(sum) + (sum->startSecond % 86400)/86400.0;
+		mjd2 = mjd1 + (sum->endSecond - sum->startSecond + 1)/86400.0;
 
 		if(fileName[0] != '/' && isMark6 == 0)
 		{
@@ -95,8 +84,61 @@ void summarizeFile(const char *fileName, int shortSum, int isMark6)
 	}
 	else
 	{
-		printvdiffilesummary(&sum);
+		printvdiffilesummary(sum);
+	}
+}
+
+void summarizeFile(const char *fileName, int shortSum, int isMark6)
+{
+	struct vdif_file_summary sum;
+	int r;
+
+	if(isMark6)
+	{
+		r = summarizevdifmark6(&sum, fileName, 0);
+	}
+	else
+	{
+		r = summarizevdiffile(&sum, fileName, 0);
+	}
+
+	printSummary(fileName, &sum, r, shortSum, isMark6);
+}
+
+/* summarizes a batch of ordinary files concurrently, then reports them in order */
+void summarizeFiles(const char * const *fileNames, int nFile, int shortSum, int nThread)
+{
+	struct vdif_file_summary *sums;
+	int *rv;
+	int i;
+
+	if(nFile <= 0)
+	{
+		return;
+	}
+
+	sums = (struct vdif_file_summary *)malloc(nFile*sizeof(struct vdif_file_summary));
+	rv = (int *)malloc(nFile*sizeof(int));
+	if(!sums || !rv)
+	{
+		free(sums);
+		free(rv);
+		for(i = 0; i < nFile; ++i)
+		{
+			summarizeFile(fileNames[i], shortSum, 0);
+		}
+
+		return;
+	}
+
+	summarizevdiffiles(sums, rv, fileNames, nFile, 0, nThread);
+	for(i = 0; i < nFile; ++i)
+	{
+		printSummary(fileNames[i], sums + i, rv[i], shortSum, 0);
 	}
+
+	free(sums);
+	free(rv);
 }
 
 void processAllMark6Scans(int shortSum)
@@ -140,12 +182,26 @@ int main(int argc, char **argv)
 		int a;
 		int shortSum = 0;
 		int isMark6 = 0;
+		int nThread = 0;
+		const char **pending;	/* ordinary files waiting to be summarized together */
+		int nPending = 0;
+
+		pending = (const char **)malloc(argc*sizeof(const char *));
+		if(!pending)
+		{
+			fprintf(stderr, "Error: cannot allocate file list\n");
+
+			exit(EXIT_FAILURE);
+		}
 
 		for(a = 1; a < argc; ++a)
 		{
 			if(strcmp(argv[a], "-s") == 0 ||
 			   strcmp(argv[a], "--shortsum") == 0)
 			{
+				/* options apply only to files after them, so finish the files before */
+				summarizeFiles(pending, nPending, shortSum, nThread);
+				nPending = 0;
 				shortSum = 1;
 			}
 			else if(strcmp(argv[a], "-h") == 0 ||
@@ -158,19 +214,37 @@ int main(int argc, char **argv)
 			else if(strcmp(argv[a], "-6") == 0 ||
 			   strcmp(argv[a], "--mark6") == 0)
 			{
+				summarizeFiles(pending, nPending, shortSum, nThread);
+				nPending = 0;
 				isMark6 = 1;
 			}
+			else if((strcmp(argv[a], "-t") == 0 ||
+			   strcmp(argv[a], "--threads") == 0) && a+1 < argc)
+			{
+				++a;
+				nThread = atoi(argv[a]);
+			}
 			else if(strcmp(argv[a], "--allmark6") == 0)
 			{
+				summarizeFiles(pending, nPending, shortSum, nThread);
 				processAllMark6Scans(shortSum);
 				
 				exit(EXIT_SUCCESS);
 			}
-			else
+			else if(isMark6)
 			{
+				summarizeFiles(pending, nPending, shortSum, nThread);
+				nPending = 0;
 				summarizeFile(argv[a], shortSum, isMark6);
 			}
+			else
+			{
+				pending[nPending++] = argv[a];
+			}
 		}
+
+		summarizeFiles(pending, nPending, shortSum, nThread);
+		free(pending);
 	}
 
 	return 0;